@@ -10,12 +10,12 @@ import (
 
 var index = flag.String("index", "", "Path to an index to run benchmarks against")
 
-func benchmarkQuery(b *testing.B, q *pb.Query) {
+func benchmarkQuery(b *testing.B, q *pb.Query, args ...string) {
 	if *index == "" {
 		b.SkipNow()
 	}
 
-	c, e := NewClient("-load_index", *index)
+	c, e := NewClient(append([]string{"-load_index", *index}, args...)...)
 	if e != nil {
 		b.Fatal(e.Error())
 	}
@@ -37,6 +37,16 @@ func BenchmarkDazedCaseFold(b *testing.B) {
 	benchmarkQuery(b, &pb.Query{Line: `dazed`, FoldCase: true})
 }
 
+// The same literal queries with the suffix-array literal path
+// disabled, for comparison against the two above.
+func BenchmarkDazedNoLiteral(b *testing.B) {
+	benchmarkQuery(b, &pb.Query{Line: `dazed`}, "-literal_search=false")
+}
+
+func BenchmarkDazedCaseFoldNoLiteral(b *testing.B) {
+	benchmarkQuery(b, &pb.Query{Line: `dazed`, FoldCase: true}, "-literal_search=false")
+}
+
 func BenchmarkDefKmalloc(b *testing.B) {
 	benchmarkQuery(b, &pb.Query{Line: `^(\s.*\S)?kmalloc\s*\(`})
 }
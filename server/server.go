@@ -18,6 +18,7 @@ import (
 	"github.com/livegrep/livegrep/server/log"
 	"github.com/livegrep/livegrep/server/reqid"
 	"github.com/livegrep/livegrep/server/templates"
+	pb "github.com/livegrep/livegrep/src/proto/go_proto"
 )
 
 type Templates struct {
@@ -118,6 +119,23 @@ func (s *server) ServeHealthcheck(w http.ResponseWriter, r *http.Request) {
 	io.WriteString(w, "ok\n")
 }
 
+// ServeMetrics passes on a backend's runtime metrics, in the
+// Prometheus text format.
+func (s *server) ServeMetrics(ctx context.Context, w http.ResponseWriter, r *http.Request) {
+	backend := s.bk[r.URL.Query().Get(":backend")]
+	if backend == nil {
+		http.Error(w, "unknown backend", 404)
+		return
+	}
+	stats, err := backend.Codesearch.Stats(ctx, &pb.StatsRequest{})
+	if err != nil {
+		http.Error(w, err.Error(), 502)
+		return
+	}
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	io.WriteString(w, stats.Metrics)
+}
+
 func (s *server) requestProtocol(r *http.Request) string {
 	if s.config.ReverseProxy {
 		if proto := r.Header.Get("X-Real-Proto"); len(proto) > 0 {
@@ -194,6 +212,7 @@ func New(cfg *config.Config) (http.Handler, error) {
 
 	m := pat.New()
 	m.Add("GET", "/debug/healthcheck", http.HandlerFunc(srv.ServeHealthcheck))
+	m.Add("GET", "/debug/metrics/:backend", srv.Handler(srv.ServeMetrics))
 	m.Add("GET", "/search/:backend", srv.Handler(srv.ServeSearch))
 	m.Add("GET", "/search/", srv.Handler(srv.ServeSearch))
 	m.Add("GET", "/about", srv.Handler(srv.ServeAbout))
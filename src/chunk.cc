@@ -5,9 +5,12 @@
  * This program is free software. You may use, redistribute, and/or
  * modify it under the terms listed in the COPYING file.
  ********************************************************************/
+#include "src/lib/bytes.h"
 #include "src/lib/radix_sort.h"
 #include "src/lib/metrics.h"
+#include "src/lib/parallel.h"
 
+#include "src/codesearch.h"
 #include "src/chunk.h"
 
 #include "divsufsort.h"
@@ -18,38 +21,93 @@
 
 metric index_divsufsort("timer.index.divsufsort");
 metric index_fixupnl("timer.index.fixupnl");
+metric index_parallel_sort("timer.index.parallel_sort");
+metric index_fold("timer.index.fold");
 
 using re2::StringPiece;
 
 DECLARE_bool(index);
+DEFINE_bool(pack_suffixes, false, "Store suffix array entries in as few bits as the chunk size needs, rather than 32.");
+DEFINE_bool(fold_index, false, "Also sort each chunk's suffixes ignoring ASCII case, so case-insensitive searches walk one range per byte. Costs a second suffix array.");
+DEFINE_int32(sort_threads, 1, "Threads to sort each chunk's suffixes with. 1 uses divsufsort; more use a parallel line-by-line sort.");
+
+namespace {
+    // The order searches need: '\n' sorts before every other byte,
+    // and nothing after it matters. A folded order compares ASCII
+    // letters as if they were lower case.
+    template <bool Fold>
+    inline int line_rank(unsigned char c) {
+        return c == '\n' ? 0 : int(Fold ? fold_byte(c) : c) + 1;
+    }
+
+    const int kLineRanks = 257;
+
+    // Suffixes are bucketed by the ranks of their first two bytes; a
+    // suffix starting with '\n' goes in bucket 0.
+    template <bool Fold>
+    inline uint32_t line_bucket(const unsigned char *p) {
+        int r = line_rank<Fold>(p[0]);
+        return r ? r * kLineRanks + line_rank<Fold>(p[1]) : 0;
+    }
+
+    template <bool Fold>
+    struct lt_line {
+        const unsigned char *data;
+        bool operator()(uint32_t lhs, uint32_t rhs) const {
+            const unsigned char *l = data + lhs, *r = data + rhs;
+            while (line_rank<Fold>(*l) == line_rank<Fold>(*r) && *l != '\n') {
+                ++l;
+                ++r;
+            }
+            return line_rank<Fold>(*l) < line_rank<Fold>(*r);
+        }
+    };
+};
 
 void chunk::add_chunk_file(indexed_file *sf, const StringPiece& line)
 {
+    // Trees are usually indexed one after another, so this is almost
+    // always just the back() check.
+    if (trees.empty() || trees.back() != sf->tree) {
+        if (find(trees.begin(), trees.end(), sf->tree) == trees.end())
+            trees.push_back(sf->tree);
+    }
+
     int l = (unsigned char*)line.data() - data;
     int r = l + line.size();
-    chunk_file *f = NULL;
-    int min_dist = numeric_limits<int>::max(), dist;
-    for (vector<chunk_file>::iterator it = cur_file.begin();
-         it != cur_file.end(); it ++) {
-        if (l <= it->left)
-            dist = max(0, it->left - r);
-        else if (r >= it->right)
-            dist = max(0, l - it->right);
-        else
-            dist = 0;
-        assert(dist == 0 || r < it->left || l > it->right);
-        if (dist < min_dist) {
-            min_dist = dist;
-            f = &(*it);
+
+    // A line never straddles a range, and the ranges are disjoint, so
+    // only the ranges on either side of it can be the closest.
+    auto next = cur_file.upper_bound(l);
+    auto best = cur_file.end();
+    int min_dist = numeric_limits<int>::max();
+    if (next != cur_file.begin()) {
+        auto prev = std::prev(next);
+        assert(r <= prev->second.right || l > prev->second.right);
+        min_dist = max(0, l - prev->second.right);
+        best = prev;
+    }
+    if (next != cur_file.end()) {
+        assert(r < next->second.left);
+        if (next->second.left - r < min_dist) {
+            min_dist = next->second.left - r;
+            best = next;
         }
     }
-    if (f && min_dist < kMaxGap) {
-        f->expand(l, r);
+    if (best != cur_file.end() && min_dist < kMaxGap) {
+        if (l < best->second.left) {
+            // re-key the range by its new left edge
+            chunk_file cf = std::move(best->second);
+            cur_file.erase(best);
+            cf.expand(l, r);
+            cur_file.insert(make_pair(cf.left, std::move(cf)));
+        } else {
+            best->second.expand(l, r);
+        }
         return;
     }
     chunk_files++;
-    cur_file.push_back(chunk_file());
-    chunk_file& cf = cur_file.back();
+    chunk_file& cf = cur_file[l];
     cf.files.push_front(sf);
     cf.left = l;
     cf.right = r;
@@ -57,20 +115,51 @@ void chunk::add_chunk_file(indexed_file *sf, const StringPiece& line)
 
 void chunk::finish_file() {
     int right = -1;
-    sort(cur_file.begin(), cur_file.end());
-    for (vector<chunk_file>::iterator it = cur_file.begin();
-         it != cur_file.end(); it ++) {
-        assert(right < it->left);
-        right = max(right, it->right);
+    for (auto it = cur_file.begin(); it != cur_file.end(); it ++) {
+        assert(right < it->second.left);
+        right = it->second.right;
+        files.push_back(std::move(it->second));
     }
-    files.insert(files.end(), cur_file.begin(), cur_file.end());
     cur_file.clear();
 }
 
 int chunk::chunk_files = 0;
 
 void chunk::finalize() {
-    if (FLAGS_index) {
+    if (!FLAGS_index)
+        return;
+    sort_suffixes(suffixes, false);
+    if (folded)
+        sort_suffixes(folded, true);
+    if (FLAGS_pack_suffixes)
+        pack_suffixes();
+}
+
+void chunk::sort_folded() {
+    assert(folded);
+    sort_suffixes(folded, true);
+    if (suffix_bits != 32)
+        pack(folded, suffix_bits);
+}
+
+void chunk::sort_suffixes(uint32_t *out, bool fold) {
+    if (FLAGS_sort_threads > 1) {
+        if (fold)
+            sort_suffixes_parallel<true>(out, FLAGS_sort_threads);
+        else
+            sort_suffixes_parallel<false>(out, FLAGS_sort_threads);
+    } else if (fold) {
+        // The folded order is divsufsort's over a lower-cased copy
+        // of the data, with the same '\n' kludge as below.
+        vector<unsigned char> text(size);
+        {
+            metric::timer tm(index_fold);
+            for (int i = 0; i < size; i++)
+                text[i] = data[i] == '\n' ? '\0' : fold_byte(data[i]);
+        }
+        metric::timer tm(index_divsufsort);
+        divsufsort(text.data(), reinterpret_cast<saidx_t*>(out), size);
+    } else {
         // For the purposes of livegrep's line-based sorting, we need
         // to sort \n before all other characters. divsufsort,
         // understandably, just lexically-sorts sorts thing. Kludge
@@ -79,17 +168,125 @@ void chunk::finalize() {
         // not an overly-expensive job.
         {
             metric::timer tm(index_fixupnl);
-            std::replace(data, data + size, '\n', '\0');
+            replace_byte(data, size, '\n', '\0');
         }
         {
             metric::timer tm(index_divsufsort);
-            divsufsort(data, reinterpret_cast<saidx_t*>(suffixes), size);
+            divsufsort(data, reinterpret_cast<saidx_t*>(out), size);
         }
         {
             metric::timer tm(index_fixupnl);
-            std::replace(data, data + size, '\0', '\n');
+            replace_byte(data, size, '\0', '\n');
+        }
+    }
+}
+
+void chunk::count_bytes(corpus_stats *out) const {
+    unsigned prev = '\n';
+    uint64_t n = 0;
+    for (const unsigned char *p = data; p != data + size; ++p) {
+        unsigned c = *p;
+        if (c != '\n') {
+            ++out->bytes[c];
+            ++n;
+            if (prev != '\n')
+                ++out->pairs[prev << 8 | c];
+        }
+        prev = c;
+    }
+    out->total += n;
+}
+
+/*
+ * Sort suffixes only as far as the end of their line, which is all
+ * searches compare. Every line in a chunk ends in '\n', so no bounds
+ * checks are needed and the data is left untouched. Suffixes are
+ * scattered into buckets by their first two bytes, each of
+ * `nthreads' threads counting and placing one slice of the chunk;
+ * the buckets are then sorted independently, largest first.
+ */
+template <bool Fold>
+void chunk::sort_suffixes_parallel(uint32_t *out, int nthreads) {
+    metric::timer tm(index_parallel_sort);
+    const int nbuckets = kLineRanks * kLineRanks;
+    uint32_t slice = (size + nthreads - 1) / nthreads;
+    vector<vector<uint32_t> > counts(nthreads, vector<uint32_t>(nbuckets + 1));
+
+    parallel_for(nthreads, nthreads, [&](int t) {
+            vector<uint32_t> &count = counts[t];
+            uint32_t end = min(uint32_t(size), (t + 1) * slice);
+            for (uint32_t i = t * slice; i < end; i++)
+                count[line_bucket<Fold>(data + i)]++;
+        });
+
+    // Turn the counts into each slice's first output index per bucket,
+    // and remember where each bucket starts.
+    vector<uint32_t> starts(nbuckets + 1);
+    uint32_t pos = 0;
+    for (int b = 0; b < nbuckets; b++) {
+        starts[b] = pos;
+        for (int t = 0; t < nthreads; t++) {
+            uint32_t n = counts[t][b];
+            counts[t][b] = pos;
+            pos += n;
         }
     }
+    starts[nbuckets] = pos;
+    assert(pos == uint32_t(size));
+
+    parallel_for(nthreads, nthreads, [&](int t) {
+            vector<uint32_t> &next = counts[t];
+            uint32_t end = min(uint32_t(size), (t + 1) * slice);
+            for (uint32_t i = t * slice; i < end; i++)
+                out[next[line_bucket<Fold>(data + i)]++] = i;
+        });
+
+    vector<uint32_t> order;
+    for (int b = 1; b < nbuckets; b++)
+        if (starts[b + 1] - starts[b] > 1)
+            order.push_back(b);
+    sort(order.begin(), order.end(), [&](uint32_t l, uint32_t r) {
+            return starts[l + 1] - starts[l] > starts[r + 1] - starts[r];
+        });
+    lt_line<Fold> lt = {data};
+    parallel_for(order.size(), nthreads, [&](int i) {
+            uint32_t b = order[i];
+            std::sort(out + starts[b], out + starts[b + 1], lt);
+        });
+}
+
+/*
+ * Rewrite the suffix arrays in place with the fewest bits per entry
+ * that can hold an offset into this chunk.
+ */
+void chunk::pack_suffixes() {
+    int bits = 1;
+    while (bits < 32 && (uint64_t(1) << bits) < uint64_t(size))
+        bits++;
+    if (bits == 32)
+        return;
+
+    pack(suffixes, bits);
+    if (folded)
+        pack(folded, bits);
+    suffix_bits = bits;
+}
+
+/*
+ * Entry i's packed bits all lie below byte 4 * (i + 1), so writing it
+ * never disturbs an entry not yet read.
+ */
+void chunk::pack(uint32_t *array, int bits) {
+    uint8_t *out = reinterpret_cast<uint8_t*>(array);
+    for (uint32_t i = 0; i < uint32_t(size); i++) {
+        uint64_t val = array[i];
+        uint64_t bit = uint64_t(i) * bits;
+        uint64_t mask = ((uint64_t(1) << bits) - 1) << (bit & 7);
+        uint64_t word;
+        memcpy(&word, out + (bit >> 3), sizeof word);
+        word = (word & ~mask) | (val << (bit & 7));
+        memcpy(out + (bit >> 3), &word, sizeof word);
+    }
 }
 
 void chunk::finalize_files() {
@@ -109,29 +306,60 @@ void chunk::finalize_files() {
         ++out;
     }
     files.resize(out - files.begin());
-    build_tree();
+
+    range_storage.clear();
+    file_id_storage.clear();
+    range_storage.reserve(files.size());
+    for (auto it = files.begin(); it != files.end(); ++it) {
+        chunk_file_range r = {
+            uint32_t(it->left), uint32_t(it->right),
+            uint32_t(file_id_storage.size()), uint32_t(it->files.size())
+        };
+        for (auto fit = it->files.begin(); fit != it->files.end(); ++fit)
+            file_id_storage.push_back((*fit)->no);
+        range_storage.push_back(r);
+    }
+    vector<chunk_file>().swap(files);
+
+    tree_storage.resize(range_storage.size());
+    uint32_t next = 0;
+    build_tree(0, &next);
+    for (size_t i = tree_storage.size(); i-- > 0;) {
+        chunk_file_node &n = tree_storage[i];
+        n.right_limit = n.right;
+        if (2*i + 1 < tree_storage.size())
+            n.right_limit = max(n.right_limit, tree_storage[2*i + 1].right_limit);
+        if (2*i + 2 < tree_storage.size())
+            n.right_limit = max(n.right_limit, tree_storage[2*i + 2].right_limit);
+    }
+
+    ranges = range_storage.data();
+    nranges = range_storage.size();
+    file_ids = file_id_storage.data();
+    tree = tree_storage.data();
 }
 
-void chunk::build_tree() {
-    assert(is_sorted(files.begin(), files.end()));
-    cf_root = build_tree(0, files.size());
+void chunk::move_files(const chunk_file_range *ranges, const uint32_t *file_ids,
+                       const chunk_file_node *tree) {
+    this->ranges = ranges;
+    this->file_ids = file_ids;
+    this->tree = tree;
+    vector<chunk_file_range>().swap(range_storage);
+    vector<uint32_t>().swap(file_id_storage);
+    vector<chunk_file_node>().swap(tree_storage);
 }
 
-chunk_file_node *chunk::build_tree(int left, int right) {
-    if (right == left)
-        return 0;
-    int mid = (left + right) / 2;
-    chunk_file_node *node = new chunk_file_node;
-
-    node->chunk = &files[mid];
-    node->left  = build_tree(left, mid);
-    node->right = build_tree(mid + 1, right);
-    node->right_limit = node->chunk->right;
-    if (node->left && node->left->right_limit > node->right_limit)
-        node->right_limit = node->left->right_limit;
-    if (node->right && node->right->right_limit > node->right_limit)
-        node->right_limit = node->right->right_limit;
-    assert(!node->left  || *(node->left->chunk) < *(node->chunk));
-    assert(!node->right || *(node->chunk) < *(node->right->chunk));
-    return node;
+/*
+ * Assign ranges to the subtree rooted at `node' in order, so that an
+ * in-order walk of the tree visits range_storage front to back.
+ */
+void chunk::build_tree(uint32_t node, uint32_t *next) {
+    if (node >= tree_storage.size())
+        return;
+    build_tree(2*node + 1, next);
+    chunk_file_node &n = tree_storage[node];
+    n.range = (*next)++;
+    n.left  = range_storage[n.range].left;
+    n.right = range_storage[n.range].right;
+    build_tree(2*node + 2, next);
 }
@@ -20,6 +20,7 @@
 #include <stdint.h>
 
 struct indexed_file;
+struct indexed_tree;
 namespace re2 {
     class StringPiece;
 }
@@ -48,11 +49,67 @@ struct chunk_file {
 
 const size_t kMaxGap       = 1 << 10;
 
+// An ASCII byte in lower case; the order of a chunk's folded suffix
+// array compares bytes through this.
+static inline unsigned char fold_byte(unsigned char c) {
+    return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+/*
+ * The finalized form of a chunk_file: bytes `left' through `right'
+ * (inclusive) are present in each of the `nfiles' files whose ids
+ * start at file_ids[files]. A chunk's ranges are sorted by (left,
+ * right).
+ *
+ * This, like chunk_file_node, is plain data with the same layout in
+ * memory and in the index file, so a loaded index searches it
+ * straight out of the mapping.
+ */
+struct chunk_file_range {
+    uint32_t left;
+    uint32_t right;
+    uint32_t files;
+    uint32_t nfiles;
+};
+
+/*
+ * One node of the interval tree over a chunk's ranges, used to find
+ * every range containing a given offset. The tree is balanced and
+ * laid out in Eytzinger (breadth-first) order: the children of node i
+ * are nodes 2i+1 and 2i+2, so the top levels share a few cache lines
+ * and there are no pointers to chase. `right_limit' is the largest
+ * `right' in the subtree rooted here, and `range' indexes the
+ * chunk's ranges.
+ */
 struct chunk_file_node {
-    chunk_file *chunk;
-    int right_limit;
+    uint32_t left;
+    uint32_t right;
+    uint32_t right_limit;
+    uint32_t range;
+};
+
+/*
+ * How often each byte, and each pair of adjacent bytes, occurs in a
+ * corpus's lines, newlines not counted. indexRE() uses these to judge
+ * how much an index key narrows a search. Plain data, written to and
+ * read from the index file as is.
+ */
+struct corpus_stats {
+    uint64_t total;             // bytes counted
+    uint64_t bytes[256];
+    uint64_t pairs[256 * 256];  // pairs[a << 8 | b]: `a' followed by `b'
 
-    chunk_file_node *left, *right;
+    corpus_stats() {
+        memset(this, 0, sizeof *this);
+    }
+
+    void add(const corpus_stats &rhs) {
+        total += rhs.total;
+        for (int i = 0; i < 256; i++)
+            bytes[i] += rhs.bytes[i];
+        for (int i = 0; i < 256 * 256; i++)
+            pairs[i] += rhs.pairs[i];
+    }
 };
 
 struct chunk {
@@ -60,15 +117,38 @@ struct chunk {
 
     int id;     // Sequential id
     int size;
+    // chunk_files being built up while indexing; emptied into
+    // `ranges' by finalize_files().
     vector<chunk_file> files;
-    vector<chunk_file> cur_file;
-    chunk_file_node *cf_root;
+    // The disjoint ranges of the file being indexed, by `left'; moved
+    // to `files' by finish_file().
+    map<int, chunk_file> cur_file;
+    // Every tree with a file that has a line in this chunk.
+    vector<const indexed_tree *> trees;
+    // Either range_storage, file_id_storage and tree_storage, or the
+    // same tables inside a loaded index. `tree' has nranges nodes.
+    const chunk_file_range *ranges;
+    uint32_t nranges;
+    const uint32_t *file_ids;
+    // Added to file_ids to index code_searcher::files_, when this
+    // chunk belongs to one of several loaded segments.
+    uint32_t file_base;
+    const chunk_file_node *tree;
+    // The suffix array, `suffix_bits' bits per entry; read it through
+    // suffix(). While building, it has room for chunk_size 32-bit
+    // entries, which finalize() may pack down (see --pack_suffixes).
     uint32_t *suffixes;
+    int suffix_bits;
+    // With --fold_index, a second suffix array in the same format,
+    // sorted as if every ASCII letter were lower case, for
+    // case-insensitive searches; read it through folded_suffix().
+    // NULL otherwise.
+    uint32_t *folded;
     unsigned char *data;
 
-    chunk(unsigned char *data, uint32_t *suffixes)
-        : size(0), files(), cf_root(0),
-          suffixes(suffixes), data(data) { }
+    chunk(unsigned char *data, uint32_t *suffixes, uint32_t *folded = 0)
+        : size(0), files(), ranges(0), nranges(0), file_ids(0), file_base(0), tree(0),
+          suffixes(suffixes), suffix_bits(32), folded(folded), data(data) { }
 
     ~chunk() {
     }
@@ -77,7 +157,42 @@ struct chunk {
     void finish_file();
     void finalize();
     void finalize_files();
-    void build_tree();
+    // Point ranges, file_ids and tree at copies of them elsewhere --
+    // in the index file being written, for a streaming build -- and
+    // free this chunk's own.
+    void move_files(const chunk_file_range *ranges, const uint32_t *file_ids,
+                    const chunk_file_node *tree);
+    // Add the bytes and byte pairs of this chunk's lines to `out'.
+    void count_bytes(corpus_stats *out) const;
+    // Sort `folded' from the chunk's data, packing it to match
+    // `suffixes'. finalize() does this itself.
+    void sort_folded();
+
+    uint32_t suffix(uint32_t i) const {
+        return entry(suffixes, i);
+    }
+
+    uint32_t folded_suffix(uint32_t i) const {
+        return entry(folded, i);
+    }
+
+    // Entry i of `suffixes' or `folded'.
+    uint32_t entry(const uint32_t *array, uint32_t i) const {
+        if (suffix_bits == 32)
+            return array[i];
+        // Packed entries are read with one unaligned 8-byte load, so
+        // the storage must extend at least 8 bytes past
+        // suffix_bytes().
+        uint64_t bit = uint64_t(i) * suffix_bits;
+        uint64_t word;
+        memcpy(&word, reinterpret_cast<const uint8_t*>(array) + (bit >> 3),
+               sizeof word);
+        return (word >> (bit & 7)) & ((uint64_t(1) << suffix_bits) - 1);
+    }
+
+    size_t suffix_bytes() const {
+        return (uint64_t(size) * suffix_bits + 7) / 8;
+    }
 
     struct lt_suffix {
         const chunk *chunk_;
@@ -115,9 +230,18 @@ struct chunk {
         }
     };
 
-    chunk_file_node *build_tree(int left, int right);
-
 private:
+    void build_tree(uint32_t node, uint32_t *next);
+    template <bool Fold>
+    void sort_suffixes_parallel(uint32_t *out, int nthreads);
+    void sort_suffixes(uint32_t *out, bool fold);
+    void pack_suffixes();
+    void pack(uint32_t *array, int bits);
+
+    vector<chunk_file_range> range_storage;
+    vector<uint32_t> file_id_storage;
+    vector<chunk_file_node> tree_storage;
+
     chunk(const chunk&);
     chunk operator=(const chunk&);
 };
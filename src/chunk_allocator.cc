@@ -6,6 +6,7 @@
  * modify it under the terms listed in the COPYING file.
  ********************************************************************/
 #include "src/lib/debug.h"
+#include "src/lib/numa.h"
 
 #include "src/chunk_allocator.h"
 #include "src/chunk.h"
@@ -13,12 +14,21 @@
 #include <gflags/gflags.h>
 
 #include <sys/mman.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <atomic>
 #include <thread>
+#include <memory>
 
 DECLARE_int32(threads);
 DECLARE_bool(index);
+DECLARE_bool(fold_index);
 DEFINE_int32(chunk_power, 27, "Size of search chunks, as a power of two");
+DEFINE_bool(hugepages, false, "Back in-memory chunks with transparent huge pages.");
+DEFINE_bool(numa, false, "Place chunks' pages on the machine's NUMA nodes in turn, and pin a group of search workers to each node, which search its chunks first.");
 size_t kChunkSize = (1 << 27);
+const size_t kHugePageSize = (1 << 21);
 
 static bool validate_chunk_power(const char* flagname, int32_t value) {
     if (value > 10 && value < 30) {
@@ -32,14 +42,38 @@ static const bool dummy = gflags::RegisterFlagValidator(&FLAGS_chunk_power,
                                                         validate_chunk_power);
 
 void chunk_allocator::finalize_worker(chunk_allocator *alloc) {
+    // Counted per worker and added up once the queue is drained, so
+    // workers never contend for the table.
+    unique_ptr<corpus_stats> stats;
     chunk *c;
     while (alloc->finalize_queue_.pop(&c)) {
         c->finalize();
+        if (FLAGS_index) {
+            if (!stats)
+                stats.reset(new corpus_stats);
+            c->count_bytes(stats.get());
+        }
+        if (alloc->stream_bytes_) {
+            alloc->release_chunk(c);
+            std::lock_guard<std::mutex> guard(alloc->sorted_mtx_);
+            if (alloc->sorted_.size() <= size_t(c->id))
+                alloc->sorted_.resize(c->id + 1);
+            alloc->sorted_[c->id] = true;
+            alloc->sorted_cond_.notify_all();
+        }
     }
+    if (stats)
+        alloc->add_corpus(*stats);
+}
+
+void chunk_allocator::add_corpus(const corpus_stats &stats) {
+    std::lock_guard<std::mutex> guard(corpus_mtx_);
+    corpus_.add(stats);
 }
 
 chunk_allocator::chunk_allocator()  :
-    chunk_size_(kChunkSize), content_finger_(0), current_(0) {
+    chunk_size_(kChunkSize), content_finger_(0), current_(0),
+    stream_bytes_(0), retired_(0) {
     for (int i = 0; i < FLAGS_threads; ++i)
         threads_.push_back(std::move(std::thread(finalize_worker, this)));
 }
@@ -86,6 +120,22 @@ uint8_t *chunk_allocator::alloc_content_data(size_t len) {
     return out;
 }
 
+int chunk_allocator::home_node(const chunk *c) {
+    return FLAGS_numa ? c->id % numa_nodes() : 0;
+}
+
+void chunk_allocator::place_chunk(const chunk *c, int node, size_t data_bytes,
+                                  size_t suffix_bytes, bool move) {
+    static std::atomic<bool> warned(false);
+    bool ok = numa_place(c->data, data_bytes, node, move);
+    if (ok && c->suffixes)
+        ok = numa_place(c->suffixes, suffix_bytes, node, move);
+    if (ok && c->folded)
+        ok = numa_place(c->folded, suffix_bytes, node, move);
+    if (!ok && numa_nodes() > 1 && !warned.exchange(true))
+        fprintf(stderr, "WARN: mbind: %s\n", strerror(errno));
+}
+
 void chunk_allocator::finish_chunk()  {
     if (current_) {
         finalize_queue_.push(current_);
@@ -97,25 +147,78 @@ void chunk_allocator::new_chunk()  {
     current_ = alloc_chunk();
     madvise(current_->data,     chunk_size_,                               MADV_RANDOM);
     madvise(current_->suffixes, chunk_size_ * sizeof(*current_->suffixes), MADV_RANDOM);
+    if (current_->folded)
+        madvise(current_->folded, chunk_size_ * sizeof(*current_->folded), MADV_RANDOM);
     current_->id = chunks_.size();
-    by_data_[current_->data] = current_;
     chunks_.push_back(current_);
 }
 
+/*
+ * Append a copy of `src', a finalized chunk, suffix array and all.
+ * The copy is never sorted again, and no later line is allocated in
+ * it -- except for a folded suffix array `src' lacks, which is sorted
+ * afresh.
+ */
+chunk *chunk_allocator::copy_chunk(const chunk *src) {
+    assert(src->size <= chunk_size_);
+    // Files copied in later can have lines anywhere in the copied
+    // chunks, so no chunk is ever done with before finalize().
+    stream_bytes_ = 0;
+    finish_chunk();
+    current_ = 0;
+    chunk *c = alloc_chunk();
+    memcpy(c->data, src->data, src->size);
+    c->size = src->size;
+    if (FLAGS_index && src->suffixes) {
+        memcpy(c->suffixes, src->suffixes, src->suffix_bytes());
+        c->suffix_bits = src->suffix_bits;
+        if (c->folded && src->folded)
+            memcpy(c->folded, src->folded, src->suffix_bytes());
+        else if (c->folded)
+            c->sort_folded();
+    }
+    c->id = chunks_.size();
+    chunks_.push_back(c);
+    return c;
+}
+
 void chunk_allocator::finalize()  {
-    if (!current_)
+    if (chunks_.empty())
         return;
     finish_chunk();
     finalize_queue_.close();
     for (auto it = threads_.begin(); it != threads_.end(); ++it)
         it->join();
     threads_.clear();
-    for (auto it = begin(); it != end(); ++it)
+    for (auto it = begin() + retired_; it != end(); ++it)
         (*it)->finalize_files();
     if (content_finger_)
         content_chunks_.back().end = content_finger_;
 }
 
+void chunk_allocator::retire_chunks() {
+    if (stream_bytes_ == 0 || current_ == 0)
+        return;
+    // The current chunk is being filled, and each one not yet
+    // retired is still taking up its memory.
+    size_t allowed = stream_bytes_ / chunk_bytes();
+    allowed = allowed > 0 ? allowed - 1 : 0;
+    std::unique_lock<std::mutex> locked(sorted_mtx_);
+    while (retired_ < size_t(current_->id)) {
+        if (retired_ >= sorted_.size() || !sorted_[retired_]) {
+            if (current_->id - retired_ <= allowed)
+                break;
+            sorted_cond_.wait(locked);
+            continue;
+        }
+        chunk *c = chunks_[retired_];
+        locked.unlock();
+        retire_chunk(c);
+        locked.lock();
+        retired_++;
+    }
+}
+
 void chunk_allocator::skip_chunk() {
     current_ = 0;
     new_chunk();
@@ -124,22 +227,20 @@ void chunk_allocator::skip_chunk() {
 void chunk_allocator::drop_caches() {
 }
 
-chunk *chunk_allocator::chunk_from_string(const unsigned char *p) {
-    auto it = by_data_.lower_bound(p);
-    if (it == by_data_.end() || it->first != p) {
-        assert(it != by_data_.begin());
-        --it;
-    }
-    assert(it->first <= p && p <= it->first + it->second->size);
-    return it->second;
-}
-
 class mem_allocator : public chunk_allocator {
 public:
     virtual chunk *alloc_chunk() {
-        unsigned char *buf = new unsigned char[chunk_size_];
-        uint32_t *idx = FLAGS_index ? new uint32_t[chunk_size_] : 0;
-        return new chunk(buf, idx);
+        unsigned char *buf = alloc_array<unsigned char>(chunk_size_);
+        uint32_t *idx = FLAGS_index ? alloc_array<uint32_t>(chunk_size_) : 0;
+        uint32_t *folded = FLAGS_index && FLAGS_fold_index ?
+            alloc_array<uint32_t>(chunk_size_) : 0;
+        chunk *c = new chunk(buf, idx, folded);
+        // Nothing has touched the arrays yet, so they are allocated
+        // where they are placed. The chunk is about to get the next id.
+        if (FLAGS_numa && numa_nodes() > 1)
+            place_chunk(c, chunks_.size() % numa_nodes(), chunk_size_,
+                        chunk_size_ * sizeof(uint32_t), false);
+        return c;
     }
 
     virtual buffer alloc_content_chunk() {
@@ -148,10 +249,29 @@ public:
     }
 
     virtual void free_chunk(chunk *chunk) {
-        delete[] chunk->data;
-        delete[] chunk->suffixes;
+        free(chunk->data);
+        free(chunk->suffixes);
+        free(chunk->folded);
         delete chunk;
     }
+
+protected:
+    // Chunk arrays are allocated with malloc() so that, with
+    // --hugepages, they can be aligned for and advised to use
+    // transparent huge pages; free them with free().
+    template <class T>
+    T *alloc_array(size_t n) {
+        size_t len = n * sizeof(T);
+        if (!FLAGS_hugepages)
+            return static_cast<T*>(malloc(len));
+        void *buf;
+        int err = posix_memalign(&buf, kHugePageSize, len);
+        if (err != 0)
+            die("posix_memalign: %s", strerror(err));
+        if (madvise(buf, len, MADV_HUGEPAGE) != 0)
+            fprintf(stderr, "WARN: madvise(MADV_HUGEPAGE): %s\n", strerror(errno));
+        return static_cast<T*>(buf);
+    }
 };
 
 chunk_allocator *make_mem_allocator() {
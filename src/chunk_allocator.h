@@ -12,12 +12,14 @@
 #include <map>
 #include <string>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
 #include <assert.h>
 
 #include "src/lib/thread_queue.h"
+#include "src/chunk.h"
 
 using namespace std;
-struct chunk;
 class code_searcher;
 
 struct buffer {
@@ -69,13 +71,44 @@ public:
     }
 
     void skip_chunk();
+    chunk *copy_chunk(const chunk *src);
     virtual void finalize();
 
-    chunk *chunk_from_string(const unsigned char *p);
+    /*
+     * For a streaming build, which only the dump allocator does (see
+     * --build_memory_mb): retire each chunk before the current one,
+     * which no more lines will go into, once it has been sorted --
+     * waiting for that if the chunks not yet retired would take up
+     * more than the memory allowed. Call it between files, when no
+     * file has lines in any chunk but the current one left to
+     * finish_file(). Retired chunks are written out and their memory
+     * given back; they read back in from the index file if used.
+     */
+    void retire_chunks();
+    // How many chunks, from the first, have been retired.
+    size_t retired() const {
+        return retired_;
+    }
 
     virtual void drop_caches();
+
+    // The byte frequencies of every chunk finalized, copied or loaded
+    // into this allocator.
+    const corpus_stats &corpus() const {
+        return corpus_;
+    }
+    void add_corpus(const corpus_stats &stats);
+
+    // With --numa, the NUMA node `c's pages are placed on, whose
+    // search workers take its tasks first; 0 otherwise.
+    static int home_node(const chunk *c);
 protected:
     static void finalize_worker(chunk_allocator *);
+    // Have the first `data_bytes' of `c's data, and `suffix_bytes' of
+    // each of its suffix arrays, placed on `node'; if `move', migrate
+    // the pages already in memory there as well.
+    static void place_chunk(const chunk *c, int node, size_t data_bytes,
+                            size_t suffix_bytes, bool move);
 
     virtual chunk *alloc_chunk() = 0;
     virtual void free_chunk(chunk *chunk) = 0;
@@ -83,6 +116,17 @@ protected:
     void finish_chunk();
     void new_chunk();
 
+    // The memory a chunk takes up while it is being built.
+    virtual size_t chunk_bytes() {
+        return chunk_size_;
+    }
+    // Called by a finalize worker once `c' is sorted, in a streaming
+    // build, to give back the memory of its data and suffix arrays.
+    virtual void release_chunk(chunk *c) {}
+    // Called by retire_chunks(), after release_chunk(), to write out
+    // and give back the rest of `c'.
+    virtual void retire_chunk(chunk *c) {}
+
     size_t chunk_size_;
     vector<chunk*> chunks_;
     vector<buffer> content_chunks_;
@@ -90,7 +134,18 @@ protected:
     chunk *current_;
     thread_queue<chunk*> finalize_queue_;
     vector<std::thread> threads_;
-    map<const unsigned char*, chunk*> by_data_;
+    std::mutex corpus_mtx_;
+    corpus_stats corpus_;
+
+    // For a streaming build, the most memory chunks not yet retired
+    // may take up; 0 if the build isn't streamed.
+    size_t stream_bytes_;
+    size_t retired_;
+    // Which chunks, by id, the finalize workers are done with;
+    // protected by sorted_mtx_.
+    vector<bool> sorted_;
+    std::mutex sorted_mtx_;
+    std::condition_variable sorted_cond_;
 };
 
 const size_t kContentChunkSize = (1UL << 22);
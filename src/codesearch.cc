@@ -10,6 +10,7 @@
 #include <string.h>
 #include <sys/mman.h>
 
+#include <algorithm>
 #include <locale>
 #include <list>
 #include <iostream>
@@ -17,34 +18,62 @@
 #include <fstream>
 #include <limits>
 #include <atomic>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
+#include "src/lib/arena.h"
 #include "src/lib/timer.h"
 #include "src/lib/metrics.h"
 #include "src/lib/thread_queue.h"
 #include "src/lib/radix_sort.h"
+#include "src/lib/bytes.h"
 #include "src/lib/per_thread.h"
 #include "src/lib/debug.h"
+#include "src/lib/numa.h"
 
 #include "src/codesearch.h"
 #include "src/chunk.h"
 #include "src/chunk_allocator.h"
 #include "src/indexer.h"
 #include "src/content.h"
+#include "src/re_width.h"
 
 #include "re2/re2.h"
+#include "re2/set.h"
 #include "gflags/gflags.h"
 
 #include "utf8.h"
 
+#include <json-c/json.h>
+
 using re2::RE2;
 using re2::StringPiece;
 using namespace std;
 
-const int    kContextLines = 3;
+const int    kDefaultContextLines = 3;
 
 const size_t kMinSkip = 250;
 const int kMinFilterRatio = 50;
+const uint8_t kAcceptUnknown = 0xff;
 const int kMaxScan        = (1 << 20);
+// How often the watchdog asks whether a query's client has gone away.
+const int kCancelPollMs   = 20;
+// The most queries that share one sweep, and the bytes of a chunk the
+// sweep hands them at a time -- small enough to stay in L2 while each
+// query that might match rescans it.
+const size_t kMaxBatch    = 32;
+const int kBatchBlock     = (1 << 16);
+// What goes into a ranked query's scores. A tree's "priority"
+// metadata counts kRankTreePriority per unit; each directory a file
+// is below its tree's root, kRankDepth; a vendored or test file,
+// kRankVendored or kRankTest; a base name that matches the query's
+// line pattern, kRankNameMatch.
+const float kRankTreePriority = 4;
+const float kRankDepth        = -0.25;
+const float kRankVendored     = -3;
+const float kRankTest         = -1;
+const float kRankNameMatch    = 2;
 
 DEFINE_bool(index, true, "Create a suffix-array index to speed searches.");
 DEFINE_bool(drop_cache, false, "Drop caches before each search");
@@ -53,11 +82,20 @@ DEFINE_int32(max_matches, 50, "The maximum number of results to return for a sin
 DEFINE_int32(timeout, 1000, "The number of milliseconds a single search may run for.");
 DEFINE_int32(threads, 4, "Number of threads to use.");
 DEFINE_int32(line_limit, 1024, "Maximum line length to index.");
+DEFINE_bool(literal_search, true, "Answer literal queries directly from the suffix array, without running RE2.");
+DEFINE_bool(global_dedup, false, "Deduplicate lines against every chunk, not just the one being filled.");
+DEFINE_int32(dedup_table_mb, 0, "Bound --global_dedup's table of lines to this many MB, at the cost of missing some duplicates (0 = unbounded).");
+DEFINE_int32(search_split_bytes, 0, "Split chunks larger than this into line-aligned pieces that are searched as separate tasks (0 = never split).");
+DEFINE_int32(query_cache_size, 1000, "The number of recently used regexes to keep compiled and analyzed, for repeat queries (0 = none).");
+DEFINE_int32(max_context_lines, 100, "The most lines of context a query may ask for either side of each match.");
+DEFINE_int32(batch_window_ms, 0, "Hold queries the index can't narrow for this long, so that those arriving together share one scan of each chunk (0 = never batch).");
+DECLARE_bool(numa);
 
 namespace {
     metric idx_bytes("index.bytes");
     metric idx_bytes_dedup("index.bytes.dedup");
     metric idx_files("index.files");
+    metric idx_files_copied("index.files.copied");
     metric idx_lines("index.lines");
     metric idx_lines_dedup("index.lines.dedup");
     metric idx_data_chunks("index.data.chunks");
@@ -65,22 +103,181 @@ namespace {
     metric idx_content_ranges("index.content.ranges");
     metric idx_hash_time("timer.index.dedup.hash");
     metric idx_index_file_time("timer.index.index_file");
+    metric idx_paths_time("timer.index.paths");
+
+    metric re_cache_hits("query.re_cache.hits");
+    metric re_cache_misses("query.re_cache.misses");
+    metric plan_cache_hits("query.plan_cache.hits");
+    metric plan_cache_misses("query.plan_cache.misses");
+    metric batch_sweeps("search.batch.sweeps");
+    metric batch_queries("search.batch.queries");
+
+    metric search_queries("search.queries");
+    metric search_active("search.queries.active", metric::gauge);
+    metric pool_jobs("search.pool.jobs", metric::gauge);
+    metric pool_tasks_queued("search.pool.tasks.queued", metric::gauge);
+    metric pool_tasks_remote("search.pool.tasks.remote");
+    metric chunks_searched("search.chunks.searched");
+    metric chunks_skipped("search.chunks.skipped");
+    // How each task was searched; see searcher::operator().
+    metric tasks_literal("search.tasks.literal");
+    metric tasks_filtered("search.tasks.filtered");
+    metric tasks_full("search.tasks.full");
+    metric tasks_batched("search.tasks.batched");
+    metric tasks_scan_instead("search.tasks.scan_instead");
+    metric tasks_outranked("search.tasks.outranked");
+
+    histogram search_latency("search.latency");
+    histogram phase_analyze("search.phase.analyze");
+    histogram phase_index("search.phase.index");
+    histogram phase_sort("search.phase.sort");
+    histogram phase_re2("search.phase.re2");
+    histogram phase_git("search.phase.git");
+    histogram phase_transform("search.phase.transform");
+
+    // Everything that makes two patterns compile to different programs.
+    string cache_key(const string& pattern, const RE2::Options& opts) {
+        return strprintf("%x:%d:%ld:", opts.ParseFlags(), int(opts.longest_match()),
+                         long(opts.max_mem())) + pattern;
+    }
+
+    /*
+     * Time the current thread has spent on its current search task,
+     * and what the task did. Kept per-thread so the scan loop never
+     * touches shared state; searcher::operator() folds it into the
+     * query's totals (and trace) once the task is done.
+     */
+    struct task_times {
+        uint64_t re2;
+        uint64_t git;
+        uint64_t index;
+        uint64_t sort;
+        // spent in the transform_func; also counted in `git'
+        uint64_t transform;
+        // see task_trace
+        uint64_t candidates;
+        bool scanned_instead;
+        uint64_t bytes_scanned;
+        uint64_t try_matches;
+    };
+    thread_local task_times tls_times;
 };
 
-bool eqstr::operator()(const StringPiece& lhs, const StringPiece& rhs) const {
-    if (lhs.data() == NULL && rhs.data() == NULL)
-        return true;
-    if (lhs.data() == NULL || rhs.data() == NULL)
-        return false;
-    return lhs == rhs;
+/*
+ * What searching an index for a line pattern needs that depends only
+ * on the pattern and the index, not on the query's other constraints.
+ */
+struct search_plan {
+    intrusive_ptr<IndexKey> key;
+    // see literalRE()
+    vector<string> literal;
+    // If the pattern ignores case and some chunks have a folded
+    // suffix array: the key to walk those with, and the literal
+    // lower-cased, if it is exactly a folded one (see fold_literal).
+    intrusive_ptr<IndexKey> folded_key;
+    string folded_literal;
+};
+
+// A search_plan's literal, for traces: each position's bytes, in
+// brackets if there are several.
+static string literal_summary(const vector<string> &literal) {
+    string out;
+    for (auto it = literal.begin(); it != literal.end(); ++it)
+        out += it->size() == 1 ? *it : "[" + *it + "]";
+    return out;
+}
+
+/*
+ * If each position of `literal' is one byte that isn't a letter, or
+ * both cases of one, set `out' to it lower-cased: the suffixes of a
+ * folded order starting with `out' are then exactly its matches.
+ */
+static bool fold_literal(const vector<string> &literal, string *out) {
+    out->clear();
+    for (auto it = literal.begin(); it != literal.end(); ++it) {
+        unsigned char c = fold_byte((*it)[0]);
+        if (it->size() == 1 && c >= 'a' && c <= 'z')
+            return false;
+        if (it->size() > 2 ||
+            (it->size() == 2 && (fold_byte((*it)[1]) != c || (*it)[0] == (*it)[1])))
+            return false;
+        *out += c;
+    }
+    return !out->empty();
+}
+
+bool eqstr::operator()(const indexed_line& lhs, const indexed_line& rhs) const {
+    if (lhs.data == NULL || rhs.data == NULL)
+        return lhs.data == rhs.data;
+    return lhs.hash == rhs.hash && lhs.size == rhs.size &&
+        memcmp(lhs.data, rhs.data, lhs.size) == 0;
+}
+
+namespace {
+    inline uint64_t load64(const char *p) {
+        uint64_t v;
+        memcpy(&v, p, sizeof v);
+        return v;
+    }
+
+    inline uint64_t load32(const char *p) {
+        uint32_t v;
+        memcpy(&v, p, sizeof v);
+        return v;
+    }
+
+    inline uint64_t mix(uint64_t a, uint64_t b) {
+        __uint128_t r = (__uint128_t)a * b;
+        return uint64_t(r) ^ uint64_t(r >> 64);
+    }
+};
+
+/*
+ * A wyhash-style hash: 16 bytes per multiply, with short and ragged
+ * tails read as overlapping loads rather than byte by byte.
+ */
+size_t hash_line(const char *p, size_t len) {
+    const uint64_t k0 = 0xa0761d6478bd642full;
+    const uint64_t k1 = 0xe7037ed1a0b428dbull;
+    const uint64_t k2 = 0x8ebc6af09c88c6e3ull;
+    uint64_t h = len ^ k0;
+    for (; len > 16; p += 16, len -= 16)
+        h = mix(load64(p) ^ k1, load64(p + 8) ^ h);
+    uint64_t a = 0, b = 0;
+    if (len >= 8) {
+        a = load64(p);
+        b = load64(p + len - 8);
+    } else if (len >= 4) {
+        a = load32(p);
+        b = load32(p + len - 4);
+    } else if (len > 0) {
+        a = (uint64_t(uint8_t(p[0])) << 16) |
+            (uint64_t(uint8_t(p[len >> 1])) << 8) |
+            uint8_t(p[len - 1]);
+    }
+    return mix(a ^ k1 ^ len, mix(b ^ k2, h));
+}
+
+const indexed_line empty_line = {NULL, 0, 0, 0};
+
+void line_cache::resize(size_t slots) {
+    size_t n = 1;
+    while (n < slots)
+        n <<= 1;
+    slots_.assign(n, empty_line);
+    mask_ = n - 1;
 }
 
-size_t hashstr::operator()(const StringPiece& str) const {
-    const std::collate<char>& coll = std::use_facet<std::collate<char> >(loc);
-    return coll.hash(str.data(), str.data() + str.size());
+indexed_line line_cache::find(const indexed_line &line) const {
+    const indexed_line &slot = slots_[line.hash & mask_];
+    if (eqstr()(slot, line))
+        return slot;
+    return empty_line;
 }
 
-const StringPiece empty_string(NULL, 0);
+void line_cache::insert(const indexed_line &line) {
+    slots_[line.hash & mask_] = line;
+}
 
 class code_searcher;
 struct match_finger;
@@ -91,80 +288,199 @@ public:
              const query &q,
              const code_searcher::search_thread::transform_func& func) :
         cc_(cc), query_(&q), transform_(func), queue_(),
-        matches_(0), re2_time_(false), git_time_(false),
-        index_time_(false), sort_time_(false), analyze_time_(false),
-        exit_reason_(kExitNone), files_(new uint8_t[cc->files_.size()]),
-        files_density_(-1)
+        matches_(0), re2_ns_(0), git_ns_(0), index_ns_(0), sort_ns_(0),
+        transform_ns_(0),
+        analyze_time_(false),
+        files_density_(-1),
+        max_matches_(q.max_matches >= 0 ? q.max_matches : FLAGS_max_matches),
+        context_lines_(q.paths ? 0 :
+                       std::min(q.context_lines >= 0 ? q.context_lines : kDefaultContextLines,
+                                std::max(FLAGS_max_context_lines, 0))),
+        match_head_((sizeof(match_result) + alignof(StringPiece) - 1) &
+                    ~(alignof(StringPiece) - 1)),
+        ranked_(q.ranked),
+        rank_floor_(-std::numeric_limits<float>::infinity()),
+        outranked_(false)
     {
-        memset(files_, 0xff, cc->files_.size());
+        if (ranked_) {
+            name_match_.reset(new std::atomic<uint8_t>[cc->files_.size()]);
+            for (size_t i = 0; i < cc->files_.size(); ++i)
+                name_match_[i].store(kAcceptUnknown, std::memory_order_relaxed);
+        }
+        if (query_->file_pat || query_->tree_pat ||
+            query_->negate.file_pat || query_->negate.tree_pat ||
+            !cc->shadowed_.empty()) {
+            files_.reset(new std::atomic<uint8_t>[cc->files_.size()]);
+            for (size_t i = 0; i < cc->files_.size(); ++i)
+                files_[i].store(kAcceptUnknown, std::memory_order_relaxed);
+            for (auto it = cc->trees_.begin(); it != cc->trees_.end(); ++it)
+                if (accept_tree(*it))
+                    trees_.insert(*it);
+        }
         {
             run_timer run(analyze_time_);
-            index_ = indexRE(*query_->line_pat);
-        }
-
-        if (FLAGS_timeout <= 0) {
-            limit_.tv_sec = numeric_limits<time_t>::max();
-        } else {
-            timeval timeout = {
-                0, FLAGS_timeout * 1000
-            }, now;
-            gettimeofday(&now, NULL);
-            timeval_add(&limit_, &now, &timeout);
+            std::shared_ptr<const search_plan> plan = cc->plan(*query_->line_pat);
+            index_ = plan->key;
+            folded_index_ = plan->folded_key;
+            if (FLAGS_literal_search) {
+                literal_ = plan->literal;
+                folded_literal_ = plan->folded_literal;
+            }
         }
+        if (query_->trace && indexed())
+            query_->trace->index_key = literal_.empty() ?
+                index_->ToString() : "literal " + literal_summary(literal_);
     }
 
     ~searcher() {
-        delete[] files_;
-
+        match_stats stats;
+        get_stats(&stats);
         debug(kDebugProfile, "re2 time: %d.%06ds",
-              int(re2_time_.elapsed().tv_sec),
-              int(re2_time_.elapsed().tv_usec));
+              int(stats.re2_time.tv_sec), int(stats.re2_time.tv_usec));
         debug(kDebugProfile, "git time: %d.%06ds",
-              int(git_time_.elapsed().tv_sec),
-              int(git_time_.elapsed().tv_usec));
+              int(stats.git_time.tv_sec), int(stats.git_time.tv_usec));
         debug(kDebugProfile, "index time: %d.%06ds",
-              int(index_time_.elapsed().tv_sec),
-              int(index_time_.elapsed().tv_usec));
+              int(stats.index_time.tv_sec), int(stats.index_time.tv_usec));
         debug(kDebugProfile, "sort time: %d.%06ds",
-              int(sort_time_.elapsed().tv_sec),
-              int(sort_time_.elapsed().tv_usec));
+              int(stats.sort_time.tv_sec), int(stats.sort_time.tv_usec));
         debug(kDebugProfile, "analyze time: %d.%06ds",
-              int(analyze_time_.elapsed().tv_sec),
-              int(analyze_time_.elapsed().tv_usec));
+              int(stats.analyze_time.tv_sec), int(stats.analyze_time.tv_usec));
     }
 
-    void operator()(const chunk *chunk);
+    /*
+     * Search the lines of `chunk' that lie within part `part' of
+     * `nparts' roughly equal, line-aligned ranges of its data. The
+     * ranges partition the chunk, so searching every part is
+     * equivalent to searching the whole chunk.
+     */
+    void operator()(const chunk *chunk, int part = 0, int nparts = 1);
+
+    /*
+     * The same, for each of `batch', in one pass over the part: each
+     * block of lines is tested against `set' -- built from the
+     * queries' line patterns, in order -- and rescanned, while it is
+     * still in cache, by just the queries that match somewhere in it.
+     * If `set' is NULL or fails, every query scans every block. Only
+     * the queries with `use' set are looked at at all, and each of
+     * them is passed to `release', by index, as soon as this part is
+     * done with it; it isn't touched again after that.
+     */
+    static void batch_search(const vector<searcher*>& batch,
+                             const vector<char>& use, const RE2::Set *set,
+                             const chunk *chunk, int part, int nparts,
+                             const std::function<void (size_t)>& release);
+
+    // Whether operator() narrows its searches using the index, rather
+    // than scanning all of every chunk.
+    bool indexed() const {
+        return FLAGS_index &&
+            (!literal_.empty() || (index_ && !index_->empty()) ||
+             (folded_index_ && !folded_index_->empty()));
+    }
+
+    // Add `t', for part `part' of `chunk', to the query's trace.
+    void trace(const chunk *chunk, int part, task_trace::path_kind path,
+               const task_times &t, uint64_t wall_ns) {
+        task_trace tt = {uint32_t(chunk->id), uint32_t(part), path,
+                         t.candidates, t.scanned_instead,
+                         t.bytes_scanned, t.try_matches, wall_ns};
+        std::unique_lock<std::mutex> locked(mtx_);
+        query_->trace->tasks.push_back(tt);
+    }
 
     void get_stats(match_stats *stats) {
-        stats->re2_time = re2_time_.elapsed();
-        stats->git_time = git_time_.elapsed();
-        stats->index_time = index_time_.elapsed();
-        stats->sort_time  = sort_time_.elapsed();
+        stats->re2_time = ns_to_timeval(re2_ns_);
+        stats->git_time = ns_to_timeval(git_ns_);
+        stats->index_time = ns_to_timeval(index_ns_);
+        stats->sort_time  = ns_to_timeval(sort_ns_);
         stats->analyze_time  = analyze_time_.elapsed();
     }
 
     exit_reason why() {
-        return exit_reason_;
+        exit_reason why = cancel_.reason();
+        if (why == kExitNone && outranked_)
+            return kExitMatchLimit;
+        return why;
+    }
+
+    bool ranked() const {
+        return ranked_;
+    }
+
+    // The best rank any match in chunk `i' of the allocator could
+    // have.
+    float chunk_bound(size_t i) const {
+        // chunk_rank() doesn't cover the path index's chunks.
+        if (query_->paths)
+            return std::numeric_limits<float>::infinity();
+        return cc_->chunk_rank(i) + max(kRankNameMatch, 0.0f);
+    }
+
+    /*
+     * True if the query is ranked and already has max_matches_
+     * matches better than anything that ranks `bound', so whatever
+     * `bound' stands for can be skipped.
+     */
+    bool outranked(float bound) {
+        if (!ranked_ || !max_matches_ ||
+            bound >= rank_floor_.load(std::memory_order_relaxed))
+            return false;
+        outranked_.store(true, std::memory_order_relaxed);
+        return true;
+    }
+
+    // No more matches are coming: hand over any ranked ones, best
+    // first, and close queue_.
+    void close() {
+        if (ranked_) {
+            std::unique_lock<std::mutex> locked(rank_mtx_);
+            std::sort(top_.begin(), top_.end(), better);
+            for (auto it = top_.begin(); it != top_.end(); ++it)
+                queue_.push(it->match);
+            matches_ = top_.size();
+        }
+        queue_.close();
     }
 
 protected:
     void next_range(match_finger *finger, int& minpos, int& maxpos, int end);
-    void full_search(const chunk *chunk);
+    /*
+     * [minpos, maxpos) below is always a whole number of lines: minpos
+     * is the start of a line and maxpos is one past a newline.
+     */
+    void full_search(const chunk *chunk, size_t minpos, size_t maxpos);
     void full_search(match_finger *finger, const chunk *chunk,
                      size_t minpos, size_t maxpos);
 
-    void filtered_search(const chunk *chunk);
-    void search_lines(uint32_t *left, int count, const chunk *chunk);
+    void filtered_search(const chunk *chunk, const intrusive_ptr<IndexKey> &key,
+                         bool fold, uint32_t minpos, uint32_t maxpos);
+    void literal_search(const chunk *chunk, uint32_t minpos, uint32_t maxpos);
+    void search_lines(uint32_t *left, int count, const chunk *chunk,
+                      uint32_t minpos, uint32_t maxpos);
 
-    bool accept(const indexed_file *file) {
-        if (query_->file_pat &&
-            !query_->file_pat->Match(file->path, 0, file->path.size(),
+    bool accept_tree(const indexed_tree *tree) {
+        if (query_->tree_pat &&
+            !query_->tree_pat->Match(tree->name, 0, tree->name.size(),
                                      RE2::UNANCHORED, 0, 0))
             return false;
 
-        if (query_->tree_pat &&
-            !query_->tree_pat->Match(file->tree->name, 0,
-                                     file->tree->name.size(),
+        if (query_->negate.tree_pat &&
+            query_->negate.tree_pat->Match(tree->name, 0, tree->name.size(),
+                                           RE2::UNANCHORED, 0, 0))
+            return false;
+
+        return true;
+    }
+
+    bool accept_uncached(const indexed_file *file) {
+        if (cc_->shadowed(file))
+            return false;
+
+        if (!trees_.count(file->tree))
+            return false;
+
+        if (query_->file_pat &&
+            !query_->file_pat->Match(file->path, 0, file->path.size(),
                                      RE2::UNANCHORED, 0, 0))
             return false;
 
@@ -174,24 +490,99 @@ protected:
                                            RE2::UNANCHORED, 0, 0))
             return false;
 
-        if (query_->negate.tree_pat &&
-            query_->negate.tree_pat->Match(file->tree->name, 0,
-                                           file->tree->name.size(),
-                                           RE2::UNANCHORED, 0, 0))
-            return false;
+        return true;
+    }
 
+    // True if no file with lines in `chunk' can pass the query's tree
+    // patterns, so there is no point searching it at all.
+    bool skip_chunk(const chunk *chunk) {
+        if (!query_->tree_pat && !query_->negate.tree_pat)
+            return false;
+        for (auto it = chunk->trees.begin(); it != chunk->trees.end(); ++it)
+            if (trees_.count(*it))
+                return false;
         return true;
     }
 
-    bool accept(const list<indexed_file *> &sfs) {
-        for (list<indexed_file *>::const_iterator it = sfs.begin();
-             it != sfs.end(); ++it) {
-            if (accept(*it))
+    /*
+     * A file is tested against the query's path and tree patterns
+     * the first time any worker asks about it; after that the answer
+     * comes from files_. Two workers racing on the same file just
+     * both compute the same answer.
+     */
+    bool accept(uint32_t file_id) {
+        if (!files_)
+            return true;
+        uint8_t v = files_[file_id].load(std::memory_order_relaxed);
+        if (v == kAcceptUnknown) {
+            v = accept_uncached(cc_->files_[file_id]);
+            files_[file_id].store(v, std::memory_order_relaxed);
+        }
+        return v;
+    }
+
+    bool accept(const indexed_file *file) {
+        return accept(file->no);
+    }
+
+    bool accept(const chunk *chunk, const chunk_file_range &range) {
+        if (!files_)
+            return true;
+        const uint32_t *ids = chunk->file_ids + range.files;
+        for (uint32_t i = 0; i < range.nfiles; ++i) {
+            if (accept(chunk->file_base + ids[i]))
                 return true;
         }
         return false;
     }
 
+    /*
+     * Try `line' against each accepted file in `range'.
+     */
+    void match_range(const chunk *chunk, const chunk_file_range &range,
+                     const StringPiece& match, const StringPiece& line) {
+        const uint32_t *ids = chunk->file_ids + range.files;
+        for (uint32_t i = 0; i < range.nfiles; ++i) {
+            uint32_t id = chunk->file_base + ids[i];
+            if (!accept(id))
+                continue;
+            if (exit_early())
+                break;
+            if (query_->paths)
+                path_match(line, match, cc_->files_[id]);
+            else
+                try_match(line, match, cc_->files_[id]);
+        }
+    }
+
+    // Whether scanning `size' bytes is cheaper than testing `count'
+    // candidate positions found in the index.
+    bool scan_cheaper(uint64_t count, uint32_t size) {
+        if (count * kMinFilterRatio > size)
+            return true;
+        return (query_->file_pat || query_->tree_pat) &&
+            double(count * 30) / size > files_density();
+    }
+
+    // Whether to scan [minpos, maxpos) of `chunk' rather than use
+    // the index, given `candidates' suffixes of the whole chunk that
+    // the index leaves.
+    bool prefer_full_search(const chunk *chunk, uint64_t candidates,
+                            uint32_t minpos, uint32_t maxpos) {
+        uint32_t size = maxpos - minpos;
+        if (candidates == 0)
+            return false;
+        if (size != chunk->size)
+            candidates = (candidates * size + chunk->size - 1) / chunk->size;
+        if (!scan_cheaper(candidates, size))
+            return false;
+        tasks_scan_instead.inc();
+        tls_times.scanned_instead = true;
+        debug(kDebugProfile, "Estimated %ld/%d candidates; scanning instead.",
+              long(candidates), int(size));
+        return true;
+    }
+
     double files_density(void) {
         std::unique_lock<std::mutex> locked(mtx_);
         if (files_density_ >= 0)
@@ -233,9 +624,27 @@ protected:
                    const StringPiece&,
                    indexed_file *);
 
+    // For paths queries: `line', in which the path index has
+    // `match', is the path of `sf'.
+    void path_match(const StringPiece& line,
+                    const StringPiece& match,
+                    indexed_file *sf);
+
+    // Post `m', which ranks `score', to queue_ -- or, for ranked
+    // queries, to the top matches.
+    void keep_match(match_result *m, float score) {
+        m->rank = score;
+        if (ranked_) {
+            offer(m, score);
+        } else {
+            queue_.push(m);
+            ++matches_;
+        }
+    }
+
     static int line_start(const chunk *chunk, int pos) {
         const unsigned char *start = static_cast<const unsigned char*>
-            (memrchr(chunk->data, '\n', pos));
+            (rfind_byte(chunk->data, pos, '\n'));
         if (start == NULL)
             return 0;
         return start - chunk->data;
@@ -243,50 +652,54 @@ protected:
 
     static int line_end(const chunk *chunk, int pos) {
         const unsigned char *end = static_cast<const unsigned char*>
-            (memchr(chunk->data + pos, '\n', chunk->size - pos));
+            (find_byte(chunk->data + pos, chunk->size - pos, '\n'));
         if (end == NULL)
             return chunk->size;
         return end - chunk->data;
     }
 
+    /*
+     * The first byte of part `part' of `nparts' of `chunk' -- the start
+     * of the first line beginning at or after part * size / nparts.
+     */
+    static uint32_t part_start(const chunk *chunk, int part, int nparts) {
+        if (part == 0)
+            return 0;
+        if (part >= nparts)
+            return chunk->size;
+        uint64_t pos = uint64_t(chunk->size) * part / nparts;
+        return min(uint32_t(chunk->size), uint32_t(line_end(chunk, pos) + 1));
+    }
+
     static StringPiece find_line(const StringPiece& chunk, const StringPiece& match) {
         const char *start, *end;
         assert(match.data() >= chunk.data());
         assert(match.data() <= chunk.data() + chunk.size());
         assert(match.size() <= (chunk.size() - (match.data() - chunk.data())));
         start = static_cast<const char*>
-            (memrchr(chunk.data(), '\n', match.data() - chunk.data()));
+            (rfind_byte(chunk.data(), match.data() - chunk.data(), '\n'));
         if (start == NULL)
             start = chunk.data();
         else
             start++;
         end = static_cast<const char*>
-            (memchr(match.data() + match.size(), '\n',
-                    chunk.size() - (match.data() - chunk.data()) - match.size()));
+            (find_byte(match.data() + match.size(),
+                       chunk.size() - (match.data() - chunk.data()) - match.size(), '\n'));
         if (end == NULL)
             end = chunk.data() + chunk.size();
         return StringPiece(start, end - start);
     }
 
+    /*
+     * Timeouts and cancellation are noticed by the pool's watchdog,
+     * which sets cancel_; all we have to do here is look at it.
+     */
     bool exit_early() {
-        if (exit_reason_)
+        if (cancel_.reason())
             return true;
 
-        if (FLAGS_max_matches && matches_.load() >= FLAGS_max_matches) {
-            exit_reason_ = kExitMatchLimit;
-            return true;
-        }
-#ifdef CODESEARCH_SLOWGTOD
-        static int counter = 1000;
-        if (--counter)
-            return false;
-        counter = 1000;
-#endif
-        timeval now;
-        gettimeofday(&now, NULL);
-        if (now.tv_sec > limit_.tv_sec ||
-            (now.tv_sec == limit_.tv_sec && now.tv_usec > limit_.tv_usec)) {
-            exit_reason_ = kExitTimeout;
+        if (max_matches_ && !ranked_ && matches_.load() >= max_matches_) {
+            cancel_.cancel(kExitMatchLimit);
             return true;
         }
         return false;
@@ -298,32 +711,150 @@ protected:
     thread_queue<match_result*> queue_;
     atomic_int matches_;
     intrusive_ptr<IndexKey> index_;
-    timer re2_time_;
-    timer git_time_;
-    timer index_time_;
-    timer sort_time_;
+    // If non-empty, line_pat is this literal (see literalRE)
+    vector<string> literal_;
+    // For chunks with folded suffix arrays; see search_plan.
+    intrusive_ptr<IndexKey> folded_index_;
+    string folded_literal_;
+    // Totals of every finished task's tls_times, in nanoseconds.
+    std::atomic<uint64_t> re2_ns_;
+    std::atomic<uint64_t> git_ns_;
+    std::atomic<uint64_t> index_ns_;
+    std::atomic<uint64_t> sort_ns_;
+    std::atomic<uint64_t> transform_ns_;
     timer analyze_time_;
-    timeval limit_;
-    exit_reason exit_reason_;
-    uint8_t *files_;
+    cancel_token cancel_;
+    // Per-file accept() results, or NULL if the query has no path or
+    // tree constraints and every file is accepted.
+    std::unique_ptr<std::atomic<uint8_t>[]> files_;
+    // The trees that pass tree_pat and negate.tree_pat.
+    std::unordered_set<const indexed_tree*> trees_;
 
     /*
      * The approximate ratio of how many files match file_pat and
      * tree_pat. Lazily computed -- -1 means it hasn't been computed
-     * yet. Protected by mtx_.
+     * yet. Protected by mtx_, as is query_->trace.
      */
     double files_density_;
     std::mutex mtx_;
 
+    const int max_matches_;
+    const int context_lines_;
+    // Where a match's context lines start, after the match_result.
+    const size_t match_head_;
+    // Every match_result this query has made, freed with it.
+    arena results_;
+
+    /*
+     * A match_result, and room for context_lines_ lines of context
+     * either side of it, in one piece of results_. Consumers never
+     * free them; they last until the query is over.
+     */
+    match_result *new_match() {
+        char *p = static_cast<char*>(results_.alloc(match_bytes()));
+        match_result *m = new (p) match_result();
+        StringPiece *lines = reinterpret_cast<StringPiece*>(p + match_head_);
+        for (size_t i = 0; i < 2 * size_t(context_lines_); ++i)
+            new (lines + i) StringPiece();
+        m->context_before = match_context(lines, context_lines_);
+        m->context_after = match_context(lines + context_lines_, context_lines_);
+        return m;
+    }
+
+    // Give back a match transform_ rejected, if nothing has been
+    // allocated since; many tag query matches are.
+    void drop_match(match_result *m) {
+        results_.release(m, match_bytes());
+    }
+
+    size_t match_bytes() const {
+        return match_head_ + 2 * size_t(context_lines_) * sizeof(StringPiece);
+    }
+
+    struct ranked_match {
+        float rank;
+        match_result *match;
+    };
+
+    // Higher rank first, then earlier files and lines, so that ties
+    // come out the same way every time.
+    static bool better(const ranked_match& a, const ranked_match& b) {
+        if (a.rank != b.rank)
+            return a.rank > b.rank;
+        if (a.match->file->no != b.match->file->no)
+            return a.match->file->no < b.match->file->no;
+        return a.match->lno < b.match->lno;
+    }
+
+    // file_rank(), plus kRankNameMatch if `sf's base name matches the
+    // line pattern.
+    float rank(const indexed_file *sf) {
+        float r = cc_->file_rank(sf);
+        uint8_t v = name_match_[sf->no].load(std::memory_order_relaxed);
+        if (v == kAcceptUnknown) {
+            StringPiece base = sf->path;
+            size_t slash = base.rfind('/');
+            if (slash != StringPiece::npos)
+                base.remove_prefix(slash + 1);
+            v = query_->line_pat->Match(base, 0, base.size(),
+                                        RE2::UNANCHORED, 0, 0);
+            name_match_[sf->no].store(v, std::memory_order_relaxed);
+        }
+        return v ? r + kRankNameMatch : r;
+    }
+
+    /*
+     * Keep `m' if it is among the max_matches_ best so far. top_ is
+     * a heap with the worst of them on top; once it is full,
+     * rank_floor_ is that match's rank, which lets workers skip
+     * whole chunks and files without taking rank_mtx_.
+     */
+    void offer(match_result *m, float rank) {
+        ranked_match r = {rank, m};
+        std::unique_lock<std::mutex> locked(rank_mtx_);
+        if (max_matches_ == 0 || top_.size() < size_t(max_matches_)) {
+            top_.push_back(r);
+            std::push_heap(top_.begin(), top_.end(), better);
+        } else if (better(r, top_.front())) {
+            std::pop_heap(top_.begin(), top_.end(), better);
+            top_.back() = r;
+            std::push_heap(top_.begin(), top_.end(), better);
+            outranked_.store(true, std::memory_order_relaxed);
+        } else {
+            outranked_.store(true, std::memory_order_relaxed);
+            locked.unlock();
+            drop_match(m);
+            return;
+        }
+        if (max_matches_ && top_.size() == size_t(max_matches_))
+            rank_floor_.store(top_.front().rank, std::memory_order_relaxed);
+    }
+
+    // For ranked queries.
+    const bool ranked_;
+    // Whether each file's base name matches line_pat; like files_,
+    // filled in on first use.
+    std::unique_ptr<std::atomic<uint8_t>[]> name_match_;
+    std::mutex rank_mtx_;
+    vector<ranked_match> top_;
+    std::atomic<float> rank_floor_;
+    // Set once anything has been skipped or dropped for ranking too
+    // low, so that the query reports hitting its match limit.
+    std::atomic<bool> outranked_;
+
     friend class code_searcher::search_thread;
+    friend class code_searcher::search_pool;
 };
 
 code_searcher::code_searcher()
-    : alloc_(0), finalized_(false)
+    : global_dedup_(FLAGS_global_dedup), alloc_(0), finalized_(false),
+      plans_(FLAGS_query_cache_size, plan_cache_hits, plan_cache_misses)
 {
 #ifdef USE_DENSE_HASH_SET
-    lines_.set_empty_key(empty_string);
+    lines_.set_empty_key(empty_line);
 #endif
+    if (global_dedup_ && FLAGS_dedup_table_mb > 0)
+        line_cache_.resize((size_t(FLAGS_dedup_table_mb) << 20) / sizeof(indexed_line));
 }
 
 void code_searcher::set_alloc(chunk_allocator *alloc) {
@@ -335,6 +866,28 @@ code_searcher::~code_searcher() {
     if (alloc_)
         alloc_->cleanup();
     delete alloc_;
+    if (path_alloc_)
+        path_alloc_->cleanup();
+    // With segments, trees_ holds theirs, which they free.
+    if (segments_.empty())
+        for (auto it = trees_.begin(); it != trees_.end(); ++it)
+            delete *it;
+    for (auto it = segments_.begin(); it != segments_.end(); ++it)
+        delete *it;
+}
+
+void code_searcher::add_tombstone(const string& tree, const string& version,
+                                  const string& path) {
+    assert(!finalized_);
+    tombstones_.push_back(tombstone{tree, version, path});
+}
+
+chunk_allocator *code_searcher::file_alloc(const indexed_file *sf) const {
+    if (segments_.empty())
+        return alloc_;
+    size_t seg = upper_bound(segment_files_.begin(), segment_files_.end(),
+                             uint32_t(sf->no)) - segment_files_.begin() - 1;
+    return segments_[seg]->alloc_;
 }
 
 void code_searcher::finalize() {
@@ -343,6 +896,45 @@ void code_searcher::finalize() {
     alloc_->finalize();
     idx_data_chunks.inc(alloc_->end() - alloc_->begin());
     idx_content_chunks.inc(alloc_->end_content() - alloc_->begin_content());
+    index_paths();
+}
+
+/*
+ * Paths are laid out and sorted just like lines of content, so paths
+ * queries run through the same searches as any other, index and all.
+ * A path shared by several files (in different trees, say) is stored
+ * once, and belongs to each of them.
+ */
+void code_searcher::index_paths() {
+    metric::timer tm(idx_paths_time);
+    size_t bytes = 1;
+    for (auto it = files_.begin(); it != files_.end(); ++it)
+        bytes += (*it)->path.size() + 1;
+    size_t size = 1 << 12;
+    while (size < bytes && size < alloc_->chunk_size())
+        size <<= 1;
+    path_alloc_.reset(make_mem_allocator());
+    path_alloc_->set_chunk_size(size);
+
+    std::unordered_map<string, pair<chunk*, StringPiece> > lines;
+    for (auto it = files_.begin(); it != files_.end(); ++it) {
+        indexed_file *sf = *it;
+        if (shadowed(sf))
+            continue;
+        auto ins = lines.insert(make_pair(sf->path.as_string(),
+                                          make_pair((chunk*)0, StringPiece())));
+        if (ins.second) {
+            unsigned char *p = path_alloc_->alloc(sf->path.size() + 1);
+            memcpy(p, sf->path.data(), sf->path.size());
+            p[sf->path.size()] = '\n';
+            ins.first->second = make_pair(path_alloc_->current_chunk(),
+                                          StringPiece((char*)p, sf->path.size()));
+        }
+        chunk *c = ins.first->second.first;
+        c->add_chunk_file(sf, ins.first->second.second);
+        c->finish_file();
+    }
+    path_alloc_->finalize();
 }
 
 vector<indexed_tree> code_searcher::trees() const {
@@ -359,18 +951,28 @@ const indexed_tree* code_searcher::open_tree(const string &name,
     indexed_tree *tree = new indexed_tree;
     tree->name = name;
     tree->version = version;
-    if (metadata) {
-        tree->metadata = metadata;
-    } else {
-        tree->metadata = NULL;
-    }
+    if (metadata)
+        tree->metadata = json_object_to_json_string(metadata);
     trees_.push_back(tree);
     return tree;
 }
 
-void code_searcher::index_file(const indexed_tree *tree,
-                               const string& path,
-                               StringPiece contents) {
+const indexed_tree* code_searcher::add_tree(const indexed_tree& tree) {
+    indexed_tree *out = new indexed_tree(tree);
+    trees_.push_back(out);
+    return out;
+}
+
+json_object *indexed_tree::parse_metadata() const {
+    if (metadata.empty())
+        return NULL;
+    json_object *js = json_tokener_parse(metadata.c_str());
+    return is_error(js) ? NULL : js;
+}
+
+indexed_file *code_searcher::index_file(const indexed_tree *tree,
+                                        const string& path,
+                                        StringPiece contents) {
     metric::timer tm(idx_index_file_time);
     assert(!finalized_);
     assert(alloc_);
@@ -382,24 +984,29 @@ void code_searcher::index_file(const indexed_tree *tree,
     chunk *prev = NULL;
     StringPiece line;
 
-    if (memchr(p, 0, len) != NULL)
-        return;
+    if (find_byte(p, len, 0) != NULL)
+        return NULL;
 
     idx_bytes.inc(len);
     idx_files.inc();
 
-    indexed_file *sf = new indexed_file;
+    file_store_.push_back(indexed_file());
+    indexed_file *sf = &file_store_.back();
     sf->tree = tree;
-    sf->path = path;
+    sf->path = paths_.intern(path);
     sf->no  = files_.size();
     files_.push_back(sf);
 
-    uint32_t lines = count(p, end, '\n');
+    uint32_t lines = count_newlines(p, end);
 
     // sf->content = new(new uint32_t[3*lines+1]) file_contents(0);
     file_contents_builder content;
+    // the chunks with ranges from this file, to finish_file() at the end
+    vector<chunk*> touched;
+    // time spent hashing and looking up lines, for idx_hash_time
+    uint64_t hash_ns = 0;
 
-    while ((f = static_cast<const char*>(memchr(p, '\n', end - p))) != 0) {
+    while ((f = static_cast<const char*>(find_byte(p, end - p, '\n'))) != 0) {
     final:
         idx_lines.inc();
         if (f - p + 1 >= FLAGS_line_limit) {
@@ -408,12 +1015,21 @@ void code_searcher::index_file(const indexed_tree *tree,
             // preserved.
             p = f;
         }
-        string_hash::iterator it;
+        indexed_line key, dup = empty_line;
         {
-            metric::timer tm(idx_hash_time);
-            it = lines_.find(StringPiece(p, f - p));
+            run_ns_timer tm(hash_ns);
+            key.data = p;
+            key.size = f - p;
+            key.hash = hash_line(p, f - p);
+            if (!line_cache_.empty()) {
+                dup = line_cache_.find(key);
+            } else {
+                string_hash::iterator it = lines_.find(key);
+                if (it != lines_.end())
+                    dup = *it;
+            }
         }
-        if (it == lines_.end()) {
+        if (dup.data == NULL) {
             idx_bytes_dedup.inc((f - p) + 1);
             idx_lines_dedup.inc();
 
@@ -421,18 +1037,32 @@ void code_searcher::index_file(const indexed_tree *tree,
             memcpy(alloc, p, f - p);
             alloc[f - p] = '\n';
             line = StringPiece((char*)alloc, f - p);
+            c = alloc_->current_chunk();
+            key.data = line.data();
+            key.chunk = c->id;
             {
-                metric::timer tm(idx_hash_time);
-                if (alloc_->current_chunk() != prev)
-                    lines_.clear();
-                lines_.insert(line);
+                run_ns_timer tm(hash_ns);
+                if (!line_cache_.empty()) {
+                    line_cache_.insert(key);
+                } else {
+                    if (c != prev && !global_dedup_)
+                        lines_.clear();
+                    lines_.insert(key);
+                }
             }
-            prev = c = alloc_->current_chunk();
+            prev = c;
         } else {
-            line = *it;
-            c = alloc_->chunk_from_string
-                (reinterpret_cast<const unsigned char*>(line.data()));
+            line = dup.piece();
+            c = alloc_->at(dup.chunk);
         }
+        // With --global_dedup, `c' may be an older chunk that a
+        // finalize worker is sorting. That is safe even so: workers
+        // only read its data (but for the newlines, which no line
+        // includes) and write its suffix arrays, while its per-file
+        // tables, which this updates, belong to the indexing thread
+        // until finalize_files().
+        if (c->cur_file.empty())
+            touched.push_back(c);
         c->add_chunk_file(sf, line);
         content.extend(c, line);
         p = min(end, f + 1);
@@ -445,6 +1075,7 @@ void code_searcher::index_file(const indexed_tree *tree,
         lines++;
         goto final;
     }
+    idx_hash_time.inc_ns(hash_ns);
 
     sf->content = content.build(alloc_);
     if (sf->content == 0) {
@@ -456,31 +1087,189 @@ void code_searcher::index_file(const indexed_tree *tree,
     idx_content_ranges.inc(sf->content->size());
     assert(sf->content->size() <= 3*lines);
 
-    for (auto it = alloc_->begin();
-         it != alloc_->end(); it++)
+    for (auto it = touched.begin(); it != touched.end(); ++it)
+        (*it)->finish_file();
+    // Only the current chunk's lines are kept for dedup, so no later
+    // file can have lines in any chunk before it.
+    if (!global_dedup_)
+        alloc_->retire_chunks();
+    return sf;
+}
+
+int code_searcher::copy_chunks(code_searcher *base) {
+    assert(!finalized_);
+    assert(alloc_);
+    if (alloc_->size() == 0)
+        alloc_->set_chunk_size(base->alloc_->chunk_size());
+    if (alloc_->chunk_size() != base->alloc_->chunk_size())
+        die("Cannot copy chunks of %ld bytes into an index of %ld-byte chunks.",
+            long(base->alloc_->chunk_size()), long(alloc_->chunk_size()));
+    int first = alloc_->size();
+    for (auto it = base->alloc_->begin(); it != base->alloc_->end(); ++it)
+        alloc_->copy_chunk(*it);
+    alloc_->add_corpus(base->alloc_->corpus());
+    return first;
+}
+
+void code_searcher::copy_index(code_searcher *src, bool reindex,
+                               const std::function<bool (const indexed_file*)>& keep) {
+    assert(src->finalized_);
+    vector<code_searcher*> segs = src->segments_;
+    if (segs.empty())
+        segs.push_back(src);
+    if (name_.empty())
+        name_ = src->name_;
+
+    // Trees of the same name and version in different segments
+    // become one.
+    map<pair<string, string>, const indexed_tree*> trees;
+    string text;
+    for (auto seg = segs.begin(); seg != segs.end(); ++seg) {
+        int chunk_base = reindex ? 0 : copy_chunks(*seg);
+        for (auto it = (*seg)->files_.begin(); it != (*seg)->files_.end(); ++it) {
+            indexed_file *f = *it;
+            if (src->shadowed(f) || (keep && !keep(f)))
+                continue;
+            const indexed_tree *&tree = trees[make_pair(f->tree->name, f->tree->version)];
+            if (tree == NULL)
+                tree = add_tree(*f->tree);
+            if (!reindex) {
+                index_copy(tree, f->path.as_string(), f, chunk_base);
+                continue;
+            }
+            text.clear();
+            chunk_allocator *alloc = (*seg)->alloc_;
+            for (auto line = f->content->begin(alloc);
+                 line != f->content->end(alloc); ++line) {
+                text.append(line->data(), line->size());
+                text += '\n';
+            }
+            index_file(tree, f->path.as_string(), text);
+        }
+    }
+
+    // The oldest segment's tombstones are for some index that is not
+    // part of this one.
+    tombstones_.insert(tombstones_.end(), segs[0]->tombstones_.begin(),
+                       segs[0]->tombstones_.end());
+}
+
+indexed_file *code_searcher::index_copy(const indexed_tree *tree,
+                                        const string& path,
+                                        const indexed_file *orig,
+                                        int chunk_base) {
+    metric::timer tm(idx_index_file_time);
+    assert(!finalized_);
+    assert(alloc_);
+
+    idx_files.inc();
+    idx_files_copied.inc();
+
+    file_store_.push_back(indexed_file());
+    indexed_file *sf = &file_store_.back();
+    sf->tree = tree;
+    sf->path = paths_.intern(path);
+    sf->no  = files_.size();
+    files_.push_back(sf);
+
+    file_contents_builder content;
+    vector<chunk*> touched;
+    for (auto it = orig->content->begin(); it != orig->content->end(); ++it) {
+        chunk *c = alloc_->at(chunk_base + it->chunk);
+        const char *p = reinterpret_cast<const char*>(c->data + it->off);
+        const char *end = p + it->len;
+        content.extend(c, StringPiece(p, it->len));
+        if (c->cur_file.empty())
+            touched.push_back(c);
+        // add_chunk_file() wants one line at a time
+        while (true) {
+            const char *f = static_cast<const char*>(find_byte(p, end - p, '\n'));
+            if (f == NULL)
+                f = end;
+            c->add_chunk_file(sf, StringPiece(p, f - p));
+            if (f == end)
+                break;
+            p = f + 1;
+        }
+    }
+
+    sf->content = content.build(alloc_);
+    if (sf->content == 0) {
+        file_contents_builder dummy;
+        sf->content = dummy.build(alloc_);
+    }
+    idx_content_ranges.inc(sf->content->size());
+
+    for (auto it = touched.begin(); it != touched.end(); ++it)
         (*it)->finish_file();
+    return sf;
 }
 
-void searcher::operator()(const chunk *chunk)
+void searcher::operator()(const chunk *chunk, int part, int nparts)
 {
-    if (exit_reason_)
+    if (cancel_.reason())
+        return;
+
+    uint32_t minpos = part_start(chunk, part, nparts);
+    uint32_t maxpos = part_start(chunk, part + 1, nparts);
+    if (minpos >= maxpos)
         return;
 
-    if (FLAGS_index && index_ && !index_->empty())
-        filtered_search(chunk);
-    else
-        full_search(chunk);
+    uint64_t start = query_->trace ? monotonic_ns() : 0;
+    task_trace::path_kind path;
+    tls_times = task_times();
+    if (FLAGS_index && !literal_.empty()) {
+        tasks_literal.inc();
+        path = task_trace::kLiteral;
+        literal_search(chunk, minpos, maxpos);
+    } else if (FLAGS_index && chunk->folded && folded_index_ && !folded_index_->empty()) {
+        tasks_filtered.inc();
+        path = task_trace::kFiltered;
+        filtered_search(chunk, folded_index_, true, minpos, maxpos);
+    } else if (FLAGS_index && index_ && !index_->empty()) {
+        tasks_filtered.inc();
+        path = task_trace::kFiltered;
+        filtered_search(chunk, index_, false, minpos, maxpos);
+    } else {
+        tasks_full.inc();
+        path = task_trace::kFull;
+        full_search(chunk, minpos, maxpos);
+    }
+    if (query_->trace)
+        trace(chunk, part, path, tls_times, monotonic_ns() - start);
+
+    re2_ns_   += tls_times.re2;
+    git_ns_   += tls_times.git;
+    index_ns_ += tls_times.index;
+    sort_ns_  += tls_times.sort;
+    transform_ns_ += tls_times.transform;
 }
 
 struct walk_state {
-    uint32_t *left, *right;
+    // a range of suffix array indexes
+    uint32_t left, right;
     intrusive_ptr<IndexKey> key;
     int depth;
 };
 
+/*
+ * Compares suffixes of `chunk_', in its suffix array or (with `fold_')
+ * its folded one, by their bytes at `idx_'.
+ */
 struct lt_index {
     const chunk *chunk_;
     int idx_;
+    bool fold_;
+
+    uint32_t suffix(uint32_t i) const {
+        return fold_ ? chunk_->folded_suffix(i) : chunk_->suffix(i);
+    }
+
+    // The byte at `depth' of entry i, as this order sees it.
+    unsigned char at(uint32_t i, int depth) const {
+        unsigned char c = chunk_->data[suffix(i) + depth];
+        return fold_ ? fold_byte(c) : c;
+    }
 
     bool operator()(uint32_t lhs, unsigned char rhs) {
         return cmp(lhs, rhs) < 0;
@@ -494,62 +1283,192 @@ struct lt_index {
         unsigned char lc = chunk_->data[lhs + idx_];
         if (lc == '\n')
             return -1;
+        if (fold_)
+            lc = fold_byte(lc);
         return (int)lc - (int)rhs;
     }
 };
 
+/*
+ * lower_bound and upper_bound over entries [left, right) of the suffix
+ * array `lt' orders, which may be packed and so can't be walked as a
+ * plain array.
+ */
+static uint32_t lower_bound_suffix(uint32_t left, uint32_t right,
+                                   unsigned char ch, lt_index lt) {
+    while (left < right) {
+        uint32_t mid = left + (right - left) / 2;
+        if (lt(lt.suffix(mid), ch))
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    return left;
+}
 
-void searcher::filtered_search(const chunk *chunk)
-{
+static uint32_t upper_bound_suffix(uint32_t left, uint32_t right,
+                                   unsigned char ch, lt_index lt) {
+    while (left < right) {
+        uint32_t mid = left + (right - left) / 2;
+        if (lt(ch, lt.suffix(mid)))
+            right = mid;
+        else
+            left = mid + 1;
+    }
+    return left;
+}
+
+
+/*
+ * Scratch space for the suffix positions a worker pulls out of the
+ * index, sized so that once it fills up a full scan is cheaper.
+ */
+static vector<uint32_t> *index_buffer(chunk_allocator *alloc) {
     static per_thread<vector<uint32_t> > indexes;
     if (!indexes.get()) {
-        indexes.put(new vector<uint32_t>(cc_->alloc_->chunk_size() / kMinFilterRatio));
+        indexes.put(new vector<uint32_t>(alloc->chunk_size() / kMinFilterRatio));
     }
+    return indexes.get();
+}
+
+/*
+ * For a literal query, the suffixes starting with the literal are
+ * exactly the matches, so we narrow the suffix array one byte at a
+ * time and hand the hits straight to find_match. A folded literal
+ * narrows a folded suffix array to one range, where the plain one
+ * splits in two at each letter.
+ */
+void searcher::literal_search(const chunk *chunk,
+                              uint32_t minpos, uint32_t maxpos)
+{
+    vector<uint32_t> *indexes = index_buffer(cc_->alloc_);
     int count = 0;
+    bool fold = chunk->folded && !folded_literal_.empty();
+    lt_index lt = {chunk, 0, fold};
     {
-        run_timer run(index_time_);
+        run_ns_timer run(tls_times.index);
+        vector<pair<uint32_t, uint32_t> > ranges, next;
+        ranges.push_back(make_pair(0, uint32_t(chunk->size)));
+        for (int depth = 0; depth < literal_.size() && !ranges.empty(); ++depth) {
+            lt.idx_ = depth;
+            StringPiece bytes = fold ?
+                StringPiece(folded_literal_).substr(depth, 1) : StringPiece(literal_[depth]);
+            next.clear();
+            for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+                for (auto ch = bytes.begin(); ch != bytes.end(); ++ch) {
+                    uint32_t l = lower_bound_suffix(it->first, it->second,
+                                                    (unsigned char)*ch, lt);
+                    uint32_t r = upper_bound_suffix(l, it->second,
+                                                    (unsigned char)*ch, lt);
+                    if (l != r)
+                        next.push_back(make_pair(l, r));
+                }
+            }
+            ranges.swap(next);
+        }
+
+        uint64_t candidates = 0;
+        for (auto it = ranges.begin(); it != ranges.end(); ++it)
+            candidates += it->second - it->first;
+        tls_times.candidates = candidates;
+        if (prefer_full_search(chunk, candidates, minpos, maxpos)) {
+            full_search(chunk, minpos, maxpos);
+            return;
+        }
+
+        for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+            for (uint32_t i = it->first; i != it->second; ++i) {
+                uint32_t pos = lt.suffix(i);
+                if (pos < minpos || pos >= maxpos)
+                    continue;
+                if (count == indexes->size()) {
+                    full_search(chunk, minpos, maxpos);
+                    return;
+                }
+                (*indexes)[count++] = pos;
+            }
+        }
+    }
+
+    if (count == 0)
+        return;
+    {
+        run_ns_timer run(tls_times.sort);
+        lsd_radix_sort(&(*indexes)[0], &(*indexes)[0] + count, maxpos);
+    }
+
+    StringPiece str((char*)chunk->data, chunk->size);
+    uint32_t next_line = 0;
+    for (int i = 0; i < count && !exit_early(); i++) {
+        // only the leftmost match on each line counts
+        if ((*indexes)[i] < next_line)
+            continue;
+        StringPiece match(str.data() + (*indexes)[i], literal_.size());
+        StringPiece line = find_line(str, match);
+        if (utf8_valid(line.data(), line.size()))
+            find_match(chunk, match, line);
+        next_line = line.data() + line.size() - str.data() + 1;
+    }
+}
+
+/*
+ * The walk only narrows the suffix array down to ranges; their sizes
+ * say how many candidates the index would hand search_lines() (for a
+ * part of the chunk, assuming they are spread evenly across it), so
+ * we can give up on the index before copying any of them out.
+ *
+ * `key' is walked down the chunk's folded suffix array if `fold', and
+ * its plain one otherwise.
+ */
+void searcher::filtered_search(const chunk *chunk, const intrusive_ptr<IndexKey> &key,
+                               bool fold, uint32_t minpos, uint32_t maxpos)
+{
+    vector<uint32_t> *indexes = index_buffer(cc_->alloc_);
+    int count = 0;
+    bool whole = (minpos == 0 && maxpos == chunk->size);
+    {
+        run_ns_timer run(tls_times.index);
         vector<walk_state> stack;
+        vector<pair<uint32_t, uint32_t> > ranges;
+        uint64_t candidates = 0;
         stack.push_back((walk_state){
-                chunk->suffixes, chunk->suffixes + chunk->size, index_, 0});
+                0, uint32_t(chunk->size), key, 0});
 
         while (!stack.empty()) {
             walk_state st = stack.back();
             stack.pop_back();
             if (!st.key || st.key->empty() || (st.right - st.left) <= 100) {
-                if ((count + st.right - st.left) > indexes->size()) {
-                    count = indexes->size() + 1;
+                ranges.push_back(make_pair(st.left, st.right));
+                candidates += st.right - st.left;
+                // As good as prefer_full_search(), and saves walking
+                // the rest of the key.
+                if (candidates * kMinFilterRatio > chunk->size)
                     break;
-                }
-                memcpy(&(*indexes)[count], st.left,
-                       (st.right - st.left) * sizeof(uint32_t));
-                count += (st.right - st.left);
                 continue;
             }
-            lt_index lt = {chunk, st.depth};
+            lt_index lt = {chunk, st.depth, fold};
             for (IndexKey::iterator it = st.key->begin();
                  it != st.key->end(); ++it) {
-                uint32_t *l, *r;
-                l = lower_bound(st.left, st.right, it->first.first, lt);
-                uint32_t *right = lower_bound(l, st.right,
-                                              (unsigned char)(it->first.second + 1),
-                                              lt);
+                uint32_t l, r;
+                l = lower_bound_suffix(st.left, st.right, it->first.first, lt);
+                uint32_t right = upper_bound_suffix(l, st.right,
+                                                    it->first.second, lt);
                 if (l == right)
                     continue;
 
                 if (st.depth)
-                    assert(chunk->data[*l + st.depth - 1] ==
-                           chunk->data[*(right - 1) + st.depth - 1]);
+                    assert(lt.at(l, st.depth - 1) == lt.at(right - 1, st.depth - 1));
 
                 assert(l == st.left ||
-                       chunk->data[*(l-1) + st.depth] == '\n' ||
-                       chunk->data[*(l-1) + st.depth] < it->first.first);
-                assert(chunk->data[*l + st.depth] >= it->first.first);
+                       lt.at(l-1, st.depth) == '\n' ||
+                       lt.at(l-1, st.depth) < it->first.first);
+                assert(lt.at(l, st.depth) >= it->first.first);
                 assert(right == st.right ||
-                       chunk->data[*right + st.depth] > it->first.second);
+                       lt.at(right, st.depth) > it->first.second);
 
                 for (unsigned char ch = it->first.first; ch <= it->first.second;
                      ch++, l = r) {
-                    r = lower_bound(l, right, (unsigned char)(ch + 1), lt);
+                    r = upper_bound_suffix(l, right, ch, lt);
 
                     if (r != l) {
                         stack.push_back((walk_state){l, r, it->second, st.depth + 1});
@@ -557,40 +1476,62 @@ void searcher::filtered_search(const chunk *chunk)
                 }
             }
         }
+
+        tls_times.candidates = candidates;
+        if (prefer_full_search(chunk, candidates, minpos, maxpos)) {
+            full_search(chunk, minpos, maxpos);
+            return;
+        }
+
+        for (auto it = ranges.begin(); it != ranges.end(); ++it) {
+            if ((count + it->second - it->first) > indexes->size()) {
+                count = indexes->size() + 1;
+                break;
+            }
+            if (whole && chunk->suffix_bits == 32) {
+                memcpy(&(*indexes)[count],
+                       (fold ? chunk->folded : chunk->suffixes) + it->first,
+                       (it->second - it->first) * sizeof(uint32_t));
+                count += (it->second - it->first);
+            } else {
+                lt_index lt = {chunk, 0, fold};
+                for (uint32_t i = it->first; i != it->second; ++i) {
+                    uint32_t pos = lt.suffix(i);
+                    if (pos >= minpos && pos < maxpos)
+                        (*indexes)[count++] = pos;
+                }
+            }
+        }
     }
 
-    search_lines(&(*indexes)[0], count, chunk);
+    search_lines(&(*indexes)[0], count, chunk, minpos, maxpos);
 }
 
 struct match_finger {
     const chunk *chunk_;
-    vector<chunk_file>::const_iterator it_;
+    const chunk_file_range *it_;
     match_finger(const chunk *chunk) :
-        chunk_(chunk), it_(chunk->files.begin()) {};
+        chunk_(chunk), it_(chunk->ranges) {};
 };
 
 void searcher::search_lines(uint32_t *indexes, int count,
-                            const chunk *chunk)
+                            const chunk *chunk,
+                            uint32_t minpos, uint32_t maxpos)
 {
-    debug(kDebugProfile, "search_lines: Searching %d/%d indexes.", count, chunk->size);
+    uint32_t size = maxpos - minpos;
+    debug(kDebugProfile, "search_lines: Searching %d/%d indexes.", count, size);
 
     if (count == 0)
         return;
 
-    if (count * kMinFilterRatio > chunk->size) {
-        full_search(chunk);
-        return;
-    }
-
-    if ((query_->file_pat || query_->tree_pat) &&
-        double(count * 30) / chunk->size > files_density()) {
-        full_search(chunk);
+    if (scan_cheaper(count, size)) {
+        full_search(chunk, minpos, maxpos);
         return;
     }
 
     {
-        run_timer run(sort_time_);
-        lsd_radix_sort(indexes, indexes + count);
+        run_ns_timer run(tls_times.sort);
+        lsd_radix_sort(indexes, indexes + count, maxpos);
     }
 
     match_finger finger(chunk);
@@ -617,10 +1558,116 @@ void searcher::search_lines(uint32_t *indexes, int count,
     }
 }
 
-void searcher::full_search(const chunk *chunk)
+void searcher::full_search(const chunk *chunk, size_t minpos, size_t maxpos)
 {
     match_finger finger(chunk);
-    full_search(&finger, chunk, 0, chunk->size - 1);
+    full_search(&finger, chunk, minpos, maxpos - 1);
+}
+
+void searcher::batch_search(const vector<searcher*>& batch,
+                            const vector<char>& use, const RE2::Set *set,
+                            const chunk *chunk, int part, int nparts,
+                            const std::function<void (size_t)>& release)
+{
+    uint32_t minpos = part_start(chunk, part, nparts);
+    uint32_t maxpos = part_start(chunk, part + 1, nparts);
+    size_t n = batch.size();
+    if (minpos >= maxpos) {
+        for (size_t i = 0; i < n; ++i)
+            if (use[i])
+                release(i);
+        return;
+    }
+    tasks_batched.inc();
+
+    uint64_t start = monotonic_ns();
+    vector<char> live(n);
+    vector<match_finger> fingers(n, match_finger(chunk));
+    vector<task_times> times(n);
+    vector<char> swept(n);
+    uint64_t set_ns = 0;
+
+    // Charge query `i' for its part of the sweep so far -- the shared
+    // scan equally to each -- and let go of it.
+    auto done = [&](size_t i) {
+        batch[i]->re2_ns_ += times[i].re2 + set_ns / n;
+        batch[i]->git_ns_ += times[i].git;
+        batch[i]->transform_ns_ += times[i].transform;
+        if (swept[i] && batch[i]->query_->trace)
+            batch[i]->trace(chunk, part, task_trace::kBatched, times[i],
+                            monotonic_ns() - start);
+        release(i);
+    };
+
+    bool any = false;
+    for (size_t i = 0; i < n; ++i) {
+        if (!use[i])
+            continue;
+        live[i] = swept[i] = !batch[i]->cancel_.reason() && !batch[i]->skip_chunk(chunk);
+        any |= live[i];
+        if (!live[i] && batch[i]->query_->trace && !batch[i]->cancel_.reason())
+            batch[i]->trace(chunk, part, task_trace::kSkipped, task_times(), 0);
+        if (!live[i])
+            done(i);
+    }
+
+    vector<int> hits;
+    StringPiece str((char*)chunk->data, chunk->size);
+    uint32_t pos = minpos;
+    while (pos < maxpos && any) {
+        uint32_t end = maxpos;
+        if (end - pos > uint32_t(kBatchBlock))
+            end = min(maxpos, uint32_t(line_end(chunk, pos + kBatchBlock) + 1));
+
+        bool all = (set == NULL);
+        if (set) {
+            run_ns_timer run(set_ns);
+            RE2::Set::ErrorInfo err;
+            hits.clear();
+            if (!set->Match(str.substr(pos, end - pos), &hits, &err))
+                all = (err.kind != RE2::Set::kNoError);
+            // First come, first served.
+            std::sort(hits.begin(), hits.end());
+        }
+        if (all) {
+            hits.resize(n);
+            for (size_t i = 0; i < n; ++i)
+                hits[i] = i;
+        }
+
+        for (auto it = hits.begin(); it != hits.end(); ++it) {
+            searcher *s = batch[*it];
+            if (!live[*it] || s->exit_early())
+                continue;
+            tls_times = task_times();
+            s->full_search(&fingers[*it], chunk, pos, end - 1);
+            task_times &t = times[*it];
+            t.re2 += tls_times.re2;
+            t.git += tls_times.git;
+            t.transform += tls_times.transform;
+            t.bytes_scanned += tls_times.bytes_scanned;
+            t.try_matches += tls_times.try_matches;
+            if (s->exit_early()) {
+                live[*it] = false;
+                done(*it);
+            }
+        }
+        // A query that has stopped, whether or not it matched in this
+        // block, is let go of now rather than at the end of the part.
+        any = false;
+        for (size_t i = 0; i < n; ++i) {
+            if (live[i] && batch[i]->exit_early()) {
+                live[i] = false;
+                done(i);
+            }
+            any |= live[i];
+        }
+        pos = end;
+    }
+
+    for (size_t i = 0; i < n; ++i)
+        if (live[i])
+            done(i);
 }
 
 void searcher::next_range(match_finger *finger,
@@ -631,21 +1678,22 @@ void searcher::next_range(match_finger *finger,
 
     debug(kDebugSearch, "next_range(%d, %d, %d)", pos, endpos, maxpos);
 
-    vector<chunk_file>::const_iterator& it = finger->it_;
-    const vector<chunk_file>::const_iterator& end = finger->chunk_->files.end();
+    const chunk *chunk = finger->chunk_;
+    const chunk_file_range *&it = finger->it_;
+    const chunk_file_range *end = chunk->ranges + chunk->nranges;
 
     /* Find the first matching range that intersects [pos, maxpos) */
     while (it != end &&
-           (it->right < pos || !accept(it->files)) &&
-           it->left < maxpos)
+           (int(it->right) < pos || !accept(chunk, *it)) &&
+           int(it->left) < maxpos)
         ++it;
 
-    if (it == end || it->left >= maxpos) {
+    if (it == end || int(it->left) >= maxpos) {
         pos = endpos = maxpos;
         return;
     }
 
-    pos    = max(pos, it->left);
+    pos    = max(pos, int(it->left));
     endpos = it->right;
 
     /*
@@ -657,8 +1705,8 @@ void searcher::next_range(match_finger *finger,
     do {
         if (it->left >= endpos + kMinSkip)
             break;
-        if (it->right >= endpos && accept(it->files)) {
-            endpos = max(endpos, it->right);
+        if (int(it->right) >= endpos && accept(chunk, *it)) {
+            endpos = max(endpos, int(it->right));
             if (endpos >= maxpos)
                 /*
                  * We've accepted the entire range. No point in going on.
@@ -666,7 +1714,7 @@ void searcher::next_range(match_finger *finger,
                 break;
         }
         ++it;
-    } while (it != end && it->left < maxpos);
+    } while (it != end && int(it->left) < maxpos);
 
     endpos = min(endpos, maxpos);
 }
@@ -693,7 +1741,8 @@ void searcher::full_search(match_finger *finger,
             int limit = end;
             if (limit - pos > kMaxScan)
                 limit = line_end(chunk, pos + kMaxScan);
-            run_timer run(re2_time_);
+            tls_times.bytes_scanned += limit - pos;
+            run_ns_timer run(tls_times.re2);
             if (!query_->line_pat->Match(str, pos, limit, RE2::UNANCHORED, &match, 1)) {
                 pos = limit + 1;
                 continue;
@@ -701,7 +1750,7 @@ void searcher::full_search(match_finger *finger,
         }
         assert(memchr(match.data(), '\n', match.size()) == NULL);
         StringPiece line = find_line(str, match);
-        if (utf8::is_valid(line.data(), line.data() + line.size()))
+        if (utf8_valid(line.data(), line.size()))
             find_match(chunk, match, line);
         new_pos = line.size() + line.data() - str.data() + 1;
         assert(new_pos > pos);
@@ -712,23 +1761,16 @@ void searcher::full_search(match_finger *finger,
 void searcher::find_match_brute(const chunk *chunk,
                                 const StringPiece& match,
                                 const StringPiece& line) {
-    run_timer run(git_time_);
+    run_ns_timer run(tls_times.git);
     timer tm;
     int off = (unsigned char*)line.data() - chunk->data;
     int searched = 0;
 
-    for(vector<chunk_file>::const_iterator it = chunk->files.begin();
-        it != chunk->files.end(); it++) {
-        if (off >= it->left && off <= it->right) {
-            for (list<indexed_file *>::const_iterator fit = it->files.begin();
-                 fit != it->files.end(); ++fit) {
-                if (!accept(*fit))
-                    continue;
-                searched++;
-                if (exit_early())
-                    break;
-                try_match(line, match, *fit);
-            }
+    for (uint32_t i = 0; i < chunk->nranges; i++) {
+        const chunk_file_range &r = chunk->ranges[i];
+        if (off >= int(r.left) && off <= int(r.right)) {
+            searched += r.nfiles;
+            match_range(chunk, r, match, line);
         }
     }
 
@@ -747,43 +1789,39 @@ void searcher::find_match(const chunk *chunk,
         return;
     }
 
-    run_timer run(git_time_);
+    run_ns_timer run(tls_times.git);
     int loff = (unsigned char*)line.data() - chunk->data;
 
-    vector<chunk_file_node *> stack;
-    assert(chunk->cf_root);
-    stack.push_back(chunk->cf_root);
+    // Each step pops one node and pushes at most two, and the tree
+    // is balanced, so the stack never holds more than one node per
+    // level plus one.
+    uint32_t stack[64];
+    int depth = 0;
+    const uint32_t n_nodes = chunk->nranges;
+    if (n_nodes)
+        stack[depth++] = 0;
 
     debug(kDebugSearch, "find_match(%d)", loff);
 
-    while (!stack.empty() && !exit_reason_) {
-        chunk_file_node *n = stack.back();
-        stack.pop_back();
+    while (depth && !cancel_.reason()) {
+        uint32_t i = stack[--depth];
+        const chunk_file_node &n = chunk->tree[i];
 
         debug(kDebugSearch,
-              "walk <%d-%d> - %d", n->chunk->left, n->chunk->right,
-              n->right_limit);
+              "walk <%d-%d> - %d", n.left, n.right, n.right_limit);
 
-        if (loff > n->right_limit)
+        if (loff > int(n.right_limit))
             continue;
-        if (loff >= n->chunk->left) {
-            if (n->right)
-                stack.push_back(n->right);
-            if (loff <= n->chunk->right) {
-                debug(kDebugSearch, "visit <%d-%d>", n->chunk->left, n->chunk->right);
-                assert(loff >= n->chunk->left && loff <= n->chunk->right);
-                for (list<indexed_file *>::const_iterator it = n->chunk->files.begin();
-                     it != n->chunk->files.end(); ++it) {
-                    if (!accept(*it))
-                        continue;
-                    if (exit_early())
-                        break;
-                    try_match(line, match, *it);
-                }
+        if (loff >= int(n.left)) {
+            if (2*i + 2 < n_nodes)
+                stack[depth++] = 2*i + 2;
+            if (loff <= int(n.right)) {
+                debug(kDebugSearch, "visit <%d-%d>", n.left, n.right);
+                match_range(chunk, chunk->ranges[n.range], match, line);
             }
         }
-        if (n->left)
-            stack.push_back(n->left);
+        if (2*i + 1 < n_nodes)
+            stack[depth++] = 2*i + 1;
     }
 }
 
@@ -791,27 +1829,34 @@ void searcher::find_match(const chunk *chunk,
 void searcher::try_match(const StringPiece& line,
                          const StringPiece& match,
                          indexed_file *sf) {
+    tls_times.try_matches++;
 
-    int lno = 1;
-    auto it = sf->content->begin(cc_->alloc_);
+    float score = 0;
+    if (ranked_) {
+        score = rank(sf);
+        if (outranked(score))
+            return;
+    }
+
+    int lno;
+    chunk_allocator *alloc = cc_->file_alloc(sf);
+    auto it = sf->content->begin(alloc);
 
     while (true) {
-        for (;it != sf->content->end(cc_->alloc_); ++it) {
+        for (;it != sf->content->end(alloc); ++it) {
             if (line.data() >= it->data() &&
-                line.data() <= it->data() + it->size()) {
-                lno += count(it->data(), line.data(), '\n');
+                line.data() <= it->data() + it->size())
                 break;
-            } else {
-                lno += count(it->data(), it->data() + it->size(), '\n') + 1;
-            }
         }
 
-        debug(kDebugSearch, "found match on %s:%d", sf->path.c_str(), lno);
-
-        if (it == sf->content->end(cc_->alloc_))
+        if (it == sf->content->end(alloc))
             return;
 
-        match_result *m = new match_result;
+        lno = it.lno(line.data());
+        debug(kDebugSearch, "found match on %.*s:%d",
+              int(sf->path.size()), sf->path.data(), lno);
+
+        match_result *m = new_match();
         m->file = sf;
         m->lno  = lno;
         m->line = line;
@@ -824,9 +1869,9 @@ void searcher::try_match(const StringPiece& line,
         StringPiece l = line;
         int i = 0;
 
-        for (i = 0; i < kContextLines; i++) {
+        for (i = 0; i < context_lines_; i++) {
             if (l.data() == bit->data()) {
-                if (bit == sf->content->begin(cc_->alloc_))
+                if (bit == sf->content->begin(alloc))
                     break;
                 --bit;
                 l = StringPiece(bit->data() + bit->size() + 1, 0);
@@ -837,9 +1882,9 @@ void searcher::try_match(const StringPiece& line,
 
         l = line;
 
-        for (i = 0; i < kContextLines; i++) {
+        for (i = 0; i < context_lines_; i++) {
             if (l.data() + l.size() == fit->data() + fit->size()) {
-                if (++fit == sf->content->end(cc_->alloc_))
+                if (++fit == sf->content->end(alloc))
                     break;
                 l = StringPiece(fit->data() - 1, 0);
             }
@@ -847,89 +1892,820 @@ void searcher::try_match(const StringPiece& line,
             m->context_after.push_back(l);
         }
 
-        if (!transform_ || transform_(m)) {
-            queue_.push(m);
-            ++matches_;
+        bool keep = true;
+        if (transform_) {
+            run_ns_timer run(tls_times.transform);
+            keep = transform_(m);
         }
+        if (keep)
+            keep_match(m, score);
+        else
+            drop_match(m);
         if (exit_early())
             break;
 
         ++it;
-        ++lno;
     }
 }
 
-code_searcher::search_thread::search_thread(code_searcher *cs)
-    : cs_(cs) {
-    if (FLAGS_search) {
-        for (int i = 0; i < FLAGS_threads; ++i)
-            threads_.push_back(std::move(std::thread(search_one, this)));
+void searcher::path_match(const StringPiece& line,
+                          const StringPiece& match,
+                          indexed_file *sf) {
+    tls_times.try_matches++;
+
+    float score = 0;
+    if (ranked_) {
+        score = rank(sf);
+        if (outranked(score))
+            return;
+    }
+
+    match_result *m = new_match();
+    m->file = sf;
+    m->lno = 0;
+    m->line = line;
+    m->matchleft = utf8::distance(line.data(), match.data());
+    m->matchright = m->matchleft +
+        utf8::distance(match.data(), match.data() + match.size());
+    keep_match(m, score);
+}
+
+struct code_searcher::search_pool::job {
+    struct task {
+        uint32_t chunk;
+        uint32_t part;
+        uint32_t nparts;
+        // For a ranked query, its chunk_bound().
+        float bound;
+    };
+
+    // One query, or several sharing a sweep (see submit_batched()).
+    vector<searcher*> searches;
+    // For a batch: the searches' line patterns, or NULL if they
+    // wouldn't compile together.
+    std::unique_ptr<RE2::Set> set;
+    chunk_allocator *alloc;
+    vector<task> tasks;
+    // One [lo, hi) range of indexes into tasks per worker, packed as
+    // (lo << 32) | hi so that it can be claimed or split with a single
+    // compare-and-swap.
+    std::unique_ptr<std::atomic<uint64_t>[]> ranges;
+    int nranges;
+    // tasks not yet finished running
+    std::atomic<uint32_t> remaining;
+    // For a batch: the key it was opened under in batches_, and, by
+    // search, how many tasks are looking at it and whether it has
+    // been closed already (see batch_task()); both protected by
+    // batch_mtx.
+    string key;
+    std::mutex batch_mtx;
+    vector<int> inflight;
+    vector<char> closed;
+
+    static uint64_t pack(uint32_t lo, uint32_t hi) {
+        return (uint64_t(lo) << 32) | hi;
+    }
+
+    bool pop(int id, uint32_t *out) {
+        uint64_t v = ranges[id].load();
+        while (true) {
+            uint32_t lo = v >> 32, hi = uint32_t(v);
+            if (lo >= hi)
+                return false;
+            if (ranges[id].compare_exchange_weak(v, pack(lo + 1, hi))) {
+                *out = lo;
+                return true;
+            }
+        }
+    }
+
+    bool steal(int id, int victim, uint32_t *out) {
+        uint64_t v = ranges[victim].load();
+        while (true) {
+            uint32_t lo = v >> 32, hi = uint32_t(v);
+            if (lo >= hi)
+                return false;
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (ranges[victim].compare_exchange_weak(v, pack(lo, mid))) {
+                // Our own range is empty, so nobody else can be
+                // modifying it; a plain store is enough.
+                ranges[id].store(pack(mid + 1, hi));
+                *out = mid;
+                return true;
+            }
+        }
+    }
+
+    // Steal from `victims' in order if given, and from every other
+    // worker in turn if not.
+    bool take(int id, const vector<int> *victims, uint32_t *out) {
+        if (pop(id, out))
+            return true;
+        if (victims) {
+            for (auto it = victims->begin(); it != victims->end(); ++it)
+                if (steal(id, *it, out))
+                    return true;
+            return false;
+        }
+        for (int i = 1; i < nranges; ++i)
+            if (steal(id, (id + i) % nranges, out))
+                return true;
+        return false;
+    }
+
+    static void sort_by_bound(vector<task> *tasks) {
+        std::stable_sort(tasks->begin(), tasks->end(),
+                         [](const task& a, const task& b) {
+                             return a.bound > b.bound;
+                         });
+    }
+
+    // Deal `sorted' out round-robin over `nranges' equal ranges of
+    // out[0, sorted.size()), so that each begins with some of the
+    // first tasks and ends with some of the last.
+    static void deal(const vector<task>& sorted, task *out, size_t nranges) {
+        size_t ntasks = sorted.size(), next = 0;
+        if (nranges == 0)
+            return;
+        for (size_t round = 0; next < ntasks; ++round) {
+            for (size_t r = 0; r < nranges && next < ntasks; ++r) {
+                size_t lo = ntasks * r / nranges, hi = ntasks * (r + 1) / nranges;
+                if (lo + round < hi)
+                    out[lo + round] = sorted[next++];
+            }
+        }
+    }
+};
+
+code_searcher::search_pool::search_pool()
+    : epoch_(0), closed_(false), next_watch_(0), watch_closed_(false) {
+    if (FLAGS_search)
+        start(FLAGS_threads);
+}
+
+code_searcher::search_pool::search_pool(int nthreads)
+    : epoch_(0), closed_(false), next_watch_(0), watch_closed_(false) {
+    start(nthreads);
+}
+
+void code_searcher::search_pool::start(int nthreads) {
+    // Worker i goes on node i % nodes, so that every node gets a
+    // share of any thread count. With fewer workers than nodes, some
+    // nodes would have none to search their chunks, so don't bother.
+    int nodes = numa_nodes();
+    if (FLAGS_numa && nodes > 1 && nthreads >= nodes) {
+        node_workers_.resize(nodes);
+        for (int i = 0; i < nthreads; ++i)
+            node_workers_[i % nodes].push_back(i);
+        victims_.resize(nthreads);
+        for (int i = 0; i < nthreads; ++i) {
+            for (int pass = 0; pass < 2; ++pass) {
+                for (int k = 1; k < nthreads; ++k) {
+                    int v = (i + k) % nthreads;
+                    if ((v % nodes == i % nodes) == (pass == 0))
+                        victims_[i].push_back(v);
+                }
+            }
+        }
+    }
+    for (int i = 0; i < nthreads; ++i)
+        threads_.push_back(std::thread(&search_pool::worker, this, i));
+    watchdog_ = std::thread(&search_pool::watchdog, this);
+}
+
+code_searcher::search_pool::~search_pool() {
+    {
+        std::unique_lock<std::mutex> locked(mtx_);
+        closed_ = true;
+        epoch_++;
+        cond_.notify_all();
+    }
+    for (auto it = threads_.begin(); it != threads_.end(); ++it)
+        it->join();
+    {
+        std::unique_lock<std::mutex> locked(watch_mtx_);
+        watch_closed_ = true;
+        watch_cond_.notify_all();
+    }
+    if (watchdog_.joinable())
+        watchdog_.join();
+}
+
+uint64_t code_searcher::search_pool::watch(cancel_token *token,
+                                           std::chrono::steady_clock::time_point deadline,
+                                           const std::function<bool ()>& abandoned) {
+    std::unique_lock<std::mutex> locked(watch_mtx_);
+    uint64_t id = next_watch_++;
+    watch_entry &w = watches_[id];
+    w.token = token;
+    w.deadline = deadline;
+    w.abandoned = abandoned;
+    watch_cond_.notify_all();
+    return id;
+}
+
+void code_searcher::search_pool::unwatch(uint64_t id) {
+    std::unique_lock<std::mutex> locked(watch_mtx_);
+    watches_.erase(id);
+}
+
+void code_searcher::search_pool::watchdog() {
+    typedef std::chrono::steady_clock clock;
+    std::unique_lock<std::mutex> locked(watch_mtx_);
+    while (!watch_closed_) {
+        clock::time_point now = clock::now();
+        if (!windows_.empty() && windows_.begin()->first <= now) {
+            std::shared_ptr<job> j = windows_.begin()->second;
+            windows_.erase(windows_.begin());
+            locked.unlock();
+            close_batch(j);
+            locked.lock();
+            continue;
+        }
+        clock::time_point wake = clock::time_point::max();
+        if (!windows_.empty())
+            wake = windows_.begin()->first;
+        for (auto it = watches_.begin(); it != watches_.end();) {
+            watch_entry &w = it->second;
+            if (w.deadline <= now) {
+                w.token->cancel(kExitTimeout);
+            } else if (w.abandoned && w.abandoned()) {
+                w.token->cancel(kExitCancelled);
+            } else {
+                wake = min(wake, w.deadline);
+                if (w.abandoned)
+                    wake = min(wake, now + std::chrono::milliseconds(kCancelPollMs));
+                ++it;
+                continue;
+            }
+            it = watches_.erase(it);
+        }
+        if (wake == clock::time_point::max())
+            watch_cond_.wait(locked);
+        else
+            watch_cond_.wait_until(locked, wake);
+    }
+}
+
+void code_searcher::search_pool::add_tasks(job *j) {
+    chunk_allocator *alloc = j->alloc;
+    long skipped = 0;
+    for (size_t i = 0; i < alloc->size(); ++i) {
+        chunk *c = alloc->at(i);
+        bool skip = true;
+        for (auto it = j->searches.begin(); it != j->searches.end() && skip; ++it)
+            skip = (*it)->skip_chunk(c);
+        if (skip) {
+            skipped++;
+            for (auto it = j->searches.begin(); it != j->searches.end(); ++it)
+                if ((*it)->query_->trace)
+                    (*it)->trace(c, 0, task_trace::kSkipped, task_times(), 0);
+            continue;
+        }
+        uint32_t nparts = 1;
+        if (FLAGS_search_split_bytes > 0 && c->size > size_t(FLAGS_search_split_bytes))
+            nparts = (c->size + FLAGS_search_split_bytes - 1) / FLAGS_search_split_bytes;
+        float bound = 0;
+        if (j->searches.size() == 1 && j->searches[0]->ranked())
+            bound = j->searches[0]->chunk_bound(i);
+        for (uint32_t p = 0; p < nparts; ++p)
+            j->tasks.push_back(job::task{uint32_t(i), p, nparts, bound});
     }
+    chunks_skipped.inc(skipped);
+    chunks_searched.inc(alloc->size() - skipped);
+
+    if (j->searches.size() == 1 && j->searches[0]->ranked() &&
+        node_workers_.empty())
+        rank_tasks(j);
+}
+
+/*
+ * Order a ranked query's tasks best chunk first, so that its top
+ * matches fill up early and the chunks that can't beat them are
+ * skipped. Each worker starts from the front of its own range (see
+ * submit()), so the ranks are dealt out round-robin: every range
+ * begins with some of the best tasks and ends with the worst.
+ */
+void code_searcher::search_pool::rank_tasks(job *j) {
+    vector<job::task> sorted = j->tasks;
+    job::sort_by_bound(&sorted);
+    job::deal(sorted, j->tasks.data(), threads_.size());
+}
+
+/*
+ * Each node's workers get the tasks of the chunks placed on that
+ * node, split between them like submit() splits all of them, and
+ * ranked within the node like rank_tasks() ranks them. They only
+ * reach across to another node's chunks by stealing, once their own
+ * node's are all claimed.
+ */
+void code_searcher::search_pool::place_tasks(job *j) {
+    size_t nodes = node_workers_.size();
+    vector<vector<job::task> > by_node(nodes);
+    for (auto it = j->tasks.begin(); it != j->tasks.end(); ++it)
+        by_node[chunk_allocator::home_node(j->alloc->at(it->chunk)) % nodes]
+            .push_back(*it);
+
+    bool ranked = j->searches.size() == 1 && j->searches[0]->ranked();
+    size_t base = 0;
+    for (size_t n = 0; n < nodes; ++n) {
+        vector<job::task> &mine = by_node[n];
+        const vector<int> &workers = node_workers_[n];
+        size_t ntasks = mine.size(), nworkers = workers.size();
+        if (ranked) {
+            job::sort_by_bound(&mine);
+            job::deal(mine, j->tasks.data() + base, nworkers);
+        } else {
+            std::copy(mine.begin(), mine.end(), j->tasks.begin() + base);
+        }
+        for (size_t k = 0; k < nworkers; ++k)
+            j->ranges[workers[k]] = job::pack(base + ntasks * k / nworkers,
+                                              base + ntasks * (k + 1) / nworkers);
+        base += ntasks;
+    }
+}
+
+void code_searcher::search_pool::submit(const std::shared_ptr<job>& j) {
+    uint32_t ntasks = j->tasks.size();
+    if (ntasks == 0) {
+        for (auto it = j->searches.begin(); it != j->searches.end(); ++it)
+            (*it)->close();
+        return;
+    }
+    j->remaining = ntasks;
+    j->nranges = threads_.size();
+    j->ranges.reset(new std::atomic<uint64_t>[j->nranges]);
+    if (!node_workers_.empty()) {
+        place_tasks(j.get());
+    } else {
+        for (int i = 0; i < j->nranges; ++i)
+            j->ranges[i] = job::pack(uint64_t(ntasks) * i / j->nranges,
+                                     uint64_t(ntasks) * (i + 1) / j->nranges);
+    }
+
+    pool_jobs.inc();
+    pool_tasks_queued.inc(ntasks);
+    std::unique_lock<std::mutex> locked(mtx_);
+    active_.push_back(j);
+    epoch_++;
+    cond_.notify_all();
+}
+
+void code_searcher::search_pool::finish(job *j) {
+    {
+        std::unique_lock<std::mutex> locked(mtx_);
+        for (auto it = active_.begin(); it != active_.end(); ++it) {
+            if (it->get() == j) {
+                active_.erase(it);
+                break;
+            }
+        }
+        epoch_++;
+        cond_.notify_all();
+    }
+    pool_jobs.dec();
+    std::unique_lock<std::mutex> locked(j->batch_mtx);
+    for (size_t i = 0; i < j->searches.size(); ++i)
+        if (i >= j->closed.size() || !j->closed[i])
+            j->searches[i]->close();
+}
+
+/*
+ * The first query to arrive opens a batch for queries compiled with
+ * the same options against the same chunks, and has the watchdog
+ * close it --batch_window_ms later; close_batch() then submits them
+ * all as one job. Every query returns at once. Each one's queue is
+ * closed as soon as the batch is done with it: when the batch
+ * finishes, or as soon as it stops early (see batch_task()).
+ */
+void code_searcher::search_pool::submit_batched(searcher *search,
+                                                chunk_allocator *alloc) {
+    string key = strprintf("%p:", (void*)alloc) +
+        cache_key("", search->query_->line_pat->options());
+    std::shared_ptr<job> j;
+    {
+        std::unique_lock<std::mutex> locked(mtx_);
+        auto it = batches_.find(key);
+        if (it != batches_.end() && it->second->searches.size() < kMaxBatch) {
+            it->second->searches.push_back(search);
+            batch_queries.inc();
+            return;
+        }
+        j.reset(new job);
+        j->alloc = alloc;
+        j->key = key;
+        j->searches.push_back(search);
+        batches_[key] = j;
+    }
+    batch_queries.inc();
+
+    std::unique_lock<std::mutex> locked(watch_mtx_);
+    windows_.insert(std::make_pair(std::chrono::steady_clock::now() +
+                                   std::chrono::milliseconds(FLAGS_batch_window_ms), j));
+    watch_cond_.notify_all();
+}
+
+void code_searcher::search_pool::close_batch(const std::shared_ptr<job>& j) {
+    {
+        std::unique_lock<std::mutex> locked(mtx_);
+        auto it = batches_.find(j->key);
+        if (it != batches_.end() && it->second == j)
+            batches_.erase(it);
+    }
+    j->inflight.assign(j->searches.size(), 0);
+    j->closed.assign(j->searches.size(), false);
+
+    searcher *search = j->searches[0];
+    if (j->searches.size() > 1) {
+        batch_sweeps.inc();
+        j->set.reset(new RE2::Set(search->query_->line_pat->options(),
+                                  RE2::UNANCHORED));
+        bool ok = true;
+        for (auto it = j->searches.begin(); it != j->searches.end() && ok; ++it)
+            ok = j->set->Add((*it)->query_->line_pat->pattern(), NULL) >= 0;
+        if (!ok || !j->set->Compile())
+            j->set.reset();
+    }
+    add_tasks(j.get());
+    submit(j);
+}
+
+/*
+ * A query that stops early -- at its match limit, its deadline or
+ * cancelled -- can't be closed while another task may still be looking
+ * at it, as its caller frees it once it is. So the last task to let it
+ * go closes it, and tasks that start after that leave it alone.
+ */
+void code_searcher::search_pool::batch_task(job *j, uint32_t t) {
+    const job::task &task = j->tasks[t];
+    size_t n = j->searches.size();
+    vector<char> use(n);
+    {
+        std::unique_lock<std::mutex> locked(j->batch_mtx);
+        for (size_t i = 0; i < n; ++i) {
+            use[i] = !j->closed[i];
+            if (use[i])
+                j->inflight[i]++;
+        }
+    }
+    searcher::batch_search(
+        j->searches, use, j->set.get(), j->alloc->at(task.chunk),
+        task.part, task.nparts, [j](size_t i) {
+            std::unique_lock<std::mutex> locked(j->batch_mtx);
+            if (--j->inflight[i] == 0 && j->searches[i]->why() != kExitNone) {
+                j->closed[i] = true;
+                j->searches[i]->close();
+            }
+        });
+}
+
+void code_searcher::search_pool::worker(int id) {
+    vector<std::shared_ptr<job> > jobs;
+    uint64_t seen = 0;
+    size_t next = 0;
+    int node = -1;
+    const vector<int> *victims = 0;
+    if (!node_workers_.empty()) {
+        node = id % node_workers_.size();
+        victims = &victims_[id];
+        if (!numa_pin_thread(node))
+            fprintf(stderr, "WARN: unable to pin search worker %d to node %d\n",
+                    id, node);
+    }
+
+    {
+        std::unique_lock<std::mutex> locked(mtx_);
+        seen = epoch_;
+        jobs = active_;
+    }
+
+    while (true) {
+        if (epoch_ != seen) {
+            std::unique_lock<std::mutex> locked(mtx_);
+            if (closed_)
+                return;
+            seen = epoch_;
+            jobs = active_;
+        }
+
+        job *j = 0;
+        uint32_t t;
+        for (size_t i = 0; i < jobs.size(); ++i) {
+            job *candidate = jobs[(next + i) % jobs.size()].get();
+            if (candidate->take(id, victims, &t)) {
+                j = candidate;
+                next += i + 1;
+                break;
+            }
+        }
+
+        if (j == 0) {
+            std::unique_lock<std::mutex> locked(mtx_);
+            while (epoch_ == seen && !closed_)
+                cond_.wait(locked);
+            if (closed_)
+                return;
+            continue;
+        }
+
+        pool_tasks_queued.dec();
+        const job::task &task = j->tasks[t];
+        if (node >= 0 &&
+            chunk_allocator::home_node(j->alloc->at(task.chunk)) % node_workers_.size() != size_t(node))
+            pool_tasks_remote.inc();
+        if (j->searches.size() == 1) {
+            searcher *s = j->searches[0];
+            if (!s->outranked(task.bound)) {
+                (*s)(j->alloc->at(task.chunk), task.part, task.nparts);
+            } else {
+                tasks_outranked.inc();
+                if (s->query_->trace)
+                    s->trace(j->alloc->at(task.chunk), task.part,
+                             task_trace::kSkipped, task_times(), 0);
+            }
+        } else
+            batch_task(j, t);
+        if (j->remaining.fetch_sub(1) == 1)
+            finish(j);
+    }
+}
+
+code_searcher::search_thread::search_thread(code_searcher *cs)
+    : cs_(cs), own_pool_(new search_pool()), pool_(own_pool_.get()) {
+}
+
+code_searcher::search_thread::search_thread(code_searcher *cs,
+                                            search_pool *pool)
+    : cs_(cs), pool_(pool) {
 }
 
 void code_searcher::search_thread::match(const query &q,
                                          const callback_func& cb,
                                          const transform_func& func,
                                          match_stats *stats) {
-    match_result *m;
-    int matches = 0;
+    std::unique_ptr<pending> p = start(q, func, std::function<void ()>());
+    collect(p.get(), cb, stats, true);
+}
 
+std::unique_ptr<code_searcher::search_thread::pending>
+code_searcher::search_thread::start(const query &q,
+                                    const transform_func& func,
+                                    const std::function<void ()>& ready) {
     assert(cs_->finalized_);
 
+    std::unique_ptr<pending> p(new pending);
+    p->pool_ = pool_;
     if (!FLAGS_search) {
-        return;
+        p->done_ = true;
+        return p;
     }
 
     if (FLAGS_drop_cache) {
         cs_->alloc_->drop_caches();
     }
 
-    searcher search(cs_, q, func);
-    job j;
-    j.search = &search;
-    j.pending = 0;
-
-    for (int i = 0; i < FLAGS_threads; ++i) {
-        ++j.pending;
-        queue_.push(&j);
+    p->start_ = monotonic_ns();
+    search_queries.inc();
+    search_active.inc();
+    p->search_.reset(new searcher(cs_, q, func));
+    searcher &search = *p->search_;
+    if (ready)
+        search.queue_.set_notify(ready);
+
+    std::chrono::steady_clock::time_point deadline = q.deadline;
+    int timeout = q.timeout >= 0 ? q.timeout : FLAGS_timeout;
+    if (timeout > 0)
+        deadline = min(deadline, std::chrono::steady_clock::now() +
+                       std::chrono::milliseconds(timeout));
+    p->watch_ = pool_->watch(&search.cancel_, deadline, q.abandoned);
+
+    if (FLAGS_batch_window_ms > 0 && !search.indexed() && !search.ranked() &&
+        !q.paths) {
+        pool_->submit_batched(&search, cs_->alloc_);
+    } else {
+        std::shared_ptr<search_pool::job> j(new search_pool::job);
+        j->searches.push_back(&search);
+        j->alloc = q.paths ? cs_->path_alloc_.get() : cs_->alloc_;
+        pool_->add_tasks(j.get());
+        pool_->submit(j);
     }
+    return p;
+}
 
-    for (auto it = cs_->alloc_->begin(); it != cs_->alloc_->end(); it++) {
-        j.chunks.push(*it);
+bool code_searcher::search_thread::collect(pending *p,
+                                           const callback_func& cb,
+                                           match_stats *stats,
+                                           bool wait) {
+    if (p->done_) {
+        if (!p->search_)
+            memset(stats, 0, sizeof *stats);
+        return true;
     }
-    j.chunks.close();
-
-    memset(stats, 0, sizeof *stats);
 
-    while (search.queue_.pop(&m)) {
-        matches++;
+    searcher &search = *p->search_;
+    match_result *m;
+    bool closed = false;
+    while (wait ? search.queue_.pop(&m) : search.queue_.try_pop(&m, &closed)) {
+        p->matches_++;
         cb(m);
-        delete m;
     }
+    if (!wait && !closed)
+        return false;
+
+    p->done_ = true;
+    p->pool_->unwatch(p->watch_);
 
+    memset(stats, 0, sizeof *stats);
     search.get_stats(stats);
     stats->why = search.why();
-    stats->matches = matches;
+    stats->matches = p->matches_;
+
+    search_active.dec();
+    search_latency.record_ns(monotonic_ns() - p->start_);
+    phase_analyze.record_ns(timeval_ns(stats->analyze_time));
+    phase_index.record_ns(search.index_ns_);
+    phase_sort.record_ns(search.sort_ns_);
+    phase_re2.record_ns(search.re2_ns_);
+    phase_git.record_ns(search.git_ns_);
+    phase_transform.record_ns(search.transform_ns_);
+    return true;
+}
+
+code_searcher::search_thread::pending::pending()
+    : pool_(0), watch_(0), start_(0), matches_(0), done_(false) {
 }
 
+code_searcher::search_thread::pending::~pending() {
+    if (done_ || !search_)
+        return;
+    search_->cancel_.cancel(kExitCancelled);
+    // The matches themselves go with the searcher's arena.
+    match_result *m;
+    while (search_->queue_.pop(&m))
+        continue;
+    pool_->unwatch(watch_);
+    search_active.dec();
+}
 
 code_searcher::search_thread::~search_thread() {
-    queue_.close();
-    for (auto it = threads_.begin(); it != threads_.end(); ++it)
-        it->join();
 }
 
-void code_searcher::search_thread::search_one(search_thread *me) {
-    job *j;
-    while (me->queue_.pop(&j)) {
-        chunk *c;
-        while (j->chunks.pop(&c)) {
-            (*j->search)(c);
+std::shared_ptr<const search_plan> code_searcher::plan(const RE2& re) const {
+    string key = re_cache_key(re);
+    std::shared_ptr<const search_plan> out;
+    if (plans_.find(key, &out))
+        return out;
+    search_plan *plan = new search_plan;
+    out.reset(plan);
+    plan->key = indexRE(re, &alloc_->corpus());
+    literalRE(re, &plan->literal);
+    if (!re.options().case_sensitive() &&
+        any_of(alloc_->begin(), alloc_->end(),
+               [](const chunk *c) { return c->folded != NULL; })) {
+        plan->folded_key = indexRE(re, &alloc_->corpus(), true);
+        fold_literal(plan->literal, &plan->folded_literal);
+    }
+    plans_.insert(key, out);
+    return out;
+}
+
+double code_searcher::scan_fraction(const RE2& re) const {
+    if (!FLAGS_index)
+        return 1.0;
+    std::shared_ptr<const search_plan> p = plan(re);
+    if (FLAGS_literal_search && !p->literal.empty())
+        return 0.0;
+    if (!p->key || p->key->empty())
+        return 1.0;
+    return std::min(1.0, p->key->selectivity());
+}
+
+namespace {
+    bool has_dir(const StringPiece& path, const char *dir) {
+        size_t len = strlen(dir);
+        for (size_t pos = 0; pos + len <= path.size(); ) {
+            size_t slash = path.find('/', pos);
+            if (slash == StringPiece::npos)
+                return false;
+            if (slash - pos == len && memcmp(path.data() + pos, dir, len) == 0)
+                return true;
+            pos = slash + 1;
+        }
+        return false;
+    }
+
+    bool is_test(const StringPiece& path) {
+        if (has_dir(path, "test") || has_dir(path, "tests") ||
+            has_dir(path, "testdata") || has_dir(path, "__tests__"))
+            return true;
+        StringPiece base = path;
+        size_t slash = path.rfind('/');
+        if (slash != StringPiece::npos)
+            base.remove_prefix(slash + 1);
+        return base.find("_test.") != StringPiece::npos ||
+            base.find("Test.") != StringPiece::npos ||
+            base.starts_with("test_");
+    }
+
+    float tree_priority(const indexed_tree *tree) {
+        json_object *meta = tree->parse_metadata(), *v;
+        float out = 0;
+        if (meta != NULL && json_object_object_get_ex(meta, "priority", &v)) {
+            switch (json_object_get_type(v)) {
+            case json_type_int:
+            case json_type_double:
+                out = json_object_get_double(v);
+                break;
+            case json_type_string:
+                out = atof(json_object_get_string(v));
+                break;
+            default:
+                break;
+            }
         }
+        if (meta != NULL)
+            json_object_put(meta);
+        return out;
+    }
+};
+
+void code_searcher::compute_ranks() const {
+    std::call_once(ranks_once_, [this] {
+            std::unordered_map<const indexed_tree*, float> trees;
+            for (auto it = trees_.begin(); it != trees_.end(); ++it)
+                trees[*it] = tree_priority(*it);
+
+            file_ranks_.resize(files_.size());
+            for (size_t i = 0; i < files_.size(); ++i) {
+                const indexed_file *sf = files_[i];
+                float r = kRankTreePriority * trees[sf->tree];
+                r += kRankDepth * std::count(sf->path.begin(), sf->path.end(), '/');
+                if (has_dir(sf->path, "vendor") || has_dir(sf->path, "third_party") ||
+                    has_dir(sf->path, "node_modules"))
+                    r += kRankVendored;
+                if (is_test(sf->path))
+                    r += kRankTest;
+                file_ranks_[i] = r;
+            }
+
+            chunk_ranks_.assign(alloc_->size(), -std::numeric_limits<float>::infinity());
+            for (size_t i = 0; i < alloc_->size(); ++i) {
+                const chunk *c = alloc_->at(i);
+                float &best = chunk_ranks_[i];
+                for (uint32_t r = 0; r < c->nranges; ++r) {
+                    const uint32_t *ids = c->file_ids + c->ranges[r].files;
+                    for (uint32_t f = 0; f < c->ranges[r].nfiles; ++f)
+                        best = std::max(best, file_ranks_[c->file_base + ids[f]]);
+                }
+            }
+        });
+}
+
+float code_searcher::file_rank(const indexed_file *sf) const {
+    compute_ranks();
+    return file_ranks_[sf->no];
+}
+
+float code_searcher::chunk_rank(size_t i) const {
+    compute_ranks();
+    return chunk_ranks_[i];
+}
+
+namespace {
+    struct compiled_re {
+        std::shared_ptr<const RE2> re;
+        int width;
+    };
+
+    lru_cache<compiled_re> &re_cache() {
+        // Built on first use, once flags have been parsed.
+        static lru_cache<compiled_re> cache(FLAGS_query_cache_size,
+                                            re_cache_hits, re_cache_misses);
+        return cache;
+    }
+};
+
+string re_cache_key(const RE2& re) {
+    return cache_key(re.pattern(), re.options());
+}
 
-        if (--j->pending == 0)
-            j->search->queue_.close();
+std::shared_ptr<const RE2> compile_re(const string& pattern,
+                                      const RE2::Options& opts,
+                                      int *width) {
+    string key = cache_key(pattern, opts);
+    compiled_re out;
+    if (!re_cache().find(key, &out)) {
+        out.re.reset(new RE2(pattern, opts));
+        out.width = 0;
+        if (!out.re->ok())
+            return out.re;
+        WidthWalker walker;
+        out.width = walker.Walk(out.re->Regexp(), 0);
+        re_cache().insert(key, out);
     }
+    if (width)
+        *width = out.width;
+    return out.re;
 }
 
 void default_re2_options(RE2::Options &opts) {
@@ -8,13 +8,19 @@
 #ifndef CODESEARCH_H
 #define CODESEARCH_H
 
+#include <assert.h>
+
 #include <vector>
+#include <deque>
 #include <string>
 #include <map>
 #include <fstream>
 #include <atomic>
 #include <mutex>
 #include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
 #include <functional>
 #include <boost/intrusive_ptr.hpp>
 
@@ -28,11 +34,14 @@
 #include <locale>
 
 #include "src/lib/thread_queue.h"
+#include "src/lib/lru_cache.h"
+#include "src/path_table.h"
 
 class searcher;
 class chunk_allocator;
 class file_contents;
 struct match_result;
+struct search_plan;
 
 using re2::RE2;
 using re2::StringPiece;
@@ -45,33 +54,130 @@ using std::pair;
 using std::atomic_int;
 
 /*
- * We special-case data() == NULL to provide an "empty" element for
- * dense_hash_set.
- *
- * StringPiece::operator== will consider a zero-length string equal to a
- * zero-length string with a NULL data().
+ * A line already copied into a chunk, as kept in the dedup tables. The
+ * id of the chunk it lives in and its hash are kept alongside, so a
+ * hit needs no lookup to find its chunk and the table never rehashes
+ * the text.
+ */
+struct indexed_line {
+    const char *data;
+    uint32_t size;
+    uint32_t chunk;
+    size_t hash;
+
+    StringPiece piece() const {
+        return StringPiece(data, size);
+    }
+};
+
+size_t hash_line(const char *p, size_t len);
+
+/*
+ * We special-case data == NULL to provide an "empty" element for
+ * dense_hash_set; it is distinct from every zero-length line.
  */
 struct eqstr {
-    bool operator()(const StringPiece& lhs, const StringPiece& rhs) const;
+    bool operator()(const indexed_line& lhs, const indexed_line& rhs) const;
 };
 
 struct hashstr {
-    locale loc;
-    size_t operator()(const StringPiece &str) const;
+    size_t operator()(const indexed_line &line) const {
+        return line.hash;
+    }
 };
 
 #ifdef USE_DENSE_HASH_SET
-typedef google::dense_hash_set<StringPiece, hashstr, eqstr> string_hash;
+typedef google::dense_hash_set<indexed_line, hashstr, eqstr> string_hash;
 #else
-typedef google::sparse_hash_set<StringPiece, hashstr, eqstr> string_hash;
+typedef google::sparse_hash_set<indexed_line, hashstr, eqstr> string_hash;
 #endif
 
+/*
+ * A fixed-size, direct-mapped table of indexed lines, used in place of
+ * a string_hash to bound the memory --global_dedup needs. Inserting a
+ * line evicts whatever shared its slot, so some duplicates are missed,
+ * but a hit is always a true duplicate.
+ */
+class line_cache {
+public:
+    line_cache() : mask_(0) {}
+
+    // Allocate (at least) `slots' empty slots, rounded to a power of two.
+    void resize(size_t slots);
+    bool empty() const {
+        return slots_.empty();
+    }
+
+    // The cached copy of `line', or an entry with NULL data.
+    indexed_line find(const indexed_line &line) const;
+    void insert(const indexed_line &line);
+private:
+    vector<indexed_line> slots_;
+    size_t mask_;
+};
+
 enum exit_reason {
     kExitNone = 0,
     kExitTimeout,
     kExitMatchLimit,
+    kExitCancelled,
 };
 
+/*
+ * The reason a search should stop, set from any thread (a worker that
+ * hit the match limit, the pool's watchdog at the deadline, ...) and
+ * polled by the search with a single atomic load. The first reason
+ * set wins.
+ */
+class cancel_token {
+public:
+    cancel_token() : reason_(kExitNone) {}
+
+    void cancel(exit_reason why) {
+        int none = kExitNone;
+        reason_.compare_exchange_strong(none, why);
+    }
+
+    exit_reason reason() const {
+        return exit_reason(reason_.load(std::memory_order_relaxed));
+    }
+private:
+    std::atomic<int> reason_;
+};
+
+
+/*
+ * How one task -- one part of one chunk -- of a traced query went.
+ */
+struct task_trace {
+    enum path_kind {
+        kSkipped,       // no file in the chunk can match
+        kLiteral,       // literal_search()
+        kFiltered,      // filtered_search()
+        kFull,          // full_search()
+        kBatched,       // a full scan shared with other queries
+    };
+
+    uint32_t chunk;
+    uint32_t part;
+    path_kind path;
+    // For kLiteral and kFiltered: the suffixes the index left, and
+    // whether there were so many it scanned the part instead.
+    uint64_t candidates;
+    bool scanned_instead;
+    // bytes handed to RE2, and lines tried against files
+    uint64_t bytes_scanned;
+    uint64_t try_matches;
+    uint64_t wall_ns;
+};
+
+// Filled in by a search whose query asks for it; see query::trace.
+struct query_trace {
+    // IndexKey::ToString() of the key the index was searched with,
+    // or empty if none
+    std::string index_key;
+    std::vector<task_trace> tasks;
+};
 
 struct match_stats {
     timeval re2_time;
@@ -89,46 +195,130 @@ struct json_object;
 
 struct indexed_tree {
     string name;
-    json_object *metadata;
+    // The tree's metadata as JSON text, or empty if it has none. It is
+    // only parsed when something asks for it.
+    string metadata;
     string version;
+
+    // A new reference to the parsed metadata, which the caller must
+    // json_object_put(); NULL if there is none.
+    json_object *parse_metadata() const;
 };
 
 struct indexed_file {
     const indexed_tree *tree;
-    string path;
+    // Points into code_searcher::paths_, or into the mapping of a
+    // loaded index.
+    StringPiece path;
     file_contents *content;
     int no;
 };
 
+// Hides a file of an older segment (see load_segments()): the file
+// `path' of the tree with this name and version, or the whole tree if
+// `path' is empty.
+struct tombstone {
+    string tree;
+    string version;
+    string path;
+};
+
 struct index_info {
     std::string name;
     vector<indexed_tree> trees;
 };
 
+/*
+ * Up to capacity() lines of context around a match, in storage that
+ * belongs to whoever made the match_result -- for searches, an arena
+ * that lives as long as the query does.
+ */
+class match_context {
+public:
+    typedef StringPiece *iterator;
+    typedef const StringPiece *const_iterator;
+
+    match_context() : lines_(0), size_(0), capacity_(0) {}
+    match_context(StringPiece *storage, int capacity)
+        : lines_(storage), size_(0), capacity_(capacity) {}
+
+    iterator begin() { return lines_; }
+    iterator end() { return lines_ + size_; }
+    const_iterator begin() const { return lines_; }
+    const_iterator end() const { return lines_ + size_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    int capacity() const { return capacity_; }
+    const StringPiece &operator[](size_t i) const { return lines_[i]; }
+
+    bool full() const { return size_ == capacity_; }
+    void push_back(const StringPiece &line) {
+        assert(size_ < capacity_);
+        lines_[size_++] = line;
+    }
+    void clear() { size_ = 0; }
+
+private:
+    StringPiece *lines_;
+    int size_;
+    int capacity_;
+};
+
 struct match_result {
     indexed_file *file;
     int lno;
-    vector<StringPiece> context_before;
-    vector<StringPiece> context_after;
+    match_context context_before;
+    match_context context_after;
     StringPiece line;
     int matchleft, matchright;
+    // For ranked queries; see query::ranked.
+    float rank;
 };
 
 // A query specification passed to match(). line_pat is required to be
 // non-NULL; file_pat, tree_pat and tag_pat may be NULL to specify "no
-// constraint"
+// constraint". The patterns may be shared with other queries (see
+// compile_re()).
 struct query {
     std::string trace_id;
 
-    std::unique_ptr<RE2> line_pat;
-    std::unique_ptr<RE2> file_pat;
-    std::unique_ptr<RE2> tree_pat;
-    std::unique_ptr<RE2> tags_pat;
+    std::shared_ptr<const RE2> line_pat;
+    std::shared_ptr<const RE2> file_pat;
+    std::shared_ptr<const RE2> tree_pat;
+    std::shared_ptr<const RE2> tags_pat;
     struct {
-        std::unique_ptr<RE2> file_pat;
-        std::unique_ptr<RE2> tree_pat;
-        std::unique_ptr<RE2> tags_pat;
+        std::shared_ptr<const RE2> file_pat;
+        std::shared_ptr<const RE2> tree_pat;
+        std::shared_ptr<const RE2> tags_pat;
     } negate;
+
+    // Stop at this time even if --timeout has not expired yet, e.g.
+    // because the client will have given up by then.
+    std::chrono::steady_clock::time_point deadline =
+        std::chrono::steady_clock::time_point::max();
+    // If set, polled periodically while the query runs; once it
+    // returns true the search is cancelled.
+    std::function<bool ()> abandoned;
+
+    // Per-query overrides of --max_matches, --timeout (in ms) and the
+    // number of context lines around each match. -1 means use the
+    // server's default; 0 means unlimited, no timeout and no context
+    // respectively. Context is capped at --max_context_lines.
+    int max_matches = -1;
+    int timeout = -1;
+    int context_lines = -1;
+    // Return the max_matches best matches by rank (see
+    // code_searcher::file_rank()), best first, rather than the first
+    // max_matches found.
+    bool ranked = false;
+    // Match line_pat against the paths of the index's files rather
+    // than their contents. Each match is then a file, with lno 0 and
+    // its path as `line', and no context.
+    bool paths = false;
+
+    // If set, records how the search went, task by task. Tasks finish
+    // in no particular order, and so are recorded in none.
+    query_trace *trace = nullptr;
 };
 
 class code_searcher {
@@ -137,11 +327,43 @@ public:
     ~code_searcher();
     void dump_index(const string& path);
     void load_index(const string& path);
+    // Load several indexes, oldest first, and search them as one.
+    // A file is hidden by a later segment's tombstones, or by a
+    // later segment with a file of the same path in a tree of the
+    // same name and version.
+    void load_segments(const vector<string>& paths);
 
     const indexed_tree *open_tree(const string &name, json_object *meta, const string& version);
-    void index_file(const indexed_tree *tree,
-                    const string& path,
-                    StringPiece contents);
+    // Returns the new file, or NULL if `contents' was not indexed
+    // because it looks binary.
+    indexed_file *index_file(const indexed_tree *tree,
+                             const string& path,
+                             StringPiece contents);
+    // Index a file whose contents are identical to those of `orig',
+    // an earlier file, reusing its lines rather than reading them
+    // again. `orig' may also be a file of an index passed to
+    // copy_chunks(), whose return value is then `chunk_base'.
+    indexed_file *index_copy(const indexed_tree *tree,
+                             const string& path,
+                             const indexed_file *orig,
+                             int chunk_base = 0);
+    // Append a copy of every chunk of `base', a loaded index, so that
+    // its files can be carried over with index_copy() without sorting
+    // anything again, and return the id of the first copy. Lines of
+    // files that are not carried over are left behind, unreferenced.
+    int copy_chunks(code_searcher *base);
+    // Add every file of `src', a loaded index, that no later segment
+    // hides -- and, if `keep' is given, that it returns true for --
+    // along with its trees. Its chunks are copied whole, unless
+    // `reindex', in which case its files' lines are indexed (and
+    // deduplicated) again, as if read from disk.
+    void copy_index(code_searcher *src, bool reindex,
+                    const std::function<bool (const indexed_file*)>& keep = nullptr);
+    // Record that this index replaces the named file in the index
+    // it is meant to be loaded after; an empty `path' hides the
+    // whole tree.
+    void add_tombstone(const string& tree, const string& version,
+                       const string& path);
     void finalize();
 
     void set_alloc(chunk_allocator *alloc);
@@ -161,10 +383,139 @@ public:
     vector<indexed_file*>::const_iterator end_files() {
         return files_.end();
     }
+    vector<tombstone>::const_iterator begin_tombstones() const {
+        return tombstones_.begin();
+    }
+    vector<tombstone>::const_iterator end_tombstones() const {
+        return tombstones_.end();
+    }
+
+    // The allocator holding `sf's contents and lines.
+    chunk_allocator *file_alloc(const indexed_file *sf) const;
+    // Whether `sf' is hidden by a later segment.
+    bool shadowed(const indexed_file *sf) const {
+        return !shadowed_.empty() && shadowed_[sf->no];
+    }
+
+    // How to search this index for lines matching `re': its index
+    // key, and so on. Plans are worked out once per pattern and kept
+    // for repeat queries; see --query_cache_size.
+    std::shared_ptr<const search_plan> plan(const RE2& re) const;
+    // Roughly what fraction of the corpus searching it for `re' will
+    // read: 0 if the index answers the pattern as a literal, 1 if it
+    // cannot narrow the search at all.
+    double scan_fraction(const RE2& re) const;
+
+    // How good a match in `sf' is for ranked queries, before counting
+    // anything about the query: higher is better.
+    float file_rank(const indexed_file *sf) const;
+    // The highest file_rank() of any file with lines in chunk `i' of
+    // alloc().
+    float chunk_rank(size_t i) const;
+
+    class search_thread;
+
+    /*
+     * A fixed set of worker threads shared by every search_thread
+     * attached to it. Each query submitted to the pool becomes a job,
+     * a list of tasks (a chunk, or a line-aligned piece of one; see
+     * --search_split_bytes) dealt out to the workers as one
+     * contiguous range each. A worker pops tasks off the front of its
+     * own range and, once that is empty, steals the back half of
+     * someone else's; both are a single compare-and-swap, so no lock
+     * is taken per task. Workers visit the active jobs round-robin,
+     * one task at a time, so concurrent queries are interleaved and
+     * the number of busy threads is bounded by the pool size no
+     * matter how many queries are in flight.
+     */
+    class search_pool {
+    public:
+        search_pool();
+        explicit search_pool(int nthreads);
+        ~search_pool();
+
+        int size() const {
+            return threads_.size();
+        }
+    protected:
+        struct job;
+
+        struct watch_entry {
+            cancel_token *token;
+            std::chrono::steady_clock::time_point deadline;
+            std::function<bool ()> abandoned;
+        };
+
+        void start(int nthreads);
+        // Add a task for each part of each chunk some search of `j'
+        // can't skip.
+        void add_tasks(job *j);
+        void rank_tasks(job *j);
+        // With --numa, lay out `j's tasks node by node and give each
+        // node's share to its own workers' ranges.
+        void place_tasks(job *j);
+        void submit(const std::shared_ptr<job>& j);
+        // Submit `search' over `alloc', sharing a job with any other
+        // full scans that arrive within --batch_window_ms.
+        void submit_batched(searcher *search, chunk_allocator *alloc);
+        // Submit the batch `j', once its window is over.
+        void close_batch(const std::shared_ptr<job>& j);
+        // Run task `t' of the batch `j' for each of its searches.
+        void batch_task(job *j, uint32_t t);
+        void finish(job *j);
+        void worker(int id);
+
+        // Have the watchdog cancel `token' at `deadline', or as soon
+        // as `abandoned' (if set) returns true. The token must stay
+        // alive until the returned id is passed to unwatch().
+        uint64_t watch(cancel_token *token,
+                       std::chrono::steady_clock::time_point deadline,
+                       const std::function<bool ()>& abandoned);
+        void unwatch(uint64_t id);
+        void watchdog();
+
+        // mtx_ protects active_ and closed_; epoch_ is bumped under
+        // it whenever active_ changes, so idle workers know when to
+        // take a fresh snapshot of the job list.
+        std::mutex mtx_;
+        std::condition_variable cond_;
+        vector<std::shared_ptr<job> > active_;
+        std::atomic<uint64_t> epoch_;
+        bool closed_;
+        // Batches still waiting for queries to join, by allocator and
+        // RE2 options; also protected by mtx_.
+        std::map<string, std::shared_ptr<job> > batches_;
+        vector<std::thread> threads_;
+        // With --numa, the workers pinned to each node, and the order
+        // each worker steals from the others in: its own node's first.
+        // Both are empty otherwise, and never change once started.
+        vector<vector<int> > node_workers_;
+        vector<vector<int> > victims_;
+
+        // The watchdog's state, protected by watch_mtx_. It also
+        // closes each batch's window, at the time it is filed under
+        // in windows_.
+        std::mutex watch_mtx_;
+        std::condition_variable watch_cond_;
+        std::map<uint64_t, watch_entry> watches_;
+        std::multimap<std::chrono::steady_clock::time_point,
+                      std::shared_ptr<job> > windows_;
+        uint64_t next_watch_;
+        bool watch_closed_;
+        std::thread watchdog_;
+
+        friend class search_thread;
+    private:
+        search_pool(const search_pool&);
+        void operator=(const search_pool&);
+    };
 
     class search_thread {
     public:
+        // Runs queries on a private pool of FLAGS_threads workers.
         search_thread(code_searcher *cs);
+        // Runs queries on `pool', which must outlive this object.
+        search_thread(code_searcher *cs, search_pool *pool);
         ~search_thread();
 
         // function that will be called to record a match
@@ -181,18 +532,51 @@ public:
                    const callback_func& cb,
                    const transform_func& func,
                    match_stats *stats);
-    protected:
-        struct job {
-            atomic_int pending;
-            searcher *search;
-            thread_queue<chunk*> chunks;
+
+        /*
+         * A query start()ed on the pool. Destroying it before
+         * collect() has returned true cancels the search and waits
+         * for the pool to let go of it.
+         */
+        class pending {
+        public:
+            ~pending();
+        private:
+            pending();
+
+            std::unique_ptr<searcher> search_;
+            search_pool *pool_;
+            uint64_t watch_;
+            uint64_t start_;
+            int matches_;
+            bool done_;
+
+            friend class search_thread;
+            pending(const pending&);
+            void operator=(const pending&);
         };
 
+        /*
+         * match(), split in two for callers that cannot block waiting
+         * for the pool. start() submits `q', which must outlive the
+         * result, and returns; `ready' (if set) is then called from
+         * whichever thread finds matches or finishes the search,
+         * whenever collect() has something new for it. collect()
+         * passes the matches found so far to `cb' and returns true,
+         * with `stats' filled in, once the search is over. Call it
+         * once after start() returns, in case the search finished
+         * before `ready' could be called, and from one thread at a
+         * time; with `wait' set it blocks until the search is over.
+         */
+        std::unique_ptr<pending> start(const query& q,
+                                       const transform_func& func,
+                                       const std::function<void ()>& ready);
+        bool collect(pending *p, const callback_func& cb, match_stats *stats,
+                     bool wait = false);
+    protected:
         const code_searcher *cs_;
-        vector<std::thread> threads_;
-        thread_queue<job*> queue_;
-
-        static void search_one(search_thread *);
+        std::unique_ptr<search_pool> own_pool_;
+        search_pool *pool_;
     private:
         search_thread(const search_thread&);
         void operator=(const search_thread&);
@@ -200,13 +584,55 @@ public:
 
 protected:
     string name_;
+    // Lines already indexed, for dedup: in lines_, cleared at each
+    // new chunk unless --global_dedup is set, or in line_cache_ if
+    // --dedup_table_mb is.
     string_hash lines_;
+    line_cache line_cache_;
+    bool global_dedup_;
     chunk_allocator *alloc_;
     bool finalized_;
     vector<indexed_tree*> trees_;
     vector<indexed_file*> files_;
+    // Storage for the files indexed in this process, and their paths.
+    std::deque<indexed_file> file_store_;
+    // Storage for the files of a loaded index, all in one array.
+    std::unique_ptr<indexed_file[]> loaded_files_;
+    path_table paths_;
+    vector<tombstone> tombstones_;
+
+    // After load_segments(), the segments, oldest first. alloc_
+    // then holds every segment's chunks, and files_ and trees_ every
+    // segment's files and trees; files are numbered across all of
+    // them.
+    vector<code_searcher*> segments_;
+    // The number of each segment's first file in files_.
+    vector<uint32_t> segment_files_;
+    // Indexed by file number; empty if no file is shadowed.
+    vector<bool> shadowed_;
+
+    mutable lru_cache<std::shared_ptr<const search_plan> > plans_;
+
+    // Chunks holding one line for each distinct path in files_,
+    // belonging to every file with that path but none that is
+    // shadowed, for paths queries. Built by index_paths() once the
+    // index has been finalized or loaded.
+    std::unique_ptr<chunk_allocator> path_alloc_;
+    void index_paths();
+    // load_index(), less index_paths(), for each of load_segments().
+    void load_one(const string& path);
+    // A new tree with the name, version and metadata of `tree'.
+    const indexed_tree *add_tree(const indexed_tree& tree);
+
+    // file_rank() and chunk_rank(), by file number and chunk,
+    // worked out by the first ranked query.
+    void compute_ranks() const;
+    mutable std::once_flag ranks_once_;
+    mutable vector<float> file_ranks_;
+    mutable vector<float> chunk_ranks_;
 
     friend class search_thread;
+    friend class search_pool;
     friend class searcher;
     friend class codesearch_index;
     friend class load_allocator;
@@ -220,4 +646,21 @@ chunk_allocator *make_mem_allocator();
 
 void default_re2_options(RE2::Options&);
 
+// `pattern' compiled with `opts', shared with any recent caller that
+// asked for the same; see --query_cache_size. The result may not be
+// ok(). If `width' is given and the pattern compiled, it is set to
+// the pattern's width, as measured by WidthWalker.
+std::shared_ptr<const RE2> compile_re(const string& pattern,
+                                      const RE2::Options& opts,
+                                      int *width = 0);
+// The key compile_re() and code_searcher::plan() cache `re' under.
+string re_cache_key(const RE2& re);
+
+// dump_load.cc: the paths in a comma-separated list of indexes, as
+// --load_index takes for load_segments().
+vector<string> split_index_paths(const string& spec);
+// dump_load.cc: whether `path' is an index load_index() can read
+// whole, every section inside the file; if not, says why in `*err'.
+bool check_index_file(const string& path, string *err);
+
 #endif /* CODESEARCH_H */
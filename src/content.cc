@@ -8,30 +8,183 @@
 #include "src/content.h"
 #include "src/chunk.h"
 
+#include <assert.h>
+#include <string.h>
+
 void file_contents_builder::extend(chunk *c, const StringPiece &piece) {
-    if (pieces_.size() && piece.size()) {
-        if (pieces_.back().data() + pieces_.back().size() == piece.data()) {
-            pieces_.back().set(pieces_.back().data(),
-                               piece.size() + pieces_.back().size());
+    if (pieces_.size() && piece.size() && pieces_.back().first == c) {
+        StringPiece &last = pieces_.back().second;
+        if (last.data() + last.size() == piece.data()) {
+            last.set(last.data(), piece.size() + last.size());
             return;
         }
     }
 
-    pieces_.push_back(piece);
+    pieces_.push_back(std::make_pair(c, piece));
+}
+
+namespace {
+
+void put_varint(vector<uint8_t> *out, uint64_t v) {
+    while (v >= 0x80) {
+        out->push_back(uint8_t(v) | 0x80);
+        v >>= 7;
+    }
+    out->push_back(uint8_t(v));
+}
+
+const uint8_t *get_varint(const uint8_t *p, uint64_t *out) {
+    uint64_t v = 0;
+    int shift = 0;
+    while (*p & 0x80) {
+        v |= uint64_t(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    *out = v | (uint64_t(*p++) << shift);
+    return p;
+}
+
+uint64_t zigzag(int64_t v) {
+    return (uint64_t(v) << 1) ^ uint64_t(v >> 63);
+}
+
+int64_t unzigzag(uint64_t v) {
+    return int64_t(v >> 1) ^ -int64_t(v & 1);
+}
+
+};
+
+file_contents::piece_iterator::piece_iterator(const uint8_t *begin,
+                                              const uint8_t *pos,
+                                              const uint8_t *end)
+    : begin_(begin), pos_(pos), next_(pos), end_(end), cur_(),
+      dchunk_(0), doff_(0), dlno_(0) {
+    if (pos_ != end_) {
+        next_ = decode(pos_);
+        cur_.chunk = dchunk_;
+        cur_.off = doff_;
+        cur_.lno = dlno_;
+    }
+}
+
+file_contents::piece_iterator::piece_iterator(const uint8_t *begin,
+                                              const uint8_t *pos,
+                                              const uint8_t *end,
+                                              const piece &at)
+    : begin_(begin), pos_(pos), next_(pos), end_(end), cur_(at),
+      dchunk_(0), doff_(0), dlno_(0) {
+    next_ = decode(pos_);
+}
+
+const uint8_t *file_contents::piece_iterator::decode(const uint8_t *p) {
+    uint64_t v;
+    p = get_varint(p, &v);
+    dchunk_ = unzigzag(v);
+    p = get_varint(p, &v);
+    doff_ = unzigzag(v);
+    p = get_varint(p, &v);
+    cur_.len = v;
+    p = get_varint(p, &v);
+    dlno_ = v;
+    return p;
+}
+
+file_contents::piece_iterator &file_contents::piece_iterator::operator++() {
+    pos_ = next_;
+    if (pos_ == end_) {
+        dchunk_ = doff_ = dlno_ = 0;
+        return *this;
+    }
+    next_ = decode(pos_);
+    cur_.chunk += dchunk_;
+    cur_.off += doff_;
+    cur_.lno += dlno_;
+    return *this;
+}
+
+file_contents::piece_iterator &file_contents::piece_iterator::operator--() {
+    assert(pos_ != begin_);
+    cur_.chunk -= dchunk_;
+    cur_.off -= doff_;
+    cur_.lno -= dlno_;
+    // Back up over the previous piece's four varints: each one
+    // starts just after a byte with its top bit clear.
+    const uint8_t *p = pos_;
+    for (int i = 0; i < 4; i++) {
+        --p;
+        while (p > begin_ && (p[-1] & 0x80))
+            --p;
+    }
+    next_ = pos_;
+    pos_ = p;
+    decode(pos_);
+    return *this;
+}
+
+bool file_contents::line(chunk_allocator *alloc, uint32_t lno, StringPiece *out) const {
+    if (lno == 0)
+        return false;
+    // Start from the last sample at or before `lno', if any; the
+    // last piece starting at or before it is no more than
+    // kSampleEvery pieces on.
+    const sample *s = samples(), *s_end = s + nsamples(npieces_);
+    const sample *at = std::upper_bound(s, s_end, lno,
+                                        [](uint32_t l, const sample &x) {
+                                            return l < x.at.lno;
+                                        });
+    piece_iterator it = at == s ? begin() :
+        piece_iterator(data_, data_ + at[-1].pos, data_ + nbytes_, at[-1].at);
+    piece_iterator p = end();
+    for (; it != end() && it->lno <= lno; ++it)
+        p = it;
+    if (p == end())
+        return false;
+    StringPiece text(reinterpret_cast<char*>(alloc->at(p->chunk)->data + p->off), p->len);
+    for (uint32_t skip = lno - p->lno; skip > 0; --skip) {
+        size_t nl = text.find('\n');
+        if (nl == StringPiece::npos)
+            return false;
+        text.remove_prefix(nl + 1);
+    }
+    size_t nl = text.find('\n');
+    *out = nl == StringPiece::npos ? text : text.substr(0, nl);
+    return true;
 }
 
 file_contents *file_contents_builder::build(chunk_allocator *alloc) {
-    size_t len = sizeof(uint32_t) * (1 + 3*pieces_.size());
-    file_contents *out = new(alloc->alloc_content_data(len)) file_contents(pieces_.size());
-    if (out == 0)
-        return 0;
+    vector<uint8_t> data;
+    vector<file_contents::sample> samples;
+    file_contents::piece prev = {0, 0, 0, 0};
+    uint32_t lno = 1;
     for (int i = 0; i < pieces_.size(); i++) {
-        const unsigned char *p = reinterpret_cast<const unsigned char*>
-            (pieces_[i].data());
-        chunk *chunk = alloc->chunk_from_string(p);
-        out->pieces_[i].chunk = chunk->id;
-        out->pieces_[i].off   = p - chunk->data;
-        out->pieces_[i].len   = pieces_[i].size();
+        chunk *chunk = pieces_[i].first;
+        const StringPiece &str = pieces_[i].second;
+        const unsigned char *p = reinterpret_cast<const unsigned char*>(str.data());
+        file_contents::piece cur = {
+            uint32_t(chunk->id), uint32_t(p - chunk->data), uint32_t(str.size()), lno
+        };
+        if (i > 0 && i % file_contents::kSampleEvery == 0)
+            samples.push_back(file_contents::sample{uint32_t(data.size()), cur});
+        put_varint(&data, zigzag(int64_t(cur.chunk) - int64_t(prev.chunk)));
+        put_varint(&data, zigzag(int64_t(cur.off) - int64_t(prev.off)));
+        put_varint(&data, cur.len);
+        put_varint(&data, cur.lno - prev.lno);
+        prev = cur;
+        lno += count_newlines(str.data(), str.data() + str.size()) + 1;
     }
+
+    assert(samples.size() == file_contents::nsamples(pieces_.size()));
+    void *buf = alloc->alloc_content_data(file_contents::footprint(pieces_.size(),
+                                                                   data.size()));
+    if (buf == 0)
+        return 0;
+    file_contents *out = new(buf) file_contents(pieces_.size(), data.size());
+    if (data.size())
+        memcpy(out->data_, data.data(), data.size());
+    memset(out->data_ + data.size(), 0,
+           file_contents::stream_footprint(data.size()) - data.size());
+    if (samples.size())
+        memcpy(const_cast<file_contents::sample*>(out->samples()), samples.data(),
+               samples.size() * sizeof(file_contents::sample));
     return out;
 }
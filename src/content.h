@@ -9,22 +9,87 @@
 #define CODESEARCH_CONTENT_H
 
 #include <vector>
+#include <algorithm>
 #include "re2/re2.h"
 
 #include "src/chunk.h"
 #include "src/chunk_allocator.h"
+#include "src/lib/bytes.h"
 
 using re2::StringPiece;
 using std::vector;
 
 
+/*
+ * The pieces of chunks a file's lines were stored in, as a stream of
+ * LEB128 varints, four to a piece: how its chunk id and its offset
+ * differ from the piece before (zigzag-encoded, as either may go
+ * down), its length, and how many lines on it starts. Most pieces
+ * are near the one before them in the same chunk, so they take about
+ * half the 16 bytes they would written out in full. Each varint ends
+ * in a byte with its top bit clear, so the stream can be walked
+ * backwards as well as forwards.
+ *
+ * After the stream, aligned to 4 bytes, comes every kSampleEvery'th
+ * piece (but the first) written out in full, with where it starts in
+ * the stream, so that line() can find a line with a binary search
+ * and a short walk rather than decoding from the start. Files with
+ * fewer pieces than that, which are most of them, have none.
+ */
 class file_contents {
 public:
     struct piece {
         uint32_t chunk;
         uint32_t off;
         uint32_t len;
-    } __attribute__((packed));
+        // The line number, within the file, of this piece's first line.
+        uint32_t lno;
+    };
+
+    // Decodes the pieces as it comes to them. An iterator from end()
+    // can only be compared against; one that got to the end by ++
+    // can step back from it.
+    static const uint32_t kSampleEvery = 16;
+
+    class piece_iterator {
+    public:
+        const piece &operator*() const {
+            return cur_;
+        }
+
+        const piece *operator->() const {
+            return &cur_;
+        }
+
+        piece_iterator &operator++();
+        piece_iterator &operator--();
+
+        bool operator==(const piece_iterator &rhs) const {
+            return pos_ == rhs.pos_;
+        }
+        bool operator!=(const piece_iterator &rhs) const {
+            return !(*this == rhs);
+        }
+    protected:
+        piece_iterator(const uint8_t *begin, const uint8_t *pos,
+                       const uint8_t *end);
+        // At the piece encoded at `pos', which is `at'.
+        piece_iterator(const uint8_t *begin, const uint8_t *pos,
+                       const uint8_t *end, const piece &at);
+
+        // Read the piece encoded at `p' into deltas_ and cur_.len,
+        // returning the end of its encoding.
+        const uint8_t *decode(const uint8_t *p);
+
+        const uint8_t *begin_, *pos_, *next_, *end_;
+        piece cur_;
+        // How cur_'s chunk, off and lno differ from the piece
+        // before's; all 0 at the end.
+        int64_t dchunk_, doff_;
+        uint32_t dlno_;
+
+        friend class file_contents;
+    };
 
     template <class T>
     class proxy {
@@ -46,13 +111,21 @@ public:
             return proxy<StringPiece>(this->operator*());
         }
 
+        // The line number of the line starting at `pos', which must
+        // lie within this piece.
+        uint32_t lno(const char *pos) {
+            const char *start = reinterpret_cast<char*>
+                (alloc_->at(it_->chunk)->data + it_->off);
+            return it_->lno + count_newlines(start, pos);
+        }
+
         iterator &operator++() {
-            it_++;
+            ++it_;
             return *this;
         }
 
         iterator &operator--() {
-            it_--;
+            --it_;
             return *this;
         }
 
@@ -63,37 +136,51 @@ public:
             return !(*this == rhs);
         }
     protected:
-        iterator(chunk_allocator *alloc, piece *it)
+        iterator(chunk_allocator *alloc, piece_iterator it)
             : alloc_(alloc), it_(it) {}
 
         chunk_allocator *alloc_;
-        piece *it_;
+        piece_iterator it_;
 
         friend class file_contents;
     };
 
-    file_contents(uint32_t npieces) : npieces_(npieces) { }
+    file_contents(uint32_t npieces, uint32_t nbytes)
+        : npieces_(npieces), nbytes_(nbytes) { }
 
-    iterator begin(chunk_allocator *alloc) {
-        return iterator(alloc, pieces_);
+    iterator begin(chunk_allocator *alloc) const {
+        return iterator(alloc, begin());
     }
 
-    iterator end(chunk_allocator *alloc) {
-        return iterator(alloc, pieces_ + npieces_);
+    iterator end(chunk_allocator *alloc) const {
+        return iterator(alloc, end());
     }
 
-    piece *begin() {
-        return pieces_;
+    piece_iterator begin() const {
+        return piece_iterator(data_, data_, data_ + nbytes_);
     }
 
-    piece *end() {
-        return pieces_ + npieces_;
+    piece_iterator end() const {
+        return piece_iterator(data_, data_ + nbytes_, data_ + nbytes_);
     }
 
-    size_t size() {
+    size_t size() const {
         return npieces_;
     }
 
+    // The bytes this takes up where it is stored, kept a multiple of 4.
+    size_t footprint() const {
+        return footprint(npieces_, nbytes_);
+    }
+    static size_t footprint(size_t npieces, size_t nbytes) {
+        return sizeof(file_contents) + stream_footprint(nbytes) +
+            nsamples(npieces) * sizeof(sample);
+    }
+
+    // Set `*out' to line `lno' (from 1) of the file, without its
+    // newline. Returns false if the file has fewer lines.
+    bool line(chunk_allocator *alloc, uint32_t lno, StringPiece *out) const;
+
     friend class codesearch_index;
     friend class load_allocator;
     friend class file_contents_builder;
@@ -101,8 +188,26 @@ public:
 protected:
     file_contents() {}
 
+    // A piece, in full, and the offset in data_ of its encoding.
+    struct sample {
+        uint32_t pos;
+        piece at;
+    };
+
+    static size_t stream_footprint(size_t nbytes) {
+        return (nbytes + 3) & ~size_t(3);
+    }
+    static size_t nsamples(size_t npieces) {
+        return npieces ? (npieces - 1) / kSampleEvery : 0;
+    }
+    const sample *samples() const {
+        return reinterpret_cast<const sample*>(data_ + stream_footprint(nbytes_));
+    }
+
     uint32_t npieces_;
-    piece pieces_[];
+    // the length of data_
+    uint32_t nbytes_;
+    uint8_t data_[];
 };
 
 class file_contents_builder {
@@ -110,7 +215,8 @@ public:
     void extend(chunk *chunk, const StringPiece &piece);
     file_contents *build(chunk_allocator *alloc);
 protected:
-    vector <StringPiece> pieces_;
+    // each piece, and the chunk it lies in
+    vector<std::pair<chunk*, StringPiece> > pieces_;
 };
 
 #endif
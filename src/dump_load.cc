@@ -5,22 +5,58 @@
  * This program is free software. You may use, redistribute, and/or
  * modify it under the terms listed in the COPYING file.
  ********************************************************************/
+#include "src/lib/metrics.h"
+#include "src/lib/numa.h"
+#include "src/lib/parallel.h"
+#include "src/lib/timer.h"
+
 #include "src/codesearch.h"
 #include "src/chunk.h"
 #include "src/chunk_allocator.h"
 #include "src/content.h"
 #include "src/dump_load.h"
 
+#include <algorithm>
 #include <map>
 #include <string>
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <unordered_set>
 
+#include <errno.h>
+#include <string.h>
 #include <sys/fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include <json-c/json.h>
+#include <gflags/gflags.h>
+
+DECLARE_int32(threads);
+DECLARE_bool(index);
+DECLARE_bool(fold_index);
+DECLARE_bool(numa);
+DEFINE_bool(warmup, false, "Fault a loaded index's chunks into memory before serving from it.");
+DEFINE_bool(mlock, false, "Lock a loaded index's chunks in memory (implies --warmup).");
+DEFINE_int32(build_memory_mb, 0, "When building straight into --dump_index, write each chunk out as soon as it is full and sorted and give its memory back, keeping the chunks being built under about this many MB (0 = keep every chunk in memory until the end). Needs --noglobal_dedup.");
+
+namespace {
+    metric idx_chunks_retired("index.chunks.retired");
+
+    metric idx_warm_bytes("index.warm_bytes");
+    metric idx_locked_bytes("index.locked_bytes");
+
+    // The bytes of the index file given to each chunk: its data, then
+    // its suffix arrays at 32 bits an entry, packed or not.
+    size_t chunk_stride(const index_header &hdr) {
+        int arrays = (hdr.flags & kIndexFolded) ? 2 : 1;
+        return size_t(hdr.chunk_size) * (1 + arrays * sizeof(uint32_t));
+    }
+};
+
+typedef google::sparse_hash_map<StringPiece, uint32_t, hash_piece> path_ids;
 
 class codesearch_index {
 public:
@@ -35,6 +71,7 @@ public:
         hdr_.magic      = kIndexMagic;
         hdr_.version    = kIndexVersion;
         hdr_.chunk_size = cs->alloc_->chunk_size();
+        hdr_.flags      = (FLAGS_index && FLAGS_fold_index) ? kIndexFolded : 0;
     }
 
     ~codesearch_index() {
@@ -45,9 +82,18 @@ public:
 protected:
     void dump_chunk_data();
     void dump_metadata();
-    void dump_file(map<const indexed_tree*, int>& ids, indexed_file *sf);
-    void dump_chunk_file(chunk_file *cf);
-    void dump_chunk_files(chunk *, chunk_header *);
+    void dump_file(map<const indexed_tree*, int>& ids,
+                   path_ids& paths, indexed_file *sf);
+    void dump_chunk_files(chunk *, chunk_header *,
+                          map<const indexed_tree*, int>& tree_ids);
+    // The id of each of cs_'s trees so far, for dump_chunk_files().
+    map<const indexed_tree*, int>& tree_ids() {
+        while (tree_ids_.size() < cs_->trees_.size()) {
+            int id = tree_ids_.size();
+            tree_ids_[cs_->trees_[id]] = id;
+        }
+        return tree_ids_;
+    }
     void dump_chunk_data(chunk *);
     void dump_content_data();
 
@@ -65,9 +111,9 @@ protected:
         dump(&i);
     }
 
-    void dump_string(const string &str) {
+    void dump_string(const StringPiece &str) {
         dump_int32(str.size());
-        stream_.write(str.c_str(), str.size());
+        stream_.write(str.data(), str.size());
     }
 
     code_searcher *cs_;
@@ -80,6 +126,7 @@ protected:
     index_header hdr_;
     vector<chunk_header> chunks_;
     vector<content_chunk_header> content_;
+    map<const indexed_tree*, int> tree_ids_;
 
     friend class dump_allocator;
 };
@@ -101,28 +148,54 @@ private:
                    index_->fd_, off);
         assert(buf != MAP_FAILED);
         index_->stream_.seekp(len, ios::cur);
+        {
+            std::lock_guard<std::mutex> guard(map_mtx_);
+            alloc_map_[buf] = off;
+        }
         return make_pair(off, static_cast<uint8_t*>(buf));
     }
 
+    // Write back the `len' bytes mapped at `p' and drop them from
+    // memory, the page cache included.
+    void release_pages(void *p, size_t len) {
+        off_t off;
+        {
+            std::lock_guard<std::mutex> guard(map_mtx_);
+            off = alloc_map_[p];
+        }
+        msync(p, len, MS_SYNC);
+        madvise(p, len, MADV_DONTNEED);
+        posix_fadvise(index_->fd_, off, len, POSIX_FADV_DONTNEED);
+    }
+
 public:
     dump_allocator(code_searcher *cs, const char *path)
         : cs_(cs), path_(path), index_() {
+        stream_bytes_ = size_t(FLAGS_build_memory_mb) << 20;
+    }
+
+    ~dump_allocator() {
+        for (auto it = file_maps_.begin(); it != file_maps_.end(); ++it)
+            munmap(it->first, it->second);
     }
 
     virtual chunk *alloc_chunk() {
-        auto alloc = alloc_mmap((1 + sizeof(uint32_t)) * chunk_size_);
+        auto alloc = alloc_mmap(stride());
 
         chunk_header chdr = {
             uint64_t(alloc.first)
         };
         index_->chunks_.push_back(chdr);
 
-        return new chunk(static_cast<unsigned char*>(alloc.second),
-                         reinterpret_cast<uint32_t*>
-                         (static_cast<unsigned char*>(alloc.second) + chunk_size_));
+        unsigned char *data = static_cast<unsigned char*>(alloc.second);
+        return new chunk(data, reinterpret_cast<uint32_t*>(data + chunk_size_),
+                         folded() ? reinterpret_cast<uint32_t*>(data + 5 * chunk_size_) : 0);
     }
 
     virtual buffer alloc_content_chunk() {
+        // Nothing more goes into the last one.
+        if (stream_bytes_ && !content_chunks_.empty())
+            release_pages(content_chunks_.back().data, kContentChunkSize);
         auto alloc = alloc_mmap(kContentChunkSize);
         buffer b = {
             alloc.second, alloc.second + kContentChunkSize
@@ -149,15 +222,66 @@ public:
     }
 
     virtual void free_chunk(chunk *chunk) {
-        munmap(chunk->data, 5*chunk_size_);
+        munmap(chunk->data, stride());
         delete chunk;
     }
 protected:
+    virtual size_t chunk_bytes() {
+        return stride();
+    }
+
+    virtual void release_chunk(chunk *c) {
+        release_pages(c->data, stride());
+    }
+
+    /*
+     * Write `c's file map out now rather than with the rest of the
+     * metadata, and map it back in to search from, as a loaded index
+     * would. It gets pages of its own, so that the chunks after it
+     * stay page-aligned.
+     */
+    virtual void retire_chunk(chunk *c) {
+        c->finalize_files();
+        chunk_header *hdr = &index_->chunks_[c->id];
+        index_->dump_chunk_files(c, hdr, index_->tree_ids());
+        index_->stream_.flush();
+        index_->alignp(kPageSize);
+
+        uint64_t start = hdr->files_off & ~uint64_t(kPageSize - 1);
+        uint64_t end = hdr->trees_off + sizeof(uint32_t) * hdr->ntrees;
+        const uint8_t *files = 0;
+        if (end > hdr->files_off) {
+            void *map = mmap(NULL, end - start, PROT_READ, MAP_SHARED,
+                             index_->fd_, start);
+            assert(map != MAP_FAILED);
+            file_maps_.push_back(make_pair(map, end - start));
+            files = static_cast<const uint8_t*>(map) + (hdr->files_off - start);
+        }
+        const chunk_file_range *ranges = reinterpret_cast<const chunk_file_range*>(files);
+        const uint32_t *file_ids = reinterpret_cast<const uint32_t*>(ranges + hdr->nfiles);
+        c->move_files(ranges, file_ids,
+                      reinterpret_cast<const chunk_file_node*>(file_ids + hdr->nfile_ids));
+        idx_chunks_retired.inc();
+    }
+
+    // As codesearch_index sets kIndexFolded in its header.
+    bool folded() const {
+        return FLAGS_index && FLAGS_fold_index;
+    }
+
+    size_t stride() {
+        return (1 + (folded() ? 2 : 1) * sizeof(uint32_t)) * chunk_size_;
+    }
+
     code_searcher *cs_;
     std::string path_;
     unique_ptr<codesearch_index> index_;
+    // The offset in the index file of each mapping alloc_mmap() made;
+    // protected by map_mtx_, as finalize workers look chunks up.
+    std::mutex map_mtx_;
     map<void *, off_t> alloc_map_;
-    vector<off_t> content_;
+    // The file maps retire_chunk() read back in.
+    vector<pair<void*, size_t> > file_maps_;
 
 };
 
@@ -168,6 +292,8 @@ public:
     ~load_allocator() {
         close(fd_);
         munmap(map_, map_size_);
+        idx_warm_bytes.dec(warm_bytes_);
+        idx_locked_bytes.dec(locked_bytes_);
     }
 
     virtual chunk *alloc_chunk();
@@ -182,15 +308,20 @@ public:
     virtual void drop_caches() {
         for (auto it = begin(); it != end(); ++it) {
             madvise((*it)->data, (*it)->size, MADV_DONTNEED);
-            madvise((*it)->suffixes, (*it)->size * sizeof(*(*it)->suffixes), MADV_DONTNEED);
+            madvise((*it)->suffixes, (*it)->suffix_bytes(), MADV_DONTNEED);
+            if ((*it)->folded)
+                madvise((*it)->folded, (*it)->suffix_bytes(), MADV_DONTNEED);
         }
         posix_fadvise(fd_, hdr_->chunks_off,
-                      chunks_.size() * chunk_size_ * (1 + sizeof(uint32_t)),
+                      chunks_.size() * chunk_stride(*hdr_),
                       POSIX_FADV_DONTNEED);
     }
 
     void load(code_searcher *cs);
 protected:
+    void warmup();
+    void prefault(void *p, size_t len);
+
     template <class T>
     T *consume() {
         T *out = reinterpret_cast<T*>(p_);
@@ -208,18 +339,25 @@ protected:
         p_ = static_cast<uint8_t*>(map_) + off;
     }
 
-    indexed_file *load_file(code_searcher *cs);
-    void load_chunk(code_searcher *);
+    void load_file(code_searcher *cs, const vector<StringPiece>& paths,
+                   indexed_file *sf);
+    void load_chunk(code_searcher *cs, chunk *chunk, const chunk_header *hdr);
+    void load_content(code_searcher *cs, const content_chunk_header *hdr,
+                      int first_file, buffer *b);
 
     uint32_t load_int32() {
         return *(consume<uint32_t>());
     }
 
-    string load_string() {
+    StringPiece load_string_piece() {
         uint32_t len = load_int32();
         uint8_t *buf = p_;
         p_ += len;
-        return string(reinterpret_cast<char*>(buf), len);
+        return StringPiece(reinterpret_cast<char*>(buf), len);
+    }
+
+    string load_string() {
+        return load_string_piece().as_string();
     }
 
     int fd_;
@@ -230,51 +368,100 @@ protected:
     index_header *hdr_;
     chunk_header *chunks_hdr_;
     chunk_header *next_chunk_;
+
+    std::atomic<long> warm_bytes_;
+    std::atomic<long> locked_bytes_;
+};
+
+/*
+ * Every chunk of a code_searcher's segments, in order, so that one
+ * search covers them all. The segments' own allocators still own the
+ * chunks.
+ */
+class segment_allocator : public chunk_allocator {
+public:
+    void add(chunk_allocator *seg) {
+        if (segments_.empty() || seg->chunk_size() > chunk_size_)
+            chunk_size_ = seg->chunk_size();
+        chunks_.insert(chunks_.end(), seg->begin(), seg->end());
+        corpus_.add(seg->corpus());
+        segments_.push_back(seg);
+    }
+
+    virtual chunk *alloc_chunk() {
+        assert(0);
+    }
+
+    virtual buffer alloc_content_chunk() {
+        assert(0);
+    }
+
+    virtual void free_chunk(chunk *chunk) {
+    }
+
+    virtual void drop_caches() {
+        for (auto it = segments_.begin(); it != segments_.end(); ++it)
+            (*it)->drop_caches();
+    }
+protected:
+    vector<chunk_allocator*> segments_;
 };
 
 chunk_allocator *make_dump_allocator(code_searcher *search, const string& path) {
     return new dump_allocator(search, path.c_str());
 }
 
-void codesearch_index::dump_file(map<const indexed_tree*, int>& ids, indexed_file *sf) {
+void codesearch_index::dump_file(map<const indexed_tree*, int>& ids,
+                                 path_ids& paths, indexed_file *sf) {
     dump_int32(ids[sf->tree]);
-    dump_string(sf->path);
+    dump_int32(paths[sf->path]);
 }
 
-void codesearch_index::dump_chunk_file(chunk_file *cf) {
-    dump_int32(cf->files.size());
-    for (list<indexed_file*>::iterator it = cf->files.begin();
-         it != cf->files.end(); ++it)
-        dump_int32((*it)->no);
-
-    dump_int32(cf->left);
-    dump_int32(cf->right);
-}
-
-void codesearch_index::dump_chunk_files(chunk *chunk, chunk_header *hdr) {
+void codesearch_index::dump_chunk_files(chunk *chunk, chunk_header *hdr,
+                                        map<const indexed_tree*, int>& tree_ids) {
+    alignp(sizeof(uint32_t));
     hdr->files_off = stream_.tellp();
-    hdr->nfiles = chunk->files.size();
+    hdr->nfiles = chunk->nranges;
+    hdr->nfile_ids = 0;
     hdr->size = chunk->size;
+    hdr->suffix_bits = chunk->suffix_bits;
 
-    for (vector<chunk_file>::iterator it = chunk->files.begin();
-         it != chunk->files.end(); it ++)
-        dump_chunk_file(&(*it));
+    if (chunk->nranges) {
+        const chunk_file_range &last = chunk->ranges[chunk->nranges - 1];
+        hdr->nfile_ids = last.files + last.nfiles;
+    }
+    stream_.write(reinterpret_cast<const char*>(chunk->ranges),
+                  chunk->nranges * sizeof(chunk_file_range));
+    stream_.write(reinterpret_cast<const char*>(chunk->file_ids),
+                  hdr->nfile_ids * sizeof(uint32_t));
+    stream_.write(reinterpret_cast<const char*>(chunk->tree),
+                  chunk->nranges * sizeof(chunk_file_node));
+
+    hdr->trees_off = stream_.tellp();
+    hdr->ntrees = chunk->trees.size();
+    for (auto it = chunk->trees.begin(); it != chunk->trees.end(); ++it)
+        dump_int32(tree_ids[*it]);
 }
 
 void codesearch_index::dump_chunk_data(chunk *chunk) {
     alignp(kPageSize);
     size_t off = stream_.tellp();
 
-    chunk_header chdr;
+    chunk_header chdr = {};
     chdr.data_off = off;
     chdr.size = chunk->size;
     chunks_.push_back(chdr);
 
-    assert(ftruncate(fd_, off + 5 * hdr_.chunk_size) == 0);
+    assert(ftruncate(fd_, off + chunk_stride(hdr_)) == 0);
     stream_.write(reinterpret_cast<char*>(chunk->data), hdr_.chunk_size);
     stream_.write(reinterpret_cast<char*>(chunk->suffixes),
-                  sizeof(uint32_t) * chunk->size);
-    stream_.seekp(off + 5 * hdr_.chunk_size);
+                  chunk->suffix_bytes());
+    if (hdr_.flags & kIndexFolded) {
+        stream_.seekp(off + 5 * hdr_.chunk_size);
+        stream_.write(reinterpret_cast<char*>(chunk->folded),
+                      chunk->suffix_bytes());
+    }
+    stream_.seekp(off + chunk_stride(hdr_));
 }
 
 void codesearch_index::dump_metadata() {
@@ -293,28 +480,68 @@ void codesearch_index::dump_metadata() {
          it != cs_->trees_.end(); ++it) {
         dump_string((*it)->name);
         dump_string((*it)->version);
-        if ((*it)->metadata)
-            dump_string(json_object_to_json_string((*it)->metadata));
-        else
-            dump_string("");
+        dump_string((*it)->metadata);
         tree_ids[*it] = it - cs_->trees_.begin();
     }
+    hdr_.ntombstones = cs_->tombstones_.size();
+    hdr_.tombstones_off = stream_.tellp();
+    for (auto it = cs_->tombstones_.begin();
+         it != cs_->tombstones_.end(); ++it) {
+        dump_string(it->tree);
+        dump_string(it->version);
+        dump_string(it->path);
+    }
+
+    alignp(sizeof(uint64_t));
+    hdr_.corpus_off = stream_.tellp();
+    stream_.write(reinterpret_cast<const char*>(&cs_->alloc_->corpus()),
+                  sizeof(corpus_stats));
+
+    // Every version of a tree has most of the same paths, so each
+    // path is written out once, to be shared by number.
+    path_ids paths;
+    hdr_.paths_off = stream_.tellp();
+    for (auto it = cs_->files_.begin(); it != cs_->files_.end(); ++it) {
+        if (paths.find((*it)->path) != paths.end())
+            continue;
+        uint32_t id = paths.size();
+        paths[(*it)->path] = id;
+        dump_string((*it)->path);
+    }
+    hdr_.npaths = paths.size();
+
+    alignp(sizeof(uint32_t));
     hdr_.files_off = stream_.tellp();
     for (vector<indexed_file*>::iterator it = cs_->files_.begin();
          it != cs_->files_.end(); ++it)
-        dump_file(tree_ids, *it);
+        dump_file(tree_ids, paths, *it);
 
     auto hdr = chunks_.begin();
     for (auto it = cs_->alloc_->begin();
          it != cs_->alloc_->end(); ++it, ++hdr) {
         assert(hdr != chunks_.end());
-        dump_chunk_files(*it, &(*hdr));
+        // A streaming build has written most of them already.
+        if (hdr->files_off == 0)
+            dump_chunk_files(*it, &(*hdr), tree_ids);
     }
 
     hdr_.chunks_off = stream_.tellp();
     for (auto it = chunks_.begin(); it != chunks_.end(); ++it)
         dump(&*it);
 
+    auto file = cs_->files_.begin();
+    auto buf = cs_->alloc_->begin_content();
+    for (auto it = content_.begin(); it != content_.end(); ++it, ++buf) {
+        it->nfiles = 0;
+        while (file != cs_->files_.end() &&
+               reinterpret_cast<uint8_t*>((*file)->content) >= buf->data &&
+               reinterpret_cast<uint8_t*>((*file)->content) < buf->end) {
+            ++it->nfiles;
+            ++file;
+        }
+    }
+    assert(file == cs_->files_.end());
+
     hdr_.content_off = stream_.tellp();
     for (auto it = content_.begin(); it != content_.end(); ++it)
         dump(&*it);
@@ -344,6 +571,14 @@ void codesearch_index::dump_content_data() {
 void codesearch_index::dump() {
     assert(cs_->finalized_);
 
+    // Chunks copied or loaded from another index may lack a folded
+    // suffix array, whatever --fold_index says.
+    hdr_.flags &= ~kIndexFolded;
+    if (cs_->alloc_->size() &&
+        all_of(cs_->alloc_->begin(), cs_->alloc_->end(),
+               [](const chunk *c) { return c->folded != NULL; }))
+        hdr_.flags |= kIndexFolded;
+
     dump(&hdr_);
 
     dump_chunk_data();
@@ -354,7 +589,8 @@ void codesearch_index::dump() {
     dump(&hdr_);
 }
 
-load_allocator::load_allocator(code_searcher *cs, const string& path) {
+load_allocator::load_allocator(code_searcher *cs, const string& path)
+    : warm_bytes_(0), locked_bytes_(0) {
     fd_ = open(path.c_str(), O_RDONLY);
     assert(fd_ > 0);
     struct stat st;
@@ -377,38 +613,52 @@ load_allocator::load_allocator(code_searcher *cs, const string& path) {
 chunk *load_allocator::alloc_chunk() {
     unsigned char *data = ptr<unsigned char>(next_chunk_->data_off);
     uint32_t *indexes = reinterpret_cast<uint32_t*>(data + chunk_size_);
+    uint32_t *folded = (hdr_->flags & kIndexFolded) ?
+        reinterpret_cast<uint32_t*>(data + 5 * chunk_size_) : 0;
 
-    return new chunk(data, indexes);
+    return new chunk(data, indexes, folded);
 }
 
-indexed_file *load_allocator::load_file(code_searcher *cs) {
-    indexed_file *sf = new indexed_file;
+void load_allocator::load_file(code_searcher *cs, const vector<StringPiece>& paths,
+                               indexed_file *sf) {
     sf->tree = cs->trees_[load_int32()];
-    sf->path = load_string();
+    sf->path = paths[load_int32()];
     sf->no = cs->files_.size();
-    return sf;
 }
 
-void load_allocator::load_chunk(code_searcher *cs) {
-    skip_chunk();
-    chunk* chunk = current_chunk();
-
-    assert(next_chunk_->size <= hdr_->chunk_size);
-    chunk->size = next_chunk_->size;
-
-    p_ = ptr<unsigned char>(next_chunk_->files_off);
+/*
+ * load_chunk and load_content each touch only their own chunk and
+ * files, so load() runs them in parallel.
+ */
+void load_allocator::load_chunk(code_searcher *cs, chunk *chunk,
+                                const chunk_header *hdr) {
+    assert(hdr->size <= hdr_->chunk_size);
+    chunk->size = hdr->size;
+    chunk->suffix_bits = hdr->suffix_bits;
+
+    chunk->ranges = ptr<chunk_file_range>(hdr->files_off);
+    chunk->nranges = hdr->nfiles;
+    chunk->file_ids = reinterpret_cast<const uint32_t*>(chunk->ranges + chunk->nranges);
+    chunk->tree = reinterpret_cast<const chunk_file_node*>
+        (chunk->file_ids + hdr->nfile_ids);
+
+    const uint32_t *trees = ptr<uint32_t>(hdr->trees_off);
+    for (int i = 0; i < hdr->ntrees; i++)
+        chunk->trees.push_back(cs->trees_[trees[i]]);
+}
 
-    for (int i = 0; i < next_chunk_->nfiles; i++) {
-        chunk->files.push_back(chunk_file());
-        chunk_file &cf = chunk->files.back();
-        uint32_t nfiles = load_int32();
-        for (int j = 0; j < nfiles; j++)
-            cf.files.push_back(cs->files_[load_int32()]);
-        cf.left  = load_int32();
-        cf.right = load_int32();
+void load_allocator::load_content(code_searcher *cs,
+                                  const content_chunk_header *hdr,
+                                  int first_file, buffer *b) {
+    uint8_t *p = ptr<uint8_t>(hdr->file_off);
+    b->data = p;
+    for (uint32_t i = 0; i < hdr->nfiles; i++) {
+        file_contents *content = new(p) file_contents;
+        cs->files_[first_file + i]->content = content;
+        p += content->footprint();
     }
-    chunk->build_tree();
-    ++next_chunk_;
+    assert(p == ptr<uint8_t>(hdr->file_off + hdr->size));
+    b->end = p;
 }
 
 void load_allocator::load(code_searcher *cs) {
@@ -426,55 +676,401 @@ void load_allocator::load(code_searcher *cs) {
         indexed_tree *tree = new indexed_tree;
         tree->name = load_string();
         tree->version = load_string();
-        string metadata = load_string();
-        if (metadata.size() == 0) {
-            tree->metadata = NULL;
-        } else {
-            json_object *js = json_tokener_parse(metadata.c_str());
-            assert(!is_error(js));
-            tree->metadata = js;
-        }
+        tree->metadata = load_string();
 
         cs->trees_.push_back(tree);
     }
 
+    p_ = ptr<uint8_t>(hdr_->tombstones_off);
+    for (int i = 0; i < hdr_->ntombstones; i++) {
+        tombstone t;
+        t.tree = load_string();
+        t.version = load_string();
+        t.path = load_string();
+        cs->tombstones_.push_back(t);
+    }
+
+    memcpy(&corpus_, ptr<corpus_stats>(hdr_->corpus_off), sizeof corpus_);
+
+    // Paths are left in the mapping, so loading a file entry does not
+    // allocate; all the entries share one array.
+    p_ = ptr<uint8_t>(hdr_->paths_off);
+    vector<StringPiece> paths(hdr_->npaths);
+    for (uint32_t i = 0; i < hdr_->npaths; i++)
+        paths[i] = load_string_piece();
+
     p_ = ptr<uint8_t>(hdr_->files_off);
+    cs->loaded_files_.reset(new indexed_file[hdr_->nfiles]);
+    indexed_file *files = cs->loaded_files_.get();
+    cs->files_.reserve(hdr_->nfiles);
     for (int i = 0; i < hdr_->nfiles; i++) {
-        cs->files_.push_back(load_file(cs));
+        load_file(cs, paths, &files[i]);
+        cs->files_.push_back(&files[i]);
     }
 
     assert(!current_);
     for (int i = 0; i < hdr_->nchunks; i++) {
-        load_chunk(cs);
+        skip_chunk();
+        ++next_chunk_;
     }
+    parallel_for(hdr_->nchunks, FLAGS_threads, [&](int i) {
+            load_chunk(cs, chunks_[i], &chunks_hdr_[i]);
+        });
 
     content_chunk_header *chdr = ptr<content_chunk_header>(hdr_->content_off);
-    auto it = cs->files_.begin();
+    vector<int> first_file(hdr_->ncontent);
+    int nfiles = 0;
     for (int i = 0; i < hdr_->ncontent; i++) {
-        buffer b;
-        p_ = ptr<uint8_t>(chdr->file_off);
-        b.data = p_;
-        while (p_ < ptr<uint8_t>(chdr->file_off + chdr->size)) {
-            (*it)->content = new(p_) file_contents;
-            p_ = reinterpret_cast<uint8_t*>((*it)->content->end());
-            ++it;
-        }
-        b.end = p_;
-        content_chunks_.push_back(b);
-        ++chdr;
+        first_file[i] = nfiles;
+        nfiles += chdr[i].nfiles;
     }
-    assert(it == cs->files_.end());
+    assert(nfiles == hdr_->nfiles);
+    content_chunks_.resize(hdr_->ncontent);
+    parallel_for(hdr_->ncontent, FLAGS_threads, [&](int i) {
+            load_content(cs, &chdr[i], first_file[i], &content_chunks_[i]);
+        });
+
+    if (FLAGS_warmup || FLAGS_mlock)
+        warmup();
 
     cs->finalized_ = true;
 }
 
+/*
+ * Chunks are mapped MADV_RANDOM, so without this the first queries
+ * after a load take a page fault for nearly every suffix they touch.
+ */
+void load_allocator::warmup() {
+    timer tm;
+    auto warm = [&](int i) {
+        chunk *c = chunks_[i];
+        prefault(c->data, c->size);
+        prefault(c->suffixes, c->suffix_bytes());
+        if (c->folded)
+            prefault(c->folded, c->suffix_bytes());
+        // Pages that were already in the page cache, wherever they
+        // were read in, are moved to the chunk's node.
+        if (FLAGS_numa)
+            place_chunk(c, home_node(c), c->size, c->suffix_bytes(), true);
+    };
+    int nodes = numa_nodes();
+    if (FLAGS_numa && nodes > 1) {
+        // Each node's chunks are faulted in from threads running on
+        // that node, so that pages read from disk land there.
+        int per_node = std::max(1, FLAGS_threads / nodes);
+        vector<std::thread> threads;
+        for (int node = 0; node < nodes; node++) {
+            for (int t = 0; t < per_node; t++) {
+                threads.emplace_back([&, node, t] {
+                        numa_pin_thread(node);
+                        for (size_t i = node + t * nodes; i < chunks_.size();
+                             i += per_node * nodes)
+                            warm(i);
+                    });
+            }
+        }
+        for (auto &t : threads)
+            t.join();
+    } else {
+        parallel_for(chunks_.size(), FLAGS_threads, warm);
+    }
+    fprintf(stderr, "warmed %ldMB of index (%ldMB locked) in %ldms\n",
+        warm_bytes_.load() >> 20, locked_bytes_.load() >> 20,
+        timeval_ms(tm.elapsed()));
+}
+
+void load_allocator::prefault(void *p, size_t len) {
+    uint8_t *start = reinterpret_cast<uint8_t*>
+        (uintptr_t(p) & ~uintptr_t(kPageSize - 1));
+    len += static_cast<uint8_t*>(p) - start;
+    if (len == 0)
+        return;
+
+    // mlock() faults the range in itself.
+    if (FLAGS_mlock && mlock(start, len) == 0) {
+        locked_bytes_ += len;
+        idx_locked_bytes.inc(len);
+    } else {
+        if (FLAGS_mlock)
+            fprintf(stderr, "WARN: mlock: %s\n", strerror(errno));
+        madvise(start, len, MADV_WILLNEED);
+        for (size_t off = 0; off < len; off += kPageSize)
+            *static_cast<volatile uint8_t*>(start + off);
+    }
+    warm_bytes_ += len;
+    idx_warm_bytes.inc(len);
+}
+
 void code_searcher::dump_index(const string &path) {
     codesearch_index idx(this, path);
     idx.dump();
 }
 
 void code_searcher::load_index(const string &path) {
+    load_one(path);
+    index_paths();
+}
+
+void code_searcher::load_one(const string &path) {
     load_allocator *alloc = new load_allocator(this, path);
     set_alloc(alloc);
     alloc->load(this);
 }
+
+vector<string> split_index_paths(const string& spec) {
+    vector<string> out;
+    size_t start = 0;
+    while (true) {
+        size_t comma = spec.find(',', start);
+        out.push_back(spec.substr(start, comma - start));
+        if (comma == string::npos)
+            break;
+        start = comma + 1;
+    }
+    return out;
+}
+
+namespace {
+
+/*
+ * Reads the metadata of a mapped index file, failing rather than
+ * reading past its end.
+ */
+class index_checker {
+public:
+    index_checker(const uint8_t *map, uint64_t size, const string& path)
+        : map_(map), size_(size), path_(path) {}
+
+    bool fits(uint64_t off, uint64_t len, const char *what, string *err) const {
+        if (off <= size_ && len <= size_ - off)
+            return true;
+        *err = path_ + ": " + what + " at " + std::to_string(off) +
+            " runs past the end of the file (" + std::to_string(size_) +
+            " bytes); is it truncated?";
+        return false;
+    }
+
+    template <class T>
+    const T *at(uint64_t off) const {
+        return reinterpret_cast<const T*>(map_ + off);
+    }
+
+    // Skip `n' strings from `*off', as load_string() reads them.
+    bool strings(uint64_t *off, uint64_t n, const char *what, string *err) const {
+        for (uint64_t i = 0; i < n; i++) {
+            if (!fits(*off, sizeof(uint32_t), what, err))
+                return false;
+            uint32_t len = *at<uint32_t>(*off);
+            *off += sizeof(uint32_t);
+            if (!fits(*off, len, what, err))
+                return false;
+            *off += len;
+        }
+        return true;
+    }
+
+private:
+    const uint8_t *map_;
+    uint64_t size_;
+    string path_;
+};
+
+bool check_index_map(const uint8_t *map, uint64_t size, const string& path,
+                     string *err) {
+    index_checker c(map, size, path);
+    if (size < sizeof(index_header) ||
+        c.at<index_header>(0)->magic != kIndexMagic) {
+        *err = path + ": not an index file";
+        return false;
+    }
+    const index_header &hdr = *c.at<index_header>(0);
+    if (hdr.version != kIndexVersion) {
+        *err = path + ": index version " + std::to_string(hdr.version) +
+            ", expected " + std::to_string(kIndexVersion);
+        return false;
+    }
+
+    uint64_t off = hdr.name_off;
+    if (!c.strings(&off, 1, "the name", err))
+        return false;
+    off = hdr.refs_off;
+    if (!c.strings(&off, 3 * uint64_t(hdr.ntrees), "the trees", err))
+        return false;
+    off = hdr.tombstones_off;
+    if (!c.strings(&off, 3 * uint64_t(hdr.ntombstones), "the tombstones", err))
+        return false;
+    off = hdr.paths_off;
+    if (!c.strings(&off, hdr.npaths, "the paths", err))
+        return false;
+    if (!c.fits(hdr.corpus_off, sizeof(corpus_stats), "the corpus stats", err))
+        return false;
+
+    if (!c.fits(hdr.files_off, 2 * sizeof(uint32_t) * uint64_t(hdr.nfiles),
+                "the files", err))
+        return false;
+    const uint32_t *files = c.at<uint32_t>(hdr.files_off);
+    for (uint32_t i = 0; i < hdr.nfiles; i++) {
+        if (files[2 * i] >= hdr.ntrees || files[2 * i + 1] >= hdr.npaths) {
+            *err = path + ": file " + std::to_string(i) + " is out of range";
+            return false;
+        }
+    }
+
+    if (hdr.chunks_off == 0 ||
+        !c.fits(hdr.chunks_off, sizeof(chunk_header) * uint64_t(hdr.nchunks),
+                "the chunk headers", err))
+        return false;
+    for (uint32_t i = 0; i < hdr.nchunks; i++) {
+        const chunk_header &ch = c.at<chunk_header>(hdr.chunks_off)[i];
+        uint64_t files_len =
+            uint64_t(ch.nfiles) * (sizeof(chunk_file_range) + sizeof(chunk_file_node)) +
+            uint64_t(ch.nfile_ids) * sizeof(uint32_t);
+        if (ch.size > hdr.chunk_size) {
+            *err = path + ": chunk " + std::to_string(i) + " is too big";
+            return false;
+        }
+        if (!c.fits(ch.data_off, chunk_stride(hdr), "a chunk", err) ||
+            !c.fits(ch.files_off, files_len, "a chunk's files", err) ||
+            !c.fits(ch.trees_off, sizeof(uint32_t) * uint64_t(ch.ntrees),
+                    "a chunk's trees", err))
+            return false;
+        const uint32_t *trees = c.at<uint32_t>(ch.trees_off);
+        for (uint32_t t = 0; t < ch.ntrees; t++) {
+            if (trees[t] >= hdr.ntrees) {
+                *err = path + ": chunk " + std::to_string(i) + " has a bad tree";
+                return false;
+            }
+        }
+    }
+
+    if (!c.fits(hdr.content_off, sizeof(content_chunk_header) * uint64_t(hdr.ncontent),
+                "the content headers", err))
+        return false;
+    uint64_t nfiles = 0;
+    for (uint32_t i = 0; i < hdr.ncontent; i++) {
+        const content_chunk_header &ch = c.at<content_chunk_header>(hdr.content_off)[i];
+        if (!c.fits(ch.file_off, ch.size, "a file's contents", err))
+            return false;
+        uint64_t p = ch.file_off, end = ch.file_off + ch.size;
+        for (uint32_t f = 0; f < ch.nfiles; f++) {
+            if (!c.fits(p, sizeof(file_contents), "a file's contents", err))
+                return false;
+            p += c.at<file_contents>(p)->footprint();
+            if (p > end) {
+                *err = path + ": content chunk " + std::to_string(i) + " overflows";
+                return false;
+            }
+        }
+        if (p != end) {
+            *err = path + ": content chunk " + std::to_string(i) + " has a bad size";
+            return false;
+        }
+        nfiles += ch.nfiles;
+    }
+    if (nfiles != hdr.nfiles) {
+        *err = path + ": the contents are of " + std::to_string(nfiles) +
+            " files, not " + std::to_string(hdr.nfiles);
+        return false;
+    }
+    return true;
+}
+
+};
+
+bool check_index_file(const string& path, string *err) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        *err = path + ": " + strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        *err = path + ": " + strerror(errno);
+        close(fd);
+        return false;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        *err = path + ": not an index file";
+        return false;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        *err = path + ": " + strerror(errno);
+        return false;
+    }
+    bool ok = check_index_map(static_cast<const uint8_t*>(map), st.st_size, path, err);
+    munmap(map, st.st_size);
+    return ok;
+}
+
+static string shadow_key(const string& tree, const string& version,
+                         StringPiece path) {
+    string key = tree;
+    key += '\0';
+    key += version;
+    key += '\0';
+    key.append(path.data(), path.size());
+    return key;
+}
+
+void code_searcher::load_segments(const vector<string>& paths) {
+    assert(!paths.empty());
+    if (paths.size() == 1) {
+        load_index(paths[0]);
+        return;
+    }
+    assert(!finalized_);
+    assert(!alloc_);
+
+    segment_allocator *alloc = new segment_allocator;
+    for (auto it = paths.begin(); it != paths.end(); ++it) {
+        code_searcher *seg = new code_searcher;
+        seg->load_one(*it);
+        uint32_t base = files_.size();
+        for (auto c = seg->alloc_->begin(); c != seg->alloc_->end(); ++c)
+            (*c)->file_base = base;
+        for (auto f = seg->files_.begin(); f != seg->files_.end(); ++f) {
+            (*f)->no += base;
+            files_.push_back(*f);
+        }
+        trees_.insert(trees_.end(), seg->trees_.begin(), seg->trees_.end());
+        alloc->add(seg->alloc_);
+        segment_files_.push_back(base);
+        segments_.push_back(seg);
+    }
+    set_alloc(alloc);
+    name_ = segments_.back()->name_;
+
+    // Walk back from the newest segment, collecting what each one
+    // hides from those before it.
+    std::unordered_set<string> hidden;
+    bool any = false;
+    shadowed_.assign(files_.size(), false);
+    for (size_t s = segments_.size(); s-- > 0;) {
+        code_searcher *seg = segments_[s];
+        if (!hidden.empty()) {
+            for (auto f = seg->files_.begin(); f != seg->files_.end(); ++f) {
+                const indexed_tree *tree = (*f)->tree;
+                if (hidden.count(shadow_key(tree->name, tree->version, (*f)->path)) ||
+                    hidden.count(shadow_key(tree->name, tree->version, ""))) {
+                    shadowed_[(*f)->no] = true;
+                    any = true;
+                }
+            }
+        }
+        if (s == 0)
+            break;
+        for (auto f = seg->files_.begin(); f != seg->files_.end(); ++f)
+            hidden.insert(shadow_key((*f)->tree->name, (*f)->tree->version,
+                                     (*f)->path));
+        for (auto t = seg->tombstones_.begin(); t != seg->tombstones_.end(); ++t)
+            hidden.insert(shadow_key(t->tree, t->version, t->path));
+    }
+    if (!any)
+        shadowed_.clear();
+
+    finalized_ = true;
+    index_paths();
+}
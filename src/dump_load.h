@@ -11,39 +11,69 @@
 #include <stdint.h>
 
 const uint32_t kIndexMagic   = 0xc0d35eac;
-const uint32_t kIndexVersion = 13;
+const uint32_t kIndexVersion = 24;
 const uint32_t kPageSize     = (1 << 12);
 
+enum {
+    // Each chunk's data and suffix array are followed by a folded
+    // suffix array; see chunk::folded.
+    kIndexFolded = 0x01
+};
+
 struct index_header {
     uint32_t magic;
     uint32_t version;
     uint32_t chunk_size;
+    // kIndex* flags
+    uint32_t flags;
 
     uint64_t name_off;
 
     uint32_t ntrees;
     uint64_t refs_off;
 
+    // Each file is a tree id and the id of its path, among the
+    // npaths distinct path strings at paths_off.
     uint32_t nfiles;
     uint64_t files_off;
 
+    uint32_t npaths;
+    uint64_t paths_off;
+
     uint32_t nchunks;
     uint64_t chunks_off;
 
     uint32_t ncontent;
     uint64_t content_off;
+
+    // tree name, tree version and path strings of each tombstone
+    uint32_t ntombstones;
+    uint64_t tombstones_off;
+
+    // a corpus_stats
+    uint64_t corpus_off;
 } __attribute__((packed));
 
 struct chunk_header {
     uint64_t data_off;
+    // chunk_file_range[nfiles], uint32_t file ids[nfile_ids], then
+    // chunk_file_node[nfiles]
     uint64_t files_off;
     uint32_t size;
     uint32_t nfiles;
+    uint32_t nfile_ids;
+    // ids of the trees with files in this chunk
+    uint64_t trees_off;
+    uint32_t ntrees;
+    // bits per suffix array entry; see chunk::suffix()
+    uint32_t suffix_bits;
 } __attribute__((packed));
 
 struct content_chunk_header {
     uint64_t file_off;
     uint32_t size;
+    // the number of files whose contents are in this chunk
+    uint32_t nfiles;
 } __attribute__((packed));
 
 #endif
@@ -2,18 +2,152 @@
 #include <gflags/gflags.h>
 #include <sstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
 
-#include "src/lib/recursion.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "src/lib/parallel.h"
 
 #include "src/codesearch.h"
 #include "src/fs_indexer.h"
 #include <boost/filesystem.hpp>
 
+DEFINE_int32(fs_threads, 4, "Threads to list directories and read files with while indexing a path.");
+DEFINE_int64(max_file_size, 0, "Skip files on disk larger than this many bytes (0 = no limit).");
+DEFINE_int32(fs_read_ahead_mb, 256, "Read at most this many MB of files ahead of the one being indexed.");
+
 static int kMaxRecursion = 100;
+// Files with a NUL in this many leading bytes are skipped as binary
+// without being read any further.
+static const size_t kBinaryCheckBytes = 8192;
+// How many files the readers may get ahead of index_file(), whatever
+// their size; --fs_read_ahead_mb bounds their bytes.
+static const size_t kReadWindow = 256;
 
 using namespace std;
 namespace fs = boost::filesystem;
 
+namespace {
+    // A directory found by the walk, and what it holds in directory
+    // order: files by path, and subdirectories by index into the
+    // walk's list of directories.
+    struct fs_dir {
+        string path;
+        int depth;
+        vector<pair<string, int> > entries;
+    };
+
+    struct unmapper {
+        size_t len;
+        void operator()(char *p) const {
+            munmap(p, len);
+        }
+    };
+
+    /*
+     * The bytes of file read but not yet indexed. A reader waits in
+     * acquire() until they would stay within the limit, except for
+     * the file to be indexed next, which nothing else can be waiting
+     * on and so always goes ahead.
+     */
+    class read_budget {
+    public:
+        read_budget(size_t limit) : limit_(limit), used_(0), next_(0) {}
+
+        void acquire(size_t i, size_t bytes) {
+            std::unique_lock<std::mutex> lk(mtx_);
+            cond_.wait(lk, [&] { return i == next_ || used_ + bytes <= limit_; });
+            used_ += bytes;
+        }
+
+        // File `i', holding `bytes', has been indexed.
+        void release(size_t i, size_t bytes) {
+            std::unique_lock<std::mutex> lk(mtx_);
+            used_ -= bytes;
+            next_ = i + 1;
+            cond_.notify_all();
+        }
+    private:
+        std::mutex mtx_;
+        std::condition_variable cond_;
+        size_t limit_;
+        size_t used_;
+        size_t next_;
+    };
+
+    // A file's contents, mapped or (if small) read, ready to index.
+    struct fs_contents {
+        bool skip = true;
+        // what this file holds of the read_budget
+        size_t bytes = 0;
+        string data;
+        std::unique_ptr<char, unmapper> map;
+
+        StringPiece piece() const {
+            if (map)
+                return StringPiece(map.get(), map.get_deleter().len);
+            return data;
+        }
+    };
+
+    void list_dir(fs_dir *dir, vector<pair<string, bool> > *out) {
+        for (fs::directory_iterator itr(dir->path), end_itr;
+             itr != end_itr; ++itr) {
+            if (fs::is_directory(itr->status()))
+                out->push_back(make_pair(itr->path().string(), true));
+            else if (fs::is_regular_file(itr->status()))
+                out->push_back(make_pair(itr->path().string(), false));
+        }
+    }
+
+    void read_contents(read_budget *budget, size_t i,
+                       const string& path, fs_contents *out) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            fprintf(stderr, "WARN: %s: %s\n", path.c_str(), strerror(errno));
+            return;
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0 ||
+            (FLAGS_max_file_size > 0 && st.st_size > FLAGS_max_file_size)) {
+            close(fd);
+            return;
+        }
+        size_t len = st.st_size;
+        out->data.resize(min(len, kBinaryCheckBytes));
+        ssize_t n = pread(fd, &out->data[0], out->data.size(), 0);
+        if (n < 0 || size_t(n) != out->data.size() ||
+            memchr(out->data.data(), 0, out->data.size()) != NULL) {
+            close(fd);
+            return;
+        }
+        out->skip = false;
+        if (len > kBinaryCheckBytes) {
+            budget->acquire(i, len);
+            out->bytes = len;
+            // Fault the whole file in here rather than on the thread
+            // indexing it.
+            void *p = mmap(NULL, len, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+            if (p == MAP_FAILED) {
+                fprintf(stderr, "WARN: mmap %s: %s\n", path.c_str(), strerror(errno));
+                out->skip = true;
+            } else {
+                out->map = std::unique_ptr<char, unmapper>(static_cast<char*>(p),
+                                                           unmapper{len});
+            }
+            out->data.clear();
+        }
+        close(fd);
+    }
+}
+
 fs_indexer::fs_indexer(code_searcher *cs,
                        const string& repopath,
                        const string& name,
@@ -25,31 +159,80 @@ fs_indexer::fs_indexer(code_searcher *cs,
 fs_indexer::~fs_indexer() {
 }
 
-void fs_indexer::read_file(const string& path) {
-    ifstream in(path.c_str(), ios::in);
-    string relpath(mismatch(path.begin(), path.end(), repopath_.begin()).first,
-                   path.end());
-    cs_->index_file(tree_, relpath, StringPiece(static_cast<stringstream const&>(stringstream() << in.rdbuf()).str().c_str(), fs::file_size(path)));
+/*
+ * List the tree under `path' one level at a time, each level's
+ * directories in parallel, then flatten it depth-first so files are
+ * indexed in the same order a serial walk would find them.
+ */
+void fs_indexer::list_files(const string& path, vector<string> *files) {
+    vector<fs_dir> dirs(1);
+    dirs[0].path = path;
+    dirs[0].depth = 1;
+    for (size_t level = 0; level < dirs.size();) {
+        size_t end = dirs.size();
+        vector<vector<pair<string, bool> > > found(end - level);
+        parallel_for(end - level, FLAGS_fs_threads, [&](int i) {
+                list_dir(&dirs[level + i], &found[i]);
+            });
+        for (size_t i = level; i < end; i++) {
+            for (auto it = found[i - level].begin(); it != found[i - level].end(); ++it) {
+                if (!it->second) {
+                    dirs[i].entries.push_back(make_pair(it->first, -1));
+                } else if (dirs[i].depth < kMaxRecursion) {
+                    dirs[i].entries.push_back(make_pair(string(), int(dirs.size())));
+                    dirs.push_back(fs_dir());
+                    dirs.back().path = it->first;
+                    dirs.back().depth = dirs[i].depth + 1;
+                }
+            }
+        }
+        level = end;
+    }
+
+    vector<pair<int, size_t> > stack;
+    stack.push_back(make_pair(0, 0));
+    while (!stack.empty()) {
+        fs_dir &dir = dirs[stack.back().first];
+        size_t i = stack.back().second++;
+        if (i == dir.entries.size()) {
+            stack.pop_back();
+        } else if (dir.entries[i].second < 0) {
+            files->push_back(dir.entries[i].first);
+        } else {
+            stack.push_back(make_pair(dir.entries[i].second, 0));
+        }
+    }
+}
+
+/*
+ * Index `files' in order, reading up to kReadWindow of them, and
+ * --fs_read_ahead_mb of their contents, ahead on --fs_threads
+ * threads.
+ */
+void fs_indexer::index_files(const vector<string>& files) {
+    read_budget budget(size_t(max(FLAGS_fs_read_ahead_mb, 0)) << 20);
+    ordered_pipeline<fs_contents>(
+        files.size(), FLAGS_fs_threads, kReadWindow,
+        [&](int t, size_t i, fs_contents *out) {
+            read_contents(&budget, i, files[i], out);
+        },
+        [&](size_t i, const fs_contents &contents) {
+            if (!contents.skip) {
+                const string &path = files[i];
+                string relpath(mismatch(path.begin(), path.end(), repopath_.begin()).first,
+                               path.end());
+                cs_->index_file(tree_, relpath, contents.piece());
+            }
+            budget.release(i, contents.bytes);
+        });
 }
 
 void fs_indexer::walk(const string& path) {
-    static int recursion_depth = 0;
-    RecursionCounter guard(recursion_depth);
-    if (recursion_depth > kMaxRecursion)
-        return;
     if (!fs::exists(path)) return;
-    fs::directory_iterator end_itr;
-    if (fs::is_directory(path)) {
-        for (fs::directory_iterator itr(path);
-                itr != end_itr;
-                ++itr) {
-            if (fs::is_directory(itr->status()) ) {
-                fs_indexer::walk(itr->path().c_str());
-            } else if (fs::is_regular_file(itr->status()) ) {
-                fs_indexer::read_file(itr->path().c_str());
-            }
-        }
-    } else if (fs::is_regular_file(path)) {
-        fs_indexer::read_file(path);
-    }
+    vector<string> files;
+    if (fs::is_directory(path))
+        list_files(path, &files);
+    else if (fs::is_regular_file(path))
+        files.push_back(path);
+    index_files(files);
 }
@@ -9,6 +9,7 @@
 #define CODESEARCH_FS_INDEXER_H
 
 #include <string>
+#include <vector>
 
 class code_searcher;
 struct indexed_tree;
@@ -20,9 +21,11 @@ public:
                const string& name,
                json_object *metadata = 0);
     ~fs_indexer();
-    void read_file(const std::string& path);
     void walk(const std::string& path);
 protected:
+    void list_files(const std::string& path, std::vector<std::string> *files);
+    void index_files(const std::vector<std::string>& files);
+
     code_searcher *cs_;
     std::string repopath_;
     std::string name_;
@@ -1,8 +1,10 @@
 #include <gflags/gflags.h>
 #include <sstream>
+#include <set>
 
 #include "src/lib/metrics.h"
 #include "src/lib/debug.h"
+#include "src/lib/parallel.h"
 
 #include "src/codesearch.h"
 #include "src/git_indexer.h"
@@ -16,12 +18,70 @@ using namespace std;
 
 DEFINE_string(order_root, "", "Walk top-level directories in this order.");
 DEFINE_bool(revparse, false, "Display parsed revisions, rather than as-provided");
+DEFINE_int32(git_threads, 1, "Threads to read and inflate git blobs with while indexing (1 = read each on the indexing thread).");
+
+// A blob found by walk_tree(), waiting to be read and indexed.
+struct pending_blob {
+    string path;
+    git_oid oid;
+    // Whether an earlier file had the same blob, so this one is just
+    // a copy of it and there is nothing to read.
+    bool copy;
+    // The same file in the base index, if it is unchanged there.
+    const indexed_file *base;
+};
+
+static string blob_key(const git_oid &oid) {
+    return string(reinterpret_cast<const char*>(oid.id), GIT_OID_RAWSZ);
+}
+
+// How many blobs the readers may get ahead of index_file().
+const size_t kBlobWindow = 256;
+
+/*
+ * A blob looked up by one of index_blobs()'s readers, held until it
+ * has been indexed so that index_file() reads its contents straight
+ * from libgit2's inflated copy. Unlike smart_object, it can be moved
+ * through the ordered_pipeline.
+ */
+class loaded_blob {
+public:
+    loaded_blob() : blob_(0) {}
+    loaded_blob(loaded_blob &&rhs) : blob_(rhs.blob_) {
+        rhs.blob_ = 0;
+    }
+    loaded_blob &operator=(loaded_blob &&rhs) {
+        std::swap(blob_, rhs.blob_);
+        return *this;
+    }
+    ~loaded_blob() {
+        if (blob_)
+            git_blob_free(blob_);
+    }
+
+    void load(git_repository *repo, const git_oid *oid) {
+        if (git_blob_lookup(&blob_, repo, oid) < 0)
+            die("git_blob_lookup: %s", giterr_last()->message);
+    }
+
+    StringPiece data() const {
+        if (!blob_)
+            return StringPiece();
+        return StringPiece(static_cast<const char*>(git_blob_rawcontent(blob_)),
+                           git_blob_rawsize(blob_));
+    }
+private:
+    loaded_blob(const loaded_blob &);
+    git_blob *blob_;
+};
 
 git_indexer::git_indexer(code_searcher *cs,
                          const string& repopath,
                          const string& name,
-                         json_object *metadata)
-    : cs_(cs), repo_(0), name_(name), metadata_(metadata) {
+                         json_object *metadata,
+                         git_blob_map *indexed)
+    : cs_(cs), repopath_(repopath), repo_(0), name_(name), metadata_(metadata),
+      indexed_(indexed ? indexed : &own_indexed_), base_(0), delta_(false) {
     int err;
     if ((err = git_libgit2_init()) < 0)
         die("git_libgit2_init: %s", giterr_last()->message);
@@ -51,12 +111,124 @@ void git_indexer::walk(const string& ref) {
         strdup(git_oid_tostr(oidstr, sizeof(oidstr), git_commit_id(commit))) : ref;
 
     idx_tree_ = cs_->open_tree(name_, metadata_, version);
-    walk_tree("", FLAGS_order_root, tree);
+    unchanged_.clear();
+    if (base_)
+        find_unchanged(tree);
+    vector<pending_blob> blobs;
+    walk_tree("", FLAGS_order_root, tree, &blobs);
+    index_blobs(blobs);
+}
+
+/*
+ * Find the files of base_ that `tree' has unchanged: those of its
+ * tree of the same name that git diff shows no change to. Only trees
+ * whose version is a commit id (see --revparse) can be diffed; if
+ * there are several, the closest one not already compared against is
+ * used. With delta_, the files that did change are tombstoned.
+ */
+void git_indexer::find_unchanged(git_tree *tree) {
+    std::set<const indexed_tree*> seen;
+    const indexed_tree *best = NULL;
+    std::set<string> best_changed;
+    size_t best_deltas = 0;
+    for (auto it = base_->begin_files(); it != base_->end_files(); ++it) {
+        const indexed_tree *old = (*it)->tree;
+        if (old->name != name_ || base_trees_.count(old) ||
+            !seen.insert(old).second)
+            continue;
+        git_oid oid;
+        if (old->version.size() != GIT_OID_HEXSZ ||
+            git_oid_fromstr(&oid, old->version.c_str()) < 0)
+            continue;
+        smart_object<git_commit> commit;
+        smart_object<git_tree> old_tree;
+        if (git_commit_lookup(commit, repo_, &oid) < 0)
+            continue;
+        git_commit_tree(old_tree, commit);
+
+        git_diff *diff;
+        if (git_diff_tree_to_tree(&diff, repo_, old_tree, tree, NULL) < 0)
+            die("git_diff_tree_to_tree: %s", giterr_last()->message);
+        size_t ndeltas = git_diff_num_deltas(diff);
+        if (best == NULL || ndeltas < best_deltas) {
+            best = old;
+            best_deltas = ndeltas;
+            best_changed.clear();
+            for (size_t i = 0; i < ndeltas; i++) {
+                const git_diff_delta *delta = git_diff_get_delta(diff, i);
+                best_changed.insert(delta->old_file.path);
+                best_changed.insert(delta->new_file.path);
+            }
+        }
+        git_diff_free(diff);
+    }
+    if (best == NULL)
+        return;
+
+    base_trees_.insert(best);
+    for (auto it = base_->begin_files(); it != base_->end_files(); ++it) {
+        if ((*it)->tree != best)
+            continue;
+        string path = (*it)->path.as_string();
+        if (best_changed.find(path) == best_changed.end())
+            unchanged_[path] = *it;
+        else if (delta_)
+            cs_->add_tombstone(best->name, best->version, path);
+    }
+}
+
+void git_indexer::index_blob(const pending_blob &blob, const loaded_blob &data) {
+    if (blob.copy) {
+        indexed_file *orig = indexed_->at(blob_key(blob.oid));
+        if (orig)
+            cs_->index_copy(idx_tree_, blob.path, orig);
+        return;
+    }
+    indexed_file *sf;
+    if (blob.base)
+        sf = cs_->index_copy(idx_tree_, blob.path, blob.base);
+    else
+        sf = cs_->index_file(idx_tree_, blob.path, data.data());
+    (*indexed_)[blob_key(blob.oid)] = sf;
+}
+
+/*
+ * Index `blobs' in order. With --git_threads > 1, reader threads, each
+ * with its own git_repository, look up and inflate blobs up to
+ * kBlobWindow ahead of this thread, the only one that may call
+ * index_file().
+ */
+void git_indexer::index_blobs(const vector<pending_blob> &blobs) {
+    int nthreads = max(1, FLAGS_git_threads);
+    vector<git_repository*> repos(nthreads, repo_);
+    if (nthreads > 1) {
+        for (auto it = repos.begin(); it != repos.end(); ++it) {
+            *it = NULL;
+            if (git_repository_open(&*it, repopath_.c_str()) < 0)
+                die("git_repository_open: %s", giterr_last()->message);
+        }
+    }
+
+    ordered_pipeline<loaded_blob>(
+        blobs.size(), nthreads, kBlobWindow,
+        [&](int t, size_t i, loaded_blob *data) {
+            if (!blobs[i].copy && !blobs[i].base)
+                data->load(repos[t], &blobs[i].oid);
+        },
+        [&](size_t i, const loaded_blob &data) {
+            index_blob(blobs[i], data);
+        });
+
+    if (nthreads > 1) {
+        for (auto it = repos.begin(); it != repos.end(); ++it)
+            git_repository_free(*it);
+    }
 }
 
 void git_indexer::walk_tree(const string& pfx,
                             const string& order,
-                            git_tree *tree) {
+                            git_tree *tree,
+                            vector<pending_blob> *blobs) {
     metric::timer tm_walk(git_walk);
     map<string, const git_tree_entry *> root;
     vector<const git_tree_entry *> ordered;
@@ -80,17 +252,24 @@ void git_indexer::walk_tree(const string& pfx,
         ordered.push_back(it->second);
     for (vector<const git_tree_entry *>::iterator it = ordered.begin();
          it != ordered.end(); ++it) {
-        smart_object<git_object> obj;
-        git_tree_entry_to_object(obj, repo_, *it);
         string path = pfx + git_tree_entry_name(*it);
-        tm_walk.pause();
 
         if (git_tree_entry_type(*it) == GIT_OBJ_TREE) {
-            walk_tree(path + "/", "", obj);
+            smart_object<git_object> obj;
+            git_tree_entry_to_object(obj, repo_, *it);
+            tm_walk.pause();
+            walk_tree(path + "/", "", obj, blobs);
+            tm_walk.start();
         } else if (git_tree_entry_type(*it) == GIT_OBJ_BLOB) {
-            const char *data = static_cast<const char*>(git_blob_rawcontent(obj));
-            cs_->index_file(idx_tree_, path, StringPiece(data, git_blob_rawsize(obj)));
+            if (delta_ && unchanged_.count(path))
+                continue;
+            blobs->push_back(pending_blob());
+            blobs->back().path = path;
+            blobs->back().oid = *git_tree_entry_id(*it);
+            blobs->back().copy = !indexed_->insert(
+                make_pair(blob_key(blobs->back().oid), (indexed_file*)NULL)).second;
+            auto base = unchanged_.find(path);
+            blobs->back().base = base == unchanged_.end() ? NULL : base->second;
         }
-        tm_walk.start();
     }
 }
@@ -9,31 +9,70 @@
 #define CODESEARCH_GIT_INDEXER_H
 
 #include <string>
+#include <vector>
+#include <unordered_map>
+#include <set>
 
 class code_searcher;
 class git_repository;
 class git_tree;
 struct indexed_tree;
+struct indexed_file;
 struct json_object;
+struct pending_blob;
+class loaded_blob;
+
+// Indexed files by the raw id of the blob they were read from, or
+// NULL for blobs index_file() skipped. Git_indexers that share one
+// index every blob only once, however many revisions or repositories
+// it appears in.
+typedef std::unordered_map<std::string, indexed_file*> git_blob_map;
 
 class git_indexer {
 public:
     git_indexer(code_searcher *cs,
                 const std::string& repopath,
                 const std::string& name,
-                json_object *metadata = 0);
+                json_object *metadata = 0,
+                git_blob_map *indexed = 0);
     ~git_indexer();
+    // Carry files over from `base', a loaded index whose chunks were
+    // copied into this one with code_searcher::copy_chunks(), rather
+    // than reading them again, wherever git shows them unchanged. If
+    // `delta', leave unchanged files out altogether instead, and
+    // tombstone the files of `base' that changed, so that this index
+    // can be loaded as a segment after it.
+    void set_base(code_searcher *base, bool delta = false) {
+        base_ = base;
+        delta_ = delta;
+    }
+    // The trees of the base index that walk() compared against.
+    const std::set<const indexed_tree*>& base_trees() const {
+        return base_trees_;
+    }
     void walk(const std::string& ref);
 protected:
+    void find_unchanged(git_tree *tree);
     void walk_tree(const std::string& pfx,
                    const std::string& order,
-                   git_tree *tree);
+                   git_tree *tree,
+                   std::vector<pending_blob> *blobs);
+    void index_blobs(const std::vector<pending_blob> &blobs);
+    void index_blob(const pending_blob &blob, const loaded_blob &data);
 
     code_searcher *cs_;
+    std::string repopath_;
     git_repository *repo_;
     const indexed_tree *idx_tree_;
     std::string name_;
     json_object *metadata_;
+    git_blob_map own_indexed_;
+    git_blob_map *indexed_;
+    code_searcher *base_;
+    bool delta_;
+    std::set<const indexed_tree*> base_trees_;
+    // Files of base_ unchanged in the tree being walked, by path.
+    std::unordered_map<std::string, const indexed_file*> unchanged_;
 };
 
 #endif
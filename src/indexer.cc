@@ -9,11 +9,13 @@
 #include "src/lib/debug.h"
 
 #include "src/indexer.h"
+#include "src/chunk.h"
 
 #include <gflags/gflags.h>
 
 #include <list>
 #include <limits>
+#include <map>
 
 #include <stdarg.h>
 
@@ -24,9 +26,36 @@ const unsigned kMinWeight = 16;
 const int kMaxWidth       = 32;
 const int kMaxRecursion   = 10;
 const int kMaxNodes       = (1 << 24);
+// The most (key, previous byte) pairs IndexKey::estimate() visits.
+const int kMaxEstimate    = (1 << 16);
 
 namespace {
     static IndexKey::Stats null_stats;
+
+    // The corpus the key being built by indexRE() on this thread is
+    // for, if any.
+    thread_local const corpus_stats *planning_corpus;
+    // Whether that key is for a folded suffix order.
+    thread_local bool planning_folded;
+
+    // Whether `c' stands for its upper case too, in a folded key.
+    inline bool folds(int c) {
+        return c >= 'a' && c <= 'z';
+    }
+
+    // The fraction of corpus bytes in [lo, hi] -- counting upper-case
+    // letters as lower case, if `fold' -- smoothed so that no byte is
+    // ever impossible.
+    double byte_frequency(const corpus_stats &corpus, uchar lo, uchar hi,
+                          bool fold) {
+        uint64_t n = 0;
+        for (int c = lo; c <= hi; c++) {
+            n += corpus.bytes[c];
+            if (fold && folds(c))
+                n += corpus.bytes[c - 'a' + 'A'];
+        }
+        return double(n + (hi - lo + 1)) / (corpus.total + 256);
+    }
 };
 
 IndexKey::Stats::Stats ()
@@ -42,11 +71,16 @@ IndexKey::Stats IndexKey::Stats::insert(const value_type& val) const {
 
     const Stats& rstats = val.second ? val.second->stats() : null_stats;
 
-    // There are 100 printable ASCII characters. As a zeroth-order
-    // approximation, assume our corpus is random strings of printable
-    // ASCII characters.  The exact computation of selectivity turn
-    // out not to matter all that much in most cases.
-    out.selectivity_ += (val.first.second - val.first.first + 1)/100. * rstats.selectivity_;
+    // Without a corpus to go by: there are 100 printable ASCII
+    // characters. As a zeroth-order approximation, assume our corpus
+    // is random strings of printable ASCII characters.  The exact
+    // computation of selectivity turn out not to matter all that much
+    // in most cases.
+    double p = planning_corpus ?
+        byte_frequency(*planning_corpus, val.first.first, val.first.second,
+                       planning_folded) :
+        (val.first.second - val.first.first + 1)/100.;
+    out.selectivity_ += p * rstats.selectivity_;
     out.depth_ = max(depth_, rstats.depth_ + 1);
     out.nodes_ += (val.first.second - val.first.first + 1) * rstats.nodes_;
     if (!val.second)
@@ -83,6 +117,87 @@ double IndexKey::selectivity() {
     return stats_.selectivity_;
 }
 
+namespace {
+    class markov_estimate {
+    public:
+        markov_estimate(const corpus_stats &corpus, bool fold)
+            : corpus_(corpus), fold_(fold), visits_(0) {
+            for (int c = 0; c < 256; c++) {
+                unigram_[c] = byte_frequency(corpus, c, c, fold);
+                row_[c] = -1;
+            }
+        }
+
+        // The fraction of positions at which `key' matches, given
+        // that the byte before them is `prev' (-1 for any), or a
+        // negative number if the key is too big.
+        double selectivity(IndexKey *key, int prev) {
+            if (!key || key->empty())
+                return 1.0;
+            auto hit = memo_.find(make_pair(key, prev));
+            if (hit != memo_.end())
+                return hit->second;
+            if (++visits_ > kMaxEstimate)
+                return -1;
+            double out = 0;
+            for (auto it = key->begin(); it != key->end(); ++it) {
+                for (int c = it->first.first; c <= it->first.second; c++) {
+                    double next = selectivity(it->second.get(), c);
+                    if (next < 0)
+                        return -1;
+                    out += probability(prev, c) * next;
+                }
+            }
+            memo_[make_pair(key, prev)] = out;
+            return out;
+        }
+
+    protected:
+        // P(c | prev), smoothed towards the frequency of `c' alone.
+        double probability(int prev, int c) {
+            if (prev < 0)
+                return unigram_[c];
+            if (row_[prev] < 0) {
+                uint64_t n = 0;
+                for (int i = 0; i < 256; i++)
+                    n += pairs(prev, i);
+                row_[prev] = n;
+            }
+            uint64_t n = pairs(prev, c);
+            if (fold_ && folds(c))
+                n += pairs(prev, c - 'a' + 'A');
+            return (n + unigram_[c]) / (row_[prev] + 1);
+        }
+
+        // How often `prev' is followed by `c', with either case of
+        // `prev' if it folds.
+        uint64_t pairs(int prev, int c) {
+            uint64_t n = corpus_.pairs[prev << 8 | c];
+            if (fold_ && folds(prev))
+                n += corpus_.pairs[(prev - 'a' + 'A') << 8 | c];
+            return n;
+        }
+
+        const corpus_stats &corpus_;
+        bool fold_;
+        double unigram_[256];
+        double row_[256];
+        std::map<pair<IndexKey*, int>, double> memo_;
+        int visits_;
+    };
+};
+
+bool IndexKey::estimate(const corpus_stats &corpus, bool fold) {
+    if (empty())
+        return true;
+    markov_estimate est(corpus, fold);
+    double selectivity = est.selectivity(this, -1);
+    if (selectivity < 0)
+        return false;
+    stats_.selectivity_ = selectivity;
+    return true;
+}
+
 unsigned IndexKey::weight() {
     if (1/selectivity() > double(numeric_limits<unsigned>::max()))
         return numeric_limits<unsigned>::max() / 2;
@@ -285,6 +400,53 @@ namespace {
         return k;
     }
 
+    typedef map<intrusive_ptr<IndexKey>, intrusive_ptr<IndexKey> > fold_cache;
+
+    /*
+     * `key' for a folded suffix order: upper-case letters become lower
+     * case, and edges that then overlap are merged. No edge of a key
+     * for a folded order covers 'A' through 'Z'.
+     */
+    intrusive_ptr<IndexKey> Fold(fold_cache& cache, intrusive_ptr<IndexKey> key) {
+        if (!key || key->empty())
+            return key;
+        auto hit = cache.find(key);
+        if (hit != cache.end())
+            return hit->second;
+
+        intrusive_ptr<IndexKey> next[256];
+        bool seen[256] = {};
+        alternate_cache alternates;
+        for (IndexKey::iterator it = key->begin(); it != key->end(); ++it) {
+            intrusive_ptr<IndexKey> n = Fold(cache, it->second);
+            for (int c = it->first.first; c <= it->first.second; c++) {
+                uchar f = fold_byte(c);
+                if (!seen[f]) {
+                    seen[f] = true;
+                    next[f] = n;
+                } else if (next[f] != n) {
+                    // A null edge already matches anything after it.
+                    next[f] = (next[f] && n) ? Alternate(alternates, next[f], n) : 0;
+                }
+            }
+        }
+
+        intrusive_ptr<IndexKey> out(new IndexKey(key->anchor));
+        for (int c = 0; c < 256; ) {
+            if (!seen[c]) {
+                c++;
+                continue;
+            }
+            int end = c;
+            while (end < 255 && seen[end + 1] && next[end + 1] == next[c])
+                end++;
+            out->insert(make_pair(make_pair(uchar(c), uchar(end)), next[c]));
+            c = end + 1;
+        }
+        cache[key] = out;
+        return out;
+    }
+
     bool ShouldConcat(intrusive_ptr<IndexKey> lhs, intrusive_ptr<IndexKey> rhs) {
         assert(lhs && rhs);
         if (!(lhs->anchor & kAnchorRight) ||
@@ -512,18 +674,81 @@ namespace {
 
 };
 
-intrusive_ptr<IndexKey> indexRE(const re2::RE2 &re) {
+intrusive_ptr<IndexKey> indexRE(const re2::RE2 &re, const corpus_stats *corpus,
+                                bool fold) {
     IndexWalker walk;
 
+    if (corpus && corpus->total == 0)
+        corpus = 0;
+    planning_corpus = corpus;
+    planning_folded = fold;
     Regexp *sre = re.Regexp()->Simplify();
     intrusive_ptr<IndexKey> key = walk.WalkExponential(sre, 0, 10000);
     sre->Decref();
+    planning_corpus = 0;
+    planning_folded = false;
 
+    if (key && corpus && !key->estimate(*corpus, fold))
+        debug(kDebugIndex, "indexRE: key too big to estimate\n");
     if (key && key->weight() < kMinWeight)
         key = 0;
     return key;
 }
 
+static bool literal_rune(Rune r, bool fold, vector<string> *bytes) {
+    if (r == '\n')
+        return false;
+    if (fold) {
+        // See CaseFoldLiteral above; RE2 only represents the two
+        // cases of an ASCII letter as a folded literal.
+        if (r > 127)
+            return false;
+        if ((r >= 'a' && r <= 'z') || (r >= 'A' && r <= 'Z')) {
+            char lower = r | 0x20;
+            bytes->push_back(string(1, lower - 'a' + 'A') + lower);
+            return true;
+        }
+    }
+    char buf[UTFmax];
+    int n = runetochar(buf, &r);
+    for (int i = 0; i < n; i++)
+        bytes->push_back(string(1, buf[i]));
+    return true;
+}
+
+static bool literal_bytes(Regexp *re, vector<string> *bytes) {
+    bool fold = re->parse_flags() & Regexp::FoldCase;
+    if (re->parse_flags() & Regexp::Latin1)
+        return false;
+
+    switch (re->op()) {
+    case kRegexpLiteral:
+        return literal_rune(re->rune(), fold, bytes);
+    case kRegexpLiteralString:
+        for (int i = 0; i < re->nrunes(); i++)
+            if (!literal_rune(re->runes()[i], fold, bytes))
+                return false;
+        return true;
+    case kRegexpConcat:
+        for (int i = 0; i < re->nsub(); i++)
+            if (!literal_bytes(re->sub()[i], bytes))
+                return false;
+        return true;
+    case kRegexpCapture:
+        return literal_bytes(re->sub()[0], bytes);
+    default:
+        return false;
+    }
+}
+
+bool literalRE(const re2::RE2 &re, vector<string> *bytes) {
+    bytes->clear();
+    if (literal_bytes(re.Regexp(), bytes) && !bytes->empty())
+        return true;
+    bytes->clear();
+    return false;
+}
+
 intrusive_ptr<IndexKey>
 IndexWalker::PostVisit(Regexp* re, intrusive_ptr<IndexKey> parent_arg,
                        intrusive_ptr<IndexKey> pre_arg,
@@ -607,6 +832,15 @@ IndexWalker::PostVisit(Regexp* re, intrusive_ptr<IndexKey> parent_arg,
 
     assert(key);
 
+    // Keys only ever get bytes from literals and classes, so folding
+    // those folds the whole key.
+    if (planning_folded &&
+        (re->op() == kRegexpLiteral || re->op() == kRegexpLiteralString ||
+         re->op() == kRegexpCharClass)) {
+        fold_cache cache;
+        key = Fold(cache, key);
+    }
+
     debug(kDebugIndex, "* INDEX %s ==> ", re->ToString().c_str());
     if (key)
         debug(kDebugIndex, "[weight %d, nodes %ld, depth %d]\n",
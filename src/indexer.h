@@ -25,6 +25,8 @@ using std::vector;
 using std::list;
 using boost::intrusive_ptr;
 
+struct corpus_stats;
+
 enum {
     kAnchorNone   = 0x00,
     kAnchorLeft   = 0x01,
@@ -94,12 +96,23 @@ public:
      *      selectivity() == 0.1 means that using this index key will
      *      only require searching 1/10th of the corpus.
      *
-     * This value is computed without any reference to the actual
+     * Unless indexRE() was given the corpus's byte frequencies, this
+     * value is computed without any reference to the actual
      * characteristics of any particular corpus, and so is a rough
      * approximation at best.
      */
     double selectivity();
 
+    /*
+     * Re-estimate selectivity() from the byte pair frequencies of
+     * `corpus', treating each path through the key as a chain in
+     * which every byte depends on the one before. Returns false, and
+     * leaves selectivity() alone, if the key is too big to walk.
+     * `fold' counts upper-case letters as lower case, for a key built
+     * with indexRE(..., true).
+     */
+    bool estimate(const corpus_stats &corpus, bool fold = false);
+
     /*
      * Returns a value approximating the "goodness" of this index key,
      * in arbitrary units. Higher is better. The weight incorporates
@@ -131,6 +144,24 @@ private:
     friend void intrusive_ptr_release(IndexKey *key);
 };
 
-intrusive_ptr<IndexKey> indexRE(const re2::RE2 &pat);
+/*
+ * Build an index key for `pat', or return NULL if no key would narrow
+ * the search enough to be worth using. If `corpus' is given, keys are
+ * chosen and weighed by its byte frequencies. With `fold', the key is
+ * for a folded suffix order (see chunk::folded): it matches text with
+ * its ASCII letters lower-cased, so one edge stands for both cases of
+ * a letter.
+ */
+intrusive_ptr<IndexKey> indexRE(const re2::RE2 &pat,
+                                const corpus_stats *corpus = 0,
+                                bool fold = false);
+
+/*
+ * If `pat' is a plain literal, or a literal with ASCII case folding,
+ * set `bytes' so that the strings `pat' matches are exactly those
+ * made by picking one byte from each of bytes[0], bytes[1], ... in
+ * turn, and return true. Otherwise return false.
+ */
+bool literalRE(const re2::RE2 &pat, vector<string> *bytes);
 
 #endif /* CODESEARCH_INDEXER_H */
@@ -0,0 +1,173 @@
+/********************************************************************
+ * livegrep -- admission.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_ADMISSION_H
+#define CODESEARCH_ADMISSION_H
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <stdint.h>
+
+/*
+ * A counting semaphore with a bounded, prioritized wait queue. Callers
+ * queue as one of `classes' priority classes, 0 first: a free slot
+ * always goes to the longest-waiting caller of the lowest class
+ * waiting. A caller that would make more than `max_waiting' wait, or
+ * that gives up before it is given a slot, is turned away instead.
+ * With `slots' == 0 everyone is let in at once.
+ */
+class admission_queue {
+public:
+    typedef std::chrono::steady_clock clock;
+    typedef std::function<void ()> grant_func;
+
+    admission_queue(int slots, int max_waiting, int classes)
+        : slots_(slots), max_waiting_(max_waiting), active_(0),
+          waiting_(0), next_(1), queues_(classes) {}
+
+    /*
+     * Queue for a slot without blocking. `granted' is called once the
+     * caller holds one: before this returns if one is free, or later
+     * from whichever thread leave()s. Returns a ticket for cancel(),
+     * or 0, without ever calling `granted', if the queue is full.
+     */
+    uint64_t wait(int cls, const grant_func& granted) {
+        uint64_t ticket;
+        {
+            std::lock_guard<std::mutex> guard(mtx_);
+            ticket = next_++;
+            if (slots_ > 0 && (waiting_ > 0 || active_ >= slots_)) {
+                if (waiting_ >= max_waiting_)
+                    return 0;
+                queues_[cls].push_back(waiter{ticket, granted});
+                ++waiting_;
+                return ticket;
+            }
+            ++active_;
+        }
+        granted();
+        return ticket;
+    }
+
+    /*
+     * Stop `ticket' waiting. Returns false if it has already been
+     * given its slot, in which case its `granted' has been or is about
+     * to be called and the caller must leave() as usual.
+     */
+    bool cancel(uint64_t ticket) {
+        std::lock_guard<std::mutex> guard(mtx_);
+        for (auto q = queues_.begin(); q != queues_.end(); ++q) {
+            for (auto it = q->begin(); it != q->end(); ++it) {
+                if (it->ticket == ticket) {
+                    q->erase(it);
+                    --waiting_;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    // Wait, blocking, until `deadline' at the latest. Returns false,
+    // without taking a slot, if the caller was turned away; otherwise
+    // the caller must leave() when done.
+    bool enter(int cls, clock::time_point deadline) {
+        struct grant {
+            std::mutex mtx;
+            std::condition_variable cond;
+            bool done = false;
+        };
+        std::shared_ptr<grant> g(new grant);
+        uint64_t ticket = wait(cls, [g] {
+                std::lock_guard<std::mutex> guard(g->mtx);
+                g->done = true;
+                g->cond.notify_all();
+            });
+        if (ticket == 0)
+            return false;
+        std::unique_lock<std::mutex> lock(g->mtx);
+        if (g->cond.wait_until(lock, deadline, [&] { return g->done; }))
+            return true;
+        lock.unlock();
+        if (cancel(ticket))
+            return false;
+        // Granted just as we gave up; it's ours anyway.
+        lock.lock();
+        g->cond.wait(lock, [&] { return g->done; });
+        return true;
+    }
+
+    void leave() {
+        grant_func next;
+        {
+            std::lock_guard<std::mutex> guard(mtx_);
+            for (auto q = queues_.begin(); q != queues_.end(); ++q) {
+                if (!q->empty()) {
+                    // Hand the slot straight over; active_ stays put.
+                    next = std::move(q->front().granted);
+                    q->pop_front();
+                    --waiting_;
+                    break;
+                }
+            }
+            if (!next)
+                --active_;
+        }
+        if (next)
+            next();
+    }
+
+    // Leaves `q' when it goes out of scope, for a caller that has
+    // entered it.
+    class slot {
+    public:
+        explicit slot(admission_queue *q) : q_(q) {}
+        ~slot() { q_->leave(); }
+    private:
+        admission_queue *q_;
+
+        slot(const slot&);
+        void operator=(const slot&);
+    };
+
+    int active() {
+        std::lock_guard<std::mutex> guard(mtx_);
+        return active_;
+    }
+
+    int waiting() {
+        std::lock_guard<std::mutex> guard(mtx_);
+        return waiting_;
+    }
+
+private:
+    struct waiter {
+        uint64_t ticket;
+        grant_func granted;
+    };
+
+    const int slots_;
+    const int max_waiting_;
+    std::mutex mtx_;
+    int active_;
+    int waiting_;
+    uint64_t next_;
+    // Each class's waiters, in arrival order.
+    std::vector<std::deque<waiter> > queues_;
+
+    admission_queue(const admission_queue&);
+    void operator=(const admission_queue&);
+};
+
+#endif
@@ -0,0 +1,120 @@
+/********************************************************************
+ * livegrep -- arena.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_ARENA_H
+#define CODESEARCH_ARENA_H
+
+#include <atomic>
+#include <mutex>
+#include <new>
+
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+ * A bump allocator, safe to allocate from on several threads at once,
+ * that frees everything in one go when it is destroyed. Allocating is
+ * normally a single atomic add; a lock is only taken to start a new
+ * block. Objects allocated from it are never destroyed, so they must
+ * be trivially destructible.
+ */
+class arena {
+public:
+    explicit arena(size_t block_size = 64 << 10)
+        : block_size_(block_size), current_(&empty_) {
+        empty_.next = 0;
+        empty_.size = 0;
+        empty_.used = 0;
+    }
+
+    ~arena() {
+        block *b = current_.load();
+        while (b != &empty_) {
+            block *next = b->next;
+            free(b);
+            b = next;
+        }
+    }
+
+    // `n' bytes, aligned for any object.
+    void *alloc(size_t n) {
+        n = (n + kAlign - 1) & ~(kAlign - 1);
+        while (true) {
+            block *b = current_.load(std::memory_order_acquire);
+            size_t off = b->used.fetch_add(n, std::memory_order_relaxed);
+            if (off + n <= b->size)
+                return b->data() + off;
+            grow(b, n);
+        }
+    }
+
+    // Give back `p', which must be the `n' bytes most recently
+    // alloc()ed, if nothing has been allocated since. Returns false,
+    // leaving the memory in use until the arena goes, if so.
+    bool release(void *p, size_t n) {
+        n = (n + kAlign - 1) & ~(kAlign - 1);
+        block *b = current_.load(std::memory_order_acquire);
+        size_t off = static_cast<char*>(p) - b->data();
+        if (off >= b->size)
+            return false;
+        size_t end = off + n;
+        return b->used.compare_exchange_strong(end, off);
+    }
+
+    template <class T>
+    T *make() {
+        return new (alloc(sizeof(T))) T();
+    }
+
+    template <class T>
+    T *make_array(size_t n) {
+        T *out = static_cast<T*>(alloc(n * sizeof(T)));
+        for (size_t i = 0; i < n; ++i)
+            new (out + i) T();
+        return out;
+    }
+
+private:
+    static const size_t kAlign = 16;
+
+    struct block {
+        block *next;
+        size_t size;
+        std::atomic<size_t> used;
+
+        char *data() {
+            return reinterpret_cast<char*>(this) + kHeader;
+        }
+    };
+    static const size_t kHeader = (sizeof(block) + kAlign - 1) & ~(kAlign - 1);
+
+    // `b' has no room for `n' more bytes; make sure there is a block
+    // that does, unless someone else already has.
+    void grow(block *b, size_t n) {
+        std::lock_guard<std::mutex> guard(mtx_);
+        if (current_.load(std::memory_order_relaxed) != b)
+            return;
+        size_t size = n > block_size_ / 4 ? n : block_size_;
+        block *nb = static_cast<block*>(malloc(kHeader + size));
+        if (nb == 0)
+            throw std::bad_alloc();
+        nb->next = b;
+        nb->size = size;
+        new (&nb->used) std::atomic<size_t>(0);
+        current_.store(nb, std::memory_order_release);
+    }
+
+    const size_t block_size_;
+    std::mutex mtx_;
+    block empty_;
+    std::atomic<block*> current_;
+
+    arena(const arena&);
+    void operator=(const arena&);
+};
+
+#endif
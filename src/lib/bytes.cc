@@ -0,0 +1,374 @@
+/********************************************************************
+ * livegrep -- bytes.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "bytes.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace {
+
+struct kernels {
+    const char *name;
+    size_t (*count)(const unsigned char *p, size_t n, unsigned char c);
+    const unsigned char *(*find)(const unsigned char *p, size_t n, unsigned char c);
+    const unsigned char *(*rfind)(const unsigned char *p, size_t n, unsigned char c);
+    void (*replace)(unsigned char *p, size_t n, unsigned char from, unsigned char to);
+    // The length of the run of ASCII bytes [p, p + n) starts with.
+    size_t (*ascii)(const unsigned char *p, size_t n);
+};
+
+size_t count_scalar(const unsigned char *p, size_t n, unsigned char c) {
+    return std::count(p, p + n, c);
+}
+
+const unsigned char *find_scalar(const unsigned char *p, size_t n, unsigned char c) {
+    return static_cast<const unsigned char*>(memchr(p, c, n));
+}
+
+const unsigned char *rfind_scalar(const unsigned char *p, size_t n, unsigned char c) {
+    return static_cast<const unsigned char*>(memrchr(p, c, n));
+}
+
+void replace_scalar(unsigned char *p, size_t n, unsigned char from, unsigned char to) {
+    for (size_t i = 0; i < n; ++i)
+        if (p[i] == from)
+            p[i] = to;
+}
+
+size_t ascii_scalar(const unsigned char *p, size_t n) {
+    size_t i = 0;
+    for (; n - i >= 8; i += 8) {
+        uint64_t w;
+        memcpy(&w, p + i, 8);
+        if (w & 0x8080808080808080ull)
+            break;
+    }
+    while (i < n && p[i] < 0x80)
+        i++;
+    return i;
+}
+
+const kernels scalar_kernels = {
+    "scalar", count_scalar, find_scalar, rfind_scalar, replace_scalar, ascii_scalar,
+};
+
+#if defined(__x86_64__)
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 size_t count_avx2(const unsigned char *p, size_t n, unsigned char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t total = 0, i = 0;
+    while (n - i >= 32) {
+        // Each byte of acc counts up to 255 matches before it has to
+        // be added up.
+        size_t stop = i + 32 * std::min<size_t>((n - i) / 32, 255);
+        __m256i acc = _mm256_setzero_si256();
+        for (; i < stop; i += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, needle));
+        }
+        __m256i sums = _mm256_sad_epu8(acc, _mm256_setzero_si256());
+        total += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+            _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+    return total + count_scalar(p + i, n - i, c);
+}
+
+/*
+ * Lines are short, so the searches below finish with one more load,
+ * overlapping bytes already looked at, rather than going through the
+ * last few bytes one at a time.
+ */
+AVX2 const unsigned char *find_avx2(const unsigned char *p, size_t n, unsigned char c) {
+    if (n < 16) {
+        for (size_t i = 0; i < n; ++i)
+            if (p[i] == c)
+                return p + i;
+        return NULL;
+    }
+    if (n < 32) {
+        const __m128i needle = _mm_set1_epi8(c);
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask)
+            return p + __builtin_ctz(mask);
+        v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + n - 16));
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        return mask ? p + n - 16 + __builtin_ctz(mask) : NULL;
+    }
+    const __m256i needle = _mm256_set1_epi8(c);
+    for (size_t i = 0;; i += 32) {
+        if (i > n - 32)
+            i = n - 32;
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if (mask)
+            return p + i + __builtin_ctz(mask);
+        if (i == n - 32)
+            return NULL;
+    }
+}
+
+AVX2 const unsigned char *rfind_avx2(const unsigned char *p, size_t n, unsigned char c) {
+    if (n < 16) {
+        while (n > 0)
+            if (p[--n] == c)
+                return p + n;
+        return NULL;
+    }
+    if (n < 32) {
+        const __m128i needle = _mm_set1_epi8(c);
+        __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + n - 16));
+        uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        if (mask)
+            return p + n - 16 + 31 - __builtin_clz(mask);
+        v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, needle));
+        return mask ? p + 31 - __builtin_clz(mask) : NULL;
+    }
+    const __m256i needle = _mm256_set1_epi8(c);
+    for (size_t end = n;; end -= 32) {
+        if (end < 32)
+            end = 32;
+        __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + end - 32));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, needle));
+        if (mask)
+            return p + end - 1 - __builtin_clz(mask);
+        if (end == 32)
+            return NULL;
+    }
+}
+
+AVX2 void replace_avx2(unsigned char *p, size_t n, unsigned char from, unsigned char to) {
+    const __m256i f = _mm256_set1_epi8(from), t = _mm256_set1_epi8(to);
+    size_t i = 0;
+    for (; n - i >= 32; i += 32) {
+        __m256i *at = reinterpret_cast<__m256i*>(p + i);
+        __m256i v = _mm256_loadu_si256(at);
+        _mm256_storeu_si256(at, _mm256_blendv_epi8(v, t, _mm256_cmpeq_epi8(v, f)));
+    }
+    replace_scalar(p + i, n - i, from, to);
+}
+
+AVX2 size_t ascii_avx2(const unsigned char *p, size_t n) {
+    if (n < 16)
+        return ascii_scalar(p, n);
+    if (n < 32) {
+        uint32_t mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+        if (mask)
+            return __builtin_ctz(mask);
+        mask = _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + n - 16)));
+        return mask ? n - 16 + __builtin_ctz(mask) : n;
+    }
+    for (size_t i = 0;; i += 32) {
+        if (i > n - 32)
+            i = n - 32;
+        uint32_t mask = _mm256_movemask_epi8(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+        if (i == n - 32)
+            return n;
+    }
+}
+
+#undef AVX2
+
+const kernels avx2_kernels = {
+    "avx2", count_avx2, find_avx2, rfind_avx2, replace_avx2, ascii_avx2,
+};
+
+#elif defined(__aarch64__)
+
+// Four bits per byte of `eq', which is all ones or all zeroes.
+inline uint64_t neon_mask(uint8x16_t eq) {
+    return vget_lane_u64(vreinterpret_u64_u8(
+        vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)), 0);
+}
+
+size_t count_neon(const unsigned char *p, size_t n, unsigned char c) {
+    const uint8x16_t needle = vdupq_n_u8(c);
+    size_t total = 0, i = 0;
+    while (n - i >= 16) {
+        size_t stop = i + 16 * std::min<size_t>((n - i) / 16, 255);
+        uint8x16_t acc = vdupq_n_u8(0);
+        for (; i < stop; i += 16)
+            acc = vsubq_u8(acc, vceqq_u8(vld1q_u8(p + i), needle));
+        total += vaddlvq_u8(acc);
+    }
+    return total + count_scalar(p + i, n - i, c);
+}
+
+const unsigned char *find_neon(const unsigned char *p, size_t n, unsigned char c) {
+    const uint8x16_t needle = vdupq_n_u8(c);
+    size_t i = 0;
+    for (; n - i >= 16; i += 16) {
+        uint64_t mask = neon_mask(vceqq_u8(vld1q_u8(p + i), needle));
+        if (mask)
+            return p + i + __builtin_ctzll(mask) / 4;
+    }
+    for (; i < n; ++i)
+        if (p[i] == c)
+            return p + i;
+    return NULL;
+}
+
+const unsigned char *rfind_neon(const unsigned char *p, size_t n, unsigned char c) {
+    const uint8x16_t needle = vdupq_n_u8(c);
+    size_t end = n;
+    for (; end >= 16; end -= 16) {
+        uint64_t mask = neon_mask(vceqq_u8(vld1q_u8(p + end - 16), needle));
+        if (mask)
+            return p + end - 1 - __builtin_clzll(mask) / 4;
+    }
+    while (end > 0)
+        if (p[--end] == c)
+            return p + end;
+    return NULL;
+}
+
+void replace_neon(unsigned char *p, size_t n, unsigned char from, unsigned char to) {
+    const uint8x16_t f = vdupq_n_u8(from), t = vdupq_n_u8(to);
+    size_t i = 0;
+    for (; n - i >= 16; i += 16) {
+        uint8x16_t v = vld1q_u8(p + i);
+        vst1q_u8(p + i, vbslq_u8(vceqq_u8(v, f), t, v));
+    }
+    replace_scalar(p + i, n - i, from, to);
+}
+
+size_t ascii_neon(const unsigned char *p, size_t n) {
+    size_t i = 0;
+    for (; n - i >= 16; i += 16)
+        if (vmaxvq_u8(vld1q_u8(p + i)) >= 0x80)
+            break;
+    return i + ascii_scalar(p + i, n - i);
+}
+
+const kernels neon_kernels = {
+    "neon", count_neon, find_neon, rfind_neon, replace_neon, ascii_neon,
+};
+
+#endif
+
+// Every set of kernels this CPU can run, best first.
+int available(const kernels **out) {
+    int n = 0;
+#if defined(__x86_64__)
+    // We may run before the constructor that sets up
+    // __builtin_cpu_supports() has.
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        out[n++] = &avx2_kernels;
+#elif defined(__aarch64__)
+    out[n++] = &neon_kernels;
+#endif
+    out[n++] = &scalar_kernels;
+    return n;
+}
+
+const kernels *best() {
+    const kernels *all[3];
+    available(all);
+    return all[0];
+}
+
+// Constant-initialized, so that scans before static constructors have
+// run are still answered.
+const kernels *active = &scalar_kernels;
+struct select_best {
+    select_best() { active = best(); }
+} select_best_;
+
+// The length of the well-formed sequence, other than ASCII, that `p'
+// starts with, or 0.
+size_t utf8_sequence(const unsigned char *p, size_t n) {
+    unsigned char c = p[0];
+    size_t len;
+    uint32_t cp, min;
+    if ((c & 0xe0) == 0xc0) {
+        len = 2; cp = c & 0x1f; min = 0x80;
+    } else if ((c & 0xf0) == 0xe0) {
+        len = 3; cp = c & 0x0f; min = 0x800;
+    } else if ((c & 0xf8) == 0xf0) {
+        len = 4; cp = c & 0x07; min = 0x10000;
+    } else {
+        return 0;
+    }
+    if (n < len)
+        return 0;
+    for (size_t i = 1; i < len; ++i) {
+        if ((p[i] & 0xc0) != 0x80)
+            return 0;
+        cp = (cp << 6) | (p[i] & 0x3f);
+    }
+    if (cp < min || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff))
+        return 0;
+    return len;
+}
+
+};
+
+size_t count_byte(const void *p, size_t n, unsigned char c) {
+    return active->count(static_cast<const unsigned char*>(p), n, c);
+}
+
+const void *find_byte(const void *p, size_t n, unsigned char c) {
+    return active->find(static_cast<const unsigned char*>(p), n, c);
+}
+
+const void *rfind_byte(const void *p, size_t n, unsigned char c) {
+    return active->rfind(static_cast<const unsigned char*>(p), n, c);
+}
+
+void replace_byte(void *p, size_t n, unsigned char from, unsigned char to) {
+    active->replace(static_cast<unsigned char*>(p), n, from, to);
+}
+
+/*
+ * Source code is nearly all ASCII, so we skip runs of it with the
+ * kernels and only decode what lies between them.
+ */
+bool utf8_valid(const char *p, size_t n) {
+    const unsigned char *s = reinterpret_cast<const unsigned char*>(p);
+    size_t i = 0;
+    while (true) {
+        i += active->ascii(s + i, n - i);
+        if (i == n)
+            return true;
+        size_t len = utf8_sequence(s + i, n - i);
+        if (len == 0)
+            return false;
+        i += len;
+    }
+}
+
+const char *byte_kernels() {
+    return active->name;
+}
+
+bool use_byte_kernels(const char *name) {
+    const kernels *all[3];
+    int n = available(all);
+    for (int i = 0; i < n; ++i) {
+        if (strcmp(all[i]->name, name) == 0) {
+            active = all[i];
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,43 @@
+/********************************************************************
+ * livegrep -- bytes.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_BYTES_H
+#define CODESEARCH_BYTES_H
+
+#include <stddef.h>
+
+/*
+ * Byte scans over chunk data, vectorized where the CPU allows: AVX2
+ * on x86-64 if the CPU has it, NEON on ARM64, and plain C (or libc)
+ * otherwise. The choice is made once, at startup.
+ */
+
+// The number of bytes equal to `c' in [p, p + n).
+size_t count_byte(const void *p, size_t n, unsigned char c);
+
+static inline size_t count_newlines(const char *p, const char *end) {
+    return count_byte(p, end - p, '\n');
+}
+
+// The first (or last) byte equal to `c' in [p, p + n), or NULL.
+const void *find_byte(const void *p, size_t n, unsigned char c);
+const void *rfind_byte(const void *p, size_t n, unsigned char c);
+
+// Replace each byte equal to `from' in [p, p + n) with `to'.
+void replace_byte(void *p, size_t n, unsigned char from, unsigned char to);
+
+// Whether [p, p + n) is well-formed UTF-8, as utf8::is_valid() has it:
+// no overlong forms, surrogates or code points past U+10FFFF.
+bool utf8_valid(const char *p, size_t n);
+
+// The kernels in use: "avx2", "neon" or "scalar".
+const char *byte_kernels();
+// Use the kernels called `name' from now on, if this CPU can run them;
+// for tests and benchmarks, and not safe while other threads scan.
+bool use_byte_kernels(const char *name);
+
+#endif
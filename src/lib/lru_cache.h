@@ -0,0 +1,98 @@
+/********************************************************************
+ * livegrep -- lru_cache.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_LRU_CACHE_H
+#define CODESEARCH_LRU_CACHE_H
+
+#include "metrics.h"
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+/*
+ * A map from strings to `V's, safe to share between threads, that
+ * holds entries whose costs add up to at most `capacity' and evicts
+ * the least recently used ones to make room. An entry costs 1 unless
+ * insert() is told otherwise, so by default `capacity' is a number of
+ * entries. Values are copied in and out, so V is normally a smart
+ * pointer. Every lookup counts towards `hits' or `misses'.
+ */
+template <class V>
+class lru_cache {
+public:
+    lru_cache(size_t capacity, metric &hits, metric &misses)
+        : capacity_(capacity), cost_(0), hits_(hits), misses_(misses) {}
+
+    bool find(const std::string &key, V *out) {
+        std::lock_guard<std::mutex> guard(mtx_);
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+            misses_.inc();
+            return false;
+        }
+        entries_.splice(entries_.begin(), entries_, it->second);
+        *out = it->second->val;
+        hits_.inc();
+        return true;
+    }
+
+    void insert(const std::string &key, const V &val, size_t cost = 1) {
+        if (cost > capacity_)
+            return;
+        std::lock_guard<std::mutex> guard(mtx_);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            cost_ -= it->second->cost;
+            entries_.erase(it->second);
+            index_.erase(it);
+        }
+        entries_.push_front(entry{key, val, cost});
+        index_[key] = entries_.begin();
+        cost_ += cost;
+        while (cost_ > capacity_) {
+            cost_ -= entries_.back().cost;
+            index_.erase(entries_.back().key);
+            entries_.pop_back();
+        }
+    }
+
+    void clear() {
+        std::lock_guard<std::mutex> guard(mtx_);
+        entries_.clear();
+        index_.clear();
+        cost_ = 0;
+    }
+
+    size_t size() {
+        std::lock_guard<std::mutex> guard(mtx_);
+        return entries_.size();
+    }
+
+private:
+    struct entry {
+        std::string key;
+        V val;
+        size_t cost;
+    };
+    typedef std::list<entry> entry_list;
+
+    size_t capacity_;
+    size_t cost_;
+    metric &hits_;
+    metric &misses_;
+    std::mutex mtx_;
+    // most recently used first
+    entry_list entries_;
+    std::unordered_map<std::string, typename entry_list::iterator> index_;
+
+    lru_cache(const lru_cache&);
+    void operator=(const lru_cache&);
+};
+
+#endif
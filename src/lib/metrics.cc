@@ -1,5 +1,8 @@
 #include "metrics.h"
 
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <map>
 #include <mutex>
@@ -7,16 +10,63 @@
 namespace {
     std::mutex metrics_mtx;
     std::map<std::string, metric*> *metrics;
+    std::map<std::string, histogram*> *histograms;
+
+    std::string prom_name(const std::string &name) {
+        std::string out = "livegrep_" + name;
+        for (auto it = out.begin(); it != out.end(); ++it)
+            if (!isalnum(*it) && *it != '_')
+                *it = '_';
+        return out;
+    }
+
+    void appendf(std::string *out, const char *fmt, ...) {
+        char buf[256];
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(buf, sizeof buf, fmt, ap);
+        va_end(ap);
+        out->append(buf);
+    }
 };
 
 
-metric::metric(const std::string &name) {
+metric::metric(const std::string &name, kind k) : val_(0), ns_(0), kind_(k) {
     std::unique_lock<std::mutex> locked(metrics_mtx);
     if (metrics == 0)
         metrics = new std::map<std::string, metric*>;
     (*metrics)[name] = this;
 }
 
+metric::~metric() {
+    std::unique_lock<std::mutex> locked(metrics_mtx);
+    for (auto it = metrics->begin(); it != metrics->end(); ++it) {
+        if (it->second == this) {
+            metrics->erase(it);
+            break;
+        }
+    }
+}
+
+histogram::histogram(const std::string &name) : sum_ns_(0), count_(0) {
+    for (int i = 0; i < kBuckets; ++i)
+        buckets_[i] = 0;
+    std::unique_lock<std::mutex> locked(metrics_mtx);
+    if (histograms == 0)
+        histograms = new std::map<std::string, histogram*>;
+    (*histograms)[name] = this;
+}
+
+histogram::~histogram() {
+    std::unique_lock<std::mutex> locked(metrics_mtx);
+    for (auto it = histograms->begin(); it != histograms->end(); ++it) {
+        if (it->second == this) {
+            histograms->erase(it);
+            break;
+        }
+    }
+}
+
 
 void metric::dump_all() {
     fprintf(stderr, "== begin metrics ==\n");
@@ -25,3 +75,36 @@ void metric::dump_all() {
     }
     fprintf(stderr, "== end metrics ==\n");
 }
+
+std::string metric::render_all() {
+    std::unique_lock<std::mutex> locked(metrics_mtx);
+    std::string out;
+    if (metrics) {
+        for (auto it = metrics->begin(); it != metrics->end(); ++it) {
+            std::string name = prom_name(it->first);
+            appendf(&out, "# TYPE %s %s\n", name.c_str(),
+                    it->second->kind_ == gauge ? "gauge" : "counter");
+            appendf(&out, "%s %ld\n", name.c_str(), it->second->val_.load());
+        }
+    }
+    if (histograms) {
+        for (auto it = histograms->begin(); it != histograms->end(); ++it) {
+            std::string name = prom_name(it->first) + "_seconds";
+            const histogram *h = it->second;
+            appendf(&out, "# TYPE %s histogram\n", name.c_str());
+            // Buckets are cumulative in this format.
+            uint64_t total = 0;
+            for (int b = 0; b < histogram::kBuckets; ++b) {
+                total += h->bucket(b);
+                if (b == histogram::kBuckets - 1)
+                    appendf(&out, "%s_bucket{le=\"+Inf\"} %lu\n", name.c_str(), total);
+                else
+                    appendf(&out, "%s_bucket{le=\"%g\"} %lu\n", name.c_str(),
+                            histogram::bound_us(b) / 1e6, total);
+            }
+            appendf(&out, "%s_sum %.9f\n", name.c_str(), h->sum_ns_.load() / 1e9);
+            appendf(&out, "%s_count %lu\n", name.c_str(), total);
+        }
+    }
+    return out;
+}
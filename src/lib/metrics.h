@@ -13,42 +13,112 @@
 #include <atomic>
 #include <string>
 
+#include <stdint.h>
+
+/*
+ * A named count, registered for dump_all() and render_all() when it is
+ * constructed; metrics are meant to be file-scope statics. A counter
+ * only goes up; a gauge is some current level, moved both ways or
+ * set().
+ */
 class metric {
 public:
-    metric(const std::string &name);
+    enum kind {
+        counter,
+        gauge,
+    };
+
+    metric(const std::string &name, kind k = counter);
+    ~metric();
     void inc() {++val_;}
     void inc(long i) {val_ += i;}
     void dec() {--val_;}
     void dec(long i) {val_ -= i;}
+    void set(long v) {val_ = v;}
+    long value() const {return val_.load();}
+    // Add `ns' nanoseconds to a metric counting milliseconds. What
+    // doesn't make up a whole millisecond is carried over to the next
+    // call, so many short intervals still add up.
+    void inc_ns(uint64_t ns) {
+        uint64_t before = ns_.fetch_add(ns);
+        val_ += (before + ns) / 1000000 - before / 1000000;
+    }
 
     static void dump_all();
+    // Every metric and histogram, in the Prometheus text format, with
+    // names prefixed by "livegrep_" and '.'s turned into '_'s.
+    static std::string render_all();
 
+    // Adds the time while it runs, from construction or start() to
+    // pause() or destruction, to a metric in milliseconds.
     class timer {
     public:
-        timer(metric &m) : m_(&m) {}
+        timer(metric &m) : m_(&m), start_(monotonic_ns()) {}
 
         void pause() {
-            tm_.pause();
-            timeval elapsed = tm_.elapsed();
-            m_->inc(elapsed.tv_sec * 1000 + elapsed.tv_usec / 1000);
-            tm_.reset();
+            m_->inc_ns(monotonic_ns() - start_);
+            start_ = 0;
         }
 
         void start() {
-            tm_.start();
+            start_ = monotonic_ns();
         }
 
         ~timer() {
-            if (tm_.running())
+            if (start_)
                 pause();
         }
     private:
         metric *m_;
-        ::timer tm_;
+        uint64_t start_;
     };
 
 private:
     std::atomic_long val_;
+    // The nanoseconds inc_ns() has added; val_ has all the whole
+    // milliseconds of it.
+    std::atomic<uint64_t> ns_;
+    kind kind_;
+};
+
+/*
+ * The distribution of some duration, as counts in fixed,
+ * exponentially growing buckets: from 10us up to about 10s, plus one
+ * for everything slower. Recording is a few relaxed atomic adds, so it
+ * can be done from any thread on the hot path. Registered and named
+ * like metric.
+ */
+class histogram {
+public:
+    static const int kBuckets = 21;
+
+    histogram(const std::string &name);
+    ~histogram();
+
+    void record_ns(uint64_t ns) {
+        int b = 0;
+        uint64_t us = ns / 1000;
+        while (b < kBuckets - 1 && us > bound_us(b))
+            ++b;
+        buckets_[b].fetch_add(1, std::memory_order_relaxed);
+        sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+        count_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The upper bound of bucket `b', for all but the last.
+    static uint64_t bound_us(int b) {
+        return uint64_t(10) << b;
+    }
+
+    uint64_t count() const {return count_.load();}
+    uint64_t bucket(int b) const {return buckets_[b].load();}
+
+private:
+    friend class metric;
+
+    std::atomic<uint64_t> buckets_[kBuckets];
+    std::atomic<uint64_t> sum_ns_;
+    std::atomic<uint64_t> count_;
 };
 
 #endif
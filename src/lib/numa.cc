@@ -0,0 +1,131 @@
+/********************************************************************
+ * livegrep -- numa.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "numa.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+namespace {
+
+// From <numaif.h>, which comes with libnuma.
+const int kMpolPreferred = 1;
+const unsigned kMpolMfMove = 1 << 1;
+const int kMaskBits = 1024;
+const int kWordBits = 8 * sizeof(unsigned long);
+
+struct topology {
+    // The kernel's id for each node with CPUs, and its CPUs.
+    std::vector<int> ids;
+    std::vector<std::vector<int> > cpus;
+};
+
+std::string read_line(const std::string& path) {
+    char buf[4096];
+    FILE *f = fopen(path.c_str(), "r");
+    if (f == NULL)
+        return "";
+    std::string out;
+    if (fgets(buf, sizeof buf, f) != NULL)
+        out = buf;
+    fclose(f);
+    return out;
+}
+
+// Parses a sysfs list such as "0-3,8,10-11".
+std::vector<int> parse_list(const std::string& s) {
+    std::vector<int> out;
+    const char *p = s.c_str();
+    while (*p >= '0' && *p <= '9') {
+        char *end;
+        long lo = strtol(p, &end, 10), hi = lo;
+        if (*end == '-')
+            hi = strtol(end + 1, &end, 10);
+        for (long i = lo; i <= hi; ++i)
+            out.push_back(i);
+        p = *end == ',' ? end + 1 : end;
+    }
+    return out;
+}
+
+topology load_topology() {
+    topology t;
+    std::vector<int> online = parse_list(read_line("/sys/devices/system/node/online"));
+    for (auto it = online.begin(); it != online.end(); ++it) {
+        if (*it >= kMaskBits)
+            continue;
+        std::vector<int> cpus = parse_list(read_line(
+            "/sys/devices/system/node/node" + std::to_string(*it) + "/cpulist"));
+        if (cpus.empty())
+            continue;
+        t.ids.push_back(*it);
+        t.cpus.push_back(cpus);
+    }
+    return t;
+}
+
+const topology& topo() {
+    static const topology t = load_topology();
+    return t;
+}
+
+std::atomic<int> simulated(0);
+
+};
+
+int numa_nodes() {
+    if (simulated)
+        return simulated;
+    return topo().ids.empty() ? 1 : topo().ids.size();
+}
+
+bool numa_pin_thread(int node) {
+    if (simulated)
+        return true;
+    const topology &t = topo();
+    if (t.ids.size() < 2)
+        return false;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    const std::vector<int> &cpus = t.cpus[node % t.ids.size()];
+    for (auto it = cpus.begin(); it != cpus.end(); ++it)
+        if (*it < CPU_SETSIZE)
+            CPU_SET(*it, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof set, &set) == 0;
+}
+
+bool numa_place(void *p, size_t len, int node, bool move) {
+    if (simulated)
+        return true;
+    const topology &t = topo();
+    if (t.ids.size() < 2)
+        return false;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t start = (uintptr_t(p) + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t(p) + len) & ~(page - 1);
+    if (end <= start)
+        return true;
+    unsigned long mask[kMaskBits / kWordBits] = {};
+    int id = t.ids[node % t.ids.size()];
+    mask[id / kWordBits] |= 1UL << (id % kWordBits);
+    // The kernel reads one bit fewer than it is told to.
+    return syscall(SYS_mbind, start, end - start, kMpolPreferred, mask,
+                   kMaskBits + 1, move ? kMpolMfMove : 0) == 0;
+}
+
+void numa_simulate(int nodes) {
+    simulated = nodes;
+}
@@ -0,0 +1,37 @@
+/********************************************************************
+ * livegrep -- numa.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_NUMA_H
+#define CODESEARCH_NUMA_H
+
+#include <stddef.h>
+
+/*
+ * The machine's NUMA nodes, as sysfs lists them, numbered from 0 in
+ * the order listed; only nodes with CPUs count. Memory placement and
+ * thread pinning go straight to the kernel, so there's no libnuma to
+ * depend on. On a machine that isn't NUMA (or won't say), there is
+ * one node and nothing is ever placed or pinned.
+ */
+
+// How many nodes there are; at least 1.
+int numa_nodes();
+
+// Run the calling thread only on the CPUs of `node'.
+bool numa_pin_thread(int node);
+
+// Give the pages of [p, p + len) `node' as their preferred node,
+// which they are allocated on when first touched -- and, if `move',
+// migrate those already in memory there right away. Only whole pages
+// are placed.
+bool numa_place(void *p, size_t len, int node, bool move);
+
+// Pretend to have `nodes' nodes, for tests: placing and pinning do
+// nothing, but report success. 0 goes back to the real ones.
+void numa_simulate(int nodes);
+
+#endif /* CODESEARCH_NUMA_H */
@@ -0,0 +1,103 @@
+/********************************************************************
+ * livegrep -- parallel.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_PARALLEL_H
+#define CODESEARCH_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Call fn(0) through fn(n - 1) from up to `nthreads' threads,
+// including the caller, handing out indexes in order.
+template <class F>
+void parallel_for(int n, int nthreads, const F& fn) {
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int i; (i = next++) < n;)
+            fn(i);
+    };
+    std::vector<std::thread> threads;
+    for (int i = 1; i < std::min(n, nthreads); i++)
+        threads.push_back(std::thread(work));
+    work();
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+}
+
+/*
+ * Make items 0 through n - 1 with produce(t, i, &item) on `nthreads'
+ * threads, t being the thread's number, and hand each to
+ * consume(i, item) on the calling thread, strictly in order.
+ * Producers run at most `window' items ahead of the consumer. With
+ * one thread, everything runs on the caller.
+ */
+template <class T, class P, class C>
+void ordered_pipeline(size_t n, int nthreads, size_t window,
+                      const P& produce, const C& consume) {
+    if (nthreads <= 1) {
+        for (size_t i = 0; i < n; i++) {
+            T item;
+            produce(0, i, &item);
+            consume(i, item);
+        }
+        return;
+    }
+
+    struct slot {
+        bool ready = false;
+        T item;
+    };
+    std::vector<slot> ring(window);
+    // mtx protects ring, next (the next item to hand a producer) and
+    // done (the number of items consumed); cond is signalled whenever
+    // a slot fills or empties.
+    std::mutex mtx;
+    std::condition_variable cond;
+    size_t next = 0, done = 0;
+
+    auto work = [&](int t) {
+        std::unique_lock<std::mutex> lk(mtx);
+        while (true) {
+            cond.wait(lk, [&] { return next == n || next < done + window; });
+            if (next == n)
+                break;
+            size_t i = next++;
+            lk.unlock();
+            T item;
+            produce(t, i, &item);
+            lk.lock();
+            ring[i % window].item = std::move(item);
+            ring[i % window].ready = true;
+            cond.notify_all();
+        }
+    };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < nthreads; t++)
+        threads.push_back(std::thread(work, t));
+
+    for (size_t i = 0; i < n; i++) {
+        T item;
+        {
+            std::unique_lock<std::mutex> lk(mtx);
+            slot &s = ring[i % window];
+            cond.wait(lk, [&] { return s.ready; });
+            item = std::move(s.item);
+            s.ready = false;
+            done = i + 1;
+            cond.notify_all();
+        }
+        consume(i, item);
+    }
+    for (auto it = threads.begin(); it != threads.end(); ++it)
+        it->join();
+}
+
+#endif
@@ -7,54 +7,135 @@
  ********************************************************************/
 #include <stdint.h>
 #include <string.h>
+#include <algorithm>
 #include <vector>
 
 using std::vector;
 
 #include "per_thread.h"
+#include "radix_sort.h"
 
-void lsd_radix_sort(uint32_t *left, uint32_t *right)
+namespace {
+    // Counts for one digit fit in L1 with room to spare.
+    const int kMaxDigitBits = 11;
+    const int kMaxPasses = (32 + kMaxDigitBits - 1) / kMaxDigitBits;
+    // Below this, the counting costs more than comparisons do.
+    const size_t kMinRadix = 256;
+    // Inputs are split into buckets of about 2^kBucketBits elements,
+    // which stay in cache while they are sorted.
+    const int kBucketBits = 11;
+    // The fewest buckets worth splitting into.
+    const int kMinSplitBits = 4;
+
+    template <int passes>
+    void count_digits(const uint32_t *in, size_t width, int digit_bits,
+                      uint32_t counts[][1 << kMaxDigitBits]) {
+        uint32_t mask = (1u << digit_bits) - 1;
+        for (size_t i = 0; i < width; i++) {
+            uint32_t v = in[i];
+            for (int d = 0; d < passes; d++)
+                counts[d][(v >> (d * digit_bits)) & mask]++;
+        }
+    }
+
+    /*
+     * Sort [data, data + width) on the low `bits' bits of each element,
+     * with `buf', as big, for scratch. All the digits are counted in
+     * one read of the input; then there is a pass per digit, from the
+     * least significant, back and forth between data and buf. A digit
+     * every element has the same value of needs no pass.
+     */
+    void lsd(uint32_t *data, uint32_t *buf, size_t width, int bits) {
+        if (width < kMinRadix) {
+            std::sort(data, data + width);
+            return;
+        }
+        int passes = (bits + kMaxDigitBits - 1) / kMaxDigitBits;
+        int digit_bits = (bits + passes - 1) / passes;
+        uint32_t mask = (1u << digit_bits) - 1;
+        uint32_t counts[kMaxPasses][1 << kMaxDigitBits];
+
+        memset(counts, 0, sizeof counts[0] * passes);
+        switch (passes) {
+        case 1: count_digits<1>(data, width, digit_bits, counts); break;
+        case 2: count_digits<2>(data, width, digit_bits, counts); break;
+        case 3: count_digits<3>(data, width, digit_bits, counts); break;
+        }
+
+        uint32_t *cur = data, *other = buf;
+        for (int d = 0; d < passes; d++) {
+            int shift = d * digit_bits;
+            if (counts[d][(cur[0] >> shift) & mask] == width)
+                continue;
+            uint32_t total = 0;
+            for (uint32_t i = 0; i <= mask; i++) {
+                uint32_t tmp = counts[d][i];
+                counts[d][i] = total;
+                total += tmp;
+            }
+            for (size_t i = 0; i < width; i++) {
+                uint32_t v = cur[i];
+                other[counts[d][(v >> shift) & mask]++] = v;
+            }
+            std::swap(cur, other);
+        }
+        if (cur != data)
+            memcpy(data, cur, width * sizeof *data);
+    }
+};
+
+/*
+ * Once the input is bigger than the cache, every LSD pass scatters
+ * writes all over memory. So big inputs are first split on their top
+ * digit into scratch, and each bucket is then sorted on the rest of
+ * the bits while it is in cache, with the input's matching range as
+ * its own scratch.
+ */
+void lsd_radix_sort(uint32_t *left, uint32_t *right, uint32_t max)
 {
     static per_thread<vector<uint32_t> > scratch;
 
-    int width = right - left;
+    size_t width = right - left;
+    if (width < kMinRadix) {
+        std::sort(left, right);
+        return;
+    }
     if (!scratch.get())
-        scratch.put(new vector<uint32_t>(width));
-    scratch->reserve(width);
-    uint32_t *cur = left, *other = &(*scratch)[0];
-    uint32_t counts[4][256];
-    /*
-     * We do four passes
-     * (0) input -> scratch
-     * (1) scratch -> input
-     * (2) input -> scratch
-     * (3) scratch -> input
-     *
-     * So after the fourth pass, the input array is sorted and back in
-     * the original storage.
-     */
+        scratch.put(new vector<uint32_t>);
+    if (scratch->size() < width)
+        scratch->resize(width);
+    uint32_t *buf = &(*scratch)[0];
 
-    memset(counts, 0, sizeof counts);
-    for (int i = 0; i < width; i++) {
-        counts[0][(cur[i] >> 0 ) & 0xFF]++;
-        counts[1][(cur[i] >> 8 ) & 0xFF]++;
-        counts[2][(cur[i] >> 16) & 0xFF]++;
-        counts[3][(cur[i] >> 24) & 0xFF]++;
+    int bits = max ? 32 - __builtin_clz(max) : 1;
+    int log_width = 63 - __builtin_clzll(width);
+    int top = std::min(std::min(kMaxDigitBits, bits - kMaxDigitBits),
+                       log_width - kBucketBits);
+    if (top < kMinSplitBits) {
+        lsd(left, buf, width, bits);
+        return;
     }
 
-    for (int digit = 0; digit < 4; digit++) {
-        int total = 0;
-        for (int i = 0; i < 256; i++) {
-            int tmp = counts[digit][i];
-            counts[digit][i] = total;
-            total += tmp;
-        }
-        for (int i = 0; i < width; i++) {
-            int d = (cur[i] >> (8 * digit)) & 0xFF;
-            other[counts[digit][d]++] = cur[i];
-        }
-        uint32_t *tmp = cur;
-        cur = other;
-        other = tmp;
+    int shift = bits - top;
+    uint32_t starts[(1 << kMaxDigitBits) + 1];
+    uint32_t next[1 << kMaxDigitBits];
+    memset(next, 0, sizeof next[0] << top);
+    for (size_t i = 0; i < width; i++)
+        next[left[i] >> shift]++;
+    uint32_t total = 0;
+    for (int b = 0; b < (1 << top); b++) {
+        starts[b] = total;
+        total += next[b];
+        next[b] = starts[b];
+    }
+    starts[1 << top] = total;
+    for (size_t i = 0; i < width; i++) {
+        uint32_t v = left[i];
+        buf[next[v >> shift]++] = v;
+    }
+
+    for (int b = 0; b < (1 << top); b++) {
+        size_t n = starts[b + 1] - starts[b];
+        lsd(buf + starts[b], left + starts[b], n, shift);
+        memcpy(left + starts[b], buf + starts[b], n * sizeof *left);
     }
 }
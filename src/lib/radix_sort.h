@@ -11,6 +11,12 @@
 #include <algorithm>
 #include <cstdint>
 
-void lsd_radix_sort(uint32_t *left, uint32_t *right);
+/*
+ * Sort [left, right), every element of which is at most `max'. Each
+ * pass sorts on up to 11 bits, so there are two passes if `max' is
+ * below 2^22 and three otherwise -- each of 9 bits for offsets into a
+ * 2^27-byte chunk.
+ */
+void lsd_radix_sort(uint32_t *left, uint32_t *right, uint32_t max = UINT32_MAX);
 
 #endif
@@ -8,6 +8,7 @@
 #ifndef CODESEARCH_THREAD_QUEUE_H
 #define CODESEARCH_THREAD_QUEUE_H
 
+#include <functional>
 #include <list>
 #include <mutex>
 #include <condition_variable>
@@ -18,15 +19,31 @@ public:
     thread_queue () : closed_(false) {}
 
     void push(const T& val) {
-        std::unique_lock<std::mutex> locked(mutex_);
-        queue_.push_back(val);
-        cond_.notify_one();
+        {
+            std::unique_lock<std::mutex> locked(mutex_);
+            queue_.push_back(val);
+            cond_.notify_one();
+        }
+        if (notify_)
+            notify_();
     }
 
     void close() {
         std::unique_lock<std::mutex> locked(mutex_);
         closed_ = true;
         cond_.notify_all();
+        if (notify_)
+            notify_();
+    }
+
+    // Have push() and close() call `fn' once they are done, for a
+    // consumer that try_pop()s instead of waiting. push() calls it
+    // without the lock held; close() with it held, so a consumer that
+    // sees the queue closed knows the last call has returned and may
+    // free whatever `fn' refers to. Must be set before anything is
+    // pushed.
+    void set_notify(const std::function<void ()>& fn) {
+        notify_ = fn;
     }
 
     bool pop(T *out) {
@@ -39,6 +56,18 @@ public:
         queue_.pop_front();
         return true;
     }
+
+    // Like pop(), but returns false at once if nothing is queued,
+    // setting *closed to whether anything ever will be.
+    bool try_pop(T *out, bool *closed) {
+        std::unique_lock<std::mutex> locked(mutex_);
+        *closed = closed_;
+        if (queue_.empty())
+            return false;
+        *out = queue_.front();
+        queue_.pop_front();
+        return true;
+    }
  protected:
     thread_queue(const thread_queue&);
     thread_queue operator=(const thread_queue &);
@@ -46,6 +75,7 @@ public:
     std::condition_variable cond_;
     bool closed_;
     std::list<T> queue_;
+    std::function<void ()> notify_;
 };
 
 
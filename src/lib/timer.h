@@ -8,6 +8,8 @@
 #ifndef CODESEARCH_TIMER_H
 #define CODESEARCH_TIMER_H
 #include <sys/time.h>
+#include <stdint.h>
+#include <time.h>
 #include <assert.h>
 #include <mutex>
 
@@ -145,4 +147,40 @@ inline static long timeval_ms(struct timeval tv) {
     return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+inline static uint64_t timeval_ns(struct timeval tv) {
+    return uint64_t(tv.tv_sec) * 1000000000 + uint64_t(tv.tv_usec) * 1000;
+}
+
+inline static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+inline static struct timeval ns_to_timeval(uint64_t ns) {
+    struct timeval tv;
+    tv.tv_sec  = ns / 1000000000;
+    tv.tv_usec = (ns % 1000000000) / 1000;
+    return tv;
+}
+
+/*
+ * A lock-free alternative to run_timer for hot paths: adds the
+ * monotonic time spent in its scope to a plain counter. The counter
+ * must only be touched by one thread at a time, so callers keep one
+ * per thread and merge them when they are done.
+ */
+class run_ns_timer {
+public:
+    run_ns_timer(uint64_t &counter)
+        : counter_(counter), start_(monotonic_ns()) {
+    }
+    ~run_ns_timer() {
+        counter_ += monotonic_ns() - start_;
+    }
+protected:
+    uint64_t &counter_;
+    uint64_t start_;
+};
+
 #endif
@@ -0,0 +1,206 @@
+/********************************************************************
+ * livegrep -- partition.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/partition.h"
+#include "src/codesearch.h"
+#include "src/content.h"
+
+#include "src/lib/bytes.h"
+#include "src/lib/debug.h"
+#include "src/lib/timer.h"
+
+#include <algorithm>
+#include <functional>
+#include <unordered_set>
+#include <utility>
+
+#include <json-c/json.h>
+
+#include <assert.h>
+#include <stdio.h>
+
+using std::string;
+using std::vector;
+
+namespace {
+
+// The bytes of the distinct lines of `files', as an index of just
+// them would store them.
+uint64_t distinct_bytes(code_searcher *cs, const vector<indexed_file*>& files) {
+    // Lines are deduplicated as they are indexed, so the same line
+    // shows up at the same address.
+    std::unordered_set<const char*> seen;
+    uint64_t bytes = 0;
+    for (auto it = files.begin(); it != files.end(); ++it) {
+        indexed_file *f = *it;
+        chunk_allocator *alloc = cs->file_alloc(f);
+        for (auto piece = f->content->begin(alloc);
+             piece != f->content->end(alloc); ++piece) {
+            const char *p = piece->data(), *end = p + piece->size();
+            while (p <= end) {
+                const char *nl = static_cast<const char*>(find_byte(p, end - p, '\n'));
+                if (nl == NULL)
+                    nl = end;
+                if (seen.insert(p).second)
+                    bytes += nl - p + 1;
+                p = nl + 1;
+            }
+        }
+    }
+    return bytes;
+}
+
+size_t path_hash(const indexed_file *f) {
+    return std::hash<string>()(f->path.as_string());
+}
+
+string strip_extension(const string& path, string *ext) {
+    size_t dot = path.rfind('.');
+    size_t slash = path.rfind('/');
+    if (dot == string::npos || dot == 0 ||
+        (slash != string::npos && dot < slash + 2)) {
+        ext->clear();
+        return path;
+    }
+    *ext = path.substr(dot);
+    return path.substr(0, dot);
+}
+
+};
+
+int index_partition::shard(const indexed_file *f) const {
+    auto it = trees.find(f->tree->name);
+    if (it != trees.end() && it->second >= 0)
+        return it->second;
+    return path_hash(f) % shards();
+}
+
+/*
+ * The trees are sized by the distinct lines of all of their versions
+ * together, and handed out biggest first, each to the shard with the
+ * fewest bytes so far. Spreading a tree costs lines the shards no
+ * longer share, and only pays off for trees too big to place whole,
+ * so just the biggest few over a shard's fair share are candidates:
+ * each way of splitting the first j of them is tried, with the split
+ * trees added last, evenly, and the one leaving the fullest shard
+ * emptiest wins, splitting as few trees as possible among equals.
+ */
+index_partition partition_index(code_searcher *cs, int shards) {
+    assert(shards > 0);
+    timer tm;
+    std::map<string, vector<indexed_file*> > by_name;
+    for (auto it = cs->begin_files(); it != cs->end_files(); ++it)
+        if (!cs->shadowed(*it))
+            by_name[(*it)->tree->name].push_back(*it);
+
+    vector<std::pair<uint64_t, string> > sizes;
+    uint64_t total = 0;
+    for (auto it = by_name.begin(); it != by_name.end(); ++it) {
+        uint64_t bytes = distinct_bytes(cs, it->second);
+        sizes.push_back(std::make_pair(bytes, it->first));
+        total += bytes;
+    }
+    // Biggest first, and by name among equals, so that the same index
+    // always splits the same way.
+    std::sort(sizes.begin(), sizes.end(),
+              [](const std::pair<uint64_t, string>& a,
+                 const std::pair<uint64_t, string>& b) {
+                  if (a.first != b.first)
+                      return a.first > b.first;
+                  return a.second < b.second;
+              });
+
+    uint64_t share = total / shards;
+    size_t oversized = 0;
+    if (shards > 1)
+        while (oversized < sizes.size() && sizes[oversized].first > share)
+            oversized++;
+
+    // Split the first `split' trees and place the rest whole.
+    auto place = [&sizes, shards](size_t split) {
+        index_partition p;
+        p.bytes.resize(shards);
+        for (size_t i = split; i < sizes.size(); i++) {
+            int k = std::min_element(p.bytes.begin(), p.bytes.end()) - p.bytes.begin();
+            p.trees[sizes[i].second] = k;
+            p.bytes[k] += sizes[i].first;
+        }
+        for (size_t i = 0; i < split; i++) {
+            p.trees[sizes[i].second] = -1;
+            for (int k = 0; k < shards; k++)
+                p.bytes[k] += sizes[i].first / shards;
+        }
+        return p;
+    };
+    auto most = [](const index_partition& p) {
+        return *std::max_element(p.bytes.begin(), p.bytes.end());
+    };
+
+    index_partition p = place(0);
+    for (size_t split = 1; split <= oversized; split++) {
+        index_partition q = place(split);
+        if (most(q) < most(p))
+            p = std::move(q);
+    }
+
+    debug(kDebugIndex, "partitioned %d trees (%ld bytes) into %d shards in %ldms",
+          int(sizes.size()), long(total), shards, timeval_ms(tm.elapsed()));
+    return p;
+}
+
+string shard_index_path(const string& path, int k) {
+    string ext;
+    string stem = strip_extension(path, &ext);
+    return stem + "." + std::to_string(k) + ext;
+}
+
+void dump_partition(code_searcher *cs, const index_partition& p,
+                    const string& path) {
+    json_object *shards = json_object_new_array();
+    for (int k = 0; k < p.shards(); k++) {
+        string out = shard_index_path(path, k);
+        timer tm;
+        code_searcher shard;
+        shard.set_alloc(make_dump_allocator(&shard, out));
+        shard.copy_index(cs, true, [&p, k](const indexed_file *f) {
+                return p.shard(f) == k;
+            });
+        shard.finalize();
+        fprintf(stderr, "wrote shard %s (%ld files) in %ldms\n", out.c_str(),
+                long(shard.end_files() - shard.begin_files()),
+                timeval_ms(tm.elapsed()));
+
+        json_object *entry = json_object_new_object();
+        json_object_object_add(entry, "path", json_object_new_string(out.c_str()));
+        json_object_object_add(entry, "bytes", json_object_new_int64(p.bytes[k]));
+        json_object *trees = json_object_new_array();
+        vector<indexed_tree> shard_trees = shard.trees();
+        for (auto it = shard_trees.begin(); it != shard_trees.end(); ++it) {
+            json_object *tree = json_object_new_object();
+            json_object_object_add(tree, "name", json_object_new_string(it->name.c_str()));
+            json_object_object_add(tree, "version", json_object_new_string(it->version.c_str()));
+            json_object_array_add(trees, tree);
+        }
+        json_object_object_add(entry, "trees", trees);
+        json_object_array_add(shards, entry);
+    }
+
+    json_object *manifest = json_object_new_object();
+    json_object_object_add(manifest, "name", json_object_new_string(cs->name().c_str()));
+    json_object_object_add(manifest, "shards", shards);
+    json_object *split = json_object_new_array();
+    for (auto it = p.trees.begin(); it != p.trees.end(); ++it)
+        if (it->second < 0)
+            json_object_array_add(split, json_object_new_string(it->first.c_str()));
+    json_object_object_add(manifest, "split_trees", split);
+
+    string ext;
+    string manifest_path = strip_extension(path, &ext) + ".shards.json";
+    if (json_object_to_file(const_cast<char*>(manifest_path.c_str()), manifest) < 0)
+        die("Unable to write %s", manifest_path.c_str());
+    json_object_put(manifest);
+}
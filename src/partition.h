@@ -0,0 +1,57 @@
+/********************************************************************
+ * livegrep -- partition.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_PARTITION_H
+#define CODESEARCH_PARTITION_H
+
+#include <stdint.h>
+
+#include <map>
+#include <string>
+#include <vector>
+
+class code_searcher;
+struct indexed_file;
+
+/*
+ * A split of one index into shards of about the same size, to be
+ * served side by side behind codesearch --shards. Every version of a
+ * tree goes to the same shard, as they have most of their lines in
+ * common, except for trees too big to fit in any one shard: their
+ * files are spread over every shard by path instead, so that each
+ * path's versions still end up together.
+ */
+struct index_partition {
+    // The shard each tree, by name, went to as a whole; -1 if its
+    // files were spread over all of them.
+    std::map<std::string, int> trees;
+    // How many bytes of distinct lines each shard is expected to hold.
+    std::vector<uint64_t> bytes;
+
+    int shards() const {
+        return bytes.size();
+    }
+    // The shard `f' belongs in.
+    int shard(const indexed_file *f) const;
+};
+
+// Split the files of `cs', a finalized index, over `shards' shards.
+index_partition partition_index(code_searcher *cs, int shards);
+
+// The file shard `k' of an index split from `path' is written to:
+// foo.idx becomes foo.k.idx.
+std::string shard_index_path(const std::string& path, int k);
+
+/*
+ * Write each shard of `cs' as `p' has it to shard_index_path(path,
+ * k), deduplicating each one's lines afresh, along with a manifest
+ * of the trees each holds at foo.shards.json.
+ */
+void dump_partition(code_searcher *cs, const index_partition& p,
+                    const std::string& path);
+
+#endif /* CODESEARCH_PARTITION_H */
@@ -0,0 +1,45 @@
+/********************************************************************
+ * livegrep -- path_table.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/path_table.h"
+#include "src/codesearch.h"
+
+#include <string.h>
+
+size_t hash_piece::operator()(const StringPiece& s) const {
+    return hash_line(s.data(), s.size());
+}
+
+StringPiece path_table::intern(const StringPiece& path) {
+    auto it = set_.find(path);
+    if (it != set_.end())
+        return *it;
+
+    char *p;
+    if (path.size() > kBlockSize / 4) {
+        // Too big to pack in with the others.
+        large_.push_back(std::unique_ptr<char[]>(new char[path.size()]));
+        p = large_.back().get();
+        bytes_ += path.size();
+    } else {
+        if (blocks_.empty() || used_ + path.size() > kBlockSize) {
+            blocks_.push_back(std::unique_ptr<char[]>(new char[kBlockSize]));
+            used_ = 0;
+            bytes_ += kBlockSize;
+        }
+        p = blocks_.back().get() + used_;
+        used_ += path.size();
+    }
+    memcpy(p, path.data(), path.size());
+    StringPiece out(p, path.size());
+    set_.insert(out);
+    return out;
+}
+
+size_t path_table::bytes() const {
+    return bytes_ + set_.bucket_count() / 8 + set_.size() * sizeof(StringPiece);
+}
@@ -0,0 +1,60 @@
+/********************************************************************
+ * livegrep -- path_table.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_PATH_TABLE_H
+#define CODESEARCH_PATH_TABLE_H
+
+#include <stddef.h>
+
+#include <memory>
+#include <vector>
+
+#include <google/sparse_hash_set>
+#include "re2/re2.h"
+
+using re2::StringPiece;
+
+struct hash_piece {
+    size_t operator()(const StringPiece& s) const;
+};
+
+/*
+ * File paths, each kept once however many trees and versions have a
+ * file there, and packed into large blocks rather than allocated a
+ * string at a time. What intern() returns lives as long as the table.
+ */
+class path_table {
+public:
+    path_table() : used_(0), bytes_(0) {}
+
+    // The table's copy of `path', made if it has none yet.
+    StringPiece intern(const StringPiece& path);
+
+    // How many distinct paths it holds.
+    size_t size() const {
+        return set_.size();
+    }
+    // The memory it takes up, blocks and hash table both.
+    size_t bytes() const;
+
+protected:
+    static const size_t kBlockSize = 64 << 10;
+
+    google::sparse_hash_set<StringPiece, hash_piece> set_;
+    std::vector<std::unique_ptr<char[]> > blocks_;
+    // Paths too long to pack, a block each.
+    std::vector<std::unique_ptr<char[]> > large_;
+    // How much of the last of blocks_ is in use.
+    size_t used_;
+    size_t bytes_;
+
+private:
+    path_table(const path_table&);
+    void operator=(const path_table&);
+};
+
+#endif /* CODESEARCH_PATH_TABLE_H */
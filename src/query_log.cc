@@ -0,0 +1,42 @@
+/********************************************************************
+ * livegrep -- query_log.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#include "src/query_log.h"
+
+using std::string;
+using std::vector;
+
+namespace {
+    const char *kFields[kLogFields] = {
+        "line", "file", "tree", "tags", "not_file", "not_tree", "not_tags",
+    };
+    const string kMarker = "processing query ";
+}
+
+bool parse_query_log(const string &line, vector<string> *out) {
+    size_t pos = line.find(kMarker);
+    if (pos == string::npos)
+        return false;
+    pos += kMarker.size();
+    out->clear();
+    for (int i = 0; i < kLogFields; i++) {
+        string start = string(i ? " " : "") + kFields[i] + "='";
+        if (line.compare(pos, start.size(), start) != 0)
+            return false;
+        pos += start.size();
+        size_t end;
+        if (i + 1 < kLogFields)
+            end = line.find(string("' ") + kFields[i + 1] + "='", pos);
+        else
+            end = line.rfind('\'');
+        if (end == string::npos || end < pos)
+            return false;
+        out->push_back(line.substr(pos, end - pos));
+        pos = end + 1;
+    }
+    return true;
+}
@@ -0,0 +1,35 @@
+/********************************************************************
+ * livegrep -- query_log.h
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+#ifndef CODESEARCH_QUERY_LOG_H
+#define CODESEARCH_QUERY_LOG_H
+
+#include <string>
+#include <vector>
+
+// The fields of a query as a "processing query" log line gives them,
+// in order; see CodeSearchImpl::prepare().
+enum query_log_field {
+    kLogLine,
+    kLogFile,
+    kLogTree,
+    kLogTags,
+    kLogNotFile,
+    kLogNotTree,
+    kLogNotTags,
+    kLogFields,
+};
+
+/*
+ * If `line' is a "processing query" log line, with or without a trace
+ * id in front, split it into kLogFields patterns and return true.
+ * Patterns are not escaped in the log, so each is taken to run up to
+ * the next field's name, and the last to the final quote on the line.
+ */
+bool parse_query_log(const std::string &line, std::vector<std::string> *fields);
+
+#endif
@@ -8,123 +8,320 @@
 #include "src/tagsearch.h"
 #include "src/content.h"
 
+#include "src/lib/bytes.h"
 #include "src/lib/debug.h"
+#include "src/lib/timer.h"
 
+#include <algorithm>
+#include <unordered_map>
 #include <utility>
 #include <boost/filesystem.hpp>
 
+#include "gflags/gflags.h"
+#include "re2/regexp.h"
+#include "utf8.h"
+
 using re2::RE2;
 using boost::filesystem::path;
 
-namespace {
-
-std::string create_partial_regex(RE2 *re) {
-    if (!re)
-        return ".*";
+DECLARE_int32(max_matches);
+DECLARE_int32(timeout);
+DECLARE_int32(max_context_lines);
 
-    std::string pattern = re->pattern();
+namespace {
 
-    if (pattern.front() == '^')
-        pattern.erase(pattern.begin());
-    else
-        pattern.insert(0, ".*");
+const int kDefaultContextLines = 3;
+// How long a prefix of the names an anchored line pattern can match
+// to work out, to narrow the lookup to a range of the table.
+const int kMaxPrefix = 64;
+// How many candidates are tested between looks at the clock.
+const int kDeadlineCheck = 256;
 
-    if (pattern.back() == '$')
-        pattern.erase(pattern.size() - 1);
-    else
-        pattern.append(".*");
+// Whether `re' can only match at the start of its input, so that
+// PossibleMatchRange() bounds the names it matches. A leading ^ isn't
+// enough: only one branch of ^foo|bar is anchored.
+bool anchored(const RE2& re) {
+    re2::Regexp *r = re.Regexp();
+    while (r->op() == re2::kRegexpCapture)
+        r = r->sub()[0];
+    if (r->op() == re2::kRegexpBeginText)
+        return true;
+    return r->op() == re2::kRegexpConcat && r->nsub() > 0 &&
+        r->sub()[0]->op() == re2::kRegexpBeginText;
+}
 
-    return pattern;
+// Splits `line', as ctags --format=2 -n writes it, into `name',
+// `file', `lno' and `fields' (the kind and anything after it).
+bool parse_tag(StringPiece line, StringPiece *name, StringPiece *file,
+               uint32_t *lno, StringPiece *fields) {
+    size_t t1 = line.find('\t');
+    if (t1 == StringPiece::npos || t1 == 0)
+        return false;
+    size_t t2 = line.find('\t', t1 + 1);
+    if (t2 == StringPiece::npos || t2 == t1 + 1)
+        return false;
+    *name = line.substr(0, t1);
+    *file = line.substr(t1 + 1, t2 - t1 - 1);
+    StringPiece rest = line.substr(t2 + 1);
+    size_t i = 0;
+    *lno = 0;
+    while (i < rest.size() && rest[i] >= '0' && rest[i] <= '9')
+        *lno = *lno * 10 + (rest[i++] - '0');
+    if (i == 0 || *lno == 0 || rest.substr(i, 3) != StringPiece(";\"\t"))
+        return false;
+    *fields = rest.substr(i + 3);
+    return true;
 }
 
-std::string create_tag_line_regex(
-    const std::string& name,
-    const std::string& file,
-    const std::string& lno,
-    const std::string& tags) {
-    // full regex match for a tag line created with
-    //  ctags --format=2 -n --fields=+K
-    return std::string("^") + name + "\t" + file + "\t" + lno + ";\"\t" + tags + "$";
+bool partial_match(const RE2 *re, const StringPiece& s) {
+    return re->Match(s, 0, s.size(), RE2::UNANCHORED, NULL, 0);
 }
 
 };
 
 void tag_searcher::cache_indexed_files(code_searcher* cs) {
-    file_alloc_ = cs->alloc_;
+    files_cs_ = cs;
     for (auto it = cs->begin_files(); it != cs->end_files(); ++it) {
         auto file = *it;
-        auto key = path(file->tree->name) / path(file->path);
+        if (cs->shadowed(file))
+            continue;
+        auto key = path(file->tree->name) / path(file->path.as_string());
         path_to_file_map_.insert(std::make_pair(key.string(), file));
     }
 }
 
-bool tag_searcher::transform(query *q, match_result *m) const {
-    static const std::string regex = create_tag_line_regex("(.+)", "(.+)", "(\\d+)", "(.+)");
-    StringPiece name, tags_path, tags;
-    if (!RE2::FullMatch(m->line, regex, &name, &tags_path, &m->lno, &tags)) {
-        log(q->trace_id, "unknown ctags format: %s\n", m->line.as_string().c_str());
-        return false;
-    }
+/*
+ * A tag's path is relative to the tags file, and is looked up in the
+ * main index under the tags file's tree name and directory. Tags for
+ * files that aren't there, and lines that aren't tags (such as the
+ * !_TAG_ header), are left out.
+ */
+void tag_searcher::index_tags(code_searcher *tagdata) {
+    symbols_.clear();
+    paths_.clear();
+    kinds_.clear();
+    std::unordered_map<std::string, uint32_t> path_ids, kind_ids;
+    // Each tags file's directory and tag path, resolved.
+    std::unordered_map<std::string, indexed_file*> resolved;
+    int skipped = 0;
 
-    // check the negation constraints
-    if (q->negate.file_pat &&
-        q->negate.file_pat->Match(tags_path, 0, tags_path.size(), RE2::UNANCHORED, NULL, 0))
-        return false;
-    if (q->negate.tags_pat &&
-        q->negate.tags_pat->Match(tags, 0, tags.size(), RE2::UNANCHORED, NULL, 0))
-        return false;
+    for (auto it = tagdata->begin_files(); it != tagdata->end_files(); ++it) {
+        indexed_file *tf = *it;
+        if (tagdata->shadowed(tf))
+            continue;
+        path dir = path(tf->tree->name) / path(tf->path.as_string()).parent_path();
+        chunk_allocator *alloc = tagdata->file_alloc(tf);
+        for (auto piece = tf->content->begin(alloc);
+             piece != tf->content->end(alloc); ++piece) {
+            StringPiece text = *piece;
+            while (!text.empty()) {
+                size_t nl = text.find('\n');
+                StringPiece line = text.substr(0, nl);
+                text.remove_prefix(nl == StringPiece::npos ? text.size() : nl + 1);
 
-    // lookup the indexed_file base on repo and path
-    path lookup = path(m->file->tree->name) /
-        path(m->file->path).parent_path() /
-        path(tags_path.as_string());
-    auto value = path_to_file_map_.find(lookup.string());
-    if (value == path_to_file_map_.end()) {
-        log(q->trace_id,
-            "unable to find a file matching %s\n",
-            lookup.string().c_str());
-        return false;
+                symbol s;
+                StringPiece tag_path, fields;
+                if (!parse_tag(line, &s.name, &tag_path, &s.lno, &fields)) {
+                    skipped++;
+                    continue;
+                }
+                std::string key = dir.string() + '\0' + tag_path.as_string();
+                auto r = resolved.find(key);
+                if (r == resolved.end()) {
+                    auto f = path_to_file_map_.find(
+                        (dir / path(tag_path.as_string())).string());
+                    r = resolved.insert(std::make_pair(
+                        key, f == path_to_file_map_.end() ? NULL : f->second)).first;
+                }
+                if ((s.file = r->second) == NULL) {
+                    skipped++;
+                    continue;
+                }
+
+                auto p = path_ids.insert(std::make_pair(tag_path.as_string(),
+                                                        uint32_t(paths_.size())));
+                if (p.second)
+                    paths_.push_back(posting{tag_path, {}});
+                s.path = p.first->second;
+                auto k = kind_ids.insert(std::make_pair(fields.as_string(),
+                                                        uint32_t(kinds_.size())));
+                if (k.second)
+                    kinds_.push_back(posting{fields, {}});
+                s.kinds = k.first->second;
+                symbols_.push_back(s);
+            }
+        }
     }
-    auto file = value->second;
-
-    // iterate through the lines to add context information
-    auto line_it = file->content->begin(file_alloc_);
-    auto line_end = file->content->end(file_alloc_);
-    const int kContextLines = 3;
-    m->file = file;
-
-    // jump to context before
-    int current = 1;
-    for (;current < std::max(1, m->lno - kContextLines); ++current)
-        ++line_it;
-
-    // context before (we reverse the order to match codesearch)
-    m->context_before.clear();
-    for (; current < m->lno; ++current) {
-        m->context_before.insert(m->context_before.begin(), *line_it);
-        ++line_it;
+
+    std::sort(symbols_.begin(), symbols_.end(),
+              [](const symbol& a, const symbol& b) {
+                  int c = a.name.compare(b.name);
+                  if (c != 0)
+                      return c < 0;
+                  if (a.file->no != b.file->no)
+                      return a.file->no < b.file->no;
+                  return a.lno < b.lno;
+              });
+    for (uint32_t i = 0; i < symbols_.size(); ++i) {
+        paths_[symbols_[i].path].symbols.push_back(i);
+        kinds_[symbols_[i].kinds].symbols.push_back(i);
     }
+    debug(kDebugSearch, "tags: %d symbols, %d lines skipped",
+          int(symbols_.size()), skipped);
+}
 
+std::vector<uint32_t> tag_searcher::lookup(const std::vector<posting>& postings,
+                                           const RE2 *pat, const RE2 *negated,
+                                           std::vector<int8_t> *verdicts) {
+    std::vector<uint32_t> out;
+    for (size_t i = 0; i < postings.size(); ++i) {
+        const posting &p = postings[i];
+        bool ok = (!pat || partial_match(pat, p.value)) &&
+            !(negated && partial_match(negated, p.value));
+        (*verdicts)[i] = ok;
+        if (ok)
+            out.insert(out.end(), p.symbols.begin(), p.symbols.end());
+    }
+    std::sort(out.begin(), out.end());
+    return out;
+}
 
-    // line (match the first occurrence for simplicity)
-    m->line = *line_it;
-    m->matchleft = line_it->find(name);
-    m->matchright = m->matchleft + name.size();
-    ++line_it;
+/*
+ * The candidates start as every symbol, or the range of names an
+ * anchored line pattern allows. If there are fewer distinct paths (or
+ * kinds) than candidates, and the query constrains them, their
+ * postings are worth a look too: the candidates are cut down to the
+ * symbols of the paths that match. Each candidate left is then checked
+ * against the rest of the query.
+ */
+void tag_searcher::search(const query& q, const callback_func& cb,
+                          match_stats *stats) const {
+    timer tm;
+    memset(stats, 0, sizeof *stats);
 
-    // context after
-    m->context_after.clear();
-    for (int i = 0; i < kContextLines && line_it != line_end; ++i) {
-        m->context_after.push_back(*line_it);
-        ++line_it;
+    uint32_t lo = 0, hi = symbols_.size();
+    std::string min, max;
+    if (anchored(*q.line_pat) &&
+        q.line_pat->PossibleMatchRange(&min, &max, kMaxPrefix)) {
+        lo = std::lower_bound(symbols_.begin(), symbols_.end(), min,
+                              [](const symbol& s, const std::string& m) {
+                                  return s.name.compare(m) < 0;
+                              }) - symbols_.begin();
+        // Names longer than max only have to be below it up to its
+        // length.
+        hi = std::upper_bound(symbols_.begin() + lo, symbols_.end(), max,
+                              [](const std::string& m, const symbol& s) {
+                                  return StringPiece(m).compare(s.name.substr(0, m.size())) < 0;
+                              }) - symbols_.begin();
     }
 
-    return true;
-}
+    std::vector<int8_t> path_ok(paths_.size(), -1), kinds_ok(kinds_.size(), -1);
+    std::vector<uint32_t> ids;
+    bool narrowed = false;
+    auto narrow = [&](const std::vector<posting>& postings, const RE2 *pat,
+                      const RE2 *negated, std::vector<int8_t> *verdicts) {
+        size_t count = narrowed ? ids.size() : hi - lo;
+        if ((!pat && !negated) || postings.size() >= count)
+            return;
+        std::vector<uint32_t> found = lookup(postings, pat, negated, verdicts);
+        std::vector<uint32_t> next;
+        if (narrowed) {
+            std::set_intersection(ids.begin(), ids.end(), found.begin(), found.end(),
+                                  std::back_inserter(next));
+        } else {
+            for (auto it = found.begin(); it != found.end(); ++it)
+                if (*it >= lo && *it < hi)
+                    next.push_back(*it);
+        }
+        ids.swap(next);
+        narrowed = true;
+    };
+    narrow(paths_, q.file_pat.get(), q.negate.file_pat.get(), &path_ok);
+    narrow(kinds_, q.tags_pat.get(), q.negate.tags_pat.get(), &kinds_ok);
+
+    int max_matches = q.max_matches >= 0 ? q.max_matches : FLAGS_max_matches;
+    int context_lines = std::min(q.context_lines >= 0 ? q.context_lines : kDefaultContextLines,
+                                 std::max(FLAGS_max_context_lines, 0));
+    std::chrono::steady_clock::time_point deadline = q.deadline;
+    int timeout = q.timeout >= 0 ? q.timeout : FLAGS_timeout;
+    if (timeout > 0)
+        deadline = std::min(deadline, std::chrono::steady_clock::now() +
+                            std::chrono::milliseconds(timeout));
+
+    std::vector<StringPiece> context(2 * size_t(context_lines));
+    match_result m;
+    int matches = 0;
+    size_t n = narrowed ? ids.size() : hi - lo;
+    for (size_t i = 0; i < n; ++i) {
+        if (max_matches && matches >= max_matches) {
+            stats->why = kExitMatchLimit;
+            break;
+        }
+        if (i % kDeadlineCheck == kDeadlineCheck - 1 &&
+            (std::chrono::steady_clock::now() >= deadline ||
+             (q.abandoned && q.abandoned()))) {
+            stats->why = kExitTimeout;
+            break;
+        }
+
+        const symbol &s = symbols_[narrowed ? ids[i] : lo + i];
+        int8_t &pok = path_ok[s.path];
+        if (pok < 0) {
+            const StringPiece &p = paths_[s.path].value;
+            pok = (!q.file_pat || partial_match(q.file_pat.get(), p)) &&
+                !(q.negate.file_pat && partial_match(q.negate.file_pat.get(), p));
+        }
+        if (!pok)
+            continue;
+        int8_t &kok = kinds_ok[s.kinds];
+        if (kok < 0) {
+            const StringPiece &k = kinds_[s.kinds].value;
+            kok = (!q.tags_pat || partial_match(q.tags_pat.get(), k)) &&
+                !(q.negate.tags_pat && partial_match(q.negate.tags_pat.get(), k));
+        }
+        if (!kok)
+            continue;
+        const std::string &tree = s.file->tree->name;
+        if ((q.tree_pat && !partial_match(q.tree_pat.get(), tree)) ||
+            (q.negate.tree_pat && partial_match(q.negate.tree_pat.get(), tree)))
+            continue;
+        if (!partial_match(q.line_pat.get(), s.name))
+            continue;
+
+        chunk_allocator *alloc = files_cs_->file_alloc(s.file);
+        if (!s.file->content->line(alloc, s.lno, &m.line))
+            continue;
+        m.file = s.file;
+        m.lno = s.lno;
+        m.rank = 0;
+        // The name's first occurrence on the line, for simplicity, in
+        // characters as try_match() counts them; none if the line
+        // isn't UTF-8.
+        size_t left = m.line.find(s.name);
+        m.matchleft = m.matchright = 0;
+        if (left != StringPiece::npos &&
+            utf8_valid(m.line.data(), m.line.size())) {
+            m.matchleft = utf8::distance(m.line.data(), m.line.data() + left);
+            m.matchright = m.matchleft +
+                utf8::distance(s.name.data(), s.name.data() + s.name.size());
+        }
+
+        // Context before is nearest first, as for searches.
+        m.context_before = match_context(context.data(), context_lines);
+        m.context_after = match_context(context.data() + context_lines, context_lines);
+        StringPiece l;
+        for (int c = 1; c <= context_lines && int(s.lno) - c >= 1; ++c) {
+            s.file->content->line(alloc, s.lno - c, &l);
+            m.context_before.push_back(l);
+        }
+        for (int c = 1; c <= context_lines &&
+                 s.file->content->line(alloc, s.lno + c, &l); ++c)
+            m.context_after.push_back(l);
+
+        matches++;
+        cb(&m);
+    }
 
-std::string tag_searcher::create_tag_line_regex_from_query(query *q) {
-    return create_tag_line_regex(create_partial_regex(q->line_pat.get()),
-                                 create_partial_regex(q->file_pat.get()),
-                                 "\\d+",
-                                 create_partial_regex(q->tags_pat.get()));
+    stats->index_time = tm.elapsed();
+    stats->matches = matches;
 }
@@ -12,21 +12,72 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 class RE2;
 class chunk_allocator;
 
+/*
+ * A symbol table built from the ctags files (ctags --format=2 -n
+ * --fields=+K) indexed in a second code_searcher. Every tag names a
+ * line of a file in the main index; queries look symbols up by name,
+ * narrowed by the tag's path and kind, and answer with that line,
+ * without searching the tags files themselves.
+ */
 class tag_searcher {
 public:
+    typedef code_searcher::search_thread::callback_func callback_func;
+
+    // Index the files of `cs', which the tags refer to. Call first.
     void cache_indexed_files(code_searcher *cs);
+    // Build the symbol table from the tags files in `tagdata', which
+    // must outlive this object.
+    void index_tags(code_searcher *tagdata);
 
-    bool transform(query *q, match_result *m) const;
+    /*
+     * Pass `cb' each tag whose name matches q.line_pat, whose path
+     * (as the tags file has it) matches file_pat and whose kind and
+     * other fields match tags_pat -- and not their negations -- and
+     * whose file's tree matches tree_pat. Stops at max_matches.
+     */
+    void search(const query& q, const callback_func& cb, match_stats *stats) const;
 
-    static std::string create_tag_line_regex_from_query(query *q);
+    size_t size() const {
+        return symbols_.size();
+    }
 
 protected:
-    chunk_allocator *file_alloc_;
+    struct symbol {
+        StringPiece name;
+        indexed_file *file;
+        uint32_t lno;
+        // Indexes into paths_ and kinds_.
+        uint32_t path;
+        uint32_t kinds;
+    };
+
+    // The tags with one value of a field, by position in symbols_.
+    struct posting {
+        StringPiece value;
+        std::vector<uint32_t> symbols;
+    };
+
+    // The symbols in `postings' whose values `pat' matches, and
+    // `negated' doesn't, in order. Records whether each posting
+    // matched in `verdicts'.
+    static std::vector<uint32_t> lookup(const std::vector<posting>& postings,
+                                        const RE2 *pat, const RE2 *negated,
+                                        std::vector<int8_t> *verdicts);
+
+    // The index whose files the tags refer to
+    const code_searcher *files_cs_;
     std::map<std::string, indexed_file*> path_to_file_map_;
+
+    // By name, then path and line.
+    std::vector<symbol> symbols_;
+    // Each distinct path and set of fields after the line number.
+    std::vector<posting> paths_;
+    std::vector<posting> kinds_;
 };
 
 #endif /* TAGSEARCH_H */
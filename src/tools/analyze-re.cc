@@ -16,6 +16,7 @@
 
 #include "src/dump_load.h"
 #include "src/codesearch.h"
+#include "src/chunk_allocator.h"
 #include "src/indexer.h"
 #include "src/re_width.h"
 
@@ -25,6 +26,7 @@ using namespace std;
 
 DEFINE_string(dot_index, "", "Write a graph of the index key as a dot graph.");
 DEFINE_bool(casefold, false, "Treat the regex as case-insensitive.");
+DEFINE_string(corpus_index, "", "Weigh the index key by the byte frequencies of this index (or comma-separated list of indexes).");
 
 class IndexKeyDotOutputter {
 protected:
@@ -132,7 +134,14 @@ int analyze_re(int argc, char **argv) {
     printf("width: %d\n", width.Walk(re.Regexp(), 0));
     printf("Program size: %d\n", re.ProgramSize());
 
-    intrusive_ptr<IndexKey> key = indexRE(re);
+    code_searcher cs;
+    const corpus_stats *corpus = 0;
+    if (FLAGS_corpus_index.size()) {
+        cs.load_segments(split_index_paths(FLAGS_corpus_index));
+        corpus = &cs.alloc()->corpus();
+    }
+
+    intrusive_ptr<IndexKey> key = indexRE(re, corpus);
     if (key) {
         IndexKey::Stats stats = key->stats();
         printf("Index key:\n");
@@ -0,0 +1,531 @@
+#include "src/lib/debug.h"
+#include "src/lib/metrics.h"
+#include "src/lib/timer.h"
+
+#include "src/tools/limits.h"
+#include "src/tools/async_server.h"
+#include "src/tagsearch.h"
+
+#include <grpc++/alarm.h>
+
+#include <chrono>
+#include <deque>
+
+using grpc::ServerContext;
+using grpc::Status;
+using grpc::StatusCode;
+
+using std::string;
+
+namespace {
+    metric async_calls("grpc.async.calls", metric::gauge);
+    metric async_kicks("grpc.async.kicks");
+};
+
+/*
+ * One Search or SearchStream call, from waiting for a request to
+ * freeing itself once gRPC is done with it. Every event for a call is
+ * delivered to its I/O thread, so proceed() is never run concurrently;
+ * other threads -- pool workers finding matches, or whoever hands the
+ * call an admission slot -- only kick() it onto that thread.
+ */
+class AsyncCodeSearch::call {
+public:
+    // What a tag on the completion queue stands for.
+    enum op {
+        kRequest,       // the call has arrived
+        kDone,          // AsyncNotifyWhenDone
+        kKick,          // another thread has news; see kick()
+        kDeadline,      // the admission wait is over
+        kWrite,         // a batch has been sent
+        kFinish,        // the status has been sent
+        kNumOps
+    };
+
+    struct tag {
+        call *c;
+        op what;
+    };
+
+    call(AsyncCodeSearch *svc, grpc::ServerCompletionQueue *cq, bool stream)
+        : svc_(svc), impl_(&svc->impl_), cq_(cq), stream_(stream),
+          responder_(&ctx_), writer_(&ctx_), phase_(kWaiting), started_(false),
+          cacheable_(false), ticket_(0), queued_at_(0), deadline_set_(false),
+          writing_(false), cancelled_(false), kicked_(false), granted_(false),
+          helped_(false), ops_(0) {
+        for (int i = 0; i < kNumOps; ++i)
+            tags_[i] = tag{this, op(i)};
+        {
+            std::lock_guard<std::mutex> guard(svc_->calls_mtx_);
+            svc_->calls_++;
+        }
+        // One for the request, and one for the done tag.
+        ops_ = 2;
+        ctx_.AsyncNotifyWhenDone(&tags_[kDone]);
+        if (stream_)
+            svc_->RequestSearchStream(&ctx_, &request_, &writer_, cq_, cq_, &tags_[kRequest]);
+        else
+            svc_->RequestSearch(&ctx_, &request_, &responder_, cq_, cq_, &tags_[kRequest]);
+    }
+
+    ~call() {
+        if (started_)
+            async_calls.dec();
+        std::lock_guard<std::mutex> guard(svc_->calls_mtx_);
+        svc_->calls_--;
+        svc_->calls_cond_.notify_all();
+    }
+
+    void proceed(op what, bool ok);
+
+private:
+    enum phase {
+        kWaiting,       // for the request
+        kPreparing,     // for the query to be parsed
+        kQueued,        // for an admission slot
+        kRunning,       // on the pool
+        kSending,       // for the last batch to be sent
+        kFinishing,     // for the status to be sent
+        kFinished,
+    };
+
+    void begin();
+    void queue();
+    void step();
+    void run();
+    void complete(const match_stats& stats);
+    void split();
+    void send();
+    void write();
+    void fail(const Status& st);
+    void finish();
+    void kick();
+
+    AsyncCodeSearch *svc_;
+    CodeSearchImpl *impl_;
+    grpc::ServerCompletionQueue *cq_;
+    bool stream_;
+    ServerContext ctx_;
+    ::Query request_;
+    grpc::ServerAsyncResponseWriter< ::CodeSearchResult> responder_;
+    grpc::ServerAsyncWriter< ::CodeSearchResult> writer_;
+    tag tags_[kNumOps];
+
+    phase phase_;
+    bool started_;
+    // What prepare() made of the request, from a helper thread.
+    Status prepared_;
+    std::shared_ptr<CodeSearchImpl::index_state> state_;
+    bool cacheable_;
+    string key_;
+    CodeSearchImpl::prepared_search search_;
+    uint64_t ticket_;
+    uint64_t queued_at_;
+    grpc::Alarm deadline_;
+    bool deadline_set_;
+    std::unique_ptr<code_searcher::search_thread> thread_;
+    // Declared after search_, which it refers to, so it goes first.
+    std::unique_ptr<code_searcher::search_thread::pending> pending_;
+
+    // The response, or for a stream the next batch, being gathered.
+    ::CodeSearchResult response_;
+    // For a stream, full batches split off response_ to send before
+    // it, the batch being written...
+    std::deque< ::CodeSearchResult> batches_;
+    ::CodeSearchResult sending_;
+    bool writing_;
+    std::chrono::steady_clock::time_point flushed_;
+    // ... and, if the response can be cached, every match so far.
+    std::unique_ptr< ::CodeSearchResult> all_;
+    std::atomic<bool> cancelled_;
+
+    // For a tag search, its stats, from a helper thread.
+    match_stats tag_stats_;
+
+    // mtx_ protects the kick alarm, granted_, helped_ and ops_,
+    // which other threads touch.
+    std::mutex mtx_;
+    grpc::Alarm kick_;
+    bool kicked_;
+    bool granted_;
+    // Whether the helper thread is done with what it was handed:
+    // prepare() while kPreparing, the tag search while kRunning.
+    bool helped_;
+    // Tags handed to gRPC and not yet delivered back.
+    int ops_;
+};
+
+void AsyncCodeSearch::call::proceed(op what, bool ok) {
+    {
+        std::lock_guard<std::mutex> guard(mtx_);
+        ops_--;
+        if (what == kKick)
+            kicked_ = false;
+    }
+
+    switch (what) {
+    case kRequest:
+        if (!ok) {
+            // Shutting down; the done tag will never come.
+            phase_ = kFinished;
+            std::lock_guard<std::mutex> guard(mtx_);
+            ops_--;
+            break;
+        }
+        new call(svc_, cq_, stream_);
+        begin();
+        break;
+    case kDone:
+        cancelled_ = ctx_.IsCancelled();
+        break;
+    case kKick:
+        step();
+        break;
+    case kDeadline:
+        if (ok && phase_ == kQueued && impl_->admission_.cancel(ticket_)) {
+            impl_->admitted(search_.q, search_.cost, false, monotonic_ns() - queued_at_);
+            fail(Status(StatusCode::RESOURCE_EXHAUSTED, "Server busy"));
+        }
+        break;
+    case kWrite:
+        writing_ = false;
+        step();
+        break;
+    case kFinish:
+        phase_ = kFinished;
+        break;
+    case kNumOps:
+        break;
+    }
+
+    bool done;
+    {
+        std::lock_guard<std::mutex> guard(mtx_);
+        done = phase_ == kFinished && ops_ == 0;
+    }
+    if (done)
+        delete this;
+}
+
+// The request has arrived: answer it from the cache, or have it parsed
+// on a helper thread.
+void AsyncCodeSearch::call::begin() {
+    scoped_trace_id trace(trace_id_from_request(&ctx_));
+    started_ = true;
+    async_calls.inc();
+
+    state_ = impl_->state();
+    cacheable_ = impl_->cacheable(&request_);
+    if (cacheable_) {
+        key_ = impl_->result_key(state_.get(), &request_);
+        if (impl_->cached_result(key_, &response_)) {
+            phase_ = kSending;
+            split();
+            send();
+            return;
+        }
+        if (stream_)
+            all_.reset(new ::CodeSearchResult);
+    }
+
+    phase_ = kPreparing;
+    svc_->work_.push([this] {
+            scoped_trace_id trace(trace_id_from_request(&ctx_));
+            prepared_ = impl_->prepare(&ctx_, &request_, state_.get(), &search_);
+            {
+                std::lock_guard<std::mutex> guard(mtx_);
+                helped_ = true;
+            }
+            kick();
+        });
+}
+
+// The query has been parsed: queue it for a slot.
+void AsyncCodeSearch::call::queue() {
+    if (!prepared_.ok()) {
+        fail(prepared_);
+        return;
+    }
+    search_.q.abandoned = [this] { return cancelled_.load(); };
+
+    phase_ = kQueued;
+    queued_at_ = monotonic_ns();
+    std::chrono::steady_clock::time_point deadline = impl_->queue(search_.q);
+    ticket_ = impl_->admission_.wait(search_.cost, [this] {
+            {
+                std::lock_guard<std::mutex> guard(mtx_);
+                granted_ = true;
+            }
+            kick();
+        });
+    if (ticket_ == 0) {
+        impl_->admitted(search_.q, search_.cost, false, 0);
+        fail(Status(StatusCode::RESOURCE_EXHAUSTED, "Server busy"));
+        return;
+    }
+    // If the slot was free, the kick is already on its way.
+    std::lock_guard<std::mutex> guard(mtx_);
+    if (!granted_) {
+        deadline_set_ = true;
+        ops_++;
+        deadline_.Set(cq_, std::chrono::system_clock::now() +
+                      (deadline - std::chrono::steady_clock::now()),
+                      &tags_[kDeadline]);
+    }
+}
+
+// Move the call along as far as it will go without waiting.
+void AsyncCodeSearch::call::step() {
+    if (phase_ == kPreparing) {
+        {
+            std::lock_guard<std::mutex> guard(mtx_);
+            if (!helped_)
+                return;
+            helped_ = false;
+        }
+        queue();
+    }
+    if (phase_ == kQueued) {
+        std::lock_guard<std::mutex> guard(mtx_);
+        if (!granted_)
+            return;
+    }
+    if (phase_ == kQueued) {
+        if (deadline_set_)
+            deadline_.Cancel();
+        run();
+    }
+    if (phase_ == kSending && !writing_)
+        send();
+    if (phase_ != kRunning)
+        return;
+
+    if (search_.tags) {
+        {
+            std::lock_guard<std::mutex> guard(mtx_);
+            if (!helped_)
+                return;
+        }
+        if (all_)
+            *all_ = response_;
+        split();
+        complete(tag_stats_);
+        return;
+    }
+
+    std::unique_ptr<add_match> add_all(all_ ? new add_match(all_.get()) : nullptr);
+    add_match add(&response_);
+    match_stats stats;
+    bool done = thread_->collect(pending_.get(), [&](const match_result *m) {
+            add(m);
+            if (add_all)
+                (*add_all)(m);
+        }, &stats);
+    split();
+
+    if (done) {
+        complete(stats);
+        return;
+    }
+    if (stream_ && !writing_ &&
+        (!batches_.empty() || response_.results_size() >= kStreamBatchSize ||
+         (response_.results_size() > 0 &&
+          std::chrono::steady_clock::now() - flushed_ >= std::chrono::milliseconds(kStreamFlushMs))))
+        write();
+}
+
+// The call holds a slot: start its search.
+void AsyncCodeSearch::call::run() {
+    impl_->admitted(search_.q, search_.cost, true, monotonic_ns() - queued_at_);
+    phase_ = kRunning;
+    flushed_ = std::chrono::steady_clock::now();
+    if (search_.tags) {
+        // Looked up on a helper thread, which leaves response_ to it
+        // until then.
+        svc_->work_.push([this] {
+                add_match add(&response_);
+                search_.tags->search(search_.q, add, &tag_stats_);
+                {
+                    std::lock_guard<std::mutex> guard(mtx_);
+                    helped_ = true;
+                }
+                kick();
+            });
+        return;
+    }
+    thread_.reset(new code_searcher::search_thread(search_.cs, impl_->pool_));
+    pending_ = thread_->start(search_.q, code_searcher::search_thread::transform_func(),
+                              [this] { kick(); });
+}
+
+// The search is over: give up the slot, and send what is left.
+void AsyncCodeSearch::call::complete(const match_stats& stats) {
+    impl_->fill_stats(search_, stats, response_.mutable_stats());
+    pending_.reset();
+    impl_->admission_.leave();
+    if (all_) {
+        *all_->mutable_stats() = response_.stats();
+        impl_->cache_result(key_, *all_);
+    } else if (cacheable_ && !stream_) {
+        impl_->cache_result(key_, response_);
+    }
+    phase_ = kSending;
+    if (!writing_)
+        send();
+}
+
+// For a stream, move all but the last kStreamBatchSize or fewer of
+// response_'s results into batches_, in order. The stats stay with
+// response_, to go last.
+void AsyncCodeSearch::call::split() {
+    if (!stream_ || response_.results_size() <= kStreamBatchSize)
+        return;
+    ::CodeSearchResult all;
+    all.mutable_results()->Swap(response_.mutable_results());
+    int n = all.results_size(), i = 0;
+    for (; n - i > kStreamBatchSize; i += kStreamBatchSize) {
+        batches_.emplace_back();
+        for (int j = i; j < i + kStreamBatchSize; j++)
+            batches_.back().add_results()->Swap(all.mutable_results(j));
+    }
+    for (; i < n; i++)
+        response_.add_results()->Swap(all.mutable_results(i));
+}
+
+// Nothing is being written and response_ is complete: write the next
+// batch, or if there are none left, response_ and the status.
+void AsyncCodeSearch::call::send() {
+    if (batches_.empty())
+        finish();
+    else
+        write();
+}
+
+// Write batches_' first batch, or else response_ so far.
+void AsyncCodeSearch::call::write() {
+    if (!batches_.empty()) {
+        sending_.Swap(&batches_.front());
+        batches_.pop_front();
+    } else {
+        sending_.Swap(&response_);
+        response_.Clear();
+    }
+    writing_ = true;
+    flushed_ = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> guard(mtx_);
+        ops_++;
+    }
+    writer_.Write(sending_, &tags_[kWrite]);
+}
+
+void AsyncCodeSearch::call::fail(const Status& st) {
+    phase_ = kFinishing;
+    {
+        std::lock_guard<std::mutex> guard(mtx_);
+        ops_++;
+    }
+    if (stream_)
+        writer_.Finish(st, &tags_[kFinish]);
+    else
+        responder_.FinishWithError(st, &tags_[kFinish]);
+}
+
+// Send response_, which is complete, and the status.
+void AsyncCodeSearch::call::finish() {
+    phase_ = kFinishing;
+    {
+        std::lock_guard<std::mutex> guard(mtx_);
+        ops_++;
+    }
+    if (stream_)
+        writer_.WriteAndFinish(response_, grpc::WriteOptions(), Status::OK, &tags_[kFinish]);
+    else
+        responder_.Finish(response_, Status::OK, &tags_[kFinish]);
+}
+
+// From any thread: have step() run on the call's I/O thread soon. Kicks
+// that arrive while one is pending are folded into it.
+void AsyncCodeSearch::call::kick() {
+    std::lock_guard<std::mutex> guard(mtx_);
+    if (kicked_)
+        return;
+    kicked_ = true;
+    ops_++;
+    async_kicks.inc();
+    kick_.Set(cq_, gpr_now(GPR_CLOCK_MONOTONIC), &tags_[kKick]);
+}
+
+AsyncCodeSearch::AsyncCodeSearch(code_searcher *cs, code_searcher *tagdata,
+                                 code_searcher::search_pool *pool)
+    : impl_(cs, tagdata, pool), calls_(0) {
+}
+
+AsyncCodeSearch::~AsyncCodeSearch() {
+    work_.close();
+    for (auto it = helpers_.begin(); it != helpers_.end(); ++it)
+        it->join();
+}
+
+Status AsyncCodeSearch::Info(ServerContext* context, const ::InfoRequest* request, ::ServerInfo* response) {
+    return impl_.Info(context, request, response);
+}
+
+Status AsyncCodeSearch::SearchFiles(ServerContext* context, const ::Query* request, ::CodeSearchResult* response) {
+    return impl_.SearchFiles(context, request, response);
+}
+
+Status AsyncCodeSearch::Reload(ServerContext* context, const ::ReloadRequest* request, ::ServerInfo* response) {
+    return impl_.Reload(context, request, response);
+}
+
+Status AsyncCodeSearch::Stats(ServerContext* context, const ::StatsRequest* request, ::ServerStats* response) {
+    return impl_.Stats(context, request, response);
+}
+
+void AsyncCodeSearch::Register(grpc::ServerBuilder* builder, int nthreads) {
+    builder->RegisterService(this);
+    for (int i = 0; i < nthreads; ++i)
+        cqs_.push_back(builder->AddCompletionQueue());
+}
+
+void AsyncCodeSearch::help() {
+    std::function<void ()> fn;
+    while (work_.pop(&fn))
+        fn();
+}
+
+void AsyncCodeSearch::Start() {
+    for (auto it = cqs_.begin(); it != cqs_.end(); ++it) {
+        grpc::ServerCompletionQueue *cq = it->get();
+        new call(this, cq, false);
+        new call(this, cq, true);
+        threads_.emplace_back(std::thread([this, cq] { serve(cq); }));
+        helpers_.emplace_back(std::thread([this] { help(); }));
+    }
+}
+
+void AsyncCodeSearch::Shutdown() {
+    {
+        std::unique_lock<std::mutex> lock(calls_mtx_);
+        calls_cond_.wait(lock, [this] { return calls_ == 0; });
+    }
+    for (auto it = cqs_.begin(); it != cqs_.end(); ++it)
+        (*it)->Shutdown();
+    for (auto it = threads_.begin(); it != threads_.end(); ++it)
+        it->join();
+    threads_.clear();
+    work_.close();
+    for (auto it = helpers_.begin(); it != helpers_.end(); ++it)
+        it->join();
+    helpers_.clear();
+}
+
+void AsyncCodeSearch::serve(grpc::ServerCompletionQueue* cq) {
+    void *t;
+    bool ok;
+    while (cq->Next(&t, &ok)) {
+        call::tag *tag = static_cast<call::tag*>(t);
+        tag->c->proceed(tag->what, ok);
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef CODESEARCH_ASYNC_SERVER_H
+#define CODESEARCH_ASYNC_SERVER_H
+
+#include "src/tools/grpc_server.h"
+#include "src/lib/thread_queue.h"
+
+#include <grpc++/server_builder.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * CodeSearchImpl with Search and SearchStream served from gRPC's
+ * completion queues. Each of a few I/O threads polls its own queue and
+ * moves every call on it along as events arrive, so a call that is
+ * waiting -- for an admission slot, for the pool's workers or for a
+ * slow client to take the next batch -- holds no thread at all; the
+ * only CPU work done per match is in the search pool. Parsing a
+ * query (compiling its regexps and working out its index key) and
+ * looking up tags can take a while for some queries, so they are done
+ * on helper threads, one per I/O thread, rather than holding up every
+ * other call on the I/O thread. SearchFiles is cheap and Info, Reload
+ * and Stats are rare, so they stay on gRPC's synchronous threads.
+ */
+class AsyncCodeSearch final
+    : public CodeSearch::WithAsyncMethod_Search<
+        CodeSearch::WithAsyncMethod_SearchStream<CodeSearch::Service> > {
+ public:
+    // As for CodeSearchImpl.
+    AsyncCodeSearch(code_searcher *cs, code_searcher *tagdata,
+                    code_searcher::search_pool *pool = nullptr);
+    virtual ~AsyncCodeSearch();
+
+    virtual grpc::Status Info(grpc::ServerContext* context, const ::InfoRequest* request, ::ServerInfo* response);
+    virtual grpc::Status SearchFiles(grpc::ServerContext* context, const ::Query* request, ::CodeSearchResult* response);
+    virtual grpc::Status Reload(grpc::ServerContext* context, const ::ReloadRequest* request, ::ServerInfo* response);
+    virtual grpc::Status Stats(grpc::ServerContext* context, const ::StatsRequest* request, ::ServerStats* response);
+
+    // Register with `builder', along with a completion queue for each
+    // of `nthreads' I/O threads (and as many helper threads). Call
+    // before BuildAndStart().
+    void Register(grpc::ServerBuilder* builder, int nthreads);
+    // Start taking calls, once the server is built.
+    void Start();
+    // Once the server has been Shutdown(), wait for every call to
+    // finish and stop the I/O and helper threads.
+    void Shutdown();
+
+ private:
+    class call;
+
+    void serve(grpc::ServerCompletionQueue* cq);
+    void help();
+
+    CodeSearchImpl impl_;
+    std::vector<std::unique_ptr<grpc::ServerCompletionQueue> > cqs_;
+    std::vector<std::thread> threads_;
+    // Work handed off by calls, and the helper threads doing it.
+    thread_queue<std::function<void ()> > work_;
+    std::vector<std::thread> helpers_;
+
+    // Calls not yet freed, including those waiting for a request;
+    // protected by calls_mtx_.
+    std::mutex calls_mtx_;
+    std::condition_variable calls_cond_;
+    int calls_;
+};
+
+#endif /* CODESEARCH_ASYNC_SERVER_H */
@@ -14,10 +14,13 @@
 #include "src/re_width.h"
 #include "src/git_indexer.h"
 #include "src/fs_indexer.h"
+#include "src/partition.h"
 
 #include "src/tools/transport.h"
 #include "src/tools/limits.h"
 #include "src/tools/grpc_server.h"
+#include "src/tools/async_server.h"
+#include "src/tools/shard_router.h"
 
 #include <stdio.h>
 #include <sys/socket.h>
@@ -31,6 +34,8 @@
 #include <iostream>
 #include <functional>
 #include <thread>
+#include <set>
+#include <sstream>
 
 #include <gflags/gflags.h>
 
@@ -45,13 +50,21 @@
 
 DEFINE_int32(concurrency, 16, "Number of concurrent queries to allow.");
 DEFINE_string(dump_index, "", "Dump the produced index to a specified file");
-DEFINE_string(load_index, "", "Load the index from a file instead of walking the repository");
+DEFINE_string(load_index, "", "Load the index from a file instead of walking the repository. A comma-separated list loads several segments, oldest first, and searches them together.");
 DEFINE_string(load_tags, "", "Load the index built from a tags file.");
+DEFINE_string(update_index, "", "Build the index incrementally from this earlier index, reusing its chunks and every file git shows unchanged. Needs indexes built with --revparse; rebuild from scratch now and then to drop the lines of removed files.");
+DEFINE_bool(delta, false, "With --update_index, write only what changed since that index, with tombstones for the files it replaces, as a segment to load after it.");
+DEFINE_int32(dump_shards, 0, "With --dump_index, split the index into this many shards of about the same size, to serve behind --shards: FILE.idx is written as FILE.0.idx, FILE.1.idx and so on, with a manifest of the trees in each at FILE.shards.json.");
 DEFINE_bool(quiet, false, "Do the search, but don't print results.");
 DEFINE_string(listen, "", "Listen on a socket for connections. example: -listen tcp://localhost:9999");
 DEFINE_string(grpc, "", "Listen for GRPC clients. example: -grpc localhost:9999");
+DEFINE_int32(grpc_io_threads, 0, "Serve GRPC searches from this many threads, each handling many calls at once (0 = a thread per call).");
+DEFINE_string(shards, "", "Instead of loading an index, serve --grpc by searching the codesearch servers at these comma-separated host:port addresses, each holding some of the trees, and merging their results.");
 DEFINE_string(listen_tags, "", "Listen on a socket for connections to tag search. example: -listen_tags tcp://localhost:9998");
 
+DECLARE_bool(global_dedup);
+DECLARE_int32(build_memory_mb);
+
 using namespace std;
 using namespace re2;
 
@@ -92,45 +105,31 @@ struct codesearch_matcher {
 };
 
 struct tagsearch_matcher {
-    tagsearch_matcher(code_searcher *cs, code_searcher *tagdata) : tagdata_(tagdata) {
+    tagsearch_matcher(code_searcher *cs, code_searcher *tagdata) {
         ts_.cache_indexed_files(cs);
+        ts_.index_tags(tagdata);
     }
 
     match_stats operator()(code_searcher::search_thread *s, query *q, codesearch_transport *tx) {
         match_stats stats;
-        // the negation constraints will be checked when we transform the match
-        // (unfortunately, we can't construct a line query that checks these)
-        query constraints;
-        constraints.negate.file_pat.swap(q->negate.file_pat);
-        constraints.negate.tags_pat.swap(q->negate.tags_pat);
-
-        // modify the line pattern to match the constraints that we can handle now
-        std::string regex = tag_searcher::create_tag_line_regex_from_query(q);
-        q->line_pat.reset(new RE2(regex, q->line_pat->options()));
-        q->file_pat.reset();
-        q->tags_pat.reset();
-
         sem_wait(&interact_sem);
-        s->match(*q,
-                 print_match(tx),
-                 boost::bind(&tag_searcher::transform, &ts_, &constraints, _1),
-                 &stats);
+        ts_.search(*q, print_match(tx), &stats);
         sem_post(&interact_sem);
         return stats;
     }
 protected:
-    code_searcher *tagdata_;
     tag_searcher ts_;
 };
 
-static std::string pat(const std::unique_ptr<RE2> &p) {
+static std::string pat(const std::shared_ptr<const RE2> &p) {
     if (p.get() == 0)
         return "";
     return p->pattern();
 }
 
-void interact(code_searcher *cs, codesearch_transport *tx, const match_func& match) {
-    code_searcher::search_thread search(cs);
+void interact(code_searcher *cs, code_searcher::search_pool *pool,
+              codesearch_transport *tx, const match_func& match) {
+    code_searcher::search_thread search(cs, pool);
     WidthWalker width;
 
     index_info info;
@@ -179,7 +178,8 @@ void interact(code_searcher *cs, codesearch_transport *tx, const match_func& mat
     }
 }
 
-void build_index(code_searcher *cs, const vector<std::string> &argv) {
+void build_index(code_searcher *cs, const vector<std::string> &argv,
+                 code_searcher *base) {
     if (argv.size() != 2) {
         fprintf(stderr, "Usage: %s [OPTIONS] config.json\n", argv[0].c_str());
         exit(1);
@@ -211,24 +211,46 @@ void build_index(code_searcher *cs, const vector<std::string> &argv) {
         fprintf(stderr, "done\n");
     }
 
+    git_blob_map indexed;
+    // The (name, version) of each tree in `base' that a walk was
+    // compared against.
+    std::set<pair<string, string> > compared;
     for (auto it = spec.repos.begin(); it != spec.repos.end(); ++it) {
         fprintf(stderr, "Walking repo_spec name=%s, path=%s\n",
                 it->name.c_str(), it->path.c_str());
-        git_indexer indexer(cs, it->path, it->name, it->metadata);
+        git_indexer indexer(cs, it->path, it->name, it->metadata, &indexed);
+        if (base)
+            indexer.set_base(base, FLAGS_delta);
         for (auto rev = it->revisions.begin();
              rev != it->revisions.end(); ++rev) {
             fprintf(stderr, "  walking %s... ", rev->c_str());
             indexer.walk(*rev);
             fprintf(stderr, "done\n");
         }
+        for (auto t : indexer.base_trees())
+            compared.insert(make_pair(t->name, t->version));
+    }
+
+    // Anything else in the base was reindexed in full, or is gone.
+    if (base && FLAGS_delta) {
+        vector<indexed_tree> trees = base->trees();
+        for (auto it = trees.begin(); it != trees.end(); ++it)
+            if (!compared.count(make_pair(it->name, it->version)))
+                cs->add_tombstone(it->name, it->version, "");
     }
 }
 
 void initialize_search(code_searcher *search,
                        code_searcher *tags,
                        int argc, char **argv) {
+    if (FLAGS_dump_shards > 0 && FLAGS_dump_index.empty())
+        die("--dump_shards needs --dump_index to name the shards.");
+    if (FLAGS_dump_shards > 0 && FLAGS_delta)
+        die("--dump_shards cannot split a --delta index.");
+    if (FLAGS_build_memory_mb > 0 && FLAGS_global_dedup)
+        die("--build_memory_mb needs --noglobal_dedup.");
     if (FLAGS_load_index.size() == 0) {
-        if (FLAGS_dump_index.size())
+        if (FLAGS_dump_index.size() && FLAGS_dump_shards <= 0)
             search->set_alloc(make_dump_allocator(search, FLAGS_dump_index));
         else
             search->set_alloc(make_mem_allocator());
@@ -239,7 +261,16 @@ void initialize_search(code_searcher *search,
 
         timer tm;
         struct timeval elapsed;
-        build_index(search, args);
+        unique_ptr<code_searcher> base;
+        if (FLAGS_update_index.size()) {
+            if (FLAGS_update_index == FLAGS_dump_index)
+                die("--update_index and --dump_index must be different files.");
+            base.reset(new code_searcher);
+            base->load_index(FLAGS_update_index);
+            if (!FLAGS_delta)
+                search->copy_chunks(base.get());
+        }
+        build_index(search, args, base.get());
         fprintf(stderr, "Finalizing...\n");
         search->finalize();
         elapsed = tm.elapsed();
@@ -247,18 +278,29 @@ void initialize_search(code_searcher *search,
                 (int)elapsed.tv_sec, (int)elapsed.tv_usec);
         metric::dump_all();
     } else {
-        search->load_index(FLAGS_load_index);
+        vector<string> paths = split_index_paths(FLAGS_load_index);
+        if (paths.size() > 1 && FLAGS_dump_index.size() && FLAGS_dump_shards <= 0)
+            die("--dump_index cannot write out several segments as one index.");
+        search->load_segments(paths);
     }
     if (FLAGS_load_tags.size() != 0) {
         tags->load_index(FLAGS_load_tags);
     }
-    if (FLAGS_dump_index.size() && FLAGS_load_index.size())
+    if (FLAGS_dump_shards > 0) {
+        timer tm;
+        index_partition p = partition_index(search, FLAGS_dump_shards);
+        dump_partition(search, p, FLAGS_dump_index);
+        fprintf(stderr, "wrote %d shards in %ldms\n", FLAGS_dump_shards,
+                timeval_ms(tm.elapsed()));
+    } else if (FLAGS_dump_index.size() && FLAGS_load_index.size()) {
         search->dump_index(FLAGS_dump_index);
+    }
 }
 
 struct child_state {
     int fd;
     code_searcher *search;
+    code_searcher::search_pool *pool;
     match_func match;
 };
 
@@ -286,7 +328,7 @@ void *handle_client(void *data) {
 
 
     codesearch_transport *tx = new codesearch_transport(r, w);
-    interact(child->search, tx, child->match);
+    interact(child->search, child->pool, tx, child->match);
     delete tx;
     delete child;
     fclose(r);
@@ -357,7 +399,8 @@ int bind_to_address(string spec) {
     return server;
 }
 
-void listen(code_searcher *search, const string& path, const match_func& match) {
+void listen(code_searcher *search, code_searcher::search_pool *pool,
+            const string& path, const match_func& match) {
     int server = bind_to_address(path);
 
     printf("codesearch: listening on %s.\n", path.c_str());
@@ -370,6 +413,7 @@ void listen(code_searcher *search, const string& path, const match_func& match)
         child_state *state = new child_state;
         state->fd = fd;
         state->search = search;
+        state->pool = pool;
         state->match = match;
 
         pthread_t thread;
@@ -377,13 +421,40 @@ void listen(code_searcher *search, const string& path, const match_func& match)
     }
 }
 
-void listen_grpc(code_searcher *search, code_searcher *tags, const string& addr) {
-    CodeSearchImpl service(search, tags);
+void listen_grpc(code_searcher *search, code_searcher *tags,
+                 code_searcher::search_pool *pool, const string& addr) {
+    ServerBuilder builder;
+    builder.AddListeningPort(addr, grpc::InsecureServerCredentials());
+    if (FLAGS_grpc_io_threads <= 0) {
+        CodeSearchImpl service(search, tags, pool);
+        builder.RegisterService(&service);
+        std::unique_ptr<Server> server(builder.BuildAndStart());
+        server->Wait();
+        return;
+    }
+
+    AsyncCodeSearch service(search, tags, pool);
+    service.Register(&builder, FLAGS_grpc_io_threads);
+    std::unique_ptr<Server> server(builder.BuildAndStart());
+    service.Start();
+    server->Wait();
+    service.Shutdown();
+}
+
+void listen_router(const string& addr) {
+    vector<string> shards;
+    std::stringstream spec(FLAGS_shards);
+    string shard;
+    while (std::getline(spec, shard, ','))
+        if (!shard.empty())
+            shards.push_back(shard);
 
+    ShardRouter service(shards);
     ServerBuilder builder;
     builder.AddListeningPort(addr, grpc::InsecureServerCredentials());
     builder.RegisterService(&service);
     std::unique_ptr<Server> server(builder.BuildAndStart());
+    printf("codesearch: routing %d shards on %s.\n", int(shards.size()), addr.c_str());
     server->Wait();
 }
 
@@ -393,6 +464,14 @@ int main(int argc, char **argv) {
 
     prctl(PR_SET_PDEATHSIG, SIGINT);
 
+    if (FLAGS_shards.size()) {
+        if (FLAGS_grpc.empty())
+            die("--shards needs --grpc to listen on.");
+        signal(SIGPIPE, SIG_IGN);
+        listen_router(FLAGS_grpc);
+        return 0;
+    }
+
     code_searcher search;
     code_searcher tags;
 
@@ -403,20 +482,23 @@ int main(int argc, char **argv) {
     if (sem_init(&interact_sem, 0, FLAGS_concurrency) < 0)
         die_errno("sem_init");
 
+    // Every query, from any listener, runs on this one set of workers.
+    code_searcher::search_pool pool;
+
     std::vector<std::thread> listeners;
     if (FLAGS_grpc.size()) {
         listeners.emplace_back(
-            std::thread(boost::bind(&listen_grpc, &search, &tags, FLAGS_grpc)));
+            std::thread(boost::bind(&listen_grpc, &search, &tags, &pool, FLAGS_grpc)));
     }
     if (FLAGS_listen.size()) {
         codesearch_matcher matcher;
         listeners.emplace_back(
-            std::thread(boost::bind(&listen, &search, FLAGS_listen, matcher)));
+            std::thread(boost::bind(&listen, &search, &pool, FLAGS_listen, matcher)));
     }
     if (FLAGS_listen_tags.size()) {
         tagsearch_matcher matcher(&search, &tags);
         listeners.emplace_back(
-            std::thread(boost::bind(&listen, &tags, FLAGS_listen_tags, matcher)));
+            std::thread(boost::bind(&listen, &tags, &pool, FLAGS_listen_tags, matcher)));
     }
     for (auto& listener : listeners) {
         listener.join();
@@ -424,7 +506,7 @@ int main(int argc, char **argv) {
 
     if (listeners.size() == 0) {
         codesearch_transport *tx = new codesearch_transport(stdin, stdout);
-        interact(&search, tx, codesearch_matcher());
+        interact(&search, &pool, tx, codesearch_matcher());
         delete tx;
     }
 
@@ -8,6 +8,8 @@ using std::string;
 extern int analyze_re(int, char**);
 extern int dump_file(int, char**);
 extern int inspect_index(int, char**);
+extern int merge_index(int, char**);
+extern int replay(int, char**);
 
 struct _command {
     string name;
@@ -16,6 +18,8 @@ struct _command {
     {"analyze-re", analyze_re},
     {"inspect-index", inspect_index},
     {"dump-file", dump_file},
+    {"merge-index", merge_index},
+    {"replay", replay},
 };
 
 int main(int argc, char **argv) {
@@ -1,4 +1,5 @@
 #include "src/lib/debug.h"
+#include "src/lib/metrics.h"
 #include "src/lib/timer.h"
 
 #include "src/codesearch.h"
@@ -13,8 +14,9 @@
 #include <string>
 #include <algorithm>
 #include <functional>
+#include <chrono>
 
-#include <boost/bind.hpp>
+#include <gflags/gflags.h>
 
 using grpc::ServerContext;
 using grpc::Status;
@@ -22,16 +24,65 @@ using grpc::StatusCode;
 
 using std::string;
 
-CodeSearchImpl::CodeSearchImpl(code_searcher *cs, code_searcher *tagdata)
-    : cs_(cs), tagdata_(tagdata), tagmatch_(nullptr) {
+DEFINE_int32(result_cache_mb, 0, "Keep up to this many MB of responses to recent searches, to answer repeats without searching (0 = none).");
+DEFINE_int32(max_concurrent_searches, 0, "Run at most this many searches at once, queueing the rest cheapest first (0 = no limit).");
+DEFINE_int32(max_queued_searches, 64, "Fail searches with RESOURCE_EXHAUSTED rather than queue more than this many under --max_concurrent_searches.");
+DEFINE_int32(max_query_matches, 10000, "The most results a client may ask a search for (0 = no limit).");
+DEFINE_int32(max_query_timeout_ms, 10000, "The longest timeout a client may ask a search for, in milliseconds (0 = no limit).");
+DEFINE_bool(allow_reload, false, "Serve Reload calls, which switch to any index the server can read. Only enable this where every client of --grpc is trusted.");
+DEFINE_int32(admission_wait_ms, 1000, "Fail searches with RESOURCE_EXHAUSTED that have waited this long for a slot under --max_concurrent_searches.");
+DECLARE_int32(max_context_lines);
+
+namespace {
+    metric result_cache_hits("search.result_cache.hits");
+    metric result_cache_misses("search.result_cache.misses");
+    metric result_cache_bytes("search.result_cache.bytes_served");
+    metric admission_rejected("search.admission.rejected");
+    metric admission_waiting("search.admission.waiting", metric::gauge);
+    histogram admission_wait("search.admission.wait");
+
+    // Priority classes for admission_, cheapest first.
+    enum {
+        kCostCheap,
+        kCostIndexed,
+        kCostScan,
+        kCostClasses
+    };
+};
+
+CodeSearchImpl::CodeSearchImpl(code_searcher *cs, code_searcher *tagdata,
+                               code_searcher::search_pool *pool)
+    : state_(new index_state),
+      pool_(pool), own_pool_(pool == nullptr),
+      results_(size_t(FLAGS_result_cache_mb) << 20,
+               result_cache_hits, result_cache_misses),
+      admission_(FLAGS_max_concurrent_searches, FLAGS_max_queued_searches,
+                 kCostClasses) {
+    if (own_pool_)
+        pool_ = new code_searcher::search_pool();
+    state_->generation = 0;
+    // The caller keeps ownership of the indexes it passed in.
+    state_->cs.reset(cs, [](code_searcher *) {});
     if (tagdata != nullptr) {
-        tagmatch_ = new tag_searcher;
-        tagmatch_->cache_indexed_files(cs_);
+        state_->tags.reset(tagdata, [](code_searcher *) {});
+        state_->tagmatch.reset(new tag_searcher);
+        state_->tagmatch->cache_indexed_files(cs);
+        state_->tagmatch->index_tags(tagdata);
     }
 }
 
 CodeSearchImpl::~CodeSearchImpl() {
-    delete tagmatch_;
+    state_.reset();
+    if (own_pool_)
+        delete pool_;
+}
+
+CodeSearchImpl::index_state::~index_state() {
+}
+
+std::shared_ptr<CodeSearchImpl::index_state> CodeSearchImpl::state() {
+    std::lock_guard<std::mutex> guard(state_mtx_);
+    return state_;
 }
 
 string trace_id_from_request(ServerContext *ctx) {
@@ -45,16 +96,23 @@ Status CodeSearchImpl::Info(ServerContext* context, const ::InfoRequest* request
     scoped_trace_id trace(trace_id_from_request(context));
     log("Info()");
 
-    response->set_name(cs_->name());
-    std::vector<indexed_tree> trees = cs_->trees();
+    fill_info(state().get(), response);
+    return Status::OK;
+}
+
+void CodeSearchImpl::fill_info(index_state *state, ::ServerInfo* response) {
+    code_searcher *cs = state->cs.get();
+    response->set_name(cs->name());
+    std::vector<indexed_tree> trees = cs->trees();
     for (auto it = trees.begin(); it != trees.end(); ++it) {
         auto insert = response->add_trees();
         insert->set_name(it->name);
         insert->set_version(it->version);
-        if (it->metadata == NULL)
+        json_object *parsed = it->parse_metadata();
+        if (parsed == NULL)
             continue;
         auto metadata = insert->mutable_metadata();
-        json_object_object_foreach(it->metadata, key, val) {
+        json_object_object_foreach(parsed, key, val) {
             switch (json_object_get_type(val)) {
             case json_type_null:
             case json_type_array:
@@ -70,21 +128,82 @@ Status CodeSearchImpl::Info(ServerContext* context, const ::InfoRequest* request
                 break;
             }
         }
+        json_object_put(parsed);
     }
-    response->set_has_tags(tagdata_ != nullptr);
+    response->set_has_tags(state->tags != nullptr);
+}
+
+Status CodeSearchImpl::Reload(ServerContext* context, const ::ReloadRequest* request, ::ServerInfo* response) {
+    scoped_trace_id trace(trace_id_from_request(context));
+    log(current_trace_id(), "Reload(%s)", request->index_path().c_str());
+
+    if (!FLAGS_allow_reload)
+        return Status(StatusCode::PERMISSION_DENIED,
+                      "reloading is disabled; start the server with --allow_reload");
+    if (request->index_path().empty())
+        return Status(StatusCode::INVALID_ARGUMENT, "index_path is required");
+
+    std::lock_guard<std::mutex> reload_guard(reload_mtx_);
+    string err;
+    // load_index() treats a bad file as fatal, taking the server down
+    // with it, so check every file is whole before committing to it.
+    vector<string> paths = split_index_paths(request->index_path());
+    for (auto it = paths.begin(); it != paths.end(); ++it)
+        if (!check_index_file(*it, &err))
+            return Status(StatusCode::FAILED_PRECONDITION, err);
+    if (!request->tags_path().empty() &&
+        !check_index_file(request->tags_path(), &err))
+        return Status(StatusCode::FAILED_PRECONDITION, err);
+
+    timer tm;
+    std::shared_ptr<index_state> next(new index_state);
+    next->generation = state()->generation + 1;
+    next->cs.reset(new code_searcher);
+    next->cs->load_segments(paths);
+    if (!request->tags_path().empty()) {
+        next->tags.reset(new code_searcher);
+        next->tags->load_index(request->tags_path());
+    } else {
+        next->tags = state()->tags;
+    }
+    // The tags are looked up afresh even if they haven't changed, as
+    // they point at files of the new index.
+    if (next->tags != nullptr) {
+        next->tagmatch.reset(new tag_searcher);
+        next->tagmatch->cache_indexed_files(next->cs.get());
+        next->tagmatch->index_tags(next->tags.get());
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(state_mtx_);
+        state_.swap(next);
+    }
+    // Entries for the old index can no longer be looked up; a search
+    // still running against it may add more, but they will age out.
+    results_.clear();
+    log(current_trace_id(), "reloaded index from %s in %ldms",
+        request->index_path().c_str(), timeval_ms(tm.elapsed()));
+
+    fill_info(state().get(), response);
+    return Status::OK;
+}
+
+Status CodeSearchImpl::Stats(ServerContext* context, const ::StatsRequest* request, ::ServerStats* response) {
+    response->set_metrics(metric::render_all());
     return Status::OK;
 }
 
-Status extract_regex(std::unique_ptr<RE2> *out,
+Status extract_regex(std::shared_ptr<const RE2> *out,
                      const std::string &label,
                      const std::string &input,
-                     RE2::Options &opts) {
+                     RE2::Options &opts,
+                     int *width = 0) {
 
     if (input.empty()) {
-        out->reset(nullptr);
+        out->reset();
         return Status::OK;
     }
-    std::unique_ptr<RE2> re(new RE2(input, opts));
+    std::shared_ptr<const RE2> re = compile_re(input, opts, width);
     if (!re->ok()) {
         return Status(StatusCode::INVALID_ARGUMENT, label + ": " + re->error());
     }
@@ -92,13 +211,19 @@ Status extract_regex(std::unique_ptr<RE2> *out,
     return Status::OK;
 }
 
-Status parse_query(query *q, const ::Query* request, ::CodeSearchResult* response) {
+// A client's override of a server default, no bigger than `limit'
+// (if it's positive).
+static int clamp_override(int requested, int limit) {
+    return limit > 0 ? std::min(requested, limit) : requested;
+}
+
+Status parse_query(query *q, const ::Query* request, int *line_width) {
     RE2::Options opts;
     default_re2_options(opts);
     opts.set_case_sensitive(!request->fold_case());
 
     Status status = Status::OK;
-    status = extract_regex(&q->line_pat, "line", request->line(), opts);
+    status = extract_regex(&q->line_pat, "line", request->line(), opts, line_width);
     if (status.ok())
         status = extract_regex(&q->file_pat, "file", request->file(), opts);
     if (status.ok())
@@ -111,53 +236,220 @@ Status parse_query(query *q, const ::Query* request, ::CodeSearchResult* respons
         status = extract_regex(&q->negate.tree_pat, "-repo", request->not_repo(), opts);
     if (status.ok())
         status = extract_regex(&q->negate.tags_pat, "-tags", request->not_tags(), opts);
+
+    if (request->max_matches() > 0)
+        q->max_matches = clamp_override(request->max_matches(), FLAGS_max_query_matches);
+    if (request->timeout_ms() > 0)
+        q->timeout = clamp_override(request->timeout_ms(), FLAGS_max_query_timeout_ms);
+    if (request->context_lines() > 0)
+        q->context_lines = std::min(request->context_lines(),
+                                    std::max(FLAGS_max_context_lines, 0));
+    else if (request->context_lines() < 0)
+        q->context_lines = 0;
+    q->ranked = request->ranked();
     return status;
 }
 
-class add_match {
-public:
-    add_match(CodeSearchResult* response) : response_(response) {}
-
-    void operator()(const match_result *m) const {
-        auto result = response_->add_results();
-        result->set_tree(m->file->tree->name);
-        result->set_version(m->file->tree->version);
-        result->set_path(m->file->path);
-        result->set_line_number(m->lno);
-        std::transform(m->context_before.begin(), m->context_before.end(),
-                       RepeatedPtrFieldBackInserter(result->mutable_context_before()),
-                       mem_fun_ref(&re2::StringPiece::ToString));
-
-        std::transform(m->context_after.begin(), m->context_after.end(),
-                       RepeatedPtrFieldBackInserter(result->mutable_context_after()),
-                       mem_fun_ref(&re2::StringPiece::ToString));
-        result->mutable_bounds()->set_left(m->matchleft);
-        result->mutable_bounds()->set_right(m->matchright);
-        result->set_line(m->line.ToString());
+static void fill_trace(const query_trace &trace, ::QueryTrace *out) {
+    out->set_trace_id(current_trace_id());
+    out->set_index_key(trace.index_key);
+    for (auto it = trace.tasks.begin(); it != trace.tasks.end(); ++it) {
+        ::TaskTrace *t = out->add_tasks();
+        t->set_chunk(it->chunk);
+        t->set_part(it->part);
+        switch (it->path) {
+        case task_trace::kSkipped:  t->set_path(TaskTrace::SKIPPED);  break;
+        case task_trace::kLiteral:  t->set_path(TaskTrace::LITERAL);  break;
+        case task_trace::kFiltered: t->set_path(TaskTrace::FILTERED); break;
+        case task_trace::kFull:     t->set_path(TaskTrace::FULL);     break;
+        case task_trace::kBatched:  t->set_path(TaskTrace::BATCHED);  break;
+        }
+        t->set_candidates(it->candidates);
+        t->set_scanned_instead(it->scanned_instead);
+        t->set_bytes_scanned(it->bytes_scanned);
+        t->set_try_matches(it->try_matches);
+        t->set_wall_time_us(it->wall_ns / 1000);
     }
+}
 
-private:
-    CodeSearchResult* response_;
-};
+add_match::add_match(CodeSearchResult* response) : response_(response) {}
+
+// Each field is copied once, straight from the index's mapped data,
+// into storage the message owns.
+void add_match::operator()(const match_result *m) const {
+    auto result = response_->add_results();
+    result->set_tree(m->file->tree->name);
+    result->set_version(m->file->tree->version);
+    result->set_path(m->file->path.data(), m->file->path.size());
+    result->set_line_number(m->lno);
+    result->mutable_context_before()->Reserve(m->context_before.size());
+    for (auto it = m->context_before.begin(); it != m->context_before.end(); ++it)
+        result->add_context_before(it->data(), it->size());
+    result->mutable_context_after()->Reserve(m->context_after.size());
+    for (auto it = m->context_after.begin(); it != m->context_after.end(); ++it)
+        result->add_context_after(it->data(), it->size());
+    result->mutable_bounds()->set_left(m->matchleft);
+    result->mutable_bounds()->set_right(m->matchright);
+    result->set_line(m->line.data(), m->line.size());
+    result->set_score(m->rank);
+}
 
-static std::string pat(const std::unique_ptr<RE2> &p) {
+static std::string pat(const std::shared_ptr<const RE2> &p) {
     if (p.get() == 0)
         return "";
     return p->pattern();
 }
 
+/*
+ * How expensive `q' is likely to be to run against `cs', as a priority
+ * class for admission_: cheap if the index narrows it to a sliver of
+ * the corpus, a scan if it leaves most of the corpus to read, and
+ * indexed otherwise. A large regex program makes every byte read
+ * dearer, so it moves the query up a class.
+ */
+static int cost_class(code_searcher *cs, const query &q) {
+    double fraction = cs->scan_fraction(*q.line_pat);
+    int cls;
+    if (fraction <= 0.01)
+        cls = kCostCheap;
+    else if (fraction < 0.5)
+        cls = kCostIndexed;
+    else
+        cls = kCostScan;
+    if (q.line_pat->ProgramSize() > kMaxProgramSize / 4 && cls < kCostScan)
+        cls++;
+    return cls;
+}
+
+string CodeSearchImpl::result_key(const index_state *state, const ::Query* request) {
+    return std::to_string(state->generation) + ":" + request->SerializeAsString();
+}
+
+bool CodeSearchImpl::cacheable(const ::Query* request) {
+    // A trace describes one particular run of the query.
+    return FLAGS_result_cache_mb > 0 && !request->trace();
+}
+
+bool CodeSearchImpl::cached_result(const string& key, ::CodeSearchResult* response) {
+    std::shared_ptr<const string> cached;
+    if (!results_.find(key, &cached) || !response->ParseFromString(*cached))
+        return false;
+    result_cache_bytes.inc(cached->size());
+    return true;
+}
+
+void CodeSearchImpl::cache_result(const string& key, const ::CodeSearchResult& response) {
+    // A search cut short by its deadline might find more next time.
+    if (response.stats().exit_reason() != SearchStats::NONE &&
+        response.stats().exit_reason() != SearchStats::MATCH_LIMIT)
+        return;
+    std::shared_ptr<const string> data(new string(response.SerializeAsString()));
+    results_.insert(key, data, data->size() + 2 * key.size());
+}
+
 Status CodeSearchImpl::Search(ServerContext* context, const ::Query* request, ::CodeSearchResult* response) {
-    WidthWalker width;
+    std::shared_ptr<index_state> state = this->state();
+    string key;
+    if (cacheable(request)) {
+        key = result_key(state.get(), request);
+        if (cached_result(key, response))
+            return Status::OK;
+    }
 
-    scoped_trace_id trace(trace_id_from_request(context));
+    Status st = DoSearch(context, request, state.get(), add_match(response),
+                         response->mutable_stats());
+    if (st.ok() && cacheable(request))
+        cache_result(key, *response);
+    return st;
+}
+
+Status CodeSearchImpl::SearchStream(ServerContext* context, const ::Query* request, ::grpc::ServerWriter< ::CodeSearchResult>* writer) {
+    std::shared_ptr<index_state> state = this->state();
+    string key;
+    // Every match, as well as each batch, if the response could be
+    // cached.
+    std::unique_ptr<CodeSearchResult> all;
+    if (cacheable(request)) {
+        key = result_key(state.get(), request);
+        CodeSearchResult response;
+        if (cached_result(key, &response)) {
+            // In batches, as if it had been searched.
+            CodeSearchResult batch;
+            for (int i = 0; i < response.results_size(); i++) {
+                if (batch.results_size() == kStreamBatchSize) {
+                    writer->Write(batch);
+                    batch.Clear();
+                }
+                batch.add_results()->Swap(response.mutable_results(i));
+            }
+            batch.mutable_stats()->Swap(response.mutable_stats());
+            writer->Write(batch);
+            return Status::OK;
+        }
+        all.reset(new CodeSearchResult);
+    }
+
+    CodeSearchResult batch;
+    // Kept out of `batch', which is cleared as each one is sent; only
+    // the last batch carries them.
+    SearchStats stats;
+    add_match add(&batch);
+    std::unique_ptr<add_match> add_all(all ? new add_match(all.get()) : nullptr);
+    std::chrono::steady_clock::time_point flushed = std::chrono::steady_clock::now();
+
+    Status st = DoSearch(context, request, state.get(), [&](const match_result *m) {
+            add(m);
+            if (add_all)
+                (*add_all)(m);
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (batch.results_size() >= kStreamBatchSize ||
+                now - flushed >= std::chrono::milliseconds(kStreamFlushMs)) {
+                writer->Write(batch);
+                batch.Clear();
+                flushed = now;
+            }
+        }, &stats);
+    if (!st.ok())
+        return st;
 
-    query q;
+    *batch.mutable_stats() = stats;
+    writer->Write(batch);
+    if (all) {
+        *all->mutable_stats() = stats;
+        cache_result(key, *all);
+    }
+    return Status::OK;
+}
+
+Status CodeSearchImpl::SearchFiles(ServerContext* context, const ::Query* request, ::CodeSearchResult* response) {
+    if (request->file().empty())
+        return Status(StatusCode::INVALID_ARGUMENT, "file: a path pattern is required");
+
+    // The path pattern goes where prepare() looks for a line pattern.
+    ::Query files(*request);
+    files.set_line(request->file());
+    files.clear_file();
+    files.clear_tags();
+    files.clear_not_tags();
+
+    std::shared_ptr<index_state> state = this->state();
+    return DoSearch(context, &files, state.get(), add_match(response),
+                    response->mutable_stats(), true);
+}
+
+Status CodeSearchImpl::prepare(ServerContext* context, const ::Query* request,
+                               index_state *state, prepared_search *out) {
+    query &q = out->q;
     Status st;
-    st = parse_query(&q, request, response);
+    int w = 0;
+    st = parse_query(&q, request, &w);
     if (!st.ok())
         return st;
 
     q.trace_id = current_trace_id();
+    if (context->deadline() != std::chrono::system_clock::time_point::max())
+        q.deadline = std::chrono::steady_clock::now() +
+            (context->deadline() - std::chrono::system_clock::now());
 
     log(q.trace_id,
         "processing query line='%s' file='%s' tree='%s' tags='%s' "
@@ -175,41 +467,45 @@ Status CodeSearchImpl::Search(ServerContext* context, const ::Query* request, ::
         return Status(StatusCode::INVALID_ARGUMENT, "Parse error");
     }
 
-    int w = width.Walk(q.line_pat->Regexp(), 0);
     if (w > kMaxWidth) {
         log("program too wide width=%d", w);
         return Status(StatusCode::INVALID_ARGUMENT, "Parse error");
     }
 
-    match_stats stats;
-    if (q.tags_pat == NULL) {
-        code_searcher::search_thread search(cs_);
-        search.match(q, add_match(response), &stats);
-    } else {
-        if (tagdata_ == NULL)
-            return Status(StatusCode::FAILED_PRECONDITION, "No tags file available.");
+    if (request->trace())
+        q.trace = &out->trace;
 
-        code_searcher::search_thread search(tagdata_);
+    out->cs = state->cs.get();
+    if (q.tags_pat == NULL) {
+        out->cost = cost_class(out->cs, q);
+        return Status::OK;
+    }
+    if (state->tagmatch == nullptr)
+        return Status(StatusCode::FAILED_PRECONDITION, "No tags file available.");
 
-        // the negation constraints will be checked when we transform the match
-        // (unfortunately, we can't construct a line query that checks these)
-        query constraints;
-        constraints.negate.file_pat.swap(q.negate.file_pat);
-        constraints.negate.tags_pat.swap(q.negate.tags_pat);
+    // Tag queries are lookups in the symbol table, so never expensive.
+    out->tags = state->tagmatch.get();
+    out->cost = kCostCheap;
+    return Status::OK;
+}
 
-        // modify the line pattern to match the constraints that we can handle now
-        std::string regex = tag_searcher::create_tag_line_regex_from_query(&q);
-        q.line_pat.reset(new RE2(regex, q.line_pat->options()));
-        q.file_pat.reset();
-        q.tags_pat.reset();
+std::chrono::steady_clock::time_point CodeSearchImpl::queue(const query& q) {
+    admission_waiting.inc();
+    return std::min(q.deadline, std::chrono::steady_clock::now() +
+                    std::chrono::milliseconds(FLAGS_admission_wait_ms));
+}
 
-        search.match(q,
-                     add_match(response),
-                     boost::bind(&tag_searcher::transform, tagmatch_, &constraints, _1),
-                     &stats);
-    }
+void CodeSearchImpl::admitted(const query& q, int cost, bool ok, uint64_t waited_ns) {
+    admission_waiting.dec();
+    admission_wait.record_ns(waited_ns);
+    if (ok)
+        return;
+    admission_rejected.inc();
+    log(q.trace_id, "rejected: server busy cost_class=%d", cost);
+}
 
-    auto out_stats = response->mutable_stats();
+void CodeSearchImpl::fill_stats(const prepared_search& p, const match_stats& stats,
+                                ::SearchStats* out_stats) {
     out_stats->set_re2_time(timeval_ms(stats.re2_time));
     out_stats->set_git_time(timeval_ms(stats.git_time));
     out_stats->set_sort_time(timeval_ms(stats.sort_time));
@@ -223,9 +519,47 @@ Status CodeSearchImpl::Search(ServerContext* context, const ::Query* request, ::
         out_stats->set_exit_reason(SearchStats::MATCH_LIMIT);
         break;
     case kExitTimeout:
+    case kExitCancelled:
+        // A cancelled client will never see this response anyway.
         out_stats->set_exit_reason(SearchStats::TIMEOUT);
         break;
     }
+    if (p.q.trace)
+        fill_trace(p.trace, out_stats->mutable_trace());
+}
+
+Status CodeSearchImpl::DoSearch(ServerContext* context, const ::Query* request,
+                                index_state *state,
+                                const code_searcher::search_thread::callback_func& cb,
+                                ::SearchStats* out_stats, bool paths) {
+    scoped_trace_id trace(trace_id_from_request(context));
+
+    prepared_search p;
+    Status st = prepare(context, request, state, &p);
+    if (!st.ok())
+        return st;
+    p.q.abandoned = [context] { return context->IsCancelled(); };
+    if (paths) {
+        // Only the paths are read, and they are small next to the
+        // corpus scan_fraction() measures.
+        p.q.paths = true;
+        p.cost = kCostCheap;
+    }
+
+    uint64_t start = monotonic_ns();
+    bool ok = admission_.enter(p.cost, queue(p.q));
+    admitted(p.q, p.cost, ok, monotonic_ns() - start);
+    if (!ok)
+        return Status(StatusCode::RESOURCE_EXHAUSTED, "Server busy");
+    admission_queue::slot slot(&admission_);
 
+    match_stats stats;
+    if (p.tags) {
+        p.tags->search(p.q, cb, &stats);
+    } else {
+        code_searcher::search_thread search(p.cs, pool_);
+        search.match(p.q, cb, &stats);
+    }
+    fill_stats(p, stats, out_stats);
     return Status::OK;
 }
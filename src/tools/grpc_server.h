@@ -3,21 +3,130 @@
 
 #include "src/proto/livegrep.grpc.pb.h"
 
-class code_searcher;
+#include "src/lib/admission.h"
+
+#include "src/codesearch.h"
+
+#include <chrono>
+#include <memory>
+#include <mutex>
+
 class tag_searcher;
 
+// The request id a client sent with its call, or "" if none.
+std::string trace_id_from_request(grpc::ServerContext *ctx);
+
+// Parse `request' into `q', holding the limits it asks for to
+// --max_query_matches, --max_query_timeout_ms and --max_context_lines.
+// Sets *line_width to the line pattern's width, as WidthWalker sees it.
+grpc::Status parse_query(query *q, const ::Query* request, int *line_width);
+
+// Appends each match it is given to `response'.
+class add_match {
+public:
+    add_match(CodeSearchResult* response);
+
+    void operator()(const match_result *m) const;
+
+private:
+    CodeSearchResult* response_;
+};
+
 class CodeSearchImpl final : public CodeSearch::Service {
  public:
-    explicit CodeSearchImpl(code_searcher *cs, code_searcher *tagdata);
+    // If `pool' is NULL, the service creates (and owns) its own.
+    explicit CodeSearchImpl(code_searcher *cs, code_searcher *tagdata,
+                            code_searcher::search_pool *pool = nullptr);
     virtual ~CodeSearchImpl();
 
     virtual grpc::Status Info(grpc::ServerContext* context, const ::InfoRequest* request, ::ServerInfo* response);
     virtual grpc::Status Search(grpc::ServerContext* context, const ::Query* request, ::CodeSearchResult* response);
+    virtual grpc::Status SearchStream(grpc::ServerContext* context, const ::Query* request, grpc::ServerWriter< ::CodeSearchResult>* writer);
+    virtual grpc::Status SearchFiles(grpc::ServerContext* context, const ::Query* request, ::CodeSearchResult* response);
+    virtual grpc::Status Reload(grpc::ServerContext* context, const ::ReloadRequest* request, ::ServerInfo* response);
+    virtual grpc::Status Stats(grpc::ServerContext* context, const ::StatsRequest* request, ::ServerStats* response);
 
  private:
-    code_searcher *cs_;
-    code_searcher *tagdata_;
-    tag_searcher *tagmatch_;
+    friend class AsyncCodeSearch;
+
+    // The index being served. Each call holds a reference to the
+    // current one for its duration, so Reload() can replace it while
+    // calls against the old one finish; the last of them frees it.
+    struct index_state {
+        std::shared_ptr<code_searcher> cs;
+        // The tags index, if any, and its tags looked up in cs.
+        std::shared_ptr<code_searcher> tags;
+        std::unique_ptr<tag_searcher> tagmatch;
+        // Distinguishes this index's entries in results_.
+        uint64_t generation;
+
+        ~index_state();
+    };
+
+    std::shared_ptr<index_state> state();
+    void fill_info(index_state *state, ::ServerInfo* response);
+
+    // A parsed and checked query, ready to run against `cs' -- or, for
+    // tag queries, looked up in `tags'. Not copyable, since `q' points
+    // into it.
+    struct prepared_search {
+        code_searcher *cs = nullptr;
+        const tag_searcher *tags = nullptr;
+        query q;
+        query_trace trace;
+        // The query's priority class for admission_.
+        int cost = 0;
+
+        prepared_search() {}
+    private:
+        prepared_search(const prepared_search&);
+        void operator=(const prepared_search&);
+    };
+
+    // Parse `request' into `out', to run against `state' (or the
+    // tags index), logging it under the current trace id.
+    grpc::Status prepare(grpc::ServerContext* context, const ::Query* request,
+                         index_state *state, prepared_search *out);
+    // Count `q' as waiting for a slot in admission_, and return how
+    // long it may wait.
+    std::chrono::steady_clock::time_point queue(const query& q);
+    // Count `q' as no longer waiting, having been let in (or not)
+    // after `waited_ns'.
+    void admitted(const query& q, int cost, bool ok, uint64_t waited_ns);
+    void fill_stats(const prepared_search& p, const match_stats& stats,
+                    ::SearchStats* out_stats);
+
+    // Runs `request' against `state', passing each match to `cb' as
+    // it is found and filling in `stats' at the end. With `paths',
+    // the line pattern is matched against file paths instead (see
+    // query::paths).
+    grpc::Status DoSearch(grpc::ServerContext* context, const ::Query* request,
+                          index_state *state,
+                          const code_searcher::search_thread::callback_func& cb,
+                          ::SearchStats* stats, bool paths = false);
+
+    // The key `request' is cached under in results_, for `state'.
+    std::string result_key(const index_state *state, const ::Query* request);
+    // Whether `request' may be answered from, and added to, results_.
+    bool cacheable(const ::Query* request);
+    // Look `key' up in results_.
+    bool cached_result(const std::string& key, ::CodeSearchResult* response);
+    // Keep `response' for repeat queries, if it is complete.
+    void cache_result(const std::string& key, const ::CodeSearchResult& response);
+
+    // state_mtx_ protects state_; reload_mtx_ serializes Reload()s.
+    std::mutex state_mtx_;
+    std::shared_ptr<index_state> state_;
+    std::mutex reload_mtx_;
+    // shared by all concurrent Search calls
+    code_searcher::search_pool *pool_;
+    bool own_pool_;
+    // Serialized responses to recent queries, up to --result_cache_mb
+    // of them; see result_key().
+    lru_cache<std::shared_ptr<const std::string> > results_;
+    // Searches waiting for, and holding, one of
+    // --max_concurrent_searches slots; see cost_class().
+    admission_queue admission_;
 };
 
 #endif /* CODESEARCH_GRPC_SERVER_H */
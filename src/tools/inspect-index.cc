@@ -13,7 +13,9 @@
 #include "src/lib/debug.h"
 
 #include "src/dump_load.h"
+#include "src/chunk.h"
 #include "src/codesearch.h"
+#include "src/content.h"
 
 #include <gflags/gflags.h>
 
@@ -80,6 +82,7 @@ int inspect_index(int argc, char **argv) {
     }
     printf(" Trees: %d\n", idx->ntrees);
     printf(" Files: %d\n", idx->nfiles);
+    printf(" Tombstones: %d\n", idx->ntombstones);
     printf(" File size: %ld (%0.2fM)\n", st.st_size, st.st_size / double(1 << 20));
     printf(" Chunks: %d (%dM) (%dM indexes)\n", idx->nchunks,
            (idx->nchunks * idx->chunk_size) >> 20,
@@ -98,18 +101,26 @@ int inspect_index(int argc, char **argv) {
     }
     printf(" Content chunks: %d (%ldM)\n",
            idx->ncontent, content_size >> 20);
-    uint8_t *p = map + idx->files_off;
-    for (int i = 0; i < idx->nfiles; i++) {
-        p += 4;
+    const corpus_stats *corpus = reinterpret_cast<const corpus_stats*>
+        (map + idx->corpus_off);
+    spans.push_back(index_span(idx->corpus_off,
+                               idx->corpus_off + sizeof(corpus_stats),
+                               "corpus stats"));
+    printf(" Corpus bytes counted: %ld\n", long(corpus->total));
+    uint8_t *p = map + idx->paths_off;
+    for (int i = 0; i < idx->npaths; i++)
         p += 4 + *reinterpret_cast<uint32_t*>(p);
-    }
-    spans.push_back(index_span(idx->files_off,
+    spans.push_back(index_span(idx->paths_off,
                                (unsigned long)(p - map),
-                               "file list" ));
-
+                               "path table" ));
+    printf(" Paths: %d (%0.2f files each)\n", idx->npaths,
+           idx->npaths ? idx->nfiles / double(idx->npaths) : 0);
     printf(" Filename data: %ld (%0.2fM)\n",
-           (p - (map + idx->files_off)),
-           (p - (map + idx->files_off))/double(1<<20));
+           (p - (map + idx->paths_off)),
+           (p - (map + idx->paths_off))/double(1<<20));
+    spans.push_back(index_span(idx->files_off,
+                               idx->files_off + 8 * (unsigned long)idx->nfiles,
+                               "file list" ));
 
     unsigned long chunk_file_size = 0;
     chunk_header *chunks = reinterpret_cast<chunk_header*>
@@ -125,22 +136,56 @@ int inspect_index(int argc, char **argv) {
                                    chunks[i].data_off +
                                    (1 + sizeof(uint32_t)) * idx->chunk_size,
                                    strprintf("chunk %d indexes", i)));
-        p = map + chunks[i].files_off;
-        for (int j = 0; j < chunks[i].nfiles; ++j) {
-            uint32_t files = *reinterpret_cast<uint32_t*>(p);
-            p += 4;
-            p += files * 4;
-            p += 8;
-        }
+        p = map + chunks[i].files_off +
+            chunks[i].nfiles * sizeof(chunk_file_range) +
+            chunks[i].nfile_ids * sizeof(uint32_t) +
+            chunks[i].nfiles * sizeof(chunk_file_node);
         chunk_file_size += p - (map + chunks[i].files_off);
         spans.push_back(index_span(chunks[i].files_off,
                                    (unsigned long)(p - map),
                                    strprintf("chunk %d file map", i)));
+        spans.push_back(index_span(chunks[i].trees_off,
+                                   chunks[i].trees_off + 4 * chunks[i].ntrees,
+                                   strprintf("chunk %d trees", i)));
     }
     printf(" chunk_file data: %ld (%0.2fM)\n",
            chunk_file_size,
            chunk_file_size / double(1 << 20));
 
+    // What the file and tree lists cost in memory once loaded; the
+    // rest of the index stays in the mapping.
+    unsigned long npieces = 0, piece_bytes = 0;
+    for (int i = 0; i < idx->ncontent; i++) {
+        uint8_t *c = map + chdrs[i].file_off;
+        for (uint32_t j = 0; j < chdrs[i].nfiles; j++) {
+            const file_contents *fc = reinterpret_cast<const file_contents*>(c);
+            npieces += fc->size();
+            piece_bytes += fc->footprint();
+            c += fc->footprint();
+        }
+    }
+    unsigned long tree_bytes = 0, metadata_bytes = 0;
+    p = map + idx->refs_off;
+    for (int i = 0; i < idx->ntrees; i++) {
+        for (int field = 0; field < 3; field++) {
+            uint32_t len = *reinterpret_cast<uint32_t*>(p);
+            tree_bytes += len;
+            if (field == 2)
+                metadata_bytes += len;
+            p += 4 + len;
+        }
+    }
+    tree_bytes += idx->ntrees * sizeof(indexed_tree);
+    printf("Memory:\n");
+    printf(" File list: %ld (%0.2fM)\n",
+           idx->nfiles * sizeof(indexed_file),
+           idx->nfiles * sizeof(indexed_file) / double(1 << 20));
+    printf(" Trees: %ld (%0.2fM, %ld of it metadata)\n",
+           tree_bytes, tree_bytes / double(1 << 20), metadata_bytes);
+    printf(" Content pieces: %ld in %ld (%0.2fM, %0.2f bytes each)\n",
+           npieces, piece_bytes, piece_bytes / double(1 << 20),
+           npieces ? piece_bytes / double(npieces) : 0);
+
     if (FLAGS_dump_trees) {
         code_searcher cs;
         cs.load_index(argv[0]);
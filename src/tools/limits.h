@@ -4,4 +4,9 @@
 const int kMaxProgramSize = 4000;
 const int kMaxWidth       = 200;
 
+// SearchStream sends a batch once it has this many results, or once
+// this many milliseconds have passed since the last one was sent.
+const int kStreamBatchSize = 50;
+const int kStreamFlushMs   = 100;
+
 #endif
@@ -0,0 +1,52 @@
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "src/lib/timer.h"
+#include "src/lib/debug.h"
+
+#include "src/codesearch.h"
+
+#include <gflags/gflags.h>
+
+using std::string;
+
+DEFINE_bool(merge_dedup, false, "Deduplicate lines across the inputs, indexing and sorting them again, rather than copying chunks as they are.");
+
+/*
+ * Each input may be a comma-separated list of segments, as for
+ * codesearch --load_index; files their tombstones hide are dropped,
+ * so merging a base with its deltas compacts them into one index.
+ */
+int merge_index(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <options> OUTPUT.idx INPUT.idx[,DELTA.idx...]...\n",
+                gflags::GetArgv0());
+        return 1;
+    }
+
+    string out = argv[0];
+    timer tm;
+    code_searcher cs;
+    cs.set_alloc(make_dump_allocator(&cs, out));
+
+    // The inputs' trees are used until the output is written.
+    std::vector<std::unique_ptr<code_searcher> > inputs;
+    for (int i = 1; i < argc; i++) {
+        std::vector<string> paths = split_index_paths(argv[i]);
+        for (auto it = paths.begin(); it != paths.end(); ++it)
+            if (*it == out)
+                die("%s: cannot merge an index into itself.", out.c_str());
+        inputs.push_back(std::unique_ptr<code_searcher>(new code_searcher));
+        inputs.back()->load_segments(paths);
+        cs.copy_index(inputs.back().get(), FLAGS_merge_dedup);
+        fprintf(stderr, "merged %s\n", argv[i]);
+    }
+    cs.finalize();
+
+    fprintf(stderr, "wrote %s (%ld files) in %ldms\n", out.c_str(),
+            long(cs.end_files() - cs.begin_files()), timeval_ms(tm.elapsed()));
+    return 0;
+}
@@ -0,0 +1,190 @@
+#include <stdio.h>
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "src/lib/timer.h"
+#include "src/lib/debug.h"
+
+#include "src/codesearch.h"
+#include "src/query_log.h"
+#include "src/re_width.h"
+#include "src/tools/limits.h"
+
+#include <gflags/gflags.h>
+
+using std::string;
+using std::vector;
+
+DECLARE_int32(threads);
+
+DEFINE_double(replay_qps, 0, "Start queries at this rate, as far as --replay_concurrency allows (0 = as fast as possible).");
+DEFINE_int32(replay_concurrency, 1, "The most queries to have running at once.");
+DEFINE_int32(replay_repeat, 1, "Replay the query log this many times.");
+DEFINE_bool(replay_fold_case, false, "Run every query case-insensitively.");
+
+namespace {
+    bool compile(const string &pattern, const RE2::Options &opts,
+                 std::shared_ptr<const RE2> *out) {
+        if (pattern.empty())
+            return true;
+        *out = compile_re(pattern, opts);
+        return (*out)->ok();
+    }
+
+    // Turn a logged query into one to run, with the same checks the
+    // server makes. Returns false if the server would reject it.
+    bool make_query(const vector<string> &fields, query *q) {
+        RE2::Options opts;
+        default_re2_options(opts);
+        opts.set_case_sensitive(!FLAGS_replay_fold_case);
+        if (!compile(fields[kLogLine], opts, &q->line_pat) ||
+            !compile(fields[kLogFile], opts, &q->file_pat) ||
+            !compile(fields[kLogTree], opts, &q->tree_pat) ||
+            !compile(fields[kLogNotFile], opts, &q->negate.file_pat) ||
+            !compile(fields[kLogNotTree], opts, &q->negate.tree_pat))
+            return false;
+        if (!q->line_pat || q->line_pat->ProgramSize() > kMaxProgramSize)
+            return false;
+        WidthWalker width;
+        return width.Walk(q->line_pat->Regexp(), 0) <= kMaxWidth;
+    }
+
+    struct result {
+        uint64_t latency_ns;
+        exit_reason why;
+        int matches;
+    };
+
+    double percentile(const vector<uint64_t> &sorted, double p) {
+        if (sorted.empty())
+            return 0;
+        size_t i = std::min(sorted.size() - 1, size_t(p * sorted.size()));
+        return sorted[i] / 1e6;
+    }
+
+    double cpu_seconds() {
+        struct rusage ru;
+        getrusage(RUSAGE_SELF, &ru);
+        return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+            ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    }
+};
+
+/*
+ * Replay the queries in a log against an index, in-process, and report
+ * how fast they ran. Queries are read from the "processing query"
+ * lines of a codesearch log; other lines are ignored, as are queries
+ * with tags, since there is no tags index to run them against. With
+ * --replay_qps, each query's latency is counted from when it was due
+ * to start, so time spent waiting for a free slot shows up in it.
+ */
+int replay(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <options> INDEX[,DELTA...] QUERY_LOG\n",
+                gflags::GetArgv0());
+        return 1;
+    }
+
+    std::ifstream in(argv[1]);
+    if (!in)
+        die("%s: cannot open", argv[1]);
+    vector<query> queries;
+    int unparsed = 0, rejected = 0, tagged = 0;
+    string line;
+    while (std::getline(in, line)) {
+        if (line.find("processing query ") == string::npos)
+            continue;
+        vector<string> fields;
+        if (!parse_query_log(line, &fields)) {
+            unparsed++;
+            continue;
+        }
+        if (!fields[kLogTags].empty() || !fields[kLogNotTags].empty()) {
+            tagged++;
+            continue;
+        }
+        query q;
+        if (!make_query(fields, &q)) {
+            rejected++;
+            continue;
+        }
+        queries.push_back(q);
+    }
+    fprintf(stderr, "read %d queries (%d unparseable, %d rejected, %d with tags skipped)\n",
+            int(queries.size()), unparsed, rejected, tagged);
+    if (queries.empty())
+        return 1;
+
+    timer load;
+    code_searcher cs;
+    cs.load_segments(split_index_paths(argv[0]));
+    fprintf(stderr, "loaded %s in %ldms\n", argv[0], timeval_ms(load.elapsed()));
+
+    code_searcher::search_pool pool(FLAGS_threads);
+    size_t total = queries.size() * FLAGS_replay_repeat;
+    vector<result> results(total);
+    std::atomic<size_t> next(0);
+
+    typedef std::chrono::steady_clock clock;
+    double cpu_start = cpu_seconds();
+    clock::time_point start = clock::now();
+    vector<std::thread> clients;
+    for (int c = 0; c < FLAGS_replay_concurrency; c++) {
+        clients.push_back(std::thread([&] {
+            code_searcher::search_thread search(&cs, &pool);
+            size_t i;
+            while ((i = next++) < total) {
+                clock::time_point due = clock::now();
+                if (FLAGS_replay_qps > 0) {
+                    due = start + std::chrono::duration_cast<clock::duration>(
+                        std::chrono::duration<double>(i / FLAGS_replay_qps));
+                    std::this_thread::sleep_until(due);
+                }
+                match_stats stats;
+                search.match(queries[i % queries.size()],
+                             [](const match_result *) {}, &stats);
+                results[i].latency_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    clock::now() - due).count();
+                results[i].why = stats.why;
+                results[i].matches = stats.matches;
+            }
+        }));
+    }
+    for (auto &t : clients)
+        t.join();
+    double wall = std::chrono::duration<double>(clock::now() - start).count();
+    double cpu = cpu_seconds() - cpu_start;
+
+    vector<uint64_t> latencies;
+    std::map<exit_reason, int> reasons;
+    long matches = 0;
+    for (auto &r : results) {
+        latencies.push_back(r.latency_ns);
+        reasons[r.why]++;
+        matches += r.matches;
+    }
+    std::sort(latencies.begin(), latencies.end());
+
+    printf("queries:      %ld\n", long(total));
+    printf("wall time:    %.3fs\n", wall);
+    printf("throughput:   %.1f queries/s\n", total / wall);
+    printf("latency p50:  %.3fms\n", percentile(latencies, 0.50));
+    printf("latency p99:  %.3fms\n", percentile(latencies, 0.99));
+    printf("latency p999: %.3fms\n", percentile(latencies, 0.999));
+    printf("latency max:  %.3fms\n", latencies.back() / 1e6);
+    printf("cpu/query:    %.3fms\n", cpu * 1e3 / total);
+    printf("matches:      %ld\n", matches);
+    printf("exit none:        %d\n", reasons[kExitNone]);
+    printf("exit match_limit: %d\n", reasons[kExitMatchLimit]);
+    printf("exit timeout:     %d\n", reasons[kExitTimeout]);
+    return 0;
+}
@@ -0,0 +1,381 @@
+#include "src/lib/debug.h"
+#include "src/lib/metrics.h"
+
+#include "src/tools/limits.h"
+#include "src/tools/grpc_server.h"
+#include "src/tools/shard_router.h"
+
+#include <grpc++/create_channel.h>
+
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <utility>
+
+#include <assert.h>
+
+#include <gflags/gflags.h>
+
+using grpc::ClientContext;
+using grpc::ServerContext;
+using grpc::Status;
+using grpc::StatusCode;
+
+using std::string;
+using std::vector;
+
+DECLARE_int32(max_matches);
+DECLARE_int32(timeout);
+
+namespace {
+    metric shard_errors("router.shard.errors");
+    metric shard_timeouts("router.shard.timeouts");
+    metric shard_cancels("router.shard.cancels");
+
+    // How long past the query's deadline a shard's call may run, so
+    // that what the shard found by then still arrives.
+    const int kShardGraceMs = 100;
+
+    // When a call on `context' that may run for `timeout_ms' (0 = no
+    // limit) has to be done.
+    std::chrono::system_clock::time_point call_deadline(ServerContext *context,
+                                                        int timeout_ms) {
+        std::chrono::system_clock::time_point deadline = context->deadline();
+        if (timeout_ms > 0)
+            deadline = std::min(deadline, std::chrono::system_clock::now() +
+                                std::chrono::milliseconds(timeout_ms));
+        return deadline;
+    }
+
+    bool bounded(std::chrono::system_clock::time_point deadline) {
+        return deadline != std::chrono::system_clock::time_point::max();
+    }
+
+    // A timeout says the most about what is missing from the results,
+    // then a match limit.
+    int severity(SearchStats::ExitReason why) {
+        switch (why) {
+        case SearchStats::TIMEOUT:
+            return 2;
+        case SearchStats::MATCH_LIMIT:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+
+    void set_exit(SearchStats *stats, SearchStats::ExitReason why) {
+        if (severity(why) > severity(stats->exit_reason()))
+            stats->set_exit_reason(why);
+    }
+
+    // The shards search side by side, so each time is the slowest
+    // shard's.
+    void merge_stats(const SearchStats &from, SearchStats *into) {
+        into->set_re2_time(std::max(into->re2_time(), from.re2_time()));
+        into->set_git_time(std::max(into->git_time(), from.git_time()));
+        into->set_sort_time(std::max(into->sort_time(), from.sort_time()));
+        into->set_index_time(std::max(into->index_time(), from.index_time()));
+        into->set_analyze_time(std::max(into->analyze_time(), from.analyze_time()));
+        set_exit(into, from.exit_reason());
+        if (from.has_trace()) {
+            QueryTrace *trace = into->mutable_trace();
+            if (trace->index_key().empty())
+                trace->set_index_key(from.trace().index_key());
+            // Each shard numbers its own chunks.
+            trace->mutable_tasks()->MergeFrom(from.trace().tasks());
+        }
+    }
+};
+
+// One shard's part of a fan_out().
+struct ShardRouter::call {
+    enum state {
+        kStarting,
+        kReading,
+        kFinishing,
+    };
+
+    const shard *sh;
+    ClientContext ctx;
+    state st = kStarting;
+    bool done = false;
+    bool cancelled = false;
+    // The batch being read or, for SearchFiles, the whole response.
+    CodeSearchResult batch;
+    // Everything the shard has sent, for ranked queries.
+    CodeSearchResult results;
+    Status status;
+    std::unique_ptr<grpc::ClientAsyncReader<CodeSearchResult> > stream;
+    std::unique_ptr<grpc::ClientAsyncResponseReader<CodeSearchResult> > unary;
+};
+
+ShardRouter::ShardRouter(const vector<string>& addrs) {
+    for (auto it = addrs.begin(); it != addrs.end(); ++it) {
+        shard s;
+        s.name = *it;
+        s.stub = CodeSearch::NewStub(
+            grpc::CreateChannel(*it, grpc::InsecureChannelCredentials()));
+        shards_.push_back(std::move(s));
+    }
+}
+
+ShardRouter::ShardRouter(const vector<string>& names,
+                         const vector<std::shared_ptr<grpc::ChannelInterface> >& channels) {
+    assert(names.size() == channels.size());
+    for (size_t i = 0; i < names.size(); ++i) {
+        shard s;
+        s.name = names[i];
+        s.stub = CodeSearch::NewStub(channels[i]);
+        shards_.push_back(std::move(s));
+    }
+}
+
+ShardRouter::~ShardRouter() {
+}
+
+Status ShardRouter::Info(ServerContext* context, const ::InfoRequest* request, ::ServerInfo* response) {
+    scoped_trace_id trace(trace_id_from_request(context));
+    log("Info()");
+
+    struct info_call {
+        ClientContext ctx;
+        ServerInfo info;
+        Status status;
+        std::unique_ptr<grpc::ClientAsyncResponseReader<ServerInfo> > reader;
+    };
+    std::chrono::system_clock::time_point deadline = call_deadline(context, FLAGS_timeout);
+    grpc::CompletionQueue cq;
+    vector<std::unique_ptr<info_call> > calls;
+    for (auto it = shards_.begin(); it != shards_.end(); ++it) {
+        std::unique_ptr<info_call> c(new info_call);
+        if (bounded(deadline))
+            c->ctx.set_deadline(deadline);
+        c->reader = it->stub->AsyncInfo(&c->ctx, *request, &cq);
+        c->reader->Finish(&c->info, &c->status, c.get());
+        calls.push_back(std::move(c));
+    }
+    void *tag;
+    bool ok;
+    for (size_t i = 0; i < calls.size(); ++i)
+        cq.Next(&tag, &ok);
+    cq.Shutdown();
+    while (cq.Next(&tag, &ok)) {
+    }
+
+    // A tree split over several shards is listed once, as the first
+    // has it.
+    std::set<std::pair<string, string> > trees;
+    for (size_t i = 0; i < calls.size(); ++i) {
+        const info_call &c = *calls[i];
+        if (!c.status.ok()) {
+            shard_errors.inc();
+            log(current_trace_id(), "shard %s: Info: %s",
+                shards_[i].name.c_str(), c.status.error_message().c_str());
+            return Status(c.status.error_code(),
+                          shards_[i].name + ": " + c.status.error_message());
+        }
+        if (response->name().empty())
+            response->set_name(c.info.name());
+        for (auto t = c.info.trees().begin(); t != c.info.trees().end(); ++t)
+            if (trees.insert(std::make_pair(t->name(), t->version())).second)
+                *response->add_trees() = *t;
+        if (c.info.has_tags())
+            response->set_has_tags(true);
+    }
+    return Status::OK;
+}
+
+Status ShardRouter::Search(ServerContext* context, const ::Query* request, ::CodeSearchResult* response) {
+    return fan_out(context, request, false, nullptr, response);
+}
+
+Status ShardRouter::SearchStream(ServerContext* context, const ::Query* request, ::grpc::ServerWriter< ::CodeSearchResult>* writer) {
+    CodeSearchResult batch;
+    Status st = fan_out(context, request, false, [writer](CodeSearchResult *b) {
+            writer->Write(*b);
+            b->Clear();
+        }, &batch);
+    if (!st.ok())
+        return st;
+    writer->Write(batch);
+    return Status::OK;
+}
+
+Status ShardRouter::SearchFiles(ServerContext* context, const ::Query* request, ::CodeSearchResult* response) {
+    if (request->file().empty())
+        return Status(StatusCode::INVALID_ARGUMENT, "file: a path pattern is required");
+    return fan_out(context, request, true, nullptr, response);
+}
+
+Status ShardRouter::Reload(ServerContext* context, const ::ReloadRequest* request, ::ServerInfo* response) {
+    return Status(StatusCode::UNIMPLEMENTED,
+                  "the router has no index; reload each shard's server instead");
+}
+
+Status ShardRouter::Stats(ServerContext* context, const ::StatsRequest* request, ::ServerStats* response) {
+    response->set_metrics(metric::render_all());
+    return Status::OK;
+}
+
+Status ShardRouter::fan_out(ServerContext* context, const ::Query* request,
+                            bool files,
+                            const std::function<void (::CodeSearchResult*)>& flush,
+                            ::CodeSearchResult* out) {
+    string trace_id = trace_id_from_request(context);
+    scoped_trace_id trace(trace_id);
+
+    int limit = request->max_matches() > 0 ? request->max_matches() : FLAGS_max_matches;
+    std::chrono::system_clock::time_point deadline = call_deadline(
+        context, request->timeout_ms() > 0 ? request->timeout_ms() : FLAGS_timeout);
+
+    // Every shard gets the same limit and what is left of the same
+    // deadline, whatever its own defaults are.
+    ::Query q(*request);
+    q.set_max_matches(limit);
+    if (bounded(deadline)) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::system_clock::now());
+        q.set_timeout_ms(std::max<long>(1, left.count()));
+    }
+
+    grpc::CompletionQueue cq;
+    vector<std::unique_ptr<call> > calls;
+    for (auto it = shards_.begin(); it != shards_.end(); ++it) {
+        std::unique_ptr<call> c(new call);
+        c->sh = &*it;
+        if (bounded(deadline))
+            c->ctx.set_deadline(deadline + std::chrono::milliseconds(kShardGraceMs));
+        if (!trace_id.empty())
+            c->ctx.AddMetadata("request-id", trace_id);
+        if (files) {
+            c->unary = it->stub->AsyncSearchFiles(&c->ctx, q, &cq);
+            c->unary->Finish(&c->batch, &c->status, c.get());
+            c->st = call::kFinishing;
+        } else {
+            c->stream = it->stub->AsyncSearchStream(&c->ctx, q, &cq, c.get());
+        }
+        calls.push_back(std::move(c));
+    }
+
+    SearchStats stats;
+    Status err = Status::OK;
+    int kept = 0;
+    auto cancel = [&calls] {
+        for (auto it = calls.begin(); it != calls.end(); ++it) {
+            call *c = it->get();
+            if (c->done || c->cancelled)
+                continue;
+            c->cancelled = true;
+            c->ctx.TryCancel();
+            shard_cancels.inc();
+        }
+    };
+    // Move the results in `c's batch to `out' while there is room for
+    // them, or keep them to rank at the end.
+    auto take = [&](call *c) {
+        merge_stats(c->batch.stats(), &stats);
+        auto results = c->batch.mutable_results();
+        if (request->ranked()) {
+            for (auto r = results->begin(); r != results->end(); ++r)
+                c->results.add_results()->Swap(&*r);
+        } else {
+            for (auto r = results->begin(); r != results->end(); ++r) {
+                if (limit && kept >= limit)
+                    break;
+                out->add_results()->Swap(&*r);
+                kept++;
+            }
+            if (limit && kept >= limit) {
+                set_exit(&stats, SearchStats::MATCH_LIMIT);
+                cancel();
+            }
+            if (flush && out->results_size())
+                flush(out);
+        }
+        c->batch.Clear();
+    };
+
+    size_t live = calls.size();
+    while (live > 0) {
+        void *tag;
+        bool ok;
+        grpc::CompletionQueue::NextStatus next = cq.AsyncNext(
+            &tag, &ok, std::chrono::system_clock::now() +
+            std::chrono::milliseconds(kStreamFlushMs));
+        if (next == grpc::CompletionQueue::TIMEOUT) {
+            if (context->IsCancelled())
+                cancel();
+            continue;
+        }
+        if (next == grpc::CompletionQueue::SHUTDOWN)
+            break;
+
+        call *c = static_cast<call*>(tag);
+        if (c->st != call::kFinishing) {
+            if (!ok) {
+                c->st = call::kFinishing;
+                c->stream->Finish(&c->status, c);
+                continue;
+            }
+            if (c->st == call::kReading)
+                take(c);
+            c->st = call::kReading;
+            c->stream->Read(&c->batch, c);
+            continue;
+        }
+
+        c->done = true;
+        live--;
+        if (c->status.ok()) {
+            if (files)
+                take(c);
+        } else if (c->cancelled) {
+            // Cut off once we had enough, or once our caller gave up.
+        } else if (c->status.error_code() == StatusCode::DEADLINE_EXCEEDED) {
+            shard_timeouts.inc();
+            log(trace_id, "shard %s: timed out", c->sh->name.c_str());
+            set_exit(&stats, SearchStats::TIMEOUT);
+        } else {
+            shard_errors.inc();
+            log(trace_id, "shard %s: %s", c->sh->name.c_str(),
+                c->status.error_message().c_str());
+            if (err.ok())
+                err = Status(c->status.error_code(),
+                             c->sh->name + ": " + c->status.error_message());
+            cancel();
+        }
+    }
+    cq.Shutdown();
+    void *tag;
+    bool ok;
+    while (cq.Next(&tag, &ok)) {
+    }
+    if (!err.ok())
+        return err;
+
+    if (request->ranked()) {
+        vector<SearchResult*> ranked;
+        for (auto it = calls.begin(); it != calls.end(); ++it) {
+            auto results = (*it)->results.mutable_results();
+            for (auto r = results->begin(); r != results->end(); ++r)
+                ranked.push_back(&*r);
+        }
+        // Ties stay in shard order, so they come out the same way
+        // every time.
+        std::stable_sort(ranked.begin(), ranked.end(),
+                         [](const SearchResult *a, const SearchResult *b) {
+                             return a->score() > b->score();
+                         });
+        if (limit && ranked.size() > size_t(limit)) {
+            ranked.resize(limit);
+            set_exit(&stats, SearchStats::MATCH_LIMIT);
+        }
+        for (auto it = ranked.begin(); it != ranked.end(); ++it)
+            out->add_results()->Swap(*it);
+    }
+    if (stats.has_trace())
+        stats.mutable_trace()->set_trace_id(current_trace_id());
+    out->mutable_stats()->Swap(&stats);
+    return Status::OK;
+}
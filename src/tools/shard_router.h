@@ -0,0 +1,61 @@
+#ifndef CODESEARCH_SHARD_ROUTER_H
+#define CODESEARCH_SHARD_ROUTER_H
+
+#include "src/proto/livegrep.grpc.pb.h"
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * A CodeSearch service with no index of its own, which answers each
+ * call by asking every one of a set of shard servers -- codesearch
+ * servers each serving some of the trees -- at once, and merging what
+ * they send back. Every shard's call shares the query's deadline. Once
+ * the shards between them have sent max_matches results, the calls
+ * still running are cancelled; ranked queries wait for every shard's
+ * best matches and keep the best of those. Reload is left to the
+ * shards themselves.
+ */
+class ShardRouter final : public CodeSearch::Service {
+ public:
+    // Route to the servers at `addrs', each a host:port.
+    explicit ShardRouter(const std::vector<std::string>& addrs);
+    // Route over `channels', calling each shard by its entry in `names'
+    // in errors and logs.
+    ShardRouter(const std::vector<std::string>& names,
+                const std::vector<std::shared_ptr<grpc::ChannelInterface> >& channels);
+    virtual ~ShardRouter();
+
+    virtual grpc::Status Info(grpc::ServerContext* context, const ::InfoRequest* request, ::ServerInfo* response);
+    virtual grpc::Status Search(grpc::ServerContext* context, const ::Query* request, ::CodeSearchResult* response);
+    virtual grpc::Status SearchStream(grpc::ServerContext* context, const ::Query* request, grpc::ServerWriter< ::CodeSearchResult>* writer);
+    virtual grpc::Status SearchFiles(grpc::ServerContext* context, const ::Query* request, ::CodeSearchResult* response);
+    virtual grpc::Status Reload(grpc::ServerContext* context, const ::ReloadRequest* request, ::ServerInfo* response);
+    virtual grpc::Status Stats(grpc::ServerContext* context, const ::StatsRequest* request, ::ServerStats* response);
+
+ private:
+    struct shard {
+        std::string name;
+        std::unique_ptr<CodeSearch::Stub> stub;
+    };
+    struct call;
+
+    /*
+     * Run `request' on every shard, as SearchFiles if `files' and as
+     * SearchStream otherwise, and merge the results into `out'. If
+     * `flush' is set, it is passed `out' whenever results arrive, to
+     * send them on and clear it. At the end, `out' has the merged
+     * stats -- and, for ranked queries, all of the results, since
+     * none can be sent until every shard has answered.
+     */
+    grpc::Status fan_out(grpc::ServerContext* context, const ::Query* request,
+                         bool files,
+                         const std::function<void (::CodeSearchResult*)>& flush,
+                         ::CodeSearchResult* out);
+
+    std::vector<shard> shards_;
+};
+
+#endif /* CODESEARCH_SHARD_ROUTER_H */
@@ -17,7 +17,7 @@
 
 #include "re2/re2.h"
 using re2::RE2;
-using std::unique_ptr;
+using std::shared_ptr;
 
 namespace {
 
@@ -38,8 +38,9 @@ json_object *to_json(const indexed_tree &tree) {
     json_object *out = json_object_new_object();
     json_object_object_add(out, "name", to_json(tree.name));
     json_object_object_add(out, "version", to_json(tree.version));
-    if (tree.metadata)
-        json_object_object_add(out, "metadata", json_object_get(tree.metadata));
+    json_object *metadata = tree.parse_metadata();
+    if (metadata)
+        json_object_object_add(out, "metadata", metadata);
     return out;
 }
 
@@ -51,6 +52,13 @@ json_object *to_json(vector<T> vec) {
     return out;
 }
 
+json_object *to_json(const match_context &lines) {
+    json_object *out = json_object_new_array();
+    for (auto it = lines.begin(); it != lines.end(); it++)
+        json_object_array_add(out, to_json(*it));
+    return out;
+}
+
 json_object *to_json(const index_info *info) {
     json_object *out = json_object_new_object();
     json_object_object_add(out, "name", to_json(info->name));
@@ -77,6 +85,9 @@ json_object *to_json(const match_stats *stats) {
     case kExitTimeout:
         json_object_object_add(obj, "why", json_object_new_string("timeout"));
         break;
+    case kExitCancelled:
+        json_object_object_add(obj, "why", json_object_new_string("cancelled"));
+        break;
     }
     return obj;
 }
@@ -153,7 +164,7 @@ json_parse_error parse_object(json_object *j, const char *key, T *t) {
 }
 
 json_parse_error parse_regex(json_object *js, const char *key,
-                             const RE2::Options &opts, unique_ptr<RE2> *out) {
+                             const RE2::Options &opts, shared_ptr<const RE2> *out) {
     std::string str;
     json_parse_error err;
     err = parse_object(js, key, &str);
@@ -161,7 +172,7 @@ json_parse_error parse_regex(json_object *js, const char *key,
         return err;
     if (str.size() == 0)
         return json_parse_error();
-    unique_ptr<RE2> re(new RE2(str, opts));
+    shared_ptr<const RE2> re = compile_re(str, opts);
     if (!re->ok()) {
         return json_parse_error(re->error()).wrap(key);
     }
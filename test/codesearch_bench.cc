@@ -0,0 +1,460 @@
+/********************************************************************
+ * livegrep -- codesearch_bench.cc
+ * Copyright (c) 2011-2013 Nelson Elhage
+ *
+ * This program is free software. You may use, redistribute, and/or
+ * modify it under the terms listed in the COPYING file.
+ ********************************************************************/
+/*
+ * Microbenchmarks for the indexing and search hot paths, each stage
+ * timed on its own. Searches run against a deterministic synthetic
+ * corpus, or against a real one given with --bench_index, and report
+ * the time each one spent in the index, sort, re2 and git (find_match
+ * and try_match) phases as counters alongside the wall time.
+ *
+ * For output to diff across commits, run with
+ *   --benchmark_out=FILE --benchmark_out_format=json
+ * Benchmark names only change when the benchmarks do.
+ */
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "gflags/gflags.h"
+
+#include "src/lib/bytes.h"
+#include "src/lib/radix_sort.h"
+
+#include "src/codesearch.h"
+#include "src/chunk.h"
+#include "src/chunk_allocator.h"
+#include "src/indexer.h"
+
+DEFINE_string(bench_index, "", "Search this index (or comma-separated segments) instead of a synthetic corpus.");
+DEFINE_int32(bench_files, 2000, "The number of files in the synthetic corpus.");
+
+DECLARE_int32(sort_threads);
+DECLARE_bool(pack_suffixes);
+
+namespace {
+    const char *kWords[] = {
+        "int", "return", "static", "const", "char", "void", "struct",
+        "if", "else", "for", "while", "sizeof", "NULL", "buf", "len",
+        "err", "ret", "data", "size", "count", "next", "prev", "node",
+        "list", "lock", "unlock", "alloc", "free", "init", "read",
+        "write", "open", "close", "state", "flags", "value", "key",
+    };
+    const int kNWords = sizeof kWords / sizeof *kWords;
+
+    // Vaguely C-like lines, the same ones every run.
+    std::string synthetic_file(std::mt19937 *rng, int lines) {
+        std::string out;
+        for (int i = 0; i < lines; i++) {
+            int indent = (*rng)() % 4;
+            out.append(indent * 4, ' ');
+            int words = 2 + (*rng)() % 8;
+            for (int w = 0; w < words; w++) {
+                if (w)
+                    out += ((*rng)() % 3) ? " " : "_";
+                out += kWords[(*rng)() % kNWords];
+            }
+            if ((*rng)() % 5 == 0)
+                out += "(" + std::to_string((*rng)() % 1000) + ");";
+            out += "\n";
+        }
+        return out;
+    }
+
+    // The corpus searches run against, built or loaded on first use.
+    // The synthetic one is built once with its suffix arrays packed
+    // (see --pack_suffixes) and once without; a loaded index is
+    // searched as it was written, whatever `pack' says.
+    code_searcher *corpus(bool pack = false) {
+        static code_searcher *built[2];
+        code_searcher *&cs = built[FLAGS_bench_index.empty() && pack];
+        if (cs)
+            return cs;
+        cs = new code_searcher;
+        if (!FLAGS_bench_index.empty()) {
+            cs->load_segments(split_index_paths(FLAGS_bench_index));
+            return cs;
+        }
+        bool was = FLAGS_pack_suffixes;
+        FLAGS_pack_suffixes = pack;
+        cs->set_alloc(make_mem_allocator());
+        std::mt19937 rng(1);
+        const indexed_tree *trees[] = {
+            cs->open_tree("alpha", 0, "HEAD"),
+            cs->open_tree("beta", 0, "HEAD"),
+        };
+        for (int i = 0; i < FLAGS_bench_files; i++)
+            cs->index_file(trees[i % 2],
+                           "/src/dir" + std::to_string(i % 50) +
+                           "/file" + std::to_string(i) + (i % 3 ? ".c" : ".h"),
+                           synthetic_file(&rng, 20 + rng() % 200));
+        cs->finalize();
+        FLAGS_pack_suffixes = was;
+        return cs;
+    }
+
+    // The bytes of suffix array in all of `cs's chunks.
+    uint64_t suffix_bytes(code_searcher *cs) {
+        uint64_t bytes = 0;
+        for (auto it = cs->alloc()->begin(); it != cs->alloc()->end(); ++it)
+            bytes += (*it)->suffix_bytes();
+        return bytes;
+    }
+
+    // Lines of `bytes' of synthetic text, as one chunk would hold.
+    std::string chunk_text(size_t bytes) {
+        std::mt19937 rng(2);
+        std::string text;
+        while (text.size() < bytes)
+            text += synthetic_file(&rng, 100);
+        text.resize(text.rfind('\n', bytes - 1) + 1);
+        return text;
+    }
+};
+
+// chunk::finalize() with --sort_threads=range(0) and
+// --pack_suffixes=range(1).
+static void BM_Finalize(benchmark::State& state) {
+    std::string text = chunk_text(4 << 20);
+    std::unique_ptr<uint32_t[]> suffixes(new uint32_t[text.size() + 2]);
+    chunk c(reinterpret_cast<unsigned char*>(&text[0]), suffixes.get());
+    c.size = text.size();
+
+    int sort_threads = FLAGS_sort_threads;
+    bool pack = FLAGS_pack_suffixes;
+    FLAGS_sort_threads = state.range(0);
+    FLAGS_pack_suffixes = state.range(1);
+    for (auto _ : state) {
+        c.suffix_bits = 32;
+        c.finalize();
+    }
+    FLAGS_sort_threads = sort_threads;
+    FLAGS_pack_suffixes = pack;
+    state.SetBytesProcessed(int64_t(state.iterations()) * c.size);
+}
+BENCHMARK(BM_Finalize)->ArgNames({"threads", "pack"})
+    ->Args({1, 0})->Args({4, 0})->Args({1, 1})->Unit(benchmark::kMillisecond);
+
+// chunk::count_bytes(), which feeds the corpus statistics.
+static void BM_CountBytes(benchmark::State& state) {
+    std::string text = chunk_text(4 << 20);
+    chunk c(reinterpret_cast<unsigned char*>(&text[0]), 0);
+    c.size = text.size();
+    std::unique_ptr<corpus_stats> stats(new corpus_stats);
+    for (auto _ : state)
+        c.count_bytes(stats.get());
+    state.SetBytesProcessed(int64_t(state.iterations()) * c.size);
+}
+BENCHMARK(BM_CountBytes)->Unit(benchmark::kMillisecond);
+
+// lsd_radix_sort() of range(0) offsets into a 2^27-byte chunk, the
+// way filtered_search() sorts its candidates.
+static void BM_RadixSort(benchmark::State& state) {
+    const uint32_t kChunk = 1 << 27;
+    std::mt19937 rng(3);
+    std::vector<uint32_t> in(state.range(0)), buf(in.size());
+    for (auto &v : in)
+        v = rng() % kChunk;
+    for (auto _ : state) {
+        state.PauseTiming();
+        buf = in;
+        state.ResumeTiming();
+        lsd_radix_sort(buf.data(), buf.data() + buf.size(), kChunk - 1);
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()) * in.size());
+}
+BENCHMARK(BM_RadixSort)->Arg(1 << 10)->Arg(1 << 16)->Arg(1 << 20)->Arg(1 << 22);
+
+// index_file() of a few hundred synthetic files, into a fresh index
+// each time.
+static void BM_IndexFiles(benchmark::State& state) {
+    std::mt19937 rng(4);
+    std::vector<std::string> files;
+    int64_t bytes = 0;
+    for (int i = 0; i < 500; i++) {
+        files.push_back(synthetic_file(&rng, 200));
+        bytes += files.back().size();
+    }
+    for (auto _ : state) {
+        state.PauseTiming();
+        std::unique_ptr<code_searcher> cs(new code_searcher);
+        cs->set_alloc(make_mem_allocator());
+        const indexed_tree *tree = cs->open_tree("repo", 0, "HEAD");
+        state.ResumeTiming();
+        for (size_t i = 0; i < files.size(); i++)
+            cs->index_file(tree, "/file" + std::to_string(i), files[i]);
+        state.PauseTiming();
+        cs.reset();
+        state.ResumeTiming();
+    }
+    state.SetBytesProcessed(int64_t(state.iterations()) * bytes);
+}
+BENCHMARK(BM_IndexFiles)->Unit(benchmark::kMillisecond);
+
+namespace {
+    // The byte kernels (see src/lib/bytes.h) over a 4MB chunk's worth
+    // of lines, each run with the kernels named `kernels'.
+    const char *kKernels[] = {"scalar", "avx2", "neon"};
+
+    void BM_CountNewlines(benchmark::State& state, const char *kernels) {
+        std::string text = chunk_text(4 << 20);
+        use_byte_kernels(kernels);
+        for (auto _ : state)
+            benchmark::DoNotOptimize(count_newlines(text.data(), text.data() + text.size()));
+        state.SetBytesProcessed(int64_t(state.iterations()) * text.size());
+    }
+
+    // Each line's end, and back from it to the start, the way
+    // find_line() goes.
+    void BM_FindLines(benchmark::State& state, const char *kernels) {
+        std::string text = chunk_text(4 << 20);
+        use_byte_kernels(kernels);
+        for (auto _ : state) {
+            const char *p = text.data(), *end = p + text.size();
+            while (p < end) {
+                const char *nl = static_cast<const char*>(find_byte(p, end - p, '\n'));
+                benchmark::DoNotOptimize(rfind_byte(text.data(), nl - text.data(), '\n'));
+                p = nl + 1;
+            }
+        }
+        state.SetBytesProcessed(int64_t(state.iterations()) * text.size());
+    }
+
+    void BM_ReplaceNewlines(benchmark::State& state, const char *kernels) {
+        std::string text = chunk_text(4 << 20);
+        use_byte_kernels(kernels);
+        for (auto _ : state) {
+            replace_byte(&text[0], text.size(), '\n', '\0');
+            replace_byte(&text[0], text.size(), '\0', '\n');
+        }
+        state.SetBytesProcessed(int64_t(state.iterations()) * text.size() * 2);
+    }
+
+    // Line by line, as each match's line is checked.
+    void BM_Utf8Valid(benchmark::State& state, const char *kernels) {
+        std::string text = chunk_text(4 << 20);
+        std::vector<StringPiece> lines;
+        for (size_t p = 0, nl; p < text.size(); p = nl + 1) {
+            nl = text.find('\n', p);
+            lines.push_back(StringPiece(text.data() + p, nl - p));
+        }
+        use_byte_kernels(kernels);
+        for (auto _ : state)
+            for (const StringPiece &l : lines)
+                benchmark::DoNotOptimize(utf8_valid(l.data(), l.size()));
+        state.SetBytesProcessed(int64_t(state.iterations()) * text.size());
+    }
+};
+
+namespace {
+    // The layout the interval tree had before chunk_file_node: an
+    // implicit tree over the sorted ranges themselves, the root of
+    // [left, right) at its midpoint, each with the largest `right' in
+    // its subtree. Rebuilt here so the two can be timed side by side.
+    uint32_t build_sorted(const chunk *c, std::vector<uint32_t> *limits,
+                          uint32_t left, uint32_t right) {
+        if (right == left)
+            return 0;
+        uint32_t mid = left + (right - left) / 2;
+        uint32_t limit = std::max(c->ranges[mid].right,
+                                  std::max(build_sorted(c, limits, left, mid),
+                                           build_sorted(c, limits, mid + 1, right)));
+        (*limits)[mid] = limit;
+        return limit;
+    }
+
+    // How many ranges contain `off', walking the old layout the way
+    // find_match() did.
+    int walk_sorted(const chunk *c, const std::vector<uint32_t> &limits,
+                    uint32_t off) {
+        int found = 0;
+        std::vector<std::pair<uint32_t, uint32_t> > stack;
+        if (c->nranges)
+            stack.push_back(std::make_pair(0, c->nranges));
+        while (!stack.empty()) {
+            uint32_t left = stack.back().first, right = stack.back().second;
+            uint32_t mid = left + (right - left) / 2;
+            const chunk_file_range &r = c->ranges[mid];
+            stack.pop_back();
+            if (off > limits[mid])
+                continue;
+            if (off >= r.left) {
+                if (mid + 1 < right)
+                    stack.push_back(std::make_pair(mid + 1, right));
+                if (off <= r.right)
+                    found++;
+            }
+            if (left < mid)
+                stack.push_back(std::make_pair(left, mid));
+        }
+        return found;
+    }
+
+    // The same, over chunk->tree, the way find_match() does now.
+    int walk_tree(const chunk *c, uint32_t off) {
+        int found = 0;
+        uint32_t stack[64];
+        int depth = 0;
+        if (c->nranges)
+            stack[depth++] = 0;
+        while (depth) {
+            uint32_t i = stack[--depth];
+            const chunk_file_node &n = c->tree[i];
+            if (off > n.right_limit)
+                continue;
+            if (off >= n.left) {
+                if (2*i + 2 < c->nranges)
+                    stack[depth++] = 2*i + 2;
+                if (off <= n.right)
+                    found++;
+            }
+            if (2*i + 1 < c->nranges)
+                stack[depth++] = 2*i + 1;
+        }
+        return found;
+    }
+};
+
+// Finding the ranges that hold each of 4096 random offsets into the
+// corpus's first chunk, with the old sorted layout (tree=0) and the
+// Eytzinger tree (tree=1).
+static void BM_FindMatch(benchmark::State& state) {
+    const chunk *c = *corpus()->alloc()->begin();
+    std::vector<uint32_t> limits(c->nranges);
+    build_sorted(c, &limits, 0, c->nranges);
+
+    std::mt19937 rng(5);
+    std::vector<uint32_t> offs(4096);
+    for (auto &o : offs)
+        o = rng() % c->size;
+
+    int64_t found = 0;
+    for (auto _ : state) {
+        for (uint32_t o : offs)
+            found += state.range(0) ? walk_tree(c, o) : walk_sorted(c, limits, o);
+    }
+    state.SetItemsProcessed(int64_t(state.iterations()) * offs.size());
+    state.counters["ranges"] = c->nranges;
+    state.counters["found"] = double(found) / (state.iterations() * offs.size());
+}
+BENCHMARK(BM_FindMatch)->ArgName("tree")->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+namespace {
+    struct search_case {
+        const char *name;
+        const char *line;
+        const char *file;
+        int max_matches;
+        bool fold_case;
+    };
+
+    // Chosen to exercise each path through searcher: the index
+    // answering a literal directly, a key narrowing RE2's work, a
+    // pattern the index can't help with, and the file-restricted and
+    // match-heavy variants that lean on find_match() and try_match().
+    // The _fold cases ignore case, which --fold_index speeds up.
+    const search_case kSearches[] = {
+        {"literal",         "unlock_free",             "",        50},
+        {"literal_many",    "return",                  "",        0},
+        {"filtered",        "lock.*alloc\\(",          "",        50},
+        {"filtered_class",  "(read|write)_(buf|len)",  "",        0},
+        {"full",            "^.{70,}$",                "",        50},
+        {"full_file",       ".{70,}",                  "\\.h$",   0},
+        {"filtered_file",   "state.count",             "dir1[0-9]/", 0},
+        {"no_match",        "zzyzx",                   "",        50},
+        {"literal_fold",    "Unlock_Free",             "",        50, true},
+        {"filtered_fold",   "lock.*alloc\\(",          "",        50, true},
+        {"class_fold",      "(read|write)_(buf|len)",  "",        0,  true},
+    };
+
+    // Against the synthetic corpus, with suffix arrays packed or not
+    // as range(0) says.
+    void BM_Search(benchmark::State& state, const search_case *c) {
+        code_searcher *cs = corpus(state.range(0));
+        static code_searcher::search_pool pool(1);
+
+        RE2::Options opts;
+        default_re2_options(opts);
+        opts.set_case_sensitive(!c->fold_case);
+        query q;
+        q.line_pat = compile_re(c->line, opts);
+        if (*c->file)
+            q.file_pat = compile_re(c->file, opts);
+        q.max_matches = c->max_matches;
+        q.timeout = 0;
+
+        code_searcher::search_thread search(cs, &pool);
+        uint64_t re2 = 0, git = 0, index = 0, sort = 0, matches = 0;
+        for (auto _ : state) {
+            match_stats stats;
+            search.match(q, [](const match_result *) {}, &stats);
+            re2 += timeval_ns(stats.re2_time);
+            git += timeval_ns(stats.git_time);
+            index += timeval_ns(stats.index_time);
+            sort += timeval_ns(stats.sort_time);
+            matches += stats.matches;
+        }
+        double n = state.iterations() * 1e6;
+        state.counters["re2_ms"] = re2 / n;
+        state.counters["git_ms"] = git / n;
+        state.counters["index_ms"] = index / n;
+        state.counters["sort_ms"] = sort / n;
+        state.counters["matches"] = double(matches) / state.iterations();
+        state.counters["suffix_bytes"] = suffix_bytes(cs);
+    }
+
+    // indexRE() against the corpus's byte statistics.
+    void BM_IndexRE(benchmark::State& state, const search_case *c) {
+        RE2::Options opts;
+        default_re2_options(opts);
+        opts.set_case_sensitive(!c->fold_case);
+        RE2 re(c->line, opts);
+        const corpus_stats *stats = &corpus()->alloc()->corpus();
+        for (auto _ : state)
+            benchmark::DoNotOptimize(indexRE(re, stats, c->fold_case));
+    }
+};
+
+int main(int argc, char **argv) {
+    benchmark::Initialize(&argc, argv);
+    gflags::ParseCommandLineFlags(&argc, &argv, true);
+
+    for (const search_case &c : kSearches) {
+        auto *search = benchmark::RegisterBenchmark((std::string("BM_Search/") + c.name).c_str(),
+                                                    BM_Search, &c);
+        search->ArgName("pack")->Arg(0)->Unit(benchmark::kMicrosecond)->UseRealTime();
+        if (FLAGS_bench_index.empty())
+            search->Arg(1);
+        benchmark::RegisterBenchmark((std::string("BM_IndexRE/") + c.name).c_str(),
+                                     BM_IndexRE, &c)
+            ->Unit(benchmark::kMicrosecond);
+    }
+    // Each benchmark sets the kernels it wants when it starts.
+    std::string best = byte_kernels();
+    for (const char *k : kKernels) {
+        if (!use_byte_kernels(k))
+            continue;
+        std::string suffix = std::string("/") + k;
+        benchmark::RegisterBenchmark(("BM_CountNewlines" + suffix).c_str(),
+                                     BM_CountNewlines, k)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("BM_FindLines" + suffix).c_str(),
+                                     BM_FindLines, k)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("BM_ReplaceNewlines" + suffix).c_str(),
+                                     BM_ReplaceNewlines, k)->Unit(benchmark::kMicrosecond);
+        benchmark::RegisterBenchmark(("BM_Utf8Valid" + suffix).c_str(),
+                                     BM_Utf8Valid, k)->Unit(benchmark::kMicrosecond);
+    }
+    use_byte_kernels(best.c_str());
+    benchmark::RunSpecifiedBenchmarks();
+    return 0;
+}
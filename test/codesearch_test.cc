@@ -1,9 +1,66 @@
 #include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
 #include "gtest/gtest.h"
 
 #include "src/codesearch.h"
 #include "src/content.h"
+#include "src/chunk.h"
+#include "src/chunk_allocator.h"
+#include "src/dump_load.h"
+#include "src/lib/arena.h"
+#include "src/lib/bytes.h"
+#include "src/lib/metrics.h"
+#include "src/lib/numa.h"
+#include "src/lib/parallel.h"
+#include "src/lib/radix_sort.h"
+#include "src/indexer.h"
+#include "src/fs_indexer.h"
+#include "src/partition.h"
+#include "src/query_log.h"
 #include "src/tools/grpc_server.h"
+#include "src/tools/async_server.h"
+#include "src/tools/shard_router.h"
+#include "src/tools/limits.h"
+
+#include <grpc++/server.h>
+#include <grpc++/server_builder.h>
+
+#include "gflags/gflags.h"
+
+#include <json-c/json.h>
+#include <random>
+
+#include "utf8.h"
+
+DECLARE_int32(search_split_bytes);
+DECLARE_bool(literal_search);
+DECLARE_bool(warmup);
+DECLARE_bool(hugepages);
+DECLARE_bool(pack_suffixes);
+DECLARE_int32(sort_threads);
+DECLARE_bool(fold_index);
+DECLARE_bool(global_dedup);
+DECLARE_int32(dedup_table_mb);
+DECLARE_int32(result_cache_mb);
+DECLARE_int32(batch_window_ms);
+DECLARE_int32(max_concurrent_searches);
+DECLARE_bool(numa);
+DECLARE_int32(build_memory_mb);
+DECLARE_int32(threads);
+DECLARE_int32(fs_threads);
+DECLARE_int32(fs_read_ahead_mb);
+DECLARE_int32(max_context_lines);
+DECLARE_int32(max_query_matches);
+DECLARE_int32(max_query_timeout_ms);
+DECLARE_bool(allow_reload);
 
 class codesearch_test : public ::testing::Test {
 protected:
@@ -174,6 +231,1853 @@ TEST_F(codesearch_test, RestrictFiles) {
     EXPECT_EQ("/file2", matches.results(1).path());
 }
 
+TEST_F(codesearch_test, RestrictFilesMemo) {
+    // The same lines in many files, trees and chunks, so each file is
+    // asked about from several chunks and threads.
+    cs_.alloc()->set_chunk_size(1 << 12);
+    const indexed_tree *trees[] = {
+        tree_, cs_.open_tree("other", 0, "REV0"), cs_.open_tree("third", 0, "REV0"),
+    };
+    for (int t = 0; t < 3; t++)
+        for (int i = 0; i < 40; i++) {
+            std::string text;
+            for (int l = 0; l < 30; l++)
+                text += "shared needle " + std::to_string(l) + "\n";
+            text += "own line " + std::to_string(t * 40 + i) + "\n";
+            cs_.index_file(trees[t], (i % 4 ? "/keep" : "/skip") + std::to_string(i), text);
+        }
+    cs_.finalize();
+    ASSERT_LT(2, cs_.alloc()->size());
+
+    code_searcher::search_pool pool(4);
+    code_searcher::search_thread search(&cs_, &pool);
+    RE2::Options opts;
+    default_re2_options(opts);
+    // Each query gets answers of its own, whatever the last one
+    // decided about the same files.
+    for (int round = 0; round < 3; round++) {
+        query q;
+        q.line_pat.reset(new RE2("needle 7$", opts));
+        q.max_matches = 0;
+        if (round != 1)
+            q.tree_pat.reset(new RE2("^(repo|third)$", opts));
+        if (round != 2)
+            q.negate.file_pat.reset(new RE2("skip", opts));
+        std::multiset<string> got;
+        match_stats stats;
+        search.match(q, [&got](const match_result *m) {
+                got.insert(m->file->tree->name + ":" + m->file->path.as_string());
+            }, &stats);
+
+        std::multiset<string> want;
+        for (int t = 0; t < 3; t++)
+            for (int i = 0; i < 40; i++) {
+                if (round != 1 && t == 1)
+                    continue;
+                if (round != 2 && i % 4 == 0)
+                    continue;
+                want.insert(trees[t]->name + ":" + (i % 4 ? "/keep" : "/skip") +
+                            std::to_string(i));
+            }
+        EXPECT_EQ(want, got) << round;
+    }
+}
+
+TEST_F(codesearch_test, ConcurrentSearches) {
+    for (int i = 0; i < 4; i++) {
+        cs_.index_file(tree_, "/file" + std::to_string(i),
+                       "needle " + std::to_string(i) + "\n" +
+                       "haystack\n");
+    }
+    cs_.finalize();
+
+    code_searcher::search_pool pool(2);
+    CodeSearchImpl srv(&cs_, nullptr, &pool);
+
+    std::vector<std::thread> threads;
+    std::vector<int> results(8);
+    for (int i = 0; i < results.size(); i++) {
+        threads.push_back(std::thread([&srv, &results, i] {
+            Query request;
+            CodeSearchResult matches;
+            grpc::ServerContext ctx;
+            request.set_line(i % 2 ? "needle" : "haystack");
+            grpc::Status st = srv.Search(&ctx, &request, &matches);
+            results[i] = st.ok() ? matches.results_size() : -1;
+        }));
+    }
+    for (auto &t : threads)
+        t.join();
+
+    for (int i = 0; i < results.size(); i++)
+        EXPECT_EQ(4, results[i]);
+}
+
+TEST_F(codesearch_test, SearchTimers) {
+    cs_.alloc()->set_chunk_size(1 << 14);
+    for (int i = 0; i < 400; i++) {
+        std::string text;
+        for (int l = 0; l < 20; l++)
+            text += "line " + std::to_string(i * 20 + l) + " " +
+                std::string(10 + l * 3, 'a' + l) + "\n";
+        cs_.index_file(tree_, "/file" + std::to_string(i), text);
+    }
+    cs_.finalize();
+    ASSERT_LT(4, cs_.alloc()->size());
+
+    // Each thread's time is added to the query it was spent on, and
+    // only that one.
+    code_searcher::search_pool pool(4);
+    code_searcher::search_thread search(&cs_, &pool);
+    RE2::Options opts;
+    default_re2_options(opts);
+    query q;
+    q.line_pat.reset(new RE2("[0-9] .{60,}$", opts));
+    q.max_matches = 0;
+    match_stats stats;
+    search.match(q, [](const match_result *) {}, &stats);
+    EXPECT_LT(0, stats.matches);
+    EXPECT_LT(0, timeval_ns(stats.re2_time));
+    EXPECT_LT(0, timeval_ns(stats.git_time));
+
+    // With no candidates, nothing runs RE2 or looks up files.
+    q.line_pat.reset(new RE2("zzyzx", opts));
+    match_stats none;
+    search.match(q, [](const match_result *) {}, &none);
+    EXPECT_EQ(0, none.matches);
+    EXPECT_EQ(0, timeval_ns(none.re2_time));
+    EXPECT_EQ(0, timeval_ns(none.git_time));
+}
+
+TEST_F(codesearch_test, SplitChunks) {
+    std::string text;
+    for (int i = 0; i < 200; i++)
+        text += "line " + std::to_string(i) + (i % 10 ? "\n" : " needle\n");
+    cs_.index_file(tree_, "/data/file1", text);
+    cs_.finalize();
+
+    code_searcher::search_pool pool(3);
+    CodeSearchImpl srv(&cs_, nullptr, &pool);
+    Query request;
+    request.set_line("needle");
+
+    FLAGS_search_split_bytes = 64;
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    grpc::Status st = srv.Search(&ctx, &request, &matches);
+    FLAGS_search_split_bytes = 0;
+    ASSERT_TRUE(st.ok());
+
+    ASSERT_EQ(20, matches.results_size());
+    std::vector<int> lines;
+    for (auto &r : matches.results())
+        lines.push_back(r.line_number());
+    std::sort(lines.begin(), lines.end());
+    for (int i = 0; i < 20; i++)
+        EXPECT_EQ(10 * i + 1, lines[i]);
+}
+
+TEST_F(codesearch_test, NumaPool) {
+    cs_.alloc()->set_chunk_size(1 << 12);
+    for (int i = 0; i < 200; i++)
+        cs_.index_file(tree_, "/src/" + std::string(i % 7, 'd') + "/file" + std::to_string(i),
+                       "line " + std::to_string(i) + (i % 3 ? "\n" : " needle\n") +
+                       std::string(100, 'a' + i % 26) + "\n");
+    cs_.finalize();
+    ASSERT_LT(4, cs_.alloc()->size());
+
+    auto search = [this](code_searcher::search_pool *pool, bool ranked) {
+        CodeSearchImpl srv(&cs_, nullptr, pool);
+        Query request;
+        request.set_line("needle");
+        request.set_max_matches(ranked ? 10 : 1000);
+        request.set_ranked(ranked);
+        CodeSearchResult matches;
+        grpc::ServerContext ctx;
+        grpc::Status st = srv.Search(&ctx, &request, &matches);
+        // Ranked matches with the same score may come in any order.
+        std::vector<std::string> out;
+        for (auto &r : matches.results())
+            out.push_back(ranked ? std::to_string(r.score()) : r.path());
+        if (!ranked)
+            std::sort(out.begin(), out.end());
+        return st.ok() ? out : std::vector<std::string>{"error"};
+    };
+
+    code_searcher::search_pool plain(1);
+    std::vector<std::string> all = search(&plain, false);
+    std::vector<std::string> top = search(&plain, true);
+    ASSERT_EQ(10, top.size());
+    ASSERT_EQ(10, top.size());
+
+    numa_simulate(2);
+    FLAGS_numa = true;
+    {
+        code_searcher::search_pool pool(4);
+        for (int i = 0; i < 5; i++) {
+            EXPECT_EQ(all, search(&pool, false));
+            EXPECT_EQ(top, search(&pool, true));
+        }
+    }
+    FLAGS_numa = false;
+    numa_simulate(0);
+}
+
+TEST_F(codesearch_test, BatchedSearches) {
+    // Enough lines that each chunk is swept in several blocks.
+    std::string text;
+    for (int i = 0; i < 12000; i++)
+        text += "line " + std::to_string(i) + "\n";
+    cs_.index_file(tree_, "/data/lines", text);
+    cs_.index_file(tree_, "/data/other", "x 7\nline 12a\n");
+    cs_.finalize();
+
+    code_searcher::search_pool pool(2);
+    CodeSearchImpl srv(&cs_, nullptr, &pool);
+    const char *patterns[] = {"[0-9]{5}", "^\\w{4} \\d\\d$", "^.{4} \\d\\da?$", "^. \\d$"};
+    const int n = sizeof patterns / sizeof *patterns;
+    auto search = [&srv](const char *pat, const char *file) {
+        Query request;
+        request.set_line(pat);
+        request.set_file(file);
+        request.set_max_matches(100000);
+        CodeSearchResult matches;
+        grpc::ServerContext ctx;
+        grpc::Status st = srv.Search(&ctx, &request, &matches);
+        std::set<std::string> out;
+        for (auto &r : matches.results())
+            out.insert(r.path() + ":" + std::to_string(r.line_number()));
+        return st.ok() ? out : std::set<std::string>{"error"};
+    };
+
+    std::vector<std::set<std::string> > expected(2 * n), results(2 * n);
+    for (int i = 0; i < 2 * n; i++)
+        expected[i] = search(patterns[i % n], i < n ? "" : "other");
+
+    FLAGS_batch_window_ms = 50;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 2 * n; i++) {
+        threads.push_back(std::thread([&, i] {
+            results[i] = search(patterns[i % n], i < n ? "" : "other");
+        }));
+    }
+    for (auto &t : threads)
+        t.join();
+    FLAGS_batch_window_ms = 0;
+
+    EXPECT_EQ(2000, expected[0].size());
+    EXPECT_EQ(91, expected[2].size());
+    EXPECT_EQ(1, expected[n + 2].size());
+    EXPECT_EQ(1, expected[n + 3].size());
+    for (int i = 0; i < 2 * n; i++)
+        EXPECT_EQ(expected[i], results[i]) << patterns[i % n];
+}
+
+TEST_F(codesearch_test, BatchedSearchLimits) {
+    std::string text;
+    for (int i = 0; i < 2000; i++)
+        text += "line " + std::to_string(i) + "\n";
+    cs_.index_file(tree_, "/data/lines", text);
+    cs_.finalize();
+
+    code_searcher::search_pool pool(1);
+    code_searcher::search_thread search(&cs_, &pool);
+    RE2::Options opts;
+    default_re2_options(opts);
+    query quick, slow;
+    quick.line_pat.reset(new RE2(".", opts));
+    quick.max_matches = 1;
+    slow.line_pat.reset(new RE2(".", opts));
+    slow.max_matches = 0;
+
+    // Both join one batch, swept in one block; the slow query's matches
+    // would take seconds, but the quick one's limit ends it at once.
+    FLAGS_batch_window_ms = 20;
+    auto q = search.start(quick, code_searcher::search_thread::transform_func(),
+                          std::function<void ()>());
+    auto s = search.start(slow, [](match_result *) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return true;
+        }, std::function<void ()>());
+    FLAGS_batch_window_ms = 0;
+
+    int matches = 0;
+    match_stats stats;
+    ASSERT_TRUE(search.collect(q.get(), [&matches](const match_result *) { matches++; },
+                               &stats, true));
+    EXPECT_EQ(kExitMatchLimit, stats.why);
+    EXPECT_EQ(1, matches);
+    EXPECT_FALSE(search.collect(s.get(), [](const match_result *) {}, &stats));
+    // Cancels the slow query: both are closed, and nothing is left
+    // pointing at the quick one, now that it's gone.
+    q.reset();
+    s.reset();
+}
+
+TEST_F(codesearch_test, Metrics) {
+    cs_.index_file(tree_, "/file", "needle\nhaystack\n");
+    cs_.finalize();
+
+    histogram h("test.histogram");
+    h.record_ns(5000);
+    h.record_ns(15000);
+    h.record_ns(uint64_t(100) * 1000000000);
+    EXPECT_EQ(3, h.count());
+    EXPECT_EQ(1, h.bucket(0));
+    EXPECT_EQ(1, h.bucket(1));
+    EXPECT_EQ(1, h.bucket(histogram::kBuckets - 1));
+
+    // Intervals shorter than a millisecond still add up.
+    metric ms("test.timer");
+    for (int i = 0; i < 5; i++)
+        ms.inc_ns(400000);
+    EXPECT_EQ(2, ms.value());
+
+    code_searcher::search_pool pool(1);
+    CodeSearchImpl srv(&cs_, nullptr, &pool);
+    Query request;
+    request.set_line("needle");
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+
+    StatsRequest stats_request;
+    ServerStats stats;
+    ASSERT_TRUE(srv.Stats(&ctx, &stats_request, &stats).ok());
+    const std::string &text = stats.metrics();
+    EXPECT_NE(std::string::npos, text.find("# TYPE livegrep_search_queries counter\n"));
+    EXPECT_NE(std::string::npos, text.find("# TYPE livegrep_search_queries_active gauge\n"));
+    EXPECT_NE(std::string::npos, text.find("livegrep_test_histogram_seconds_bucket{le=\"1e-05\"} 1\n"));
+    EXPECT_NE(std::string::npos, text.find("livegrep_test_histogram_seconds_bucket{le=\"+Inf\"} 3\n"));
+    EXPECT_NE(std::string::npos, text.find("livegrep_search_latency_seconds_count "));
+}
+
+TEST_F(codesearch_test, CancelAbandonedSearch) {
+    std::string text;
+    for (int i = 0; i < 20; i++)
+        text += "needle " + std::to_string(i) + "\n";
+    cs_.index_file(tree_, "/data/file1", text);
+    cs_.finalize();
+
+    code_searcher::search_pool pool(1);
+    code_searcher::search_thread search(&cs_, &pool);
+    query q;
+    RE2::Options opts;
+    default_re2_options(opts);
+    q.line_pat.reset(new RE2("needle", opts));
+    q.abandoned = [] { return true; };
+
+    int matches = 0;
+    match_stats stats;
+    search.match(q,
+                 [&matches](const match_result *) { matches++; },
+                 [](match_result *) {
+                     std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                     return true;
+                 },
+                 &stats);
+
+    EXPECT_EQ(kExitCancelled, stats.why);
+    EXPECT_LT(matches, 20);
+}
+
+TEST_F(codesearch_test, QueryLimits) {
+    std::string text;
+    for (int i = 0; i < 10; i++)
+        text += "needle " + std::to_string(i) + "\n";
+    cs_.index_file(tree_, "/data/file1", text);
+    cs_.finalize();
+
+    CodeSearchImpl srv(&cs_, nullptr);
+    Query request;
+    request.set_line("needle");
+    request.set_max_matches(2);
+    request.set_context_lines(-1);
+
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    grpc::Status st = srv.Search(&ctx, &request, &matches);
+    ASSERT_TRUE(st.ok());
+
+    ASSERT_EQ(2, matches.results_size());
+    EXPECT_EQ(SearchStats::MATCH_LIMIT, matches.stats().exit_reason());
+    for (auto &r : matches.results()) {
+        EXPECT_EQ(0, r.context_before_size());
+        EXPECT_EQ(0, r.context_after_size());
+    }
+
+    request.set_max_matches(0);
+    request.set_context_lines(1);
+    matches.Clear();
+    st = srv.Search(&ctx, &request, &matches);
+    ASSERT_TRUE(st.ok());
+    ASSERT_EQ(10, matches.results_size());
+    for (auto &r : matches.results())
+        EXPECT_GE(1, r.context_after_size());
+}
+
+TEST(grpc_test, ClampQueryLimits) {
+    Query request;
+    request.set_line("needle");
+    request.set_max_matches(std::numeric_limits<int32_t>::max());
+    request.set_timeout_ms(std::numeric_limits<int32_t>::max());
+    request.set_context_lines(std::numeric_limits<int32_t>::max());
+
+    query q;
+    int w;
+    ASSERT_TRUE(parse_query(&q, &request, &w).ok());
+    EXPECT_EQ(FLAGS_max_query_matches, q.max_matches);
+    EXPECT_EQ(FLAGS_max_query_timeout_ms, q.timeout);
+    EXPECT_EQ(FLAGS_max_context_lines, q.context_lines);
+
+    // Within the limits, the client's values stand.
+    request.set_max_matches(7);
+    request.set_timeout_ms(20);
+    request.set_context_lines(3);
+    query small;
+    ASSERT_TRUE(parse_query(&small, &request, &w).ok());
+    EXPECT_EQ(7, small.max_matches);
+    EXPECT_EQ(20, small.timeout);
+    EXPECT_EQ(3, small.context_lines);
+
+    FLAGS_max_query_matches = 0;
+    FLAGS_max_query_timeout_ms = 0;
+    request.set_max_matches(std::numeric_limits<int32_t>::max());
+    request.set_timeout_ms(std::numeric_limits<int32_t>::max());
+    query unlimited;
+    ASSERT_TRUE(parse_query(&unlimited, &request, &w).ok());
+    FLAGS_max_query_matches = 10000;
+    FLAGS_max_query_timeout_ms = 10000;
+    EXPECT_EQ(std::numeric_limits<int32_t>::max(), unlimited.max_matches);
+    EXPECT_EQ(std::numeric_limits<int32_t>::max(), unlimited.timeout);
+}
+
+TEST_F(codesearch_test, RankedMatches) {
+    json_object *meta = json_tokener_parse("{\"priority\": 2}");
+    const indexed_tree *high = cs_.open_tree("high", meta, "REV0");
+    for (int i = 0; i < 20; i++)
+        cs_.index_file(tree_, "/src/a/b/c/d/file" + std::to_string(i),
+                       "needle " + std::to_string(i) + "\n");
+    cs_.index_file(tree_, "/vendor/x.c", "needle\n");
+    cs_.index_file(tree_, "/x_test.c", "needle test\n");
+    cs_.index_file(tree_, "/needle.c", "needle name\n");
+    cs_.index_file(high, "/deep/er/y.c", "needle high\n");
+    cs_.finalize();
+
+    CodeSearchImpl srv(&cs_, nullptr);
+    Query request;
+    request.set_line("needle");
+    request.set_max_matches(3);
+    request.set_ranked(true);
+
+    for (int i = 0; i < 5; i++) {
+        CodeSearchResult matches;
+        grpc::ServerContext ctx;
+        ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+        ASSERT_EQ(3, matches.results_size());
+        EXPECT_EQ("/deep/er/y.c", matches.results(0).path());
+        EXPECT_EQ("/needle.c", matches.results(1).path());
+        EXPECT_EQ("/x_test.c", matches.results(2).path());
+        EXPECT_EQ(SearchStats::MATCH_LIMIT, matches.stats().exit_reason());
+    }
+
+    request.set_max_matches(0);
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+    ASSERT_EQ(24, matches.results_size());
+    EXPECT_EQ("/vendor/x.c", matches.results(23).path());
+    EXPECT_EQ(SearchStats::NONE, matches.stats().exit_reason());
+}
+
+TEST_F(codesearch_test, SearchStream) {
+    for (int i = 0; i < 120; i++)
+        cs_.index_file(tree_, "/file" + std::to_string(i),
+                       "needle " + std::to_string(i) + "\n");
+    cs_.finalize();
+
+    // Each server answers the second time from its cache.
+    FLAGS_result_cache_mb = 1;
+    code_searcher::search_pool pool(1);
+    CodeSearchImpl sync(&cs_, nullptr, &pool);
+    AsyncCodeSearch async(&cs_, nullptr, &pool);
+    FLAGS_result_cache_mb = 0;
+    for (int a = 0; a < 2; a++) {
+        grpc::ServerBuilder builder;
+        if (a)
+            async.Register(&builder, 1);
+        else
+            builder.RegisterService(&sync);
+        std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+        if (a)
+            async.Start();
+        std::unique_ptr<CodeSearch::Stub> stub(
+            CodeSearch::NewStub(server->InProcessChannel(grpc::ChannelArguments())));
+
+        Query request;
+        request.set_line("needle");
+        request.set_max_matches(1000);
+        request.set_timeout_ms(60000);
+        for (int cached = 0; cached < 2; cached++) {
+            grpc::ClientContext ctx;
+            std::unique_ptr<grpc::ClientReader<CodeSearchResult> > reader(
+                stub->SearchStream(&ctx, request));
+            // Every result once, in batches of at most
+            // kStreamBatchSize, and the stats only with the last.
+            std::vector<CodeSearchResult> batches(1);
+            while (reader->Read(&batches.back()))
+                batches.emplace_back();
+            batches.pop_back();
+            ASSERT_TRUE(reader->Finish().ok());
+            ASSERT_LE(3, batches.size()) << a << cached;
+            std::set<string> paths;
+            for (size_t b = 0; b < batches.size(); b++) {
+                EXPECT_GE(kStreamBatchSize, batches[b].results_size()) << a << cached;
+                EXPECT_EQ(b + 1 == batches.size(), batches[b].has_stats()) << a << cached;
+                for (auto &r : batches[b].results())
+                    paths.insert(r.path());
+            }
+            EXPECT_EQ(120, paths.size()) << a << cached;
+            EXPECT_EQ(SearchStats::NONE, batches.back().stats().exit_reason()) << a << cached;
+        }
+
+        server->Shutdown();
+        if (a)
+            async.Shutdown();
+    }
+}
+
+TEST_F(codesearch_test, SearchFiles) {
+    const indexed_tree *other = cs_.open_tree("other", 0, "REV0");
+    cs_.index_file(tree_, "/src/main.cc", "int main() {}\n");
+    cs_.index_file(tree_, "/src/main.h", "// only mentions main.cc\n");
+    cs_.index_file(tree_, "/doc/README", "see src/main.cc\n");
+    cs_.index_file(other, "/src/main.cc", "int main() { return 1; }\n");
+    cs_.finalize();
+
+    CodeSearchImpl srv(&cs_, nullptr);
+    Query request;
+    request.set_file("main\\.cc");
+
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv.SearchFiles(&ctx, &request, &matches).ok());
+    std::set<std::string> got;
+    for (auto &r : matches.results()) {
+        got.insert(r.tree() + ":" + r.path());
+        EXPECT_EQ(0, r.line_number());
+        EXPECT_EQ(r.path(), r.line());
+        EXPECT_EQ(5, r.bounds().left());
+        EXPECT_EQ(12, r.bounds().right());
+    }
+    EXPECT_EQ((std::set<std::string>{"repo:/src/main.cc", "other:/src/main.cc"}), got);
+
+    request.set_file("^/[a-z]+/main");
+    request.set_repo("^repo$");
+    matches.Clear();
+    ASSERT_TRUE(srv.SearchFiles(&ctx, &request, &matches).ok());
+    got.clear();
+    for (auto &r : matches.results())
+        got.insert(r.path());
+    EXPECT_EQ((std::set<std::string>{"/src/main.cc", "/src/main.h"}), got);
+
+    request.set_file("");
+    EXPECT_EQ(grpc::StatusCode::INVALID_ARGUMENT,
+              srv.SearchFiles(&ctx, &request, &matches).error_code());
+}
+
+TEST_F(codesearch_test, LiteralSearch) {
+    cs_.index_file(tree_, "/file1", file1);
+    cs_.index_file(tree_, "/file2",
+                   "the Fox and the fox\n"
+                   "caf\xc3\xa9 foxes\n"
+                   "no match here\n");
+    cs_.finalize();
+
+    CodeSearchImpl srv(&cs_, nullptr);
+    auto run = [&srv](const char *line, bool fold) {
+        Query request;
+        request.set_line(line);
+        request.set_fold_case(fold);
+        CodeSearchResult matches;
+        grpc::ServerContext ctx;
+        EXPECT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+        std::vector<std::string> out;
+        for (auto &r : matches.results())
+            out.push_back(r.path() + ":" + std::to_string(r.line_number()) + ":" +
+                          std::to_string(r.bounds().left()) + "-" +
+                          std::to_string(r.bounds().right()));
+        std::sort(out.begin(), out.end());
+        return out;
+    };
+
+    const char *queries[] = {"fox", "o", "the", "caf\xc3\xa9", "zzz"};
+    for (auto q : queries) {
+        for (int fold = 0; fold < 2; fold++) {
+            FLAGS_literal_search = true;
+            auto literal = run(q, fold);
+            FLAGS_literal_search = false;
+            auto scanned = run(q, fold);
+            FLAGS_literal_search = true;
+            EXPECT_EQ(scanned, literal) << q << " fold=" << fold;
+        }
+    }
+
+    auto folded = run("FOX", true);
+    ASSERT_EQ(3, folded.size());
+    EXPECT_EQ("/file1:1:16-19", folded[0]);
+    EXPECT_EQ("/file2:1:4-7", folded[1]);
+    EXPECT_EQ("/file2:2:5-8", folded[2]);
+}
+
+TEST_F(codesearch_test, ChunkTrees) {
+    cs_.alloc()->set_chunk_size(64);
+    const indexed_tree *other = cs_.open_tree("other", 0, "REV0");
+    for (int i = 0; i < 4; i++)
+        cs_.index_file(tree_, "/a" + std::to_string(i),
+                       "needle in repo " + std::to_string(i) + "\n");
+    for (int i = 0; i < 4; i++)
+        cs_.index_file(other, "/b" + std::to_string(i),
+                       "needle in other " + std::to_string(i) + "\n");
+    cs_.finalize();
+
+    ASSERT_LT(2, cs_.alloc()->size());
+    EXPECT_EQ(std::vector<const indexed_tree*>{tree_}, cs_.alloc()->at(0)->trees);
+    EXPECT_EQ(std::vector<const indexed_tree*>{other},
+              cs_.alloc()->at(cs_.alloc()->size() - 1)->trees);
+
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    close(fd);
+    cs_.dump_index(path);
+    code_searcher loaded;
+    loaded.load_index(path);
+    unlink(path);
+
+    ASSERT_EQ(cs_.alloc()->size(), loaded.alloc()->size());
+    for (size_t i = 0; i < loaded.alloc()->size(); i++) {
+        std::vector<std::string> want, got;
+        for (auto t : cs_.alloc()->at(i)->trees)
+            want.push_back(t->name);
+        for (auto t : loaded.alloc()->at(i)->trees)
+            got.push_back(t->name);
+        EXPECT_EQ(want, got);
+    }
+
+    CodeSearchImpl srv(&loaded, nullptr);
+    Query request;
+    request.set_line("needle");
+    request.set_repo("^other$");
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+    ASSERT_EQ(4, matches.results_size());
+    for (auto &r : matches.results())
+        EXPECT_EQ("other", r.tree());
+}
+
+TEST_F(codesearch_test, MappedChunkTables) {
+    cs_.alloc()->set_chunk_size(1 << 12);
+    for (int i = 0; i < 100; i++) {
+        std::string text;
+        for (int l = 0; l < 20; l++)
+            text += "line " + std::to_string((l * 11 + i) % (l % 2 ? 30 : 500)) + "\n";
+        cs_.index_file(tree_, "/file" + std::to_string(i), text);
+    }
+    cs_.finalize();
+
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    close(fd);
+    cs_.dump_index(path);
+    code_searcher loaded;
+    loaded.load_index(path);
+
+    // Where the index file is mapped.
+    std::vector<std::pair<uintptr_t, uintptr_t> > maps;
+    FILE *f = fopen("/proc/self/maps", "r");
+    ASSERT_TRUE(f != NULL);
+    char line[4096];
+    while (fgets(line, sizeof line, f)) {
+        unsigned long lo, hi;
+        if (strstr(line, path) && sscanf(line, "%lx-%lx", &lo, &hi) == 2)
+            maps.push_back(std::make_pair(lo, hi));
+    }
+    fclose(f);
+    unlink(path);
+    ASSERT_FALSE(maps.empty());
+    auto mapped = [&maps](const void *p, size_t len) {
+        uintptr_t a = reinterpret_cast<uintptr_t>(p);
+        for (auto &m : maps)
+            if (a >= m.first && a + len <= m.second)
+                return true;
+        return false;
+    };
+
+    // The tables are used where they lie in the mapping, and say the
+    // same as the ones they were written from.
+    ASSERT_EQ(cs_.alloc()->size(), loaded.alloc()->size());
+    std::vector<const indexed_file*> built(cs_.begin_files(), cs_.end_files());
+    std::vector<const indexed_file*> files(loaded.begin_files(), loaded.end_files());
+    for (size_t i = 0; i < loaded.alloc()->size(); i++) {
+        const chunk *a = cs_.alloc()->at(i), *b = loaded.alloc()->at(i);
+        ASSERT_EQ(a->nranges, b->nranges) << i;
+        ASSERT_LT(0, b->nranges);
+        EXPECT_TRUE(mapped(b->ranges, b->nranges * sizeof *b->ranges)) << i;
+        EXPECT_TRUE(mapped(b->tree, b->nranges * sizeof *b->tree)) << i;
+        for (uint32_t r = 0; r < b->nranges; r++) {
+            EXPECT_EQ(a->ranges[r].left, b->ranges[r].left);
+            EXPECT_EQ(a->ranges[r].right, b->ranges[r].right);
+            ASSERT_EQ(a->ranges[r].nfiles, b->ranges[r].nfiles);
+            EXPECT_TRUE(mapped(b->file_ids + b->ranges[r].files,
+                               b->ranges[r].nfiles * sizeof *b->file_ids));
+            for (uint32_t k = 0; k < b->ranges[r].nfiles; k++)
+                EXPECT_EQ(built[a->file_ids[a->ranges[r].files + k]]->path,
+                          files[b->file_ids[b->ranges[r].files + k]]->path);
+            EXPECT_EQ(a->tree[r].right_limit, b->tree[r].right_limit);
+            EXPECT_EQ(a->tree[r].range, b->tree[r].range);
+        }
+    }
+}
+
+TEST_F(codesearch_test, ParallelLoad) {
+    cs_.alloc()->set_chunk_size(1 << 12);
+    const indexed_tree *other = cs_.open_tree("other", 0, "REV1");
+    for (int i = 0; i < 200; i++) {
+        std::string text;
+        for (int l = 0; l < 15; l++)
+            text += "line " + std::to_string((l * 13 + i) % (l % 2 ? 40 : 800)) + "\n";
+        cs_.index_file(i % 3 ? tree_ : other, "/dir" + std::to_string(i % 7) +
+                       "/file" + std::to_string(i), text);
+    }
+    cs_.finalize();
+    ASSERT_LT(4, cs_.alloc()->size());
+
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    close(fd);
+    cs_.dump_index(path);
+
+    // Every line of every file, as a search finds them.
+    auto lines = [](code_searcher *cs) {
+        code_searcher::search_thread search(cs);
+        RE2::Options opts;
+        default_re2_options(opts);
+        query q;
+        q.line_pat.reset(new RE2(".", opts));
+        q.max_matches = 0;
+        std::set<string> out;
+        match_stats stats;
+        search.match(q, [&out](const match_result *m) {
+                out.insert(m->file->tree->name + ":" + m->file->path.as_string() + ":" +
+                           std::to_string(m->lno) + ":" + m->line.as_string());
+            }, &stats);
+        return out;
+    };
+    std::set<string> want = lines(&cs_);
+    ASSERT_EQ(200 * 15, want.size());
+
+    // However many threads load it, the index is the same.
+    int threads = FLAGS_threads;
+    for (int t : {1, 3, 8}) {
+        FLAGS_threads = t;
+        code_searcher loaded;
+        loaded.load_index(path);
+        ASSERT_EQ(cs_.alloc()->size(), loaded.alloc()->size()) << t;
+        for (size_t i = 0; i < loaded.alloc()->size(); i++) {
+            const chunk *a = cs_.alloc()->at(i), *b = loaded.alloc()->at(i);
+            EXPECT_EQ(int(i), b->id) << t;
+            ASSERT_EQ(a->size, b->size) << t;
+            EXPECT_EQ(0, memcmp(a->data, b->data, a->size)) << t << " " << i;
+        }
+        EXPECT_EQ(want, lines(&loaded)) << t;
+    }
+    FLAGS_threads = threads;
+    unlink(path);
+}
+
+TEST_F(codesearch_test, CompactMetadata) {
+    cs_.alloc()->set_chunk_size(1 << 12);
+    json_object *meta = json_tokener_parse("{\"priority\": 2, \"url\": \"x\"}");
+    const indexed_tree *next = cs_.open_tree("repo", meta, "REV1");
+    json_object_put(meta);
+    // Lines shared between files and versions make for pieces that
+    // jump back and forth between and within chunks.
+    for (int i = 0; i < 40; i++) {
+        std::string text;
+        for (int l = 0; l < 60; l++)
+            text += "line " + std::to_string((l * 7 + i) % (l % 3 ? 50 : 1000)) + "\n";
+        cs_.index_file(tree_, "/src/file" + std::to_string(i), text);
+        cs_.index_file(next, "/src/file" + std::to_string(i), text + "more\n");
+    }
+    cs_.finalize();
+
+    std::map<std::string, const char*> seen;
+    size_t max_pieces = 0;
+    for (auto it = cs_.begin_files(); it != cs_.end_files(); ++it) {
+        const indexed_file *f = *it;
+        auto ins = seen.insert(std::make_pair(f->path.as_string(), f->path.data()));
+        EXPECT_EQ(ins.first->second, f->path.data());
+
+        std::vector<std::string> fwd, back, lines;
+        auto p = f->content->begin(cs_.alloc());
+        for (; p != f->content->end(cs_.alloc()); ++p)
+            fwd.push_back(p->as_string());
+        while (p != f->content->begin(cs_.alloc())) {
+            --p;
+            back.push_back(p->as_string());
+        }
+        std::reverse(back.begin(), back.end());
+        EXPECT_EQ(fwd, back);
+        EXPECT_EQ(f->content->size(), fwd.size());
+
+        max_pieces = std::max(max_pieces, fwd.size());
+
+        std::vector<std::string> want;
+        for (auto &piece : fwd) {
+            size_t start = 0, nl;
+            while ((nl = piece.find('\n', start)) != std::string::npos) {
+                want.push_back(piece.substr(start, nl - start));
+                start = nl + 1;
+            }
+            want.push_back(piece.substr(start));
+        }
+        StringPiece line;
+        uint32_t lno = 1;
+        for (; f->content->line(cs_.alloc(), lno, &line); ++lno) {
+            ASSERT_GE(want.size(), lno);
+            EXPECT_EQ(want[lno - 1], line.as_string()) << f->path << ":" << lno;
+        }
+        EXPECT_EQ(want.size() + 1, lno);
+    }
+    EXPECT_EQ(40, seen.size());
+    // Enough for line() to start from a sample.
+    EXPECT_LT(2 * file_contents::kSampleEvery, max_pieces);
+
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    close(fd);
+    cs_.dump_index(path);
+    code_searcher loaded;
+    loaded.load_index(path);
+    unlink(path);
+
+    ASSERT_EQ(cs_.end_files() - cs_.begin_files(),
+              loaded.end_files() - loaded.begin_files());
+    std::map<std::string, const char*> loaded_seen;
+    for (size_t i = 0; i < loaded.end_files() - loaded.begin_files(); i++) {
+        const indexed_file *a = cs_.begin_files()[i], *b = loaded.begin_files()[i];
+        EXPECT_EQ(a->path, b->path);
+        auto ins = loaded_seen.insert(std::make_pair(b->path.as_string(), b->path.data()));
+        EXPECT_EQ(ins.first->second, b->path.data());
+        std::string want, got;
+        for (auto p = a->content->begin(cs_.alloc()); p != a->content->end(cs_.alloc()); ++p)
+            want += p->as_string() + "\n";
+        for (auto p = b->content->begin(loaded.alloc()); p != b->content->end(loaded.alloc()); ++p)
+            got += p->as_string() + "\n";
+        EXPECT_EQ(want, got);
+        StringPiece la, lb;
+        for (uint32_t lno = 1; a->content->line(cs_.alloc(), lno, &la); ++lno) {
+            ASSERT_TRUE(b->content->line(loaded.alloc(), lno, &lb));
+            EXPECT_EQ(la, lb);
+        }
+    }
+
+    std::vector<indexed_tree> trees = loaded.trees();
+    ASSERT_EQ(2, trees.size());
+    EXPECT_EQ(NULL, trees[0].parse_metadata());
+    json_object *parsed = trees[1].parse_metadata(), *v;
+    ASSERT_TRUE(parsed != NULL);
+    ASSERT_TRUE(json_object_object_get_ex(parsed, "priority", &v));
+    EXPECT_EQ(2, json_object_get_int(v));
+    json_object_put(parsed);
+
+    CodeSearchImpl srv(&loaded, nullptr);
+    InfoRequest request;
+    ServerInfo info;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv.Info(&ctx, &request, &info).ok());
+    ASSERT_EQ(2, info.trees_size());
+    EXPECT_EQ("x", info.trees(1).metadata().at("url"));
+    EXPECT_EQ("2", info.trees(1).metadata().at("priority"));
+}
+
+TEST_F(codesearch_test, QueryLog) {
+    cs_.index_file(tree_, "/src/it.c", "don't stop\n");
+    cs_.finalize();
+
+    // What the server logs of a query is read back as it was asked,
+    // for codesearchtool replay.
+    CodeSearchImpl srv(&cs_, nullptr);
+    Query request;
+    request.set_line("don't (stop|go)");
+    request.set_file("\\.c$");
+    request.set_repo("^re po");
+    request.set_not_file("test' x");
+    request.set_not_repo("o'ther");
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    testing::internal::CaptureStderr();
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+    std::string logged = testing::internal::GetCapturedStderr();
+
+    std::vector<string> fields;
+    std::istringstream lines(logged);
+    std::string line;
+    int found = 0;
+    while (std::getline(lines, line)) {
+        if (!parse_query_log(line, &fields))
+            continue;
+        found++;
+        ASSERT_EQ(kLogFields, fields.size());
+        EXPECT_EQ(request.line(), fields[kLogLine]);
+        EXPECT_EQ(request.file(), fields[kLogFile]);
+        EXPECT_EQ(request.repo(), fields[kLogTree]);
+        EXPECT_EQ("", fields[kLogTags]);
+        EXPECT_EQ(request.not_file(), fields[kLogNotFile]);
+        EXPECT_EQ(request.not_repo(), fields[kLogNotTree]);
+        EXPECT_EQ("", fields[kLogNotTags]);
+    }
+    EXPECT_EQ(1, found) << logged;
+    EXPECT_FALSE(parse_query_log("processing query line='x'", &fields));
+    EXPECT_FALSE(parse_query_log("search done", &fields));
+}
+
+TEST_F(codesearch_test, QueryTrace) {
+    cs_.alloc()->set_chunk_size(64);
+    const indexed_tree *other = cs_.open_tree("other", 0, "REV0");
+    for (int i = 0; i < 4; i++)
+        cs_.index_file(tree_, "/a" + std::to_string(i),
+                       "needle in repo " + std::to_string(i) + "\n");
+    for (int i = 0; i < 4; i++)
+        cs_.index_file(other, "/b" + std::to_string(i),
+                       "needle in other " + std::to_string(i) + "\n");
+    cs_.finalize();
+
+    CodeSearchImpl srv(&cs_, nullptr);
+    Query request;
+    request.set_line("needle");
+    request.set_repo("^other$");
+    request.set_trace(true);
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+    ASSERT_EQ(4, matches.results_size());
+
+    const QueryTrace &trace = matches.stats().trace();
+    EXPECT_EQ("literal needle", trace.index_key());
+    ASSERT_EQ(cs_.alloc()->size(), trace.tasks_size());
+    int skipped = 0, tries = 0;
+    for (auto &t : trace.tasks()) {
+        if (t.path() == TaskTrace::SKIPPED) {
+            skipped++;
+            continue;
+        }
+        EXPECT_EQ(TaskTrace::LITERAL, t.path());
+        tries += t.try_matches();
+    }
+    EXPECT_LT(0, skipped);
+    EXPECT_EQ(4, tries);
+
+    request.set_line("n.*e");
+    request.set_repo("");
+    matches.Clear();
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+    ASSERT_EQ(8, matches.results_size());
+    int64_t scanned = 0;
+    for (auto &t : matches.stats().trace().tasks()) {
+        EXPECT_NE(TaskTrace::SKIPPED, t.path());
+        scanned += t.bytes_scanned();
+    }
+    EXPECT_LT(0, scanned);
+
+    request.set_trace(false);
+    matches.Clear();
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+    EXPECT_FALSE(matches.stats().has_trace());
+}
+
+TEST_F(codesearch_test, IndexCopy) {
+    const indexed_tree *rev1 = cs_.open_tree("repo", 0, "REV1");
+    indexed_file *orig = cs_.index_file(tree_, "/data/file1", file1);
+    ASSERT_TRUE(orig != NULL);
+    indexed_file *copy = cs_.index_copy(rev1, "/data/file1", orig);
+    cs_.finalize();
+
+    string want, got;
+    for (auto it = orig->content->begin(cs_.alloc());
+         it != orig->content->end(cs_.alloc()); ++it)
+        want += it->ToString() + "\n";
+    for (auto it = copy->content->begin(cs_.alloc());
+         it != copy->content->end(cs_.alloc()); ++it)
+        got += it->ToString() + "\n";
+    EXPECT_EQ(want, got);
+
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    close(fd);
+    cs_.dump_index(path);
+    code_searcher loaded;
+    loaded.load_index(path);
+    unlink(path);
+
+    CodeSearchImpl srv(&loaded, nullptr);
+    Query request;
+    request.set_line("lazy");
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+    ASSERT_EQ(2, matches.results_size());
+    std::set<std::string> versions;
+    for (auto &r : matches.results()) {
+        EXPECT_EQ(2, r.line_number());
+        versions.insert(r.version());
+    }
+    EXPECT_EQ((std::set<std::string>{"REV0", "REV1"}), versions);
+}
+
+TEST(update_test, CopyChunks) {
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    close(fd);
+    {
+        code_searcher cs;
+        cs.set_alloc(make_mem_allocator());
+        cs.alloc()->set_chunk_size(1 << 12);
+        const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+        cs.index_file(tree, "/kept", "kept line\n");
+        cs.index_file(tree, "/changed", "old line\n");
+        cs.finalize();
+        cs.dump_index(path);
+    }
+    code_searcher base;
+    base.load_index(path);
+    unlink(path);
+
+    code_searcher cs;
+    cs.set_alloc(make_mem_allocator());
+    cs.copy_chunks(&base);
+    const indexed_tree *tree = cs.open_tree("repo", 0, "REV1");
+    for (auto it = base.begin_files(); it != base.end_files(); ++it) {
+        if ((*it)->path == "/kept")
+            cs.index_copy(tree, "/kept", *it);
+    }
+    cs.index_file(tree, "/changed", "new line\n");
+    cs.finalize();
+    EXPECT_EQ(base.alloc()->size() + 1, cs.alloc()->size());
+
+    CodeSearchImpl srv(&cs, nullptr);
+    for (auto &q : std::vector<std::pair<std::string, int>>{
+            {"kept line", 1}, {"old line", 0}, {"new line", 1}}) {
+        Query request;
+        request.set_line(q.first);
+        CodeSearchResult matches;
+        grpc::ServerContext ctx;
+        ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+        EXPECT_EQ(q.second, matches.results_size()) << q.first;
+        for (auto &r : matches.results())
+            EXPECT_EQ("REV1", r.version());
+    }
+}
+
+TEST(segment_test, Tombstones) {
+    std::vector<std::string> paths;
+    auto dump = [&](code_searcher *cs) {
+        char path[] = "/tmp/codesearch_test.XXXXXX";
+        int fd = mkstemp(path);
+        ASSERT_LE(0, fd);
+        close(fd);
+        cs->finalize();
+        cs->dump_index(path);
+        paths.push_back(path);
+    };
+    {
+        code_searcher cs;
+        cs.set_alloc(make_mem_allocator());
+        const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+        cs.index_file(tree, "/a", "alpha old\n");
+        cs.index_file(tree, "/b", "beta\nalpha in b\n");
+        dump(&cs);
+    }
+    {
+        code_searcher cs;
+        cs.set_alloc(make_mem_allocator());
+        const indexed_tree *tree = cs.open_tree("repo", 0, "REV1");
+        cs.index_file(tree, "/a", "context\nalpha new\n");
+        cs.add_tombstone("repo", "REV0", "/a");
+        dump(&cs);
+    }
+    {
+        code_searcher cs;
+        cs.set_alloc(make_mem_allocator());
+        const indexed_tree *tree = cs.open_tree("other", 0, "REV0");
+        cs.index_file(tree, "/c", "alpha elsewhere\n");
+        cs.add_tombstone("repo", "REV0", "");
+        dump(&cs);
+    }
+
+    std::vector<std::string> two(paths.begin(), paths.begin() + 2);
+    code_searcher cs;
+    cs.load_segments(two);
+    CodeSearchImpl srv(&cs, nullptr);
+    {
+        Query request;
+        request.set_line("alpha");
+        request.set_context_lines(1);
+        CodeSearchResult matches;
+        grpc::ServerContext ctx;
+        ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+        std::set<std::string> got;
+        for (auto &r : matches.results()) {
+            got.insert(r.version() + ":" + r.path() + ":" + r.line());
+            if (r.path() == "/a") {
+                ASSERT_EQ(1, r.context_before_size());
+                EXPECT_EQ("context", r.context_before(0));
+            }
+        }
+        EXPECT_EQ((std::set<std::string>{"REV1:/a:alpha new", "REV0:/b:alpha in b"}), got);
+    }
+    {
+        Query request;
+        request.set_line("alpha");
+        request.set_file("a$");
+        CodeSearchResult matches;
+        grpc::ServerContext ctx;
+        ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+        ASSERT_EQ(1, matches.results_size());
+        EXPECT_EQ("REV1", matches.results(0).version());
+    }
+
+    code_searcher all;
+    all.load_segments(paths);
+    for (auto &p : paths)
+        unlink(p.c_str());
+    CodeSearchImpl srv_all(&all, nullptr);
+    Query request;
+    request.set_line("alpha");
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv_all.Search(&ctx, &request, &matches).ok());
+    std::set<std::string> got;
+    for (auto &r : matches.results())
+        got.insert(r.tree() + ":" + r.path());
+    EXPECT_EQ((std::set<std::string>{"repo:/a", "other:/c"}), got);
+}
+
+TEST(merge_test, CopyIndex) {
+    std::vector<std::string> paths;
+    for (int i = 0; i < 3; i++) {
+        char path[] = "/tmp/codesearch_test.XXXXXX";
+        int fd = mkstemp(path);
+        ASSERT_LE(0, fd);
+        close(fd);
+        code_searcher cs;
+        cs.set_alloc(make_mem_allocator());
+        if (i == 0) {
+            const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+            cs.index_file(tree, "/a", "shared\nold a\n");
+            cs.index_file(tree, "/b", "shared\nb\n");
+        } else if (i == 1) {
+            const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+            cs.index_file(tree, "/a", "shared\nnew a\n");
+        } else {
+            const indexed_tree *tree = cs.open_tree("other", 0, "REV0");
+            cs.index_file(tree, "/c", "shared\nc\n");
+        }
+        cs.finalize();
+        cs.dump_index(path);
+        paths.push_back(path);
+    }
+
+    size_t bytes[2] = {0, 0};
+    for (int reindex = 0; reindex < 2; reindex++) {
+        code_searcher base, other;
+        base.load_segments({paths[0], paths[1]});
+        other.load_index(paths[2]);
+        FLAGS_global_dedup = reindex;
+        code_searcher cs;
+        FLAGS_global_dedup = false;
+        cs.set_alloc(make_mem_allocator());
+        cs.copy_index(&base, reindex);
+        cs.copy_index(&other, reindex);
+        cs.finalize();
+        EXPECT_EQ(3, cs.end_files() - cs.begin_files());
+        EXPECT_EQ(2, cs.trees().size());
+
+        CodeSearchImpl srv(&cs, nullptr);
+        Query request;
+        request.set_line("shared|a$");
+        CodeSearchResult matches;
+        grpc::ServerContext ctx;
+        ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+        std::multiset<std::string> got;
+        for (auto &r : matches.results())
+            got.insert(r.tree() + ":" + r.path() + ":" + r.line());
+        EXPECT_EQ((std::multiset<std::string>{
+                    "repo:/a:shared", "repo:/a:new a", "repo:/b:shared",
+                    "other:/c:shared"}), got) << "reindex " << reindex;
+        for (auto it = cs.alloc()->begin(); it != cs.alloc()->end(); ++it)
+            bytes[reindex] += (*it)->size;
+    }
+    // "shared" is stored once instead of three times, and "old a" is
+    // dropped.
+    EXPECT_GT(bytes[0], bytes[1]);
+    for (auto &p : paths)
+        unlink(p.c_str());
+}
+
+TEST_F(codesearch_test, ReloadIndex) {
+    cs_.index_file(tree_, "/old", "old needle\n");
+    cs_.finalize();
+
+    code_searcher next;
+    next.set_alloc(make_mem_allocator());
+    next.set_name("next");
+    next.index_file(next.open_tree("next", 0, "REV1"), "/new", "new needle\n");
+    next.finalize();
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    close(fd);
+    next.dump_index(path);
+
+    CodeSearchImpl srv(&cs_, nullptr);
+    Query request;
+    request.set_line("needle");
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+    ASSERT_EQ(1, matches.results_size());
+    EXPECT_EQ("/old", matches.results(0).path());
+
+    ReloadRequest reload;
+    ServerInfo info;
+    reload.set_index_path(path);
+    EXPECT_EQ(grpc::StatusCode::PERMISSION_DENIED,
+              srv.Reload(&ctx, &reload, &info).error_code());
+
+    FLAGS_allow_reload = true;
+    reload.clear_index_path();
+    EXPECT_FALSE(srv.Reload(&ctx, &reload, &info).ok());
+    reload.set_index_path(string(path) + ".missing");
+    EXPECT_FALSE(srv.Reload(&ctx, &reload, &info).ok());
+
+    // A cut-short copy of the index is refused, and the old one kept.
+    struct stat st;
+    ASSERT_EQ(0, stat(path, &st));
+    string truncated = string(path) + ".truncated";
+    for (off_t size : {off_t(0), off_t(sizeof(index_header) - 1), off_t(sizeof(index_header)),
+                       off_t(kPageSize), st.st_size / 2, st.st_size - 1}) {
+        std::ifstream in(path, std::ios::binary);
+        std::ofstream out(truncated, std::ios::binary | std::ios::trunc);
+        out << in.rdbuf();
+        out.close();
+        ASSERT_EQ(0, truncate(truncated.c_str(), size));
+        reload.set_index_path(truncated);
+        EXPECT_EQ(grpc::StatusCode::FAILED_PRECONDITION,
+                  srv.Reload(&ctx, &reload, &info).error_code()) << size;
+        matches.Clear();
+        ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+        ASSERT_EQ(1, matches.results_size());
+        EXPECT_EQ("/old", matches.results(0).path());
+    }
+    unlink(truncated.c_str());
+
+    reload.set_index_path(path);
+    ASSERT_TRUE(srv.Reload(&ctx, &reload, &info).ok());
+    FLAGS_allow_reload = false;
+    unlink(path);
+    EXPECT_EQ("next", info.name());
+
+    matches.Clear();
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+    ASSERT_EQ(1, matches.results_size());
+    EXPECT_EQ("/new", matches.results(0).path());
+    EXPECT_EQ("next", matches.results(0).tree());
+}
+
+TEST_F(codesearch_test, ReloadRepeatedly) {
+    cs_.index_file(tree_, "/file.c", "void old_thing(void) {\n");
+    cs_.finalize();
+
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    char tags_path[] = "/tmp/codesearch_test.XXXXXX";
+    for (char *p : {path, tags_path}) {
+        int fd = mkstemp(p);
+        ASSERT_LE(0, fd);
+        close(fd);
+    }
+    {
+        code_searcher next;
+        next.set_alloc(make_mem_allocator());
+        next.index_file(next.open_tree("repo", 0, "REV1"), "/file.c",
+                        "\nvoid new_thing(void) {\n");
+        next.finalize();
+        next.dump_index(path);
+
+        code_searcher tags;
+        tags.set_alloc(make_mem_allocator());
+        tags.index_file(tags.open_tree("", 0, "HEAD"), "tags",
+                        "new_thing\trepo/file.c\t2;\"\tfunction\n");
+        tags.finalize();
+        tags.dump_index(tags_path);
+    }
+
+    CodeSearchImpl srv(&cs_, nullptr);
+    grpc::ServerContext ctx;
+    InfoRequest info_request;
+    ServerInfo info;
+    ASSERT_TRUE(srv.Info(&ctx, &info_request, &info).ok());
+    EXPECT_FALSE(info.has_tags());
+
+    // Each reload frees the index (and tags) it replaces once nothing
+    // uses them; the tags stay until a reload names new ones.
+    FLAGS_allow_reload = true;
+    for (int i = 0; i < 4; i++) {
+        ReloadRequest reload;
+        reload.set_index_path(path);
+        if (i == 1)
+            reload.set_tags_path(tags_path);
+        info.Clear();
+        ASSERT_TRUE(srv.Reload(&ctx, &reload, &info).ok());
+        EXPECT_EQ(i >= 1, info.has_tags()) << i;
+
+        Query request;
+        request.set_line("thing");
+        CodeSearchResult matches;
+        ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+        ASSERT_EQ(1, matches.results_size());
+        EXPECT_EQ(2, matches.results(0).line_number());
+
+        request.set_tags("func");
+        matches.Clear();
+        grpc::Status st = srv.Search(&ctx, &request, &matches);
+        EXPECT_EQ(i >= 1, st.ok()) << i;
+        if (st.ok()) {
+            ASSERT_EQ(1, matches.results_size());
+            EXPECT_EQ("/file.c", matches.results(0).path());
+        }
+    }
+    FLAGS_allow_reload = false;
+    unlink(path);
+    unlink(tags_path);
+}
+
+TEST_F(codesearch_test, ResultCache) {
+    cs_.index_file(tree_, "/old", "old needle\n");
+    cs_.finalize();
+
+    code_searcher next;
+    next.set_alloc(make_mem_allocator());
+    next.index_file(next.open_tree("next", 0, "REV1"), "/new", "new needle\n");
+    next.finalize();
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    close(fd);
+    next.dump_index(path);
+
+    FLAGS_result_cache_mb = 1;
+    CodeSearchImpl srv(&cs_, nullptr);
+    Query request;
+    request.set_line("needle");
+    grpc::ServerContext ctx;
+    CodeSearchResult first, second;
+    ASSERT_TRUE(srv.Search(&ctx, &request, &first).ok());
+    ASSERT_TRUE(srv.Search(&ctx, &request, &second).ok());
+    EXPECT_EQ(first.SerializeAsString(), second.SerializeAsString());
+    ASSERT_EQ(1, second.results_size());
+    EXPECT_EQ("/old", second.results(0).path());
+
+    // A reload must not serve answers from the old index.
+    ReloadRequest reload;
+    ServerInfo info;
+    reload.set_index_path(path);
+    FLAGS_allow_reload = true;
+    ASSERT_TRUE(srv.Reload(&ctx, &reload, &info).ok());
+    FLAGS_allow_reload = false;
+    unlink(path);
+    CodeSearchResult third;
+    ASSERT_TRUE(srv.Search(&ctx, &request, &third).ok());
+    FLAGS_result_cache_mb = 0;
+    ASSERT_EQ(1, third.results_size());
+    EXPECT_EQ("/new", third.results(0).path());
+}
+
+TEST(partition_test, SplitsOnlyWhenItHelps) {
+    code_searcher cs;
+    cs.set_alloc(make_mem_allocator());
+    // Sized 60 and 40: either shard's fair share is 50, but splitting
+    // the first would leave 70 and 30.
+    int files[] = {60, 40};
+    for (int t = 0; t < 2; t++) {
+        const indexed_tree *tree = cs.open_tree("tree" + std::to_string(t), 0, "REV0");
+        for (int i = 0; i < files[t]; i++)
+            cs.index_file(tree, "/f" + std::to_string(i),
+                          string(96, 'a' + t) + std::to_string(1000 + i) + "\n");
+    }
+    cs.finalize();
+
+    index_partition p = partition_index(&cs, 2);
+    ASSERT_EQ(2, p.shards());
+    EXPECT_LE(0, p.trees["tree0"]);
+    EXPECT_LE(0, p.trees["tree1"]);
+    EXPECT_NE(p.trees["tree0"], p.trees["tree1"]);
+    EXPECT_EQ(60 * 101, p.bytes[p.trees["tree0"]]);
+    EXPECT_EQ(40 * 101, p.bytes[p.trees["tree1"]]);
+}
+
+TEST(partition_test, BalancedShards) {
+    code_searcher cs;
+    cs.set_alloc(make_mem_allocator());
+    // Two versions of one tree much bigger than the rest, which have
+    // most of their lines in common.
+    for (int v = 0; v < 2; v++) {
+        const indexed_tree *big = cs.open_tree("big", 0, "REV" + std::to_string(v));
+        for (int i = 0; i < 60; i++)
+            cs.index_file(big, "/big" + std::to_string(i),
+                          "big line " + std::to_string(i) + "\n" +
+                          string(200, 'a' + i % 26) + std::to_string(v) + "\n");
+    }
+    for (int t = 0; t < 6; t++) {
+        const indexed_tree *tree = cs.open_tree("small" + std::to_string(t), 0, "REV0");
+        for (int i = 0; i <= t; i++)
+            cs.index_file(tree, "/small" + std::to_string(i),
+                          "small " + std::to_string(t) + " " + std::to_string(i) +
+                          string(100, 'x') + "\n");
+    }
+    cs.finalize();
+
+    index_partition p = partition_index(&cs, 3);
+    ASSERT_EQ(3, p.shards());
+    EXPECT_EQ(-1, p.trees["big"]);
+    for (int t = 0; t < 6; t++)
+        EXPECT_LE(0, p.trees["small" + std::to_string(t)]);
+    uint64_t most = *std::max_element(p.bytes.begin(), p.bytes.end());
+    uint64_t least = *std::min_element(p.bytes.begin(), p.bytes.end());
+    EXPECT_LT(most, least * 5 / 4);
+
+    char dir[] = "/tmp/codesearch_test.XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    string path = string(dir) + "/corpus.idx";
+    EXPECT_EQ(string(dir) + "/corpus.1.idx", shard_index_path(path, 1));
+    dump_partition(&cs, p, path);
+
+    // Every file is in exactly one shard, and each version of a path
+    // of the big tree in the same one.
+    std::map<string, int> shard_of;
+    std::set<int> big_shards;
+    for (int k = 0; k < 3; k++) {
+        code_searcher shard;
+        shard.load_index(shard_index_path(path, k));
+        for (auto it = shard.begin_files(); it != shard.end_files(); ++it) {
+            string key = (*it)->tree->name + ":" + (*it)->tree->version + ":" +
+                (*it)->path.as_string();
+            EXPECT_EQ(0, shard_of.count(key)) << key;
+            shard_of[key] = k;
+            if ((*it)->tree->name == "big")
+                big_shards.insert(k);
+        }
+        unlink(shard_index_path(path, k).c_str());
+    }
+    EXPECT_EQ(size_t(cs.end_files() - cs.begin_files()), shard_of.size());
+    EXPECT_EQ(3, big_shards.size());
+    for (int i = 0; i < 60; i++)
+        EXPECT_EQ(shard_of["big:REV0:/big" + std::to_string(i)],
+                  shard_of["big:REV1:/big" + std::to_string(i)]);
+
+    string manifest_path = string(dir) + "/corpus.shards.json";
+    json_object *manifest = json_object_from_file(manifest_path.c_str());
+    ASSERT_FALSE(is_error(manifest));
+    json_object *shards;
+    ASSERT_TRUE(json_object_object_get_ex(manifest, "shards", &shards));
+    EXPECT_EQ(3, json_object_array_length(shards));
+    json_object_put(manifest);
+    unlink(manifest_path.c_str());
+    rmdir(dir);
+}
+
+TEST(warmup_test, WarmLoadedIndex) {
+    FLAGS_hugepages = true;
+    code_searcher cs;
+    cs.set_alloc(make_mem_allocator());
+    const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+    cs.index_file(tree, "/file", "warm needle\n");
+    cs.finalize();
+    FLAGS_hugepages = false;
+
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    close(fd);
+    cs.dump_index(path);
+
+    FLAGS_warmup = true;
+    code_searcher loaded;
+    loaded.load_index(path);
+    FLAGS_warmup = false;
+    unlink(path);
+
+    CodeSearchImpl srv(&loaded, nullptr);
+    Query request;
+    request.set_line("needle");
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+    ASSERT_EQ(1, matches.results_size());
+    EXPECT_EQ("/file", matches.results(0).path());
+}
+
+TEST(streaming_test, RetireChunks) {
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    close(fd);
+
+    code_searcher mem;
+    mem.set_alloc(make_mem_allocator());
+    mem.alloc()->set_chunk_size(1 << 18);
+    FLAGS_build_memory_mb = 1;
+    code_searcher cs;
+    cs.set_alloc(make_dump_allocator(&cs, path));
+    FLAGS_build_memory_mb = 0;
+    cs.alloc()->set_chunk_size(1 << 18);
+    for (code_searcher *c : {&mem, &cs}) {
+        const indexed_tree *tree = c->open_tree("repo", 0, "REV0");
+        for (int f = 0; f < 64; f++) {
+            std::string text;
+            for (int i = 0; i < 1000; i++)
+                text += "file " + std::to_string(f) + " line " +
+                    std::to_string(i) + (i % 100 ? " text\n" : " needle\n");
+            c->index_file(tree, "/file" + std::to_string(f), text);
+        }
+        c->finalize();
+    }
+    EXPECT_LT(0, cs.alloc()->retired());
+
+    code_searcher loaded;
+    loaded.load_index(path);
+    unlink(path);
+
+    for (const char *line : {"needle", "file 3 line 42 ", "line 999 text"}) {
+        std::set<std::string> want;
+        for (code_searcher *c : {&mem, &cs, &loaded}) {
+            CodeSearchImpl srv(c, nullptr);
+            Query request;
+            request.set_line(line);
+            request.set_max_matches(1000);
+            CodeSearchResult matches;
+            grpc::ServerContext ctx;
+            ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+            std::set<std::string> got;
+            for (auto &r : matches.results())
+                got.insert(r.path() + ":" + std::to_string(r.line_number()));
+            if (c == &mem)
+                want = got;
+            else
+                EXPECT_EQ(want, got) << line;
+        }
+        EXPECT_FALSE(want.empty()) << line;
+    }
+}
+
+// Every way of building the suffix array must find the same matches.
+TEST(suffix_array_test, SameMatches) {
+    std::vector<std::string> files;
+    for (int i = 0; i < 50; i++) {
+        std::string body;
+        for (int j = 0; j < 20; j++)
+            body += "line " + std::to_string(i * j) + " of file" + std::to_string(i) + "\n";
+        files.push_back(body);
+    }
+    const char *patterns[] = {"line 1[0-9]", "file4", "of (file1|file2)$", "line 99"};
+
+    std::vector<std::string> want;
+    for (int config = 0; config < 4; config++) {
+        bool pack = config & 1;
+        FLAGS_pack_suffixes = pack;
+        FLAGS_sort_threads = (config & 2) ? 3 : 1;
+        code_searcher cs;
+        cs.set_alloc(make_mem_allocator());
+        cs.alloc()->set_chunk_size(1 << 12);
+        const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+        for (size_t i = 0; i < files.size(); i++)
+            cs.index_file(tree, "/f" + std::to_string(i), files[i]);
+        cs.finalize();
+        FLAGS_pack_suffixes = false;
+        FLAGS_sort_threads = 1;
+        for (size_t i = 0; i < cs.alloc()->size(); i++)
+            EXPECT_GE(pack ? 12 : 32, cs.alloc()->at(i)->suffix_bits);
+
+        CodeSearchImpl srv(&cs, nullptr);
+        std::vector<std::string> got;
+        for (auto p : patterns) {
+            Query request;
+            request.set_line(p);
+            request.set_max_matches(10000);
+            CodeSearchResult matches;
+            grpc::ServerContext ctx;
+            ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+            for (auto &r : matches.results())
+                got.push_back(r.path() + ":" + std::to_string(r.line_number()));
+        }
+        std::sort(got.begin(), got.end());
+        if (config == 0)
+            want = got;
+        else
+            EXPECT_EQ(want, got) << "config " << config;
+    }
+    EXPECT_LT(100, want.size());
+}
+
+// A folded suffix array must find what the plain one does, however it
+// was sorted, and survive a dump and load.
+TEST(suffix_array_test, FoldedSameMatches) {
+    std::vector<std::string> files;
+    const char *words[] = {"Alpha", "BETA", "gamma", "DeLtA_9"};
+    for (int i = 0; i < 50; i++) {
+        std::string body;
+        for (int j = 0; j < 20; j++)
+            body += std::string(words[(i + j) % 4]) + " Line " + std::to_string(i * j) +
+                " of FILE" + std::to_string(i) + " " + words[j % 4] + "\n";
+        files.push_back(body);
+    }
+    struct {
+        const char *line;
+        bool fold_case;
+    } patterns[] = {
+        {"alpha line", true}, {"DELTA_9", true}, {"line 1[0-9] of file4", true},
+        {"(beta|gamma) line 9", true}, {"Alpha", false}, {"of FILE1 BETA$", false},
+    };
+
+    std::vector<std::string> want;
+    for (int config = 0; config < 4; config++) {
+        FLAGS_fold_index = config > 0;
+        FLAGS_pack_suffixes = config == 2;
+        FLAGS_sort_threads = config == 2 ? 3 : 1;
+        code_searcher cs;
+        cs.set_alloc(make_mem_allocator());
+        cs.alloc()->set_chunk_size(1 << 12);
+        const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+        for (size_t i = 0; i < files.size(); i++)
+            cs.index_file(tree, "/f" + std::to_string(i), files[i]);
+        cs.finalize();
+        FLAGS_pack_suffixes = false;
+        FLAGS_sort_threads = 1;
+
+        code_searcher loaded;
+        code_searcher *search = &cs;
+        if (config == 3) {
+            char path[] = "/tmp/livegrep_test.XXXXXX";
+            int fd = mkstemp(path);
+            ASSERT_LE(0, fd);
+            close(fd);
+            cs.dump_index(path);
+            loaded.load_index(path);
+            unlink(path);
+            search = &loaded;
+        }
+        FLAGS_fold_index = false;
+        for (size_t i = 0; i < search->alloc()->size(); i++)
+            EXPECT_EQ(config > 0, search->alloc()->at(i)->folded != NULL);
+
+        CodeSearchImpl srv(search, nullptr);
+        std::vector<std::string> got;
+        for (auto p : patterns) {
+            Query request;
+            request.set_line(p.line);
+            request.set_fold_case(p.fold_case);
+            request.set_max_matches(10000);
+            CodeSearchResult matches;
+            grpc::ServerContext ctx;
+            ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+            for (auto &r : matches.results())
+                got.push_back(std::string(p.line) + " " + r.path() + ":" +
+                              std::to_string(r.line_number()));
+        }
+        std::sort(got.begin(), got.end());
+        if (config == 0)
+            want = got;
+        else
+            EXPECT_EQ(want, got) << "config " << config;
+    }
+    EXPECT_LT(200, want.size());
+}
+
+TEST(dedup_test, GlobalDedup) {
+    std::string body;
+    for (int i = 0; i < 40; i++)
+        body += "shared line " + std::to_string(i) + "\n";
+
+    // per-chunk, global, and global with a bounded table
+    size_t bytes[3];
+    for (int mode = 0; mode < 3; mode++) {
+        FLAGS_global_dedup = mode > 0;
+        FLAGS_dedup_table_mb = mode == 2 ? 1 : 0;
+        code_searcher cs;
+        FLAGS_global_dedup = false;
+        FLAGS_dedup_table_mb = 0;
+        cs.set_alloc(make_mem_allocator());
+        cs.alloc()->set_chunk_size(1 << 11);
+        const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+        for (int i = 0; i < 20; i++)
+            cs.index_file(tree, "/f" + std::to_string(i),
+                          "unique " + std::to_string(i) + "\n" + body);
+        cs.finalize();
+
+        bytes[mode] = 0;
+        for (auto it = cs.alloc()->begin(); it != cs.alloc()->end(); ++it)
+            bytes[mode] += (*it)->size;
+
+        CodeSearchImpl srv(&cs, nullptr);
+        Query request;
+        request.set_line("shared line 17$");
+        CodeSearchResult matches;
+        grpc::ServerContext ctx;
+        ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+        EXPECT_EQ(20, matches.results_size()) << "mode " << mode;
+    }
+    EXPECT_GT(bytes[0], bytes[1]);
+    EXPECT_EQ(bytes[1], bytes[2]);
+}
+
+TEST(dedup_test, TouchedChunks) {
+    // Files whose lines are mostly already in earlier chunks, out of
+    // order, so each touches several chunks and grows several ranges
+    // in each.
+    FLAGS_global_dedup = true;
+    code_searcher cs;
+    FLAGS_global_dedup = false;
+    cs.set_alloc(make_mem_allocator());
+    cs.alloc()->set_chunk_size(1 << 11);
+    const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+    std::mt19937 rng(7);
+    for (int i = 0; i < 60; i++) {
+        std::string text;
+        for (int l = 0; l < 30; l++)
+            text += "shared " + std::to_string(rng() % (i < 20 ? 1000 : 300)) + "\n";
+        text += "own " + std::to_string(i) + "\n";
+        cs.index_file(tree, "/f" + std::to_string(i), text);
+    }
+    cs.finalize();
+    ASSERT_LT(3, cs.alloc()->size());
+
+    // Each chunk's ranges are in order, and every line of every file
+    // is in one of its chunk's ranges for that file, and in no more
+    // than one.
+    for (auto it = cs.alloc()->begin(); it != cs.alloc()->end(); ++it)
+        for (uint32_t r = 1; r < (*it)->nranges; r++)
+            EXPECT_LE((*it)->ranges[r - 1].left, (*it)->ranges[r].left);
+
+    code_searcher::search_thread search(&cs);
+    RE2::Options opts;
+    default_re2_options(opts);
+    query q;
+    q.line_pat.reset(new RE2(".", opts));
+    q.max_matches = 0;
+    int checked = 0;
+    match_stats stats;
+    search.match(q, [&](const match_result *m) {
+            const unsigned char *p = reinterpret_cast<const unsigned char*>(m->line.data());
+            for (auto it = cs.alloc()->begin(); it != cs.alloc()->end(); ++it) {
+                const chunk *c = *it;
+                if (p < c->data || p >= c->data + c->size)
+                    continue;
+                uint32_t off = p - c->data;
+                int holding = 0;
+                for (uint32_t r = 0; r < c->nranges; r++) {
+                    const chunk_file_range &range = c->ranges[r];
+                    if (off < range.left || off > range.right)
+                        continue;
+                    for (uint32_t k = 0; k < range.nfiles; k++)
+                        if (c->file_ids[range.files + k] == m->file->no)
+                            holding++;
+                }
+                EXPECT_EQ(1, holding) << m->file->path.as_string() << ":" << m->lno;
+                checked++;
+            }
+        }, &stats);
+    EXPECT_EQ(60 * 31, stats.matches);
+    EXPECT_EQ(60 * 31, checked);
+}
+
+TEST(corpus_test, Selectivity) {
+    code_searcher cs;
+    cs.set_alloc(make_mem_allocator());
+    const indexed_tree *tree = cs.open_tree("repo", 0, "REV0");
+    std::string body;
+    for (int i = 0; i < 200; i++)
+        body += "eeee line " + std::to_string(i) + "\n";
+    body += "zq rare\n";
+    cs.index_file(tree, "/f", body);
+    cs.finalize();
+
+    const corpus_stats &corpus = cs.alloc()->corpus();
+    EXPECT_EQ(body.size() - std::count(body.begin(), body.end(), '\n'), corpus.total);
+    EXPECT_EQ(1, corpus.pairs['z' << 8 | 'q']);
+    EXPECT_EQ(0, corpus.pairs['q' << 8 | 'e']);
+
+    // `e' is a fine key for random text, but useless for this one.
+    RE2 common("e"), rare("zq");
+    EXPECT_TRUE(indexRE(common));
+    EXPECT_FALSE(indexRE(common, &corpus));
+    EXPECT_TRUE(indexRE(rare, &corpus));
+
+    char path[] = "/tmp/codesearch_test.XXXXXX";
+    int fd = mkstemp(path);
+    ASSERT_LE(0, fd);
+    close(fd);
+    cs.dump_index(path);
+    code_searcher loaded;
+    loaded.load_index(path);
+    unlink(path);
+    EXPECT_EQ(0, memcmp(&corpus, &loaded.alloc()->corpus(), sizeof corpus));
+
+    CodeSearchImpl srv(&loaded, nullptr);
+    Query request;
+    request.set_line("e line 19");
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    ASSERT_TRUE(srv.Search(&ctx, &request, &matches).ok());
+    EXPECT_EQ(11, matches.results_size());
+}
+
+TEST_F(codesearch_test, PlanCache) {
+    cs_.index_file(tree_, "/f", "cached needle\n");
+    cs_.finalize();
+
+    RE2::Options opts;
+    default_re2_options(opts);
+    std::shared_ptr<const RE2> re = compile_re("needle", opts);
+    EXPECT_EQ(re, compile_re("needle", opts));
+    RE2 copy("needle", opts);
+    EXPECT_EQ(cs_.plan(*re), cs_.plan(copy));
+
+    opts.set_case_sensitive(false);
+    std::shared_ptr<const RE2> folded = compile_re("needle", opts);
+    EXPECT_NE(re, folded);
+    EXPECT_NE(cs_.plan(*re), cs_.plan(*folded));
+    EXPECT_FALSE(compile_re("(", opts)->ok());
+
+    metric hits("test.lru.hits"), misses("test.lru.misses");
+    lru_cache<int> lru(2, hits, misses);
+    int v;
+    lru.insert("a", 1);
+    lru.insert("b", 2);
+    EXPECT_TRUE(lru.find("a", &v));
+    EXPECT_EQ(1, v);
+    lru.insert("c", 3);
+    EXPECT_FALSE(lru.find("b", &v));
+    EXPECT_TRUE(lru.find("a", &v));
+    EXPECT_TRUE(lru.find("c", &v));
+    EXPECT_EQ(2, lru.size());
+}
 
 TEST_F(codesearch_test, Tags) {
     cs_.index_file(tree_,
@@ -205,3 +2109,640 @@ TEST_F(codesearch_test, Tags) {
 
     ASSERT_EQ(1, matches.results_size());
 }
+
+TEST_F(codesearch_test, TagsLookup) {
+    cs_.index_file(tree_,
+                   "a.c",
+                   "struct thing {\n"
+                   "};\n"
+                   "void do_one(void) {\n"
+                   "}\n"
+                   "void do_two(void) {\n"
+                   "}\n");
+    cs_.index_file(tree_,
+                   "b.c",
+                   "int do_one;\n");
+    cs_.index_file(tree_,
+                   "u.c",
+                   "/* gr\xc3\xb6\xc3\x9f" "e */ int wide_one;\n");
+    cs_.finalize();
+
+    code_searcher tags;
+    tags.set_alloc(make_mem_allocator());
+    const indexed_tree *tag_tree = cs_.open_tree("", 0, "HEAD");
+    tags.index_file(tag_tree,
+                    "tags",
+                    "!_TAG_FILE_FORMAT\t2\t/extended format/\n"
+                    "do_one\trepo/a.c\t3;\"\tfunction\n"
+                    "do_one\trepo/b.c\t1;\"\tvariable\n"
+                    "do_two\trepo/a.c\t5;\"\tfunction\n"
+                    "missing\trepo/c.c\t1;\"\tfunction\n"
+                    "thing\trepo/a.c\t1;\"\tstruct\n"
+                    "wide_one\trepo/u.c\t1;\"\tvariable\n");
+    tags.finalize();
+
+    CodeSearchImpl srv(&cs_, &tags);
+    Query request;
+    CodeSearchResult matches;
+    grpc::ServerContext ctx;
+    grpc::Status st;
+
+    request.set_line("^do_");
+    request.set_tags(".");
+    st = srv.Search(&ctx, &request, &matches);
+    ASSERT_TRUE(st.ok());
+    ASSERT_EQ(3, matches.results_size());
+    EXPECT_EQ("void do_one(void) {", matches.results(0).line());
+    EXPECT_EQ(3, matches.results(0).line_number());
+    EXPECT_EQ(5, matches.results(0).bounds().left());
+    EXPECT_EQ(11, matches.results(0).bounds().right());
+    ASSERT_EQ(2, matches.results(0).context_before_size());
+    EXPECT_EQ("};", matches.results(0).context_before(0));
+    EXPECT_EQ("b.c", matches.results(1).path());
+    EXPECT_EQ("void do_two(void) {", matches.results(2).line());
+
+    request.set_tags("variable");
+    matches.Clear();
+    st = srv.Search(&ctx, &request, &matches);
+    ASSERT_TRUE(st.ok());
+    ASSERT_EQ(1, matches.results_size());
+    EXPECT_EQ("int do_one;", matches.results(0).line());
+
+    request.set_tags(".");
+    request.set_file("a\\.c");
+    request.set_not_tags("function");
+    request.set_line("i");
+    matches.Clear();
+    st = srv.Search(&ctx, &request, &matches);
+    ASSERT_TRUE(st.ok());
+    ASSERT_EQ(1, matches.results_size());
+    EXPECT_EQ("struct thing {", matches.results(0).line());
+
+    // Only one branch is anchored, so the other may match any name.
+    request.clear_file();
+    request.clear_not_tags();
+    request.set_line("^do_t|one");
+    matches.Clear();
+    st = srv.Search(&ctx, &request, &matches);
+    ASSERT_TRUE(st.ok());
+    ASSERT_EQ(4, matches.results_size());
+    EXPECT_EQ("u.c", matches.results(3).path());
+
+    request.set_file("a\\.c");
+    request.set_line("^missing$");
+    matches.Clear();
+    st = srv.Search(&ctx, &request, &matches);
+    ASSERT_TRUE(st.ok());
+    EXPECT_EQ(0, matches.results_size());
+
+    // Bounds count characters, as they do for searches.
+    request.clear_file();
+    request.set_line("^wide_");
+    matches.Clear();
+    st = srv.Search(&ctx, &request, &matches);
+    ASSERT_TRUE(st.ok());
+    ASSERT_EQ(1, matches.results_size());
+    EXPECT_EQ(16, matches.results(0).bounds().left());
+    EXPECT_EQ(24, matches.results(0).bounds().right());
+}
+
+TEST(admission_test, CheapestFirst) {
+    admission_queue q(1, 2, 3);
+    auto never = admission_queue::clock::time_point::max();
+    ASSERT_TRUE(q.enter(2, never));
+
+    std::mutex mtx;
+    std::vector<int> order;
+    auto waiter = [&](int cls) {
+        return std::thread([&, cls] {
+                ASSERT_TRUE(q.enter(cls, never));
+                {
+                    std::lock_guard<std::mutex> guard(mtx);
+                    order.push_back(cls);
+                }
+                q.leave();
+            });
+    };
+    std::thread expensive = waiter(2);
+    while (q.waiting() < 1)
+        std::this_thread::yield();
+    std::thread cheap = waiter(0);
+    while (q.waiting() < 2)
+        std::this_thread::yield();
+
+    // The queue is full, and nothing frees up in time for this one.
+    EXPECT_FALSE(q.enter(1, admission_queue::clock::now()));
+    EXPECT_FALSE(q.enter(0, admission_queue::clock::now() +
+                         std::chrono::milliseconds(10)));
+
+    q.leave();
+    expensive.join();
+    cheap.join();
+    EXPECT_EQ((std::vector<int>{0, 2}), order);
+    EXPECT_EQ(0, q.active());
+    EXPECT_EQ(0, q.waiting());
+}
+
+TEST_F(codesearch_test, ScanFraction) {
+    cs_.index_file(tree_, "/file1", file1);
+    cs_.finalize();
+
+    RE2::Options opts;
+    default_re2_options(opts);
+    EXPECT_EQ(0.0, cs_.scan_fraction(*compile_re("quick", opts)));
+    EXPECT_EQ(1.0, cs_.scan_fraction(*compile_re(".", opts)));
+    double f = cs_.scan_fraction(*compile_re("qu.*dog", opts));
+    EXPECT_GT(f, 0.0);
+    EXPECT_LT(f, 1.0);
+}
+
+TEST_F(codesearch_test, AsyncServer) {
+    for (int i = 0; i < 100; i++)
+        cs_.index_file(tree_, "/file" + std::to_string(i),
+                       "needle " + std::to_string(i) + "\nhaystack\n");
+    cs_.index_file(tree_, "file.c", "void do_the_thing(void) {\n");
+    cs_.finalize();
+
+    code_searcher tags;
+    tags.set_alloc(make_mem_allocator());
+    tags.index_file(tags.open_tree("", 0, "HEAD"), "tags",
+                    "do_the_thing\trepo/file.c\t1;\"\tfunction\n");
+    tags.finalize();
+
+    // Fewer slots than clients, so calls also wait in the queue.
+    FLAGS_max_concurrent_searches = 2;
+    code_searcher::search_pool pool(2);
+    AsyncCodeSearch service(&cs_, &tags, &pool);
+    FLAGS_max_concurrent_searches = 0;
+    grpc::ServerBuilder builder;
+    service.Register(&builder, 2);
+    std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+    service.Start();
+    std::unique_ptr<CodeSearch::Stub> stub(
+        CodeSearch::NewStub(server->InProcessChannel(grpc::ChannelArguments())));
+
+    std::atomic<int> failures(0);
+    std::vector<std::thread> clients;
+    for (int c = 0; c < 8; c++) {
+        clients.emplace_back([&, c] {
+                for (int i = 0; i < 5; i++) {
+                    Query request;
+                    request.set_line("needle");
+                    request.set_max_matches(1000);
+                    request.set_timeout_ms(60000);
+                    request.set_context_lines(0);
+                    grpc::ClientContext ctx;
+                    if (c % 2 == 0) {
+                        CodeSearchResult result;
+                        if (!stub->Search(&ctx, request, &result).ok() ||
+                            result.results_size() != 100 ||
+                            result.stats().exit_reason() != SearchStats::NONE)
+                            failures++;
+                        continue;
+                    }
+                    std::unique_ptr<grpc::ClientReader<CodeSearchResult> > reader(
+                        stub->SearchStream(&ctx, request));
+                    CodeSearchResult batch;
+                    int results = 0;
+                    while (reader->Read(&batch))
+                        results += batch.results_size();
+                    if (!reader->Finish().ok() || results != 100)
+                        failures++;
+                }
+            });
+    }
+    for (auto &t : clients)
+        t.join();
+    EXPECT_EQ(0, failures.load());
+
+    Query bad;
+    bad.set_line("(");
+    grpc::ClientContext ctx;
+    CodeSearchResult result;
+    EXPECT_EQ(grpc::StatusCode::INVALID_ARGUMENT,
+              stub->Search(&ctx, bad, &result).error_code());
+
+    Query tag;
+    tag.set_line("do_the_thing");
+    tag.set_tags("func");
+    grpc::ClientContext tag_ctx;
+    result.Clear();
+    ASSERT_TRUE(stub->Search(&tag_ctx, tag, &result).ok());
+    ASSERT_EQ(1, result.results_size());
+    EXPECT_EQ("file.c", result.results(0).path());
+
+    server->Shutdown();
+    service.Shutdown();
+}
+
+TEST(shard_router_test, MergesShards) {
+    // Each shard has its own tree; the second also has a file whose
+    // name matches, which ranks best.
+    code_searcher shards[2];
+    std::vector<std::unique_ptr<CodeSearchImpl> > impls;
+    std::vector<std::unique_ptr<grpc::Server> > servers;
+    std::vector<std::shared_ptr<grpc::ChannelInterface> > channels;
+    for (int s = 0; s < 2; s++) {
+        shards[s].set_alloc(make_mem_allocator());
+        const indexed_tree *tree = shards[s].open_tree("tree" + std::to_string(s), 0, "REV0");
+        for (int i = 0; i < 20; i++)
+            shards[s].index_file(tree, "/file" + std::to_string(i),
+                                 "needle " + std::to_string(i) + "\n");
+        if (s == 1)
+            shards[s].index_file(tree, "/needle.c", "needle\n");
+        shards[s].finalize();
+
+        impls.emplace_back(new CodeSearchImpl(&shards[s], nullptr));
+        grpc::ServerBuilder builder;
+        builder.RegisterService(impls.back().get());
+        servers.emplace_back(builder.BuildAndStart());
+        channels.push_back(servers.back()->InProcessChannel(grpc::ChannelArguments()));
+    }
+
+    ShardRouter router({"shard0", "shard1"}, channels);
+    grpc::ServerBuilder builder;
+    builder.RegisterService(&router);
+    std::unique_ptr<grpc::Server> server(builder.BuildAndStart());
+    std::unique_ptr<CodeSearch::Stub> stub(
+        CodeSearch::NewStub(server->InProcessChannel(grpc::ChannelArguments())));
+
+    {
+        grpc::ClientContext ctx;
+        ServerInfo info;
+        ASSERT_TRUE(stub->Info(&ctx, InfoRequest(), &info).ok());
+        ASSERT_EQ(2, info.trees_size());
+        EXPECT_EQ("tree0", info.trees(0).name());
+        EXPECT_EQ("tree1", info.trees(1).name());
+    }
+
+    Query request;
+    request.set_line("needle");
+    request.set_max_matches(1000);
+    request.set_timeout_ms(60000);
+    {
+        grpc::ClientContext ctx;
+        CodeSearchResult result;
+        ASSERT_TRUE(stub->Search(&ctx, request, &result).ok());
+        EXPECT_EQ(41, result.results_size());
+        EXPECT_EQ(SearchStats::NONE, result.stats().exit_reason());
+        std::set<string> trees;
+        for (auto &r : result.results())
+            trees.insert(r.tree());
+        EXPECT_EQ(2, trees.size());
+    }
+
+    // The limit is for all of the shards together.
+    request.set_max_matches(5);
+    {
+        grpc::ClientContext ctx;
+        CodeSearchResult result;
+        ASSERT_TRUE(stub->Search(&ctx, request, &result).ok());
+        EXPECT_EQ(5, result.results_size());
+        EXPECT_EQ(SearchStats::MATCH_LIMIT, result.stats().exit_reason());
+    }
+    {
+        grpc::ClientContext ctx;
+        std::unique_ptr<grpc::ClientReader<CodeSearchResult> > reader(
+            stub->SearchStream(&ctx, request));
+        CodeSearchResult batch;
+        int results = 0;
+        SearchStats::ExitReason why = SearchStats::NONE;
+        while (reader->Read(&batch)) {
+            results += batch.results_size();
+            why = batch.stats().exit_reason();
+        }
+        ASSERT_TRUE(reader->Finish().ok());
+        EXPECT_EQ(5, results);
+        EXPECT_EQ(SearchStats::MATCH_LIMIT, why);
+    }
+
+    request.set_ranked(true);
+    request.set_max_matches(3);
+    {
+        grpc::ClientContext ctx;
+        CodeSearchResult result;
+        ASSERT_TRUE(stub->Search(&ctx, request, &result).ok());
+        ASSERT_EQ(3, result.results_size());
+        EXPECT_EQ("tree1", result.results(0).tree());
+        EXPECT_EQ("/needle.c", result.results(0).path());
+        for (int i = 1; i < result.results_size(); i++)
+            EXPECT_GE(result.results(i - 1).score(), result.results(i).score());
+        EXPECT_EQ(SearchStats::MATCH_LIMIT, result.stats().exit_reason());
+    }
+
+    {
+        Query files;
+        files.set_file("needle");
+        grpc::ClientContext ctx;
+        CodeSearchResult result;
+        ASSERT_TRUE(stub->SearchFiles(&ctx, files, &result).ok());
+        ASSERT_EQ(1, result.results_size());
+        EXPECT_EQ("/needle.c", result.results(0).line());
+    }
+
+    Query bad;
+    bad.set_line("(");
+    {
+        grpc::ClientContext ctx;
+        CodeSearchResult result;
+        EXPECT_EQ(grpc::StatusCode::INVALID_ARGUMENT,
+                  stub->Search(&ctx, bad, &result).error_code());
+    }
+
+    server->Shutdown();
+    for (auto &s : servers)
+        s->Shutdown();
+}
+
+TEST(arena_test, Concurrent) {
+    arena a(1024);
+    std::vector<std::thread> threads;
+    std::vector<std::vector<uint64_t*> > got(4);
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([&, t] {
+                for (int i = 0; i < 10000; i++) {
+                    uint64_t *p = static_cast<uint64_t*>(a.alloc(8 + i % 40));
+                    *p = t * 100000 + i;
+                    got[t].push_back(p);
+                }
+            });
+    }
+    for (auto &t : threads)
+        t.join();
+    for (int t = 0; t < 4; t++)
+        for (int i = 0; i < 10000; i++)
+            ASSERT_EQ(uint64_t(t * 100000 + i), *got[t][i]);
+
+    void *p = a.alloc(100);
+    EXPECT_TRUE(a.release(p, 100));
+    EXPECT_EQ(p, a.alloc(100));
+    void *q = a.alloc(16);
+    EXPECT_FALSE(a.release(p, 100));
+    EXPECT_TRUE(a.release(q, 16));
+    // Bigger than a block.
+    memset(a.alloc(4096), 0, 4096);
+}
+
+TEST(bytes_test, Kernels) {
+    std::string best = byte_kernels();
+    std::mt19937 rng(1);
+    // Newlines, ASCII, and the pieces of well- and ill-formed UTF-8.
+    const char alphabet[] = "\n\nab\x80\xa9\xbf\xc3\xe2\xf0\xf5\xed\xa0";
+    for (const char *k : {"scalar", "avx2", "neon"}) {
+        if (!use_byte_kernels(k))
+            continue;
+        SCOPED_TRACE(k);
+        for (int i = 0; i < 2000; i++) {
+            size_t n = i < 1900 ? rng() % 100 : rng() % 5000;
+            std::string buf(1 + n, '\0');
+            for (size_t j = 0; j < buf.size(); j++)
+                buf[j] = i % 2 ? alphabet[rng() % (sizeof alphabet - 1)] : "a\n"[rng() % 17 == 0];
+            // Start off any alignment.
+            const char *p = buf.data() + 1;
+
+            ASSERT_EQ(size_t(std::count(p, p + n, '\n')), count_newlines(p, p + n));
+            ASSERT_EQ(memchr(p, '\n', n), find_byte(p, n, '\n'));
+            ASSERT_EQ(memrchr(p, '\n', n), rfind_byte(p, n, '\n'));
+            ASSERT_EQ(utf8::is_valid(p, p + n), utf8_valid(p, n));
+
+            std::string want(p, n), got(p, n);
+            std::replace(want.begin(), want.end(), '\n', '\0');
+            replace_byte(&got[0], n, '\n', '\0');
+            ASSERT_EQ(want, got);
+        }
+        EXPECT_TRUE(utf8_valid("caf\xc3\xa9 \xe2\x82\xac \xf0\x9f\x98\x80", 14));
+        EXPECT_FALSE(utf8_valid("\xc0\xaf", 2));
+        EXPECT_FALSE(utf8_valid("\xed\xa0\x80", 3));
+        EXPECT_FALSE(utf8_valid("\xf4\x90\x80\x80", 4));
+    }
+    EXPECT_FALSE(use_byte_kernels("nonesuch"));
+    ASSERT_TRUE(use_byte_kernels(best.c_str()));
+}
+
+TEST(parallel_test, OrderedPipeline) {
+    // As the git and fs indexers use it: items made on reader
+    // threads and consumed strictly in order, never more than the
+    // window ahead.
+    for (int nthreads : {1, 4}) {
+        const size_t n = 2000, window = 8;
+        std::atomic<size_t> consumed(0), most_ahead(0);
+        std::vector<std::atomic<int> > made(n);
+        std::thread::id caller = std::this_thread::get_id();
+        std::atomic<int> on_caller(0), bad_thread(0);
+        size_t next = 0;
+        ordered_pipeline<std::string>(
+            n, nthreads, window,
+            [&](int t, size_t i, std::string *out) {
+                if (t < 0 || t >= nthreads)
+                    bad_thread++;
+                if (std::this_thread::get_id() == caller)
+                    on_caller++;
+                made[i]++;
+                size_t ahead = i - consumed.load();
+                size_t prev = most_ahead.load();
+                while (ahead > prev && !most_ahead.compare_exchange_weak(prev, ahead))
+                    ;
+                *out = "item " + std::to_string(i);
+                if (i % 97 == 0)
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+            },
+            [&](size_t i, const std::string &item) {
+                EXPECT_EQ(next, i);
+                EXPECT_EQ("item " + std::to_string(i), item);
+                next = i + 1;
+                consumed = next;
+            });
+        EXPECT_EQ(n, next);
+        for (size_t i = 0; i < n; i++)
+            EXPECT_EQ(1, made[i].load()) << i;
+        EXPECT_EQ(0, bad_thread.load());
+        EXPECT_LE(most_ahead.load(), window) << nthreads;
+        if (nthreads == 1)
+            EXPECT_EQ(int(n), on_caller.load());
+        else
+            EXPECT_EQ(0, on_caller.load());
+    }
+}
+
+TEST(radix_sort_test, Sorts) {
+    std::mt19937 rng(1);
+    // Big enough to be split on the top digit first, and then smaller
+    // again, reusing the scratch space.
+    for (size_t n : {0, 1, 255, 256, 5000, 300000, 1000}) {
+        for (uint32_t max : {0u, 1u, 2047u, 1u << 22, (1u << 27) - 1, 0xffffffffu}) {
+            std::vector<uint32_t> v(n);
+            for (auto &x : v)
+                x = max == 0xffffffffu ? rng() : rng() % (uint64_t(max) + 1);
+            std::vector<uint32_t> want = v;
+            std::sort(want.begin(), want.end());
+            lsd_radix_sort(v.data(), v.data() + n, max);
+            ASSERT_EQ(want, v) << "n=" << n << " max=" << max;
+        }
+    }
+}
+
+TEST_F(codesearch_test, MatchContext) {
+    std::string text;
+    for (int i = 1; i <= 20; i++)
+        text += (i % 5 ? "line " : "hit ") + std::to_string(i) + "\n";
+    cs_.index_file(tree_, "/file", text);
+    cs_.finalize();
+
+    code_searcher::search_thread search(&cs_);
+    query q;
+    RE2::Options opts;
+    default_re2_options(opts);
+    q.line_pat.reset(new RE2("hit", opts));
+    q.context_lines = 2;
+    q.max_matches = 0;
+
+    // Drop every other match, so some are handed back to the arena.
+    std::map<int, std::vector<std::string> > got;
+    match_stats stats;
+    search.match(q,
+                 [&got](const match_result *m) {
+                     std::vector<std::string> &lines = got[m->lno];
+                     for (auto &l : m->context_before)
+                         lines.push_back(l.ToString());
+                     lines.push_back("> " + m->line.ToString());
+                     for (auto &l : m->context_after)
+                         lines.push_back(l.ToString());
+                 },
+                 [](match_result *m) { return m->lno % 10 == 0; },
+                 &stats);
+    ASSERT_EQ(2, got.size());
+    EXPECT_EQ((std::vector<std::string>{"line 9", "line 8", "> hit 10", "line 11", "line 12"}),
+              got[10]);
+    EXPECT_EQ((std::vector<std::string>{"line 19", "line 18", "> hit 20"}), got[20]);
+}
+
+TEST_F(codesearch_test, HugeContextRequest) {
+    std::string text;
+    for (int i = 1; i <= 20; i++)
+        text += (i % 5 ? "line " : "hit ") + std::to_string(i) + "\n";
+    cs_.index_file(tree_, "/file", text);
+    cs_.finalize();
+
+    code_searcher::search_thread search(&cs_);
+    query q;
+    RE2::Options opts;
+    default_re2_options(opts);
+    q.line_pat.reset(new RE2("hit", opts));
+    q.max_matches = 0;
+
+    // Far more than could be allocated for each match: the server's
+    // maximum applies instead.
+    q.context_lines = 1500000000;
+    std::vector<std::pair<size_t, size_t> > got;
+    match_stats stats;
+    search.match(q,
+                 [&got](const match_result *m) {
+                     got.push_back(std::make_pair(m->context_before.size(),
+                                                  m->context_after.size()));
+                 },
+                 &stats);
+    ASSERT_EQ(4, got.size());
+    EXPECT_EQ(std::make_pair(size_t(4), size_t(15)), got[0]);
+    EXPECT_EQ(std::make_pair(size_t(19), size_t(0)), got[3]);
+
+    FLAGS_max_context_lines = 2;
+    got.clear();
+    search.match(q,
+                 [&got](const match_result *m) {
+                     got.push_back(std::make_pair(m->context_before.size(),
+                                                  m->context_after.size()));
+                 },
+                 &stats);
+    FLAGS_max_context_lines = 100;
+    ASSERT_EQ(4, got.size());
+    EXPECT_EQ(std::make_pair(size_t(2), size_t(2)), got[0]);
+    EXPECT_EQ(std::make_pair(size_t(2), size_t(0)), got[3]);
+}
+
+TEST(fs_indexer_test, OrderAndContents) {
+    char dir[] = "/tmp/codesearch_test.XXXXXX";
+    ASSERT_TRUE(mkdtemp(dir) != NULL);
+    string root = dir;
+    std::vector<string> made;
+    auto put = [&](const string &rel, const string &text) {
+        FILE *f = fopen((root + rel).c_str(), "w");
+        ASSERT_TRUE(f != NULL);
+        fwrite(text.data(), 1, text.size(), f);
+        fclose(f);
+        made.push_back(root + rel);
+    };
+    // Files big enough to be mapped, a binary one and a small one, in
+    // a few levels of directories.
+    std::string big;
+    for (int l = 0; l < 2000; l++)
+        big += "filler line " + std::to_string(l) + "\n";
+    for (int d = 0; d < 3; d++) {
+        string sub = "/d" + std::to_string(d);
+        ASSERT_EQ(0, mkdir((root + sub).c_str(), 0755));
+        ASSERT_EQ(0, mkdir((root + sub + "/inner").c_str(), 0755));
+        for (int i = 0; i < 4; i++)
+            put(sub + "/f" + std::to_string(i),
+                big + "needle " + std::to_string(d) + "." + std::to_string(i) + "\n");
+        put(sub + "/inner/small", "needle small " + std::to_string(d) + "\n");
+    }
+    put("/binary", std::string("needle\0binary\n", 14));
+
+    // The same walk serially and with readers limited to one file at
+    // a time ahead: the same files, in the same order.
+    int threads = FLAGS_fs_threads, ahead = FLAGS_fs_read_ahead_mb;
+    std::vector<std::vector<string> > paths;
+    for (int run = 0; run < 2; run++) {
+        FLAGS_fs_threads = run ? 4 : 1;
+        FLAGS_fs_read_ahead_mb = 0;
+        code_searcher cs;
+        cs.set_alloc(make_mem_allocator());
+        fs_indexer indexer(&cs, root, "repo");
+        indexer.walk(root);
+        cs.finalize();
+
+        paths.emplace_back();
+        for (auto it = cs.begin_files(); it != cs.end_files(); ++it)
+            paths.back().push_back((*it)->path.as_string());
+
+        code_searcher::search_thread search(&cs);
+        query q;
+        RE2::Options opts;
+        default_re2_options(opts);
+        q.line_pat.reset(new RE2("^needle", opts));
+        q.max_matches = 0;
+        std::map<string, string> found;
+        match_stats stats;
+        search.match(q,
+                     [&found](const match_result *m) {
+                         found[m->file->path.as_string()] = m->line.as_string();
+                     },
+                     &stats);
+        EXPECT_EQ(15, found.size());
+        EXPECT_EQ("needle 2.3", found["/d2/f3"]);
+        EXPECT_EQ("needle small 1", found["/d1/inner/small"]);
+        EXPECT_EQ(0, found.count("/binary"));
+    }
+    FLAGS_fs_threads = threads;
+    FLAGS_fs_read_ahead_mb = ahead;
+    EXPECT_EQ(15, paths[0].size());
+    EXPECT_EQ(paths[0], paths[1]);
+
+    // Depth first: each top-level directory's files are indexed
+    // together.
+    int runs = 0;
+    string last;
+    for (auto &p : paths[0]) {
+        if (p.substr(0, 3) != last)
+            runs++;
+        last = p.substr(0, 3);
+    }
+    EXPECT_EQ(3, runs);
+
+    for (auto it = made.rbegin(); it != made.rend(); ++it)
+        unlink(it->c_str());
+    for (int d = 0; d < 3; d++) {
+        rmdir((root + "/d" + std::to_string(d) + "/inner").c_str());
+        rmdir((root + "/d" + std::to_string(d)).c_str());
+    }
+    rmdir(dir);
+}